@@ -0,0 +1,19 @@
+/**
+ * accesslog.h
+ *
+ * Responsible for logging viewings without a mount, from the fanotify events
+ * of media players opening and reading films straight from the library.
+ */
+
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+/**
+ * Marks the filesystem mount that LIBRARY_PATH is on and logs viewings of the
+ * films in it until SIGINT, SIGTERM or SIGHUP. The database must be open.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int accesslog_run(void);
+
+#endif
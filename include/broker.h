@@ -0,0 +1,49 @@
+/**
+ * broker.h
+ *
+ * Responsible for dividing one memory budget between the caches of filmFS
+ * according to how useful each of them has recently been.
+ */
+
+#ifndef BROKER_H
+#define BROKER_H
+
+#include <stdint.h>
+
+/* How often we measure the caches and move memory between them in seconds */
+#define BROKER_INTERVAL 10
+
+/**
+ * The caches that share the memory budget:
+ * CONSUMER_RESIDENT - the openings of the most watched films, see resident.c
+ * CONSUMER_MMAP - memory mappings of small films, see mapcache.c
+ * CONSUMER_LOOKAHEAD - data prefetched ahead of streams, see lookahead.c
+ */
+enum memory_consumer {
+  CONSUMER_RESIDENT,
+  CONSUMER_MMAP,
+  CONSUMER_LOOKAHEAD,
+  CONSUMERS
+};
+
+/**
+ * Returns how many bytes a cache may use right now. Without MEMORY_BUDGET_MB
+ * this is the cache's own fixed cap.
+ */
+uint64_t broker_quota(enum memory_consumer consumer);
+
+/* This records how many bytes a cache is using right now */
+void broker_set_usage(enum memory_consumer consumer, uint64_t bytes);
+
+/* This records bytes that a cache served so that we didn't have to read them */
+void broker_add_hits(enum memory_consumer consumer, uint64_t bytes);
+
+/**
+ * Sets the first quotas, registers the memory metrics and schedules the task
+ * that rebalances the quotas every BROKER_INTERVAL seconds.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int broker_start(void);
+
+#endif
@@ -7,8 +7,149 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
-/* We currently only support DEBUG and LIBRARY_PATH as settings */
-#define NUM_OF_SUPPORTED_CONFIG 2
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * We currently support DEBUG, LIBRARY_PATH, LOOKAHEAD_SECONDS,
+ * LOOKAHEAD_MAX_MB, RESIDENT_FILMS, RESIDENT_SECONDS, RESIDENT_MAX_MB,
+ * MMAP_MAX_MB, CHANGE_TRACKING, RESCAN_SECONDS, POLICY, MEMORY_BUDGET_MB,
+ * FIRST_BYTE_ALERT_MS, RESIDENT_CACHE_DIR, LAYOUT, LAYOUT_RANGE_SIZE,
+ * WORKERS_MIN, WORKERS_MAX, LOG_MODE, REMOTE_URL, REMOTE_CACHE_DIR,
+ * REMOTE_CACHE_MB, REMOTE_CHUNK_MB, REMOTE_CONNECTIONS and MOUNT as settings
+ */
+#define NUM_OF_SUPPORTED_CONFIG 25
+
+/* How many seconds of playback we try to keep prefetched for each stream */
+#define LOOKAHEAD_SECONDS_DEFAULT 30
+
+/* The most memory in MiB that the lookahead buffers of all streams may use */
+#define LOOKAHEAD_MAX_MB_DEFAULT 512
+
+/* How many of the most watched films we keep the openings of in memory */
+#define RESIDENT_FILMS_DEFAULT 10
+
+/* How many seconds of playback from the start of each of those films we keep */
+#define RESIDENT_SECONDS_DEFAULT 30
+
+/* The most memory in MiB that the resident films may use together */
+#define RESIDENT_MAX_MB_DEFAULT 256
+
+/* Films up to this size in MiB are read through a memory mapping */
+#define MMAP_MAX_MB_DEFAULT 8
+
+/* Values of CHANGE_TRACKING: NONE scans the library only at startup */
+#define CHANGE_TRACKING_NONE 0
+#define CHANGE_TRACKING_FANOTIFY 1
+
+/* How often we check the library for changes in seconds, 0 to never check */
+#define RESCAN_SECONDS_DEFAULT 0
+
+/**
+ * The memory in MiB that the caches share, 0 to give each its own fixed cap
+ * (LOOKAHEAD_MAX_MB and RESIDENT_MAX_MB) instead
+ */
+#define MEMORY_BUDGET_MB_DEFAULT 0
+
+/* Starts slower than this many milliseconds are recorded, 0 to record none */
+#define FIRST_BYTE_ALERT_MS_DEFAULT 0
+
+/**
+ * Values of LAYOUT: FLAT lists every film in the root directory, the others
+ * group films into directories by the first letter of their name, by the year
+ * in their name, or into ranges of LAYOUT_RANGE_SIZE films in name order
+ */
+#define LAYOUT_FLAT 0
+#define LAYOUT_LETTER 1
+#define LAYOUT_YEAR 2
+#define LAYOUT_RANGE 3
+
+/* How many films each directory holds with LAYOUT=RANGE */
+#define LAYOUT_RANGE_SIZE_DEFAULT 1000
+
+/* The fewest and most threads that answer FUSE requests at once */
+#define WORKERS_MIN_DEFAULT 2
+#define WORKERS_MAX_DEFAULT 16
+
+/* The most threads that WORKERS_MAX may ask for */
+#define WORKERS_LIMIT 256
+
+/**
+ * Values of LOG_MODE: FUSE logs the viewings of films read through the
+ * mountpoint, FANOTIFY those of films read straight from the library, without
+ * mounting anything
+ */
+#define LOG_MODE_FUSE 0
+#define LOG_MODE_FANOTIFY 1
+
+/* REMOTE_URL must start with this, since we don't speak TLS */
+#define REMOTE_SCHEME "http://"
+
+/* The disk space in MiB that cached chunks of remote films may use together */
+#define REMOTE_CACHE_MB_DEFAULT 4096
+
+/* The size in MiB of the chunks that remote films are fetched and cached in */
+#define REMOTE_CHUNK_MB_DEFAULT 4
+
+/* The most connections to the remote server that are open at once */
+#define REMOTE_CONNECTIONS_DEFAULT 4
+
+/* The most connections that REMOTE_CONNECTIONS may ask for */
+#define REMOTE_CONNECTIONS_LIMIT 64
+
+/* The most MOUNT settings there can be, besides the mountpoint argument */
+#define MOUNTS_MAX 16
+
+/**
+ * The most policies there can be, including the default one. Every film stores
+ * the ID of its policy in one byte, so this can't be more than 256.
+ */
+#define POLICIES_MAX 256
+
+/* Values of a policy's readahead, which are passed on to posix_fadvise() */
+#define READAHEAD_NORMAL 0
+#define READAHEAD_SEQUENTIAL 1
+#define READAHEAD_RANDOM 2
+
+/**
+ * A policy decides how filmFS treats the films that it applies to. Policy 0
+ * comes from the global settings and applies to films that no POLICY rule
+ * matches:
+ * glob - pattern matched against the path of a film relative to LIBRARY_PATH,
+ *        NULL for policy 0
+ * lookahead_seconds - seconds of playback to prefetch, 0 to not prefetch
+ * readahead - the kernel readahead hint for the film, READAHEAD_*
+ * direct_io - whether reads bypass the page cache of the mountpoint
+ * cache - whether the film may be memory mapped and stay in the page cache
+ *         after it is read
+ * resident - whether the film may be kept in the resident set
+ * log - whether viewings of the film are logged to the database
+ */
+struct film_policy {
+  const char *glob;
+  unsigned int lookahead_seconds;
+  int readahead;
+  bool direct_io;
+  bool cache;
+  bool resident;
+  bool log;
+};
+
+/**
+ * A MOUNT setting: another mountpoint served by the same daemon, with its own
+ * view of the library:
+ * mountpoint - where it is mounted
+ * layout - how films are arranged in it, LAYOUT_*
+ * layout_range_size - films per directory with LAYOUT_RANGE
+ * fuse_options - options passed to FUSE when mounting it, like allow_other,
+ *                NULL for none
+ */
+struct mount_config {
+  const char *mountpoint;
+  int layout;
+  unsigned int layout_range_size;
+  const char *fuse_options;
+};
 
 /* This stores information about each setting in the config */
 struct config_pair {
@@ -20,15 +161,67 @@ struct config_pair {
  * We store a variety of configuration variables in this structure:
  * home - The path to the user's home directory (/home/user/)
  * library_path - Where the video files are actually located
+ * mountpoint - Where the filesystem is mounted, set once it has been
  * debug - whether extensive error messages should be printed to stdout
- *         (currently not implemented)
+ * lookahead_seconds - seconds of playback to prefetch ahead of each stream
+ * lookahead_max_bytes - cap on the lookahead buffers of all streams combined
+ * resident_films - number of most watched films to keep in memory
+ * resident_seconds - seconds of playback from the start of each one to keep
+ * resident_max_bytes - cap on the memory used by resident films combined
+ * mmap_max_bytes - size up to which films are read through a memory mapping
+ * change_tracking - how we notice changes to the library while mounted
+ * rescan_seconds - how often we rescan the library for changes, 0 for never
+ * policies - the default policy followed by the POLICY rules in order
+ * policy_count - the number of policies, including the default one
+ * memory_budget_bytes - memory shared by the caches, 0 for fixed caps
+ * first_byte_alert_ms - how slow a start must be to be recorded, 0 for never
+ * resident_cache_dir - where the resident set is saved across mounts, NULL
+ *                      for ~/.filmfs and empty for nowhere
+ * layout - how films are arranged in the mountpoint
+ * layout_range_size - films per directory with LAYOUT_RANGE
+ * workers_min, workers_max - bounds of the pool of threads answering requests
+ * log_mode - how we notice viewings, through a mount or with fanotify
+ * remote_url - URL of the index of remote films, NULL for none
+ * remote_cache_dir - where chunks of remote films are cached, NULL for
+ *                    ~/.filmfs/remote
+ * remote_cache_bytes - cap on the disk space used by cached chunks
+ * remote_chunk_bytes - size of the chunks that remote films are fetched in
+ * remote_connections - most connections open to the remote server at once
+ * mounts - the MOUNT settings in the order they were given
+ * mount_count - the number of MOUNT settings
  * vars_count - the number of settings specified in the configuration file
  * vars - the names and values of settings as given by the configuration file
  */
 struct config_ctx {
   char *home;
   char *library_path;
+  const char *mountpoint;
   int debug;
+  unsigned int lookahead_seconds;
+  unsigned long long lookahead_max_bytes;
+  unsigned int resident_films;
+  unsigned int resident_seconds;
+  unsigned long long resident_max_bytes;
+  unsigned long long mmap_max_bytes;
+  int change_tracking;
+  unsigned int rescan_seconds;
+  struct film_policy policies[POLICIES_MAX];
+  unsigned int policy_count;
+  unsigned long long memory_budget_bytes;
+  unsigned long long first_byte_alert_ms;
+  char *resident_cache_dir;
+  int layout;
+  unsigned int layout_range_size;
+  unsigned int workers_min;
+  unsigned int workers_max;
+  int log_mode;
+  char *remote_url;
+  char *remote_cache_dir;
+  unsigned long long remote_cache_bytes;
+  unsigned long long remote_chunk_bytes;
+  unsigned int remote_connections;
+  struct mount_config mounts[MOUNTS_MAX];
+  unsigned int mount_count;
   unsigned int vars_count;
   struct config_pair *vars;
 };
@@ -40,6 +233,14 @@ struct config_ctx {
  */
 struct config_ctx *get_config(void);
 
+/**
+ * Finds the policy of a film from its full path. The first POLICY rule whose
+ * glob matches wins.
+ *
+ * Return: ID of the policy, 0 if no rule matches
+ */
+uint8_t match_policy(const char *path);
+
 /**
  * load_config - Load and parse the configuration file
  *
@@ -8,17 +8,12 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
-/**
- * 8192 bytes should be more than enough for our command template and even
- * long film titles.
- */
-#define SQL_COMMAND_MAX 8192
-
 /* We specify the FUSE version because the API differs per version*/
 #define FUSE_USE_VERSION 30
 
 /**
  * Opens (or creates if needed) the SQLite database file and sets up the schema.
+ * It is safe to call the other functions while this runs in another thread.
  *
  * Return: 0 on success, -1 on error
  */
@@ -30,10 +25,20 @@ void db_cleanup(void);
 /**
  * This records that a film was watched by inserting a new row if we haven't
  * watched it before or incrementing the watch count and updating the timestamp
- * if we have.
+ * if we have, under any filename with the same normalized key. Watches logged
+ * before db_init() finishes are queued until it does.
  *
  * Return: 0 on success, -1 on error
  */
 int db_insert(const char *path);
 
+/**
+ * Gets the normalized keys of the most watched films, see normalize_title(),
+ * ordered by watch count and then by how recently they were watched, waiting
+ * for db_init() to finish if needed. The caller frees each key and the array.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int db_top_keys(unsigned int limit, char ***keys, unsigned int *count);
+
 #endif
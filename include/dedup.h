@@ -0,0 +1,36 @@
+/**
+ * dedup.h
+ *
+ * Responsible for finding video files in LIBRARY_PATH that have identical
+ * contents so that they can share a single backing file for I/O and caching.
+ */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+/**
+ * The number of evenly spaced blocks that we read from a file to compute its
+ * fingerprint, including the first and last block of the file.
+ */
+#define FINGERPRINT_SAMPLES 4
+
+/* The size of each sampled block in bytes (64 KiB) */
+#define FINGERPRINT_BLOCK_SIZE 65536
+
+/**
+ * The size of the blocks in bytes (1 MiB) that we read from two candidate
+ * files at a time to check that they are identical before merging them
+ */
+#define COMPARE_BLOCK_SIZE (1024 * 1024)
+
+/**
+ * Queues the background task that fingerprints the library, compares the
+ * files whose fingerprints match in full and assigns shared content IDs to
+ * identical files, unless one is already queued. It stops early if the
+ * executor is stopped.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int dedup_start(void);
+
+#endif
@@ -0,0 +1,38 @@
+/**
+ * device.h
+ *
+ * Responsible for accounting reads to the devices that films are stored on,
+ * and for sampling how busy those devices are, so that a saturated disk can be
+ * told apart from a slow filmFS.
+ */
+
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* The most devices that we keep separate accounts for */
+#define DEVICES_MAX 16
+
+/* How often we sample DISKSTATS_PATH in seconds */
+#define DEVICE_INTERVAL 5
+
+/* Where the kernel shows the I/O statistics of every block device */
+#define DISKSTATS_PATH "/proc/diskstats"
+
+/**
+ * Accounts a read that went to a backing file on a device, with the time it
+ * took in nanoseconds.
+ */
+void device_account(dev_t dev, size_t bytes, uint64_t ns);
+
+/**
+ * Registers the per-device metrics and schedules the task that samples
+ * DISKSTATS_PATH.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int device_start(void);
+
+#endif
@@ -0,0 +1,91 @@
+/**
+ * executor.h
+ *
+ * Responsible for running all of filmFS's background work, such as
+ * fingerprinting and prefetching, on one shared pool of low-priority threads.
+ */
+
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <stdbool.h>
+
+/* The number of worker threads in the pool */
+#define EXECUTOR_WORKERS 3
+
+/**
+ * The number of workers that only run PRIORITY_HIGH tasks, so that they never
+ * wait behind normal and low priority work
+ */
+#define EXECUTOR_HIGH_WORKERS 1
+
+/* The nice value of the worker threads, so FUSE requests win the CPU */
+#define EXECUTOR_NICE 10
+
+/**
+ * Priority levels. Workers always run the highest priority task they can find,
+ * in their own queue first and then in the queues of other workers.
+ */
+enum task_priority { PRIORITY_HIGH, PRIORITY_NORMAL, PRIORITY_LOW, PRIORITIES };
+
+/**
+ * Every task belongs to a class, which decides its priority, how many workers
+ * may run tasks of the class at once (its CPU budget) and the I/O priority
+ * that the worker runs it with (its I/O budget).
+ */
+enum task_class {
+  TASK_PREFETCH,
+  TASK_RESIDENT,
+  TASK_FINGERPRINT,
+  TASK_RESCAN,
+  TASK_BROKER,
+  TASK_RESIDENCY,
+  TASK_FUSECONN,
+  TASK_DEVICES,
+  TASK_WORKERS,
+  TASK_CLASSES
+};
+
+/* A background task. It must not block waiting for other tasks. */
+typedef void (*task_fn)(void *arg);
+
+/**
+ * Queues a task to run on the pool. discard is called instead of fn if the
+ * executor is stopped before the task runs, so that it can free arg, and may
+ * be NULL.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int executor_submit(enum task_class task_class, task_fn fn, task_fn discard,
+                    void *arg);
+
+/**
+ * Queues a task to run on the pool once delay seconds have passed, for work
+ * that repeats on a timer. discard is called the same way as for
+ * executor_submit().
+ *
+ * Return: 0 on success, -1 on error
+ */
+int executor_schedule(enum task_class task_class, task_fn fn, task_fn discard,
+                      void *arg, unsigned int delay);
+
+/**
+ * Checks whether the executor is being stopped, so that long-running tasks can
+ * return early.
+ */
+bool executor_stopping(void);
+
+/**
+ * Starts the worker threads and registers the executor metrics.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int executor_start(void);
+
+/**
+ * Waits for running tasks to finish, discards queued ones and stops the worker
+ * threads.
+ */
+void executor_stop(void);
+
+#endif
@@ -0,0 +1,92 @@
+/**
+ * filmfs.h
+ *
+ * Responsible for the C API of libfilmfs, which lets a program on the same host
+ * as the library, like a media server, read films and log viewings in-process
+ * instead of through the mountpoint. The filmfs binary is built on the same
+ * calls.
+ *
+ * This is the only header that programs using libfilmfs need.
+ */
+
+#ifndef FILMFS_H
+#define FILMFS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* A film that a program is reading, from filmfs_begin() to filmfs_end() */
+struct filmfs_session;
+
+/* Flags of filmfs_begin(): log the session as a viewing of the film */
+#define FILMFS_LOG 1
+
+/**
+ * Loads the configuration, opens the database, scans the library and starts
+ * the background work, all of which the filmfs binary does before and after it
+ * mounts.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int filmfs_init(void);
+
+/* This stops the background work and frees everything filmfs_init() set up */
+void filmfs_cleanup(void);
+
+/**
+ * Starts the background work: the executor, memory broker, prefetching, the
+ * resident set, memory mappings, deduplication, measurements, change tracking
+ * and the remote films. Apart from the remote films, they are all
+ * optimizations, so reads work even if they fail.
+ */
+void filmfs_start(void);
+
+/* This stops what filmfs_start() started and saves the library's index */
+void filmfs_stop(void);
+
+/**
+ * Finds a film by its title, the name of its file like "Film (1999).mkv".
+ *
+ * Return: ID of the film, -1 if there is no such film
+ */
+int filmfs_find(const char *title);
+
+/* This returns the number of film IDs, including those of removed films */
+unsigned int filmfs_count(void);
+
+/**
+ * Return: The title of a film, which stays valid until filmfs_cleanup(), or
+ * NULL if the film has been removed
+ */
+const char *filmfs_title(unsigned int id);
+
+/**
+ * Begins reading a film. The session prefetches ahead of the reads and serves
+ * them from the same caches as reads through the mountpoint do. With
+ * FILMFS_LOG, the film is also logged as viewed unless its policy says not to.
+ *
+ * Return: The session on success, NULL with errno set on error
+ */
+struct filmfs_session *filmfs_begin(unsigned int id, int flags);
+
+/**
+ * Reads from a film into buffer. Sessions may be read from by several threads
+ * at once. The offset is 64 bits wide whatever the size of the caller's off_t.
+ *
+ * Return: Number of bytes read, 0 at the end of the film, -errno on error
+ */
+ssize_t filmfs_read(struct filmfs_session *session, void *buffer, size_t size,
+                    uint64_t offset);
+
+/* This ends a session once nothing reads from it anymore */
+void filmfs_end(struct filmfs_session *session);
+
+/**
+ * Logs a viewing of a film by its title, as the mountpoint does when a media
+ * player reads one.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int filmfs_log(const char *title);
+
+#endif
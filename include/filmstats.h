@@ -0,0 +1,49 @@
+/**
+ * filmstats.h
+ *
+ * Responsible for counting the I/O of every film, so that the films that cost
+ * the most backing I/O can be found and moved to faster storage.
+ */
+
+#ifndef FILMSTATS_H
+#define FILMSTATS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* The number of films whose counters are allocated together */
+#define FILMSTATS_CHUNK 1024
+
+/* The most chunks, which limits the films that are counted */
+#define FILMSTATS_CHUNKS_MAX 1024
+
+/* The extended attribute of a film that holds its counters */
+#define FILMSTATS_XATTR "user.filmfs.stats"
+
+/* This counts an open of a film */
+void filmstats_open(unsigned int index);
+
+/**
+ * Counts a read of a film, with the bytes that came from memory and the bytes
+ * that had to be read from its backing file.
+ */
+void filmstats_read(unsigned int index, size_t memory_bytes,
+                    size_t backing_bytes);
+
+/**
+ * Writes the counters of a film as its FILMSTATS_XATTR attribute into value,
+ * or just measures them if size is 0.
+ *
+ * Return: The length of the attribute, -ERANGE if size is too small
+ */
+int filmstats_xattr(unsigned int index, char *value, size_t size);
+
+/**
+ * Adds films.tsv, a table of the counters of every film, to the metrics
+ * directory.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int filmstats_start(void);
+
+#endif
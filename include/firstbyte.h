@@ -0,0 +1,91 @@
+/**
+ * firstbyte.h
+ *
+ * Responsible for measuring how long it takes from a program opening a film to
+ * the first data of it arriving, which is the wait that a viewer sees after
+ * pressing play.
+ */
+
+#ifndef FIRSTBYTE_H
+#define FIRSTBYTE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* The number of buckets in the histograms of open-to-first-byte times */
+#define FIRSTBYTE_BUCKETS 10
+
+/* The most backing devices that we keep separate histograms for */
+#define FIRSTBYTE_DEVICES_MAX 16
+
+/* The number of slow starts that /.filmfs/slow_starts remembers */
+#define FIRSTBYTE_SLOW_MAX 32
+
+/**
+ * The kinds of programs that open films:
+ * CALLER_PLAYER - media players, whose starts a viewer waits on
+ * CALLER_SCANNER - library scanners and thumbnailers
+ * CALLER_OTHER - anything else, such as cp or a file manager
+ */
+enum caller_class { CALLER_PLAYER, CALLER_SCANNER, CALLER_OTHER, CALLERS };
+
+/**
+ * The stages between opening a film and its first data arriving:
+ * STAGE_LOOKUP - finding the film in the library
+ * STAGE_CLASSIFY - working out the caller class of the program
+ * STAGE_OPEN - opening the backing file and setting up its session
+ * STAGE_WAIT - the program's own time between open() and its first read()
+ * STAGE_LOG - logging the viewing to the database
+ * STAGE_IO - reading the first data
+ */
+enum first_byte_stage {
+  STAGE_LOOKUP,
+  STAGE_CLASSIFY,
+  STAGE_OPEN,
+  STAGE_WAIT,
+  STAGE_LOG,
+  STAGE_IO,
+  STAGES
+};
+
+/**
+ * The timing of one start:
+ * stage_ns - how long each stage took in nanoseconds
+ * mark - when the current stage began
+ * caller - the caller class of the program that opened the film
+ */
+struct first_byte {
+  uint64_t stage_ns[STAGES];
+  struct timespec mark;
+  enum caller_class caller;
+};
+
+/* This starts timing a start, with the first stage beginning now */
+void firstbyte_begin(struct first_byte *timing);
+
+/* This ends the current stage of a start, and begins the next one now */
+void firstbyte_stage(struct first_byte *timing, enum first_byte_stage stage);
+
+/**
+ * Works out the caller class of a program from its command name, as read from
+ * /proc/<pid>/comm.
+ */
+enum caller_class firstbyte_caller_class(const char *comm);
+
+/**
+ * Adds a finished start to the histograms of its film, caller class and backing
+ * device, and to /.filmfs/slow_starts if it took longer than
+ * FIRST_BYTE_ALERT_MS.
+ */
+void firstbyte_record(const struct first_byte *timing, unsigned int index,
+                      dev_t dev);
+
+/**
+ * Registers the open-to-first-byte metrics and /.filmfs/slow_starts.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int firstbyte_start(void);
+
+#endif
@@ -0,0 +1,26 @@
+/**
+ * fuseconn.h
+ *
+ * Responsible for sampling the kernel's counters for our FUSE connections, one
+ * for each mountpoint, so that we can tell whether requests are waiting on
+ * filmFS or on the kernel.
+ */
+
+#ifndef FUSECONN_H
+#define FUSECONN_H
+
+/* Where the fusectl filesystem shows the state of every FUSE connection */
+#define FUSECONN_DIR "/sys/fs/fuse/connections"
+
+/* How often we sample the connections in seconds */
+#define FUSECONN_INTERVAL 1
+
+/**
+ * Registers the connection metrics and schedules the sampling task. The
+ * metrics are left out if fusectl isn't mounted.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int fuseconn_start(void);
+
+#endif
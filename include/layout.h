@@ -0,0 +1,77 @@
+/**
+ * layout.h
+ *
+ * Responsible for arranging the films of the library in a mountpoint, either
+ * all in the root directory or grouped into virtual directories, so that
+ * clients that time out listing huge directories only ever list a slice. Every
+ * mountpoint has a layout of its own.
+ */
+
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/* The longest name of a virtual directory, including the '\0' */
+#define LAYOUT_BUCKET_NAME_MAX 24
+
+/* One virtual directory of a layout, see layout.c */
+struct layout_bucket;
+
+/**
+ * How films are arranged in one mountpoint, with its sorted index, which is
+ * protected by lock:
+ * mode - LAYOUT_FLAT, LAYOUT_LETTER, LAYOUT_YEAR or LAYOUT_RANGE
+ * range_size - films per directory with LAYOUT_RANGE
+ * built - whether the index has been built
+ * listing - the video_listing() it was built for
+ * names - names of the films in bucket and name order
+ * buckets - the buckets in name order
+ * bucket_count - the number of buckets
+ * positions - for each index, its position in names, or UINT_MAX if removed
+ * position_count - the number of indices in positions
+ *
+ * The names point into video_files, so a layout costs two arrays of the size
+ * of the library, and nothing at all with LAYOUT_FLAT.
+ */
+struct layout {
+  int mode;
+  unsigned int range_size;
+  bool built;
+  unsigned int listing;
+  const char **names;
+  struct layout_bucket *buckets;
+  unsigned int bucket_count;
+  unsigned int *positions;
+  unsigned int position_count;
+  pthread_rwlock_t lock;
+};
+
+/* This sets up an empty layout, whose index is built on the first lookup */
+void layout_init(struct layout *layout, int mode, unsigned int range_size);
+
+/**
+ * Finds the film at a path in the mountpoint, which is in the root directory
+ * with LAYOUT_FLAT and in the directory of its bucket otherwise.
+ *
+ * Return: Index of the film, -1 if there is none at path
+ */
+int layout_find(struct layout *layout, const char *path);
+
+/* This checks whether a path is one of the virtual directories */
+bool layout_is_bucket(struct layout *layout, const char *path);
+
+/**
+ * Calls fn with the name of every entry of a directory of the layout: the
+ * buckets for the root directory, or the films of a bucket.
+ *
+ * Return: 0 on success, -1 if path isn't a directory of the layout
+ */
+int layout_list(struct layout *layout, const char *path,
+                void (*fn)(const char *name, void *arg), void *arg);
+
+/* This frees the sorted index of the layout */
+void layout_cleanup(struct layout *layout);
+
+#endif
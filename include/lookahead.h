@@ -0,0 +1,84 @@
+/**
+ * lookahead.h
+ *
+ * Responsible for estimating how fast each stream is being played and keeping
+ * a number of seconds of playback prefetched ahead of its read position.
+ */
+
+#ifndef LOOKAHEAD_H
+#define LOOKAHEAD_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* We re-estimate a stream's consumption rate once per second of reads */
+#define LOOKAHEAD_SAMPLE_NS 1000000000ULL
+
+/**
+ * Reads that land within this many bytes of the previous read's end still
+ * count as sequential, since the kernel may deliver reads slightly out of
+ * order.
+ */
+#define LOOKAHEAD_SEEK_SLACK (1024 * 1024)
+
+/* We don't bother prefetching ranges smaller than this (2 MiB) */
+#define LOOKAHEAD_MIN_REQUEST (2 * 1024 * 1024)
+
+/* Prefetch tasks ask the kernel for data in chunks of this size (8 MiB) */
+#define LOOKAHEAD_CHUNK (8 * 1024 * 1024)
+
+struct session;
+
+/**
+ * Contains the lookahead state of one stream. It is protected by the lock of
+ * the session that it belongs to.
+ *
+ * position - the end of the most recent sequential read
+ * prefetched_end - the end of the range that we have asked to be prefetched
+ * rate - estimated consumption rate in bytes per second (0 until measured)
+ * sample_start - when the current rate sample started
+ * sample_bytes - bytes read since sample_start
+ * accounted - bytes of this stream's buffer counted against the global cap
+ * generation - raised whenever the buffer is dropped, so that prefetches
+ *              queued for the old one stop. Prefetches read it without the
+ *              lock.
+ * fetched_end - the end of the range that prefetches have actually asked the
+ *               kernel for, written by prefetches without the lock
+ */
+struct lookahead {
+  off_t position;
+  off_t prefetched_end;
+  uint64_t rate;
+  struct timespec sample_start;
+  uint64_t sample_bytes;
+  uint64_t accounted;
+  atomic_uint generation;
+  atomic_llong fetched_end;
+};
+
+/**
+ * Updates a session's rate estimate after a read and queues a prefetch if its
+ * buffer has fallen below LOOKAHEAD_SECONDS of playback.
+ */
+void lookahead_on_read(struct session *session, off_t offset, size_t bytes);
+
+/**
+ * Drops a session's buffer and stops the prefetches queued for it, for example
+ * because a read of the session was interrupted by a seek.
+ */
+void lookahead_cancel(struct session *session);
+
+/* This releases a closing session's share of the global lookahead budget */
+void lookahead_forget(struct session *session);
+
+/**
+ * Registers the lookahead metrics. Prefetches run on the executor, which drops
+ * any that are still queued when it is stopped.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int lookahead_start(void);
+
+#endif
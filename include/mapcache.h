@@ -0,0 +1,76 @@
+/**
+ * mapcache.h
+ *
+ * Responsible for serving small films from cached read-only memory mappings
+ * instead of calling pread() for every chunk.
+ */
+
+#ifndef MAPCACHE_H
+#define MAPCACHE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* The maximum number of mappings that we keep at once */
+#define MAPCACHE_MAX 64
+
+/**
+ * A read-only mapping of a whole backing file:
+ * content_id - content ID of the mapped film
+ * addr - start of the mapping
+ * size - size of the file when it was mapped
+ * mtime - modification time of the file when it was mapped
+ * refs - number of sessions using the mapping, protected by the cache lock
+ * valid - cleared if the file shrank underneath the mapping, which can happen
+ *         while other threads are reading it
+ * last_used - when the mapping was last handed out, for eviction
+ * reserved - set while the slot's file is being mapped, protected by the cache
+ *            lock
+ */
+struct mapping {
+  unsigned int content_id;
+  void *addr;
+  off_t size;
+  struct timespec mtime;
+  unsigned int refs;
+  atomic_bool valid;
+  unsigned long long last_used;
+  bool reserved;
+};
+
+/**
+ * Gets a mapping of a backing file that is no larger than MMAP_MAX_MB, reusing
+ * a cached one if the file hasn't changed since it was mapped.
+ *
+ * Return: Referenced mapping on success, NULL if the file shouldn't or couldn't
+ * be mapped
+ */
+struct mapping *mapcache_get(unsigned int content_id, int fd,
+                             const struct stat *file_stat);
+
+/* This drops a reference returned by mapcache_get() */
+void mapcache_put(struct mapping *mapping);
+
+/**
+ * Copies part of a mapped film into buffer.
+ *
+ * Return: Number of bytes copied on success, -1 if the file was truncated
+ * underneath the mapping
+ */
+ssize_t mapcache_read(struct mapping *mapping, char *buffer, size_t size,
+                      off_t offset);
+
+/**
+ * Installs the SIGBUS handler that makes reading a truncated mapping safe and
+ * registers the mapping metrics.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int mapcache_start(void);
+
+/* This unmaps every cached mapping that is no longer in use */
+void mapcache_stop(void);
+
+#endif
@@ -0,0 +1,113 @@
+/**
+ * metrics.h
+ *
+ * Responsible for collecting metrics from the rest of filmFS and exposing them
+ * as read-only virtual files in a hidden directory of the mountpoint.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+/* The hidden directory in the mountpoint that holds our virtual files */
+#define METRICS_DIR "/.filmfs"
+
+/* The maximum number of subsystems that can add a section to the metrics */
+#define METRICS_SOURCES_MAX 32
+
+/* The maximum number of virtual files in METRICS_DIR */
+#define METRICS_FILES_MAX 8
+
+/**
+ * A metrics source writes its current values to the stream, one per line, in
+ * the form "name value" or "name{label="x"} value".
+ */
+typedef void (*metrics_fn)(FILE *out);
+
+/**
+ * Adds a section to the /.filmfs/metrics virtual file. Sources are written in
+ * the order that they were registered in.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int metrics_register(metrics_fn fn);
+
+/**
+ * Writes a label value in double quotes, escaping quotes, backslashes and
+ * newlines so that filenames can't break the "name{label="x"} value" format.
+ */
+void metrics_write_label(FILE *out, const char *value);
+
+/**
+ * Finds the bucket of a histogram that a value falls in, given the upper
+ * bounds of every bucket but the last, which has none.
+ *
+ * Return: Index of the bucket
+ */
+unsigned int metrics_bucket(const unsigned long long *bounds,
+                            unsigned int count, unsigned long long value);
+
+/**
+ * Writes a histogram as Prometheus-style cumulative buckets followed by its sum
+ * and count. labels, such as class="player", are added to every line and may
+ * be NULL. Bounds and sum are divided by scale, for example to write
+ * nanoseconds as seconds.
+ */
+void metrics_write_histogram(FILE *out, const char *name, const char *labels,
+                             const unsigned long long *bounds,
+                             atomic_ullong *counts, unsigned int count,
+                             unsigned long long sum, double scale);
+
+/**
+ * Adds a virtual file to METRICS_DIR whose contents are entirely generated by
+ * fn each time the file is opened.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int metrics_add_file(const char *name, metrics_fn fn);
+
+/**
+ * Checks whether a FUSE path refers to METRICS_DIR or a virtual file in it.
+ *
+ * Return: METRICS_PATH_DIR, METRICS_PATH_FILE or METRICS_PATH_NONE
+ */
+int metrics_path_type(const char *path);
+
+#define METRICS_PATH_NONE 0
+#define METRICS_PATH_DIR 1
+#define METRICS_PATH_FILE 2
+
+/**
+ * Return: The number of virtual files in METRICS_DIR
+ */
+unsigned int metrics_file_count(void);
+
+/**
+ * Return: The name of the virtual file at position i in METRICS_DIR
+ */
+const char *metrics_file_name(unsigned int i);
+
+/**
+ * The contents of a virtual file at the time it was opened:
+ * data - malloc'd contents of the file
+ * len - the length of data in bytes
+ */
+struct metrics_snapshot {
+  char *data;
+  size_t len;
+};
+
+/**
+ * Generates the current contents of a virtual file so that every read of one
+ * open file sees the same snapshot.
+ *
+ * Return: Malloc'd snapshot on success, NULL on error
+ */
+struct metrics_snapshot *metrics_generate(const char *path);
+
+/* This frees a snapshot returned by metrics_generate() */
+void metrics_snapshot_free(struct metrics_snapshot *snapshot);
+
+#endif
@@ -0,0 +1,39 @@
+/**
+ * normalize.h
+ *
+ * Responsible for turning the many ways a film can be named into one key, so
+ * that "Film.1999.1080p.BluRay.x264.mkv" and "Film (1999).mkv" can be matched
+ * to each other and to the titles in the FILMS table with a hash lookup.
+ */
+
+#ifndef NORMALIZE_H
+#define NORMALIZE_H
+
+#include <stddef.h>
+
+/**
+ * Increases whenever the rules of normalize_title() change, so that keys
+ * stored by an earlier version are computed again.
+ */
+#define NORMALIZE_VERSION 1
+
+/* Years in names from this one on are taken as the year of release */
+#define NORMALIZE_YEAR_MIN 1880
+
+/* Years in names up to this one are taken as the year of release */
+#define NORMALIZE_YEAR_MAX 2099
+
+/**
+ * Normalizes a filename or title into a key: the words of the title in lower
+ * case, separated by single spaces, followed by the year of release if the
+ * name has one. The video extension, punctuation, anything in square brackets
+ * and the resolution, source and codec tags of release names are left out.
+ *
+ * The key is never longer than the name, so key must have room for
+ * strlen(name) + 1 bytes.
+ *
+ * Return: Length of the key
+ */
+size_t normalize_title(const char *name, char *key);
+
+#endif
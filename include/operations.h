@@ -7,9 +7,6 @@
 #ifndef OPERATIONS_H
 #define OPERATIONS_H
 
-/* This is the number of media player process names that we recognize */
-#define NUM_OF_MEDIA_PLAYERS 2
-
 /**
  * Return: Pointer to fuse_operations structure
  */
@@ -0,0 +1,31 @@
+/**
+ * player.h
+ *
+ * Responsible for recognizing media players by the names of their threads and
+ * logging the films that they play.
+ */
+
+#ifndef PLAYER_H
+#define PLAYER_H
+
+#include <sys/types.h>
+
+/* This is the number of media player process names that we recognize */
+#define NUM_OF_MEDIA_PLAYERS 2
+
+/**
+ * Reads the name of a process or thread from /proc/<pid>/comm.
+ *
+ * Return: Allocated string with the name, or NULL on error
+ */
+char *player_proc_name(pid_t pid);
+
+/**
+ * Logs a viewing of a film if the thread accessing it belongs to a media
+ * player, once for every new thread that reads it.
+ *
+ * Return: 0 on success, -ERRNO on failure
+ */
+int player_log_access(pid_t pid, const char *title);
+
+#endif
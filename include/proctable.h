@@ -0,0 +1,91 @@
+/**
+ * proctable.h
+ *
+ * Responsible for counting the reads of every process that uses the
+ * mountpoint in a table in shared memory, which tools/filmfs-top.c shows as a
+ * live view. This header is shared by both.
+ */
+
+#ifndef PROCTABLE_H
+#define PROCTABLE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * The name of the shared memory object, with the user ID of the filesystem's
+ * owner filled in, so that every user's mount has its own
+ */
+#define PROCTABLE_NAME "/filmfs-%u"
+
+/* Identifies the table and its layout, so that filmfs-top can check both */
+#define PROCTABLE_MAGIC 0x666d6673
+#define PROCTABLE_VERSION 1
+
+/**
+ * The number of processes that the table holds. Once it is full, the least
+ * recently active process makes way for a new one.
+ */
+#define PROCTABLE_SLOTS 128
+
+/* A slot that no process has used yet, and one that is being taken over */
+#define PROCTABLE_FREE 0
+#define PROCTABLE_BUSY (-1)
+
+/**
+ * The counters of one process. pid is written last when a slot is claimed, so
+ * a reader that sees a pid sees the rest of the entry too:
+ * pid - the process ID, or PROCTABLE_FREE or PROCTABLE_BUSY
+ * comm - the command name of the process
+ * caller - its caller class, see enum caller_class in firstbyte.h
+ * opens - films opened
+ * reads - reads served
+ * bytes - bytes read
+ * read_ns - time spent serving reads in nanoseconds
+ * last_active - when the process last opened or read, in monotonic
+ *               nanoseconds
+ */
+struct proc_entry {
+  _Atomic pid_t pid;
+  char comm[16];
+  uint8_t caller;
+  atomic_ullong opens;
+  atomic_ullong reads;
+  atomic_ullong bytes;
+  atomic_ullong read_ns;
+  atomic_ullong last_active;
+};
+
+/**
+ * The shared memory object:
+ * magic, version - PROCTABLE_MAGIC and PROCTABLE_VERSION
+ * slots - PROCTABLE_SLOTS
+ * owner - process ID of the filesystem
+ * entries - the processes
+ */
+struct proc_table {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slots;
+  pid_t owner;
+  struct proc_entry entries[PROCTABLE_SLOTS];
+};
+
+/**
+ * Creates the shared memory table.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int proctable_start(void);
+
+/* This removes the shared memory table */
+void proctable_stop(void);
+
+/* This counts a film that a process opened */
+void proctable_open(pid_t pid);
+
+/* This counts a read that a process made, with the time it took */
+void proctable_read(pid_t pid, size_t bytes, uint64_t ns);
+
+#endif
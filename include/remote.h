@@ -0,0 +1,63 @@
+/**
+ * remote.h
+ *
+ * Responsible for films that live on an HTTP server rather than in
+ * LIBRARY_PATH: listing them from the index at REMOTE_URL, and reading them
+ * with range requests through a cache of fixed-size chunks on local disk.
+ */
+
+#ifndef REMOTE_H
+#define REMOTE_H
+
+#include <sys/types.h>
+
+/* How long we wait for the server to accept, answer or take data in seconds */
+#define REMOTE_TIMEOUT 30
+
+/* The most bytes of headers that we read from a response */
+#define REMOTE_HEADER_MAX 8192
+
+/* The largest index that we accept, in bytes */
+#define REMOTE_INDEX_MAX (64 * 1024 * 1024)
+
+/* A remote film being read by a session, see remote_open() */
+struct remote_file;
+
+/**
+ * Loads the chunks cached by earlier runs, lists the remote films from the
+ * index and schedules refreshing it every RESCAN_SECONDS. Does nothing unless
+ * REMOTE_URL is set.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int remote_start(void);
+
+/* This closes the idle connections and forgets the cached chunks */
+void remote_stop(void);
+
+/**
+ * Starts reading a remote film. Nothing is fetched until the first read.
+ *
+ * Return: The remote file on success, NULL with errno set on error
+ */
+struct remote_file *remote_open(unsigned int index);
+
+/* This ends reading a remote film */
+void remote_close(struct remote_file *file);
+
+/**
+ * Reads from a remote film, fetching the chunks that the read covers into the
+ * cache if they aren't there yet.
+ *
+ * Return: Number of bytes read on success, -ERRNO on failure
+ */
+ssize_t remote_read(struct remote_file *file, char *buffer, size_t size,
+                    off_t offset);
+
+/**
+ * Fetches the chunks that cover a range of a remote film into the cache, for
+ * the lookahead.
+ */
+void remote_prefetch(struct remote_file *file, off_t offset, off_t len);
+
+#endif
@@ -0,0 +1,38 @@
+/**
+ * residency.h
+ *
+ * Responsible for sampling how much of each film that is playing, or was
+ * played recently, is in the page cache, so that the effect of prefetching and
+ * caching can be seen.
+ */
+
+#ifndef RESIDENCY_H
+#define RESIDENCY_H
+
+/* How often we sample the films in seconds */
+#define RESIDENCY_INTERVAL 5
+
+/* How long after its last session closes we keep sampling a film in seconds */
+#define RESIDENCY_KEEP_SECONDS 600
+
+/* The most films that we sample at once, the least recently played go first */
+#define RESIDENCY_FILMS_MAX 16
+
+/* The number of equal parts that the residency map divides each film into */
+#define RESIDENCY_CLUSTERS 64
+
+/**
+ * The most of a film that the mincore() fallback maps at once (256 MiB), so
+ * that sampling a large film doesn't need a huge vector or address range
+ */
+#define RESIDENCY_WINDOW (256 * 1024 * 1024)
+
+/**
+ * Registers the page cache metrics and the /.filmfs/residency map, and
+ * schedules the sampling task.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int residency_start(void);
+
+#endif
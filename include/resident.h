@@ -0,0 +1,76 @@
+/**
+ * resident.h
+ *
+ * Responsible for keeping the openings of the most watched films in memory so
+ * that starting them doesn't have to wait on the disk.
+ */
+
+#ifndef RESIDENT_H
+#define RESIDENT_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/**
+ * The playback rate we assume for films that haven't been played since the
+ * filesystem was mounted, in bytes per second (1 MiB/s is about 8 Mbit/s).
+ */
+#define RESIDENT_DEFAULT_RATE (1024 * 1024)
+
+/**
+ * Many containers keep their index at the end of the file (the moov atom of an
+ * MP4 or the cues of an MKV), and players read it right after opening. We keep
+ * this many bytes (1 MiB) of the end of each resident film as well.
+ */
+#define RESIDENT_TAIL_SIZE (1024 * 1024)
+
+/* We don't keep openings shorter than this (1 MiB) when the budget runs out */
+#define RESIDENT_MIN_HEAD (1024 * 1024)
+
+/**
+ * The files of the warm cache in RESIDENT_CACHE_DIR, which hold the resident
+ * set saved by the last mount
+ */
+#define RESIDENT_CACHE_MANIFEST "resident"
+#define RESIDENT_CACHE_DATA "resident.data"
+
+/* The first line of the manifest, with the version of its format */
+#define RESIDENT_CACHE_HEADER "filmfs-resident 1\n"
+
+/* The starting value of the checksums of cached films, the FNV-1a offset */
+#define RESIDENT_CHECKSUM_SEED 14695981039346656037ULL
+
+/**
+ * Registers the resident set metrics and queues the task that builds the
+ * resident set for the first time.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int resident_start(void);
+
+/* This frees the resident set once the executor has been stopped */
+void resident_stop(void);
+
+/**
+ * Queues a background task to pick the most watched films again, for example
+ * after the watch history has changed.
+ */
+void resident_refresh(void);
+
+/**
+ * Copies the start of a read from memory if it falls within the resident part
+ * of a film.
+ *
+ * Return: Number of bytes copied into buffer, 0 if none are resident
+ */
+size_t resident_read(unsigned int content_id, char *buffer, size_t size,
+                     off_t offset);
+
+/**
+ * Stops serving a film from memory and queues a rebuild if its backing file
+ * no longer has the size and modification time it had when it was read.
+ */
+void resident_check(unsigned int content_id, const struct stat *file_stat);
+
+#endif
@@ -0,0 +1,144 @@
+/**
+ * session.h
+ *
+ * Responsible for the state of each open film in the mountpoint, and for
+ * reading film data on behalf of the FUSE callbacks.
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "firstbyte.h"
+#include "lookahead.h"
+#include "mapcache.h"
+#include "remote.h"
+
+/**
+ * Reads from a backing file are split into chunks of this many bytes (64 KiB),
+ * so that a read the caller gave up on stops within one chunk
+ */
+#define SESSION_READ_CHUNK (64 * 1024)
+
+/**
+ * A session is created each time a film is opened and lives until the last
+ * file descriptor for it is closed.
+ *
+ * id - unique number of the session, used to label its metrics
+ * fd - file descriptor of the backing file, -1 for a remote film
+ * size - size of the backing file in bytes when it was opened
+ * dev - device that the backing file is on
+ * index - index of the opened file in video_files
+ * content_id - content ID of the file at the time it was opened
+ * policy - ID of the file's policy, so reads don't have to look it up
+ * refs - reference count, the fd stays open until this drops to zero
+ * closed - set once the film has been closed in the mountpoint
+ * mapping - memory mapping of the backing file if it is small enough, or NULL
+ * remote - state of reading a remote film, NULL for local films
+ * first_byte - timing of the film's start, see firstbyte.h
+ * first_read - set by the first read, which finishes timing the start
+ * lock - protects lookahead
+ * lookahead - prefetching state for the stream
+ * prev, next - links in the list of open sessions
+ */
+struct session {
+  unsigned long id;
+  int fd;
+  off_t size;
+  dev_t dev;
+  unsigned int index;
+  unsigned int content_id;
+  uint8_t policy;
+  atomic_int refs;
+  atomic_bool closed;
+  struct mapping *mapping;
+  struct remote_file *remote;
+  struct first_byte first_byte;
+  atomic_bool first_read;
+  pthread_mutex_t lock;
+  struct lookahead lookahead;
+  struct session *prev;
+  struct session *next;
+};
+
+/**
+ * Where the data of a read came from. READ_SOURCES is the number of sources.
+ */
+enum read_source {
+  READ_RESIDENT,
+  READ_MMAP,
+  READ_PREAD,
+  READ_REMOTE,
+  READ_SOURCES
+};
+
+/**
+ * The number of buckets in the histogram of read request sizes, which go up in
+ * powers of two from 4 KiB to 1 MiB and then everything larger
+ */
+#define READ_SIZE_BUCKETS 10
+
+/**
+ * The number of buckets in the histogram of the time between read requests,
+ * which go up in powers of ten from 10 microseconds to 1 second and then
+ * everything longer
+ */
+#define READ_GAP_BUCKETS 7
+
+/**
+ * Registers the read metrics, which count reads and their latency by source,
+ * and histograms of the size of read requests and the time between them.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int session_start(void);
+
+/**
+ * Opens the backing file for a film, or the remote film, and starts a new
+ * session for it.
+ *
+ * Return: Pointer to the session on success, NULL with errno set on error
+ */
+struct session *session_open(unsigned int index);
+
+/**
+ * Ends a session when its film is closed. The backing file is closed once any
+ * background work still using the session has finished.
+ */
+void session_close(struct session *session);
+
+/* This takes an extra reference to a session for background work */
+void session_get(struct session *session);
+
+/* This drops a reference taken with session_get() */
+void session_put(struct session *session);
+
+/**
+ * Reads film data for a session. If interrupted isn't NULL, it is asked before
+ * each chunk read from the backing file whether the caller gave up on the read.
+ *
+ * Return: Number of bytes read on success, -EINTR if the read was given up,
+ * -ERRNO on failure
+ */
+ssize_t session_read(struct session *session, char *buffer, size_t size,
+                     off_t offset, int (*interrupted)(void));
+
+/**
+ * Counts a read that was interrupted before it could finish, and drops the
+ * session's prefetched buffer.
+ */
+void session_interrupted(struct session *session, size_t bytes);
+
+/**
+ * Calls fn for every open session while holding the session list lock, so fn
+ * must not open or close sessions.
+ */
+void session_foreach(void (*fn)(struct session *session, void *arg),
+                     void *arg);
+
+#endif
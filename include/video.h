@@ -8,6 +8,12 @@
 #ifndef VIDEO_H
 #define VIDEO_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
 /**
  * The default maximum number of entries in the mountpoint directory, more
  * memory is allocated if this number is reached.
@@ -21,27 +27,254 @@
 #define NUM_OF_VIDEO_EXTENSIONS 11
 
 /**
- * Contains information about the video files in LIBRARY_PATH.
+ * Directories modified less than this many seconds before we read them are
+ * read again on the next rescan, since a filesystem that only stores whole
+ * seconds wouldn't show a second change within the same second.
+ */
+#define RESCAN_RACY_SECONDS 2
+
+/**
+ * Contains information about the video files in LIBRARY_PATH and its
+ * subdirectories. Entries are never removed while the filesystem is mounted, so
+ * an index stays valid for as long as it is in use; files that disappear are
+ * only marked as removed.
  *
- * names - dynamically allocated array of video file basenames
+ * names - basenames of the video files, which point into paths
  * paths - dynamically allocated array of video file paths
- * count - the number of video files in LIBRARY_PATH
+ * content_ids - for each file, the index of the file whose contents we actually
+ *               read. Every file starts out as its own content ID, and the
+ *               deduplication task points identical copies at one of them.
+ * byte_rates - the playback rate in bytes per second last measured for each
+ *              content ID, or 0 if it hasn't been played yet
+ * removed - whether each file has been deleted or moved out of the library
+ * next_in_dir - index + 1 of the next file in the same directory, with 0 for
+ *               the last one, see library_dirs
+ * last_read - the number of the last directory read that found each file, so
+ *             that a rescan can tell which files are gone
+ * policies - the ID of the policy of each file, see struct film_policy
+ * devs - the device that each file is on, taken from its directory
+ * sizes - the size of each remote file as listed by the remote index, 0 for
+ *         local files, which are stat()ed instead
+ * keys - the normalized key of each basename, see normalize_title(), which
+ *        points into the same allocation as the path
+ * next_with_key - index + 1 of the next file added before this one with the
+ *                 same key, with 0 for the first one
+ * slots - hash table from basename to index + 1, with 0 marking an empty slot
+ * slot_count - the number of slots in the hash table, a power of two
+ * key_slots - hash table from key to index + 1 of the last file added with it
+ * key_slot_count - the number of slots in key_slots, a power of two
+ * count - the number of entries, including removed ones
  */
 struct video_files {
   char **names;
   char **paths;
+  _Atomic unsigned int *content_ids;
+  _Atomic uint64_t *byte_rates;
+  bool *removed;
+  unsigned int *next_in_dir;
+  unsigned int *last_read;
+  uint8_t *policies;
+  dev_t *devs;
+  off_t *sizes;
+  char **keys;
+  unsigned int *next_with_key;
+  unsigned int *slots;
+  unsigned int slot_count;
+  unsigned int *key_slots;
+  unsigned int key_slot_count;
   unsigned int count;
 };
 
 /**
- * Return: a pointer to video_files struct instance
+ * A film listed by the remote index:
+ * url - full URL of the film, not percent-encoded
+ * size - size of the film in bytes
+ */
+struct remote_film {
+  char *url;
+  off_t size;
+};
+
+/**
+ * Contains the directories in LIBRARY_PATH that we have read, so that a rescan
+ * only has to read the ones that changed. Like files, directories are never
+ * removed, only marked as removed.
+ *
+ * paths - dynamically allocated array of directory paths, ending in '/'
+ * mtimes - the modification time of each directory when we last read it, or
+ *          zero if it should be read again on the next rescan
+ * first_files - index + 1 of the first file in each directory, or 0 if it has
+ *               never had any
+ * removed - whether each directory has been deleted or moved out of the library
+ * devs - the device that each directory is on, or 0 if we haven't looked yet
+ * slots - hash table from path to index + 1, like the one for files
+ * slot_count - the number of slots in the hash table, a power of two
+ * count - the number of directories, including removed ones
+ */
+struct library_dirs {
+  char **paths;
+  struct timespec *mtimes;
+  unsigned int *first_files;
+  bool *removed;
+  dev_t *devs;
+  unsigned int *slots;
+  unsigned int slot_count;
+  unsigned int count;
+};
+
+/**
+ * Looks up a FUSE path ("/file.mp4") in the list of video files.
+ *
+ * Return: index of the file on success, -1 if it is not in the library
+ */
+int video_find(const char *path);
+
+/**
+ * Looks up the films whose names normalize to a key, like the titles in the
+ * FILMS table do. Pass the result to video_next_with_key() for the others.
+ *
+ * Return: index of the last film added with the key, -1 if there is none
+ */
+int video_find_key(const char *key);
+
+/**
+ * Return: index of the next film with the same key as a film, -1 after the
+ * last one
+ */
+int video_next_with_key(unsigned int index);
+
+/**
+ * Return: the number of entries in the library, including removed ones. Every
+ * index below it is valid.
+ */
+unsigned int video_count(void);
+
+/* This returns whether a file has been removed from the library */
+bool video_removed(unsigned int index);
+
+/* This returns the basename of a file, which stays valid until unmount */
+const char *video_name(unsigned int index);
+
+/* This returns the full path of a file, which stays valid until unmount */
+const char *video_path(unsigned int index);
+
+/**
+ * Returns the content ID of a file, which is the index of the file that all
+ * identical copies share for reading and caching.
+ */
+unsigned int video_content_id(unsigned int index);
+
+/**
+ * Returns a number that changes whenever a file's contents may have changed, to
+ * pass to video_merge_content().
+ */
+unsigned int video_generation(void);
+
+/**
+ * Returns a number that changes whenever a file appears in or disappears from
+ * the library.
+ */
+unsigned int video_listing(void);
+
+/**
+ * Points a file at the content ID of an identical file, unless either of them
+ * may have changed since generation since was read.
+ *
+ * Return: 0 on success, -1 if the comparison is stale
+ */
+int video_merge_content(unsigned int index, unsigned int content_id,
+                        unsigned int since);
+
+/**
+ * Returns the ID of the policy that applies to a file, which was matched when
+ * the file was added to the library.
+ */
+uint8_t video_policy(unsigned int index);
+
+/**
+ * Returns the device that a file is on, which is found when its directory is
+ * read, or on the first rescan for a library loaded from the index. Returns 0
+ * until then.
+ */
+dev_t video_dev(unsigned int index);
+
+/**
+ * Returns the path that reads for a file should actually go to, which is the
+ * path of its content ID rather than its own path.
+ */
+const char *video_backing_path(unsigned int index);
+
+/**
+ * Returns whether a file is a remote film, whose path is a URL that is read
+ * through remote.c rather than a file on disk.
+ */
+bool video_remote(unsigned int index);
+
+/* This returns the size that the remote index lists for a remote film */
+off_t video_remote_size(unsigned int index);
+
+/**
+ * Replaces the remote films in the library with those listed by the remote
+ * index. Films that are no longer listed are marked as removed, and films that
+ * are listed again get their old index back.
+ *
+ * Return: number of films that appeared or disappeared, -1 on error
+ */
+int video_set_remote(const struct remote_film *films, unsigned int count);
+
+/**
+ * Returns the playback rate in bytes per second that was last measured for a
+ * film's content, or 0 if it hasn't been played yet.
+ */
+uint64_t video_byte_rate(unsigned int index);
+
+/* This records the measured playback rate of a film's content */
+void video_set_byte_rate(unsigned int index, uint64_t rate);
+
+/**
+ * Checks a filename's extension against the list of video formats that we
+ * serve, ignoring case.
+ *
+ * Return: true if file has video extension, false otherwise
+ */
+bool has_video_extension(const char *filename);
+
+/**
+ * Adds a file, or every video file under a directory, that appeared in the
+ * library. A file that is already in the library is treated as changed, and
+ * forgets its content ID and playback rate.
+ */
+void video_path_added(const char *path);
+
+/**
+ * Marks a file, or every file under a directory, as removed from the library.
+ */
+void video_path_removed(const char *path);
+
+/**
+ * Checks every directory in the library for changes, for when we may have
+ * missed them or can't be told about them. Only directories whose modification
+ * time changed are read again. Files that are still there keep their index.
+ *
+ * Return: number of files that appeared or disappeared, -1 on error
+ */
+int video_rescan(void);
+
+/**
+ * Saves the index of files and directories to ~/.filmfs/index if it changed
+ * since it was last saved or loaded, so that the next startup only has to read
+ * the directories that changed in between.
+ *
+ * Return: 0 on success, -1 on error
  */
-struct video_files *get_files(void);
+int video_save_index(void);
 
 /**
- * This function opens the library directory, reads all the entries, filters for
- * video files, stores filenames and full paths in video_files struct, and
- * dynamically grows the arrays in the struct if there are more than 64 files.
+ * This function loads the index saved by the last run and reads again only the
+ * directories that changed since. Without a usable index, it walks the library
+ * directory and its subdirectories, filters for video files, stores filenames
+ * and full paths in video_files struct, and dynamically grows the arrays in the
+ * struct if there are more than 64 files.
  *
  * Return: 0 on success, -1 on error
  */
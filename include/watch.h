@@ -0,0 +1,25 @@
+/**
+ * watch.h
+ *
+ * Responsible for noticing files that are added to, changed in or removed from
+ * LIBRARY_PATH while the filesystem is mounted.
+ */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+/* The size of the buffer that we read fanotify events into (64 KiB) */
+#define WATCH_BUFFER_SIZE 65536
+
+/**
+ * Starts watching the library if CHANGE_TRACKING is FANOTIFY, schedules rescans
+ * if RESCAN_SECONDS is set, and registers the change tracking metrics.
+ *
+ * Return: 0 on success or if change tracking is off, -1 on error
+ */
+int watch_start(void);
+
+/* This stops watching the library */
+void watch_stop(void);
+
+#endif
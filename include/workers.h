@@ -0,0 +1,55 @@
+/**
+ * workers.h
+ *
+ * Responsible for the pool of threads that answer FUSE requests, which grows
+ * when requests queue up behind busy threads and shrinks when they sit idle.
+ */
+
+#ifndef WORKERS_H
+#define WORKERS_H
+
+struct fuse;
+
+/* How often the controller looks at the pool in seconds */
+#define WORKERS_INTERVAL 1
+
+/**
+ * The pool grows once the estimated queueing delay of requests has been more
+ * than this share of their service time for WORKERS_GROW_INTERVALS intervals
+ * in a row
+ */
+#define WORKERS_GROW_RATIO 0.1
+#define WORKERS_GROW_INTERVALS 2
+
+/**
+ * The pool shrinks by one thread once its threads have been busy less than
+ * this share of the time, without any queueing, for WORKERS_SHRINK_INTERVALS
+ * intervals in a row
+ */
+#define WORKERS_SHRINK_UTILIZATION 0.25
+#define WORKERS_SHRINK_INTERVALS 10
+
+/**
+ * The number of buckets in the histogram of request service times, which go
+ * from 50 µs to 500 ms and then everything slower
+ */
+#define WORKERS_SERVICE_BUCKETS 8
+
+/**
+ * Runs the event loop on the adaptive pool of worker threads until the first
+ * of the filesystems is unmounted or the loop is exited. One pool answers the
+ * requests of every mountpoint. It takes the place of fuse_loop_mt().
+ *
+ * Return: 0 on success, -1 on error
+ */
+int workers_loop(struct fuse **fuses, unsigned int count);
+
+/**
+ * Registers the pool metrics and schedules the controller that resizes the
+ * pool. Does nothing if the event loop is single-threaded.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int workers_start(void);
+
+#endif
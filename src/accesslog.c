@@ -0,0 +1,240 @@
+/**
+ * accesslog.c
+ *
+ * Logging viewings with fanotify instead of a mount.
+ *
+ * OVERVIEW:
+ * Through the mountpoint, every read of a film passes through filmFS. With
+ * LOG_MODE=FANOTIFY players read the library directly at the speed of the
+ * disk, and we only watch: a fanotify mark on the mount that LIBRARY_PATH is
+ * on reports every file opened or read on it, along with an open file
+ * descriptor for the file and the ID of the thread that opened or read it.
+ *
+ * For each event we:
+ * 1. Find the path of the file from its descriptor, and skip files outside
+ *    LIBRARY_PATH, files that aren't videos and films whose policy turns
+ *    logging off
+ * 2. Hand the thread and the name of the film to player_log_access(), which
+ *    recognizes media players and logs viewings exactly like a read through
+ *    the mountpoint does
+ *
+ * FAN_REPORT_TID gives us the thread rather than the process, since players
+ * are recognized by the names of their reading threads, like FUSE reports
+ * them. Consecutive events from the thread we last handed over can only lead
+ * to the same answer, so we skip reading its name again.
+ *
+ * A mount mark needs CAP_SYS_ADMIN. Without it, we print why and exit.
+ *
+ * COST:
+ * The kernel merges events for the same file that are still queued, so a
+ * player reading steadily costs about one event per read() that we don't keep
+ * up with. In debug mode we print the events handled and the CPU time that we
+ * used on exit, to compare with the CPU time of the FUSE mode for the same
+ * playback.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fanotify.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "config.h"
+#include "player.h"
+#include "video.h"
+
+/* The events we ask for: a file being opened and a file being read */
+#define ACCESSLOG_EVENTS (FAN_OPEN | FAN_ACCESS)
+
+/* Written to by the signal handler to wake the event loop up */
+static int stop_pipe[2] = {-1, -1};
+
+/* LIBRARY_PATH with symbolic links resolved and a trailing '/' */
+static char library_root[PATH_MAX];
+
+/* The thread of the last event handed to player_log_access(), 0 for none */
+static pid_t last_tid = 0;
+
+/* What we did, for the summary in debug mode */
+static unsigned long long events_read = 0;
+static unsigned long long films_accessed = 0;
+
+/**
+ * handle_stop - Handler of the signals that stop the event loop
+ * @signal: The signal
+ */
+static void handle_stop(int signal) {
+  (void)signal;
+  char stop = 1;
+  /* There is nothing we can do from here if the pipe is full */
+  if (write(stop_pipe[1], &stop, 1) == -1) {
+    return;
+  }
+}
+
+/**
+ * handle_event - Log the viewing that an event may be
+ * @event: The event, whose descriptor we close
+ */
+static void handle_event(const struct fanotify_event_metadata *event) {
+  if (event->fd < 0) {
+    return;
+  }
+
+  char fd_path[32];
+  char path[PATH_MAX];
+  snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", event->fd);
+  ssize_t len = readlink(fd_path, path, sizeof(path) - 1);
+  if (close(event->fd) == -1) {
+    fprintf(stderr, "Failed to close fanotify event file: %s\n",
+            strerror(errno));
+  }
+  if (len <= 0) {
+    return;
+  }
+  path[len] = '\0';
+
+  size_t root_len = strlen(library_root);
+  if (strncmp(path, library_root, root_len) != 0) {
+    return;
+  }
+  const char *title = strrchr(path, '/') + 1;
+  if (!has_video_extension(title) ||
+      !get_config()->policies[match_policy(path)].log) {
+    return;
+  }
+
+  films_accessed++;
+  if (event->pid == last_tid) {
+    return;
+  }
+  last_tid = event->pid;
+  if (player_log_access(event->pid, title) != 0) {
+    fprintf(stderr, "Failed to log access to %s.\n", title);
+  }
+}
+
+/**
+ * print_summary - Print the events handled and the CPU time used
+ */
+static void print_summary(void) {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == -1) {
+    return;
+  }
+  double cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+               (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+  printf("Handled %llu fanotify events, %llu of them for films, using %.3f s "
+         "of CPU.\n",
+         events_read, films_accessed, cpu);
+}
+
+/**
+ * set_up - Resolve LIBRARY_PATH and install the signal handlers
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int set_up(void) {
+  const char *library_path = get_config()->library_path;
+  char real_path[PATH_MAX];
+  if (!realpath(library_path, real_path) ||
+      snprintf(library_root, PATH_MAX, "%s/", real_path) >= PATH_MAX) {
+    fprintf(stderr, "Failed to resolve %s: %s\n", library_path,
+            strerror(errno));
+    return -1;
+  }
+
+  if (pipe2(stop_pipe, O_CLOEXEC) == -1) {
+    fprintf(stderr, "Failed to create stop pipe: %s\n", strerror(errno));
+    return -1;
+  }
+
+  struct sigaction action = {.sa_handler = handle_stop};
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGINT, &action, NULL) == -1 ||
+      sigaction(SIGTERM, &action, NULL) == -1 ||
+      sigaction(SIGHUP, &action, NULL) == -1) {
+    fprintf(stderr, "Failed to install signal handlers: %s\n",
+            strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * accesslog_run - Log viewings from fanotify events until we are stopped
+ *
+ * Return: 0 on success, -1 on error
+ */
+int accesslog_run(void) {
+  if (set_up() == -1) {
+    return -1;
+  }
+
+  int fanotify_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC |
+                                      FAN_REPORT_TID,
+                                  O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+  if (fanotify_fd == -1) {
+    fprintf(stderr, "Failed to start fanotify, which needs CAP_SYS_ADMIN: %s\n",
+            strerror(errno));
+    return -1;
+  }
+
+  const char *library_path = get_config()->library_path;
+  if (fanotify_mark(fanotify_fd, FAN_MARK_ADD | FAN_MARK_MOUNT,
+                    ACCESSLOG_EVENTS, AT_FDCWD, library_path) == -1) {
+    fprintf(stderr, "Failed to mark %s for fanotify: %s\n", library_path,
+            strerror(errno));
+    close(fanotify_fd);
+    return -1;
+  }
+
+  /* Events are small, so this holds dozens of them */
+  char buffer[4096]
+      __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+  struct pollfd fds[2] = {{.fd = fanotify_fd, .events = POLLIN},
+                          {.fd = stop_pipe[0], .events = POLLIN}};
+  int result = 0;
+  while (true) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Failed to wait for fanotify events: %s\n",
+              strerror(errno));
+      result = -1;
+      break;
+    }
+    if (fds[1].revents) {
+      break;
+    }
+
+    ssize_t len = read(fanotify_fd, buffer, sizeof(buffer));
+    if (len <= 0) {
+      continue;
+    }
+    for (struct fanotify_event_metadata *event =
+             (struct fanotify_event_metadata *)buffer;
+         FAN_EVENT_OK(event, len); event = FAN_EVENT_NEXT(event, len)) {
+      events_read++;
+      handle_event(event);
+    }
+  }
+
+  if (get_config()->debug) {
+    print_summary();
+  }
+  close(fanotify_fd);
+  close(stop_pipe[0]);
+  close(stop_pipe[1]);
+  return result;
+}
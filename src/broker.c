@@ -0,0 +1,252 @@
+/**
+ * broker.c
+ *
+ * One memory budget shared by the caches of filmFS.
+ *
+ * OVERVIEW:
+ * The resident set, the memory mappings of small films and the lookahead
+ * buffers all trade memory for fewer waits on the disk. Given fixed caps, one
+ * of them can sit on memory that it barely uses while another turns reads away
+ * for lack of room. With MEMORY_BUDGET_MB set, the broker owns one budget and
+ * grants each cache a quota out of it instead.
+ *
+ * UTILITY:
+ * Every cache reports the bytes that it served from memory (its hits) and the
+ * bytes that it is holding (its usage). Every BROKER_INTERVAL seconds we work
+ * out each cache's utility, the bytes it served per second for every MiB of
+ * its quota, and blend it into the previous value, giving the new measurement
+ * a quarter of the weight like the lookahead rate estimate does.
+ *
+ * REBALANCING:
+ * Each cache keeps a floor of a quarter of an equal share, so that a cache
+ * that is idle now can still show that it would be useful. The rest of the
+ * budget is divided in proportion to utility, or equally before any cache has
+ * had a hit. A cache only moves halfway towards its new quota at a time, so a
+ * single busy interval doesn't empty the others.
+ *
+ * Caches read their quota whenever they are about to grow, so a smaller quota
+ * takes effect as they evict. The resident set only changes when it is
+ * rebuilt, so we ask for a rebuild when its quota moves by more than an
+ * eighth.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "broker.h"
+#include "config.h"
+#include "executor.h"
+#include "metrics.h"
+#include "resident.h"
+
+/* Names of the consumers in the metrics */
+static const char *consumer_names[CONSUMERS] = {"resident", "mmap",
+                                                "lookahead"};
+
+/* What each cache may use, holds and has served since mounting */
+static _Atomic uint64_t quotas[CONSUMERS];
+static _Atomic uint64_t usage[CONSUMERS];
+static atomic_ullong hits[CONSUMERS];
+
+/**
+ * The state of the last rebalance, protected by broker_lock:
+ * utility - smoothed hit bytes per second per MiB of quota
+ * last_hits - the hits of each cache at the last rebalance
+ * last_time - when the last rebalance happened
+ */
+static double utility[CONSUMERS];
+static unsigned long long last_hits[CONSUMERS];
+static struct timespec last_time;
+static pthread_mutex_t broker_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * broker_quota - Get the memory quota of a cache
+ * @consumer: The cache
+ *
+ * Return: Bytes that the cache may use
+ */
+uint64_t broker_quota(enum memory_consumer consumer) {
+  return atomic_load(&quotas[consumer]);
+}
+
+/**
+ * broker_set_usage - Record the memory used by a cache
+ * @consumer: The cache
+ * @bytes: Bytes that the cache is holding
+ */
+void broker_set_usage(enum memory_consumer consumer, uint64_t bytes) {
+  atomic_store(&usage[consumer], bytes);
+}
+
+/**
+ * broker_add_hits - Record bytes served from a cache
+ * @consumer: The cache
+ * @bytes: Bytes served from memory
+ */
+void broker_add_hits(enum memory_consumer consumer, uint64_t bytes) {
+  atomic_fetch_add(&hits[consumer], bytes);
+}
+
+/**
+ * fixed_quota - Get the cap of a cache when there is no shared budget
+ * @consumer: The cache
+ *
+ * Memory mappings were only ever limited by MAPCACHE_MAX and MMAP_MAX_MB, so
+ * they get no cap of their own.
+ *
+ * Return: Bytes that the cache may use
+ */
+static uint64_t fixed_quota(enum memory_consumer consumer) {
+  struct config_ctx *config = get_config();
+
+  switch (consumer) {
+  case CONSUMER_RESIDENT:
+    return config->resident_max_bytes;
+  case CONSUMER_LOOKAHEAD:
+    return config->lookahead_max_bytes;
+  default:
+    return UINT64_MAX;
+  }
+}
+
+/**
+ * measure - Update the utility of every cache
+ *
+ * Must be called with broker_lock held.
+ */
+static void measure(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double seconds = (now.tv_sec - last_time.tv_sec) +
+                   (now.tv_nsec - last_time.tv_nsec) / 1e9;
+  last_time = now;
+  if (seconds <= 0) {
+    return;
+  }
+
+  for (unsigned int i = 0; i < CONSUMERS; i++) {
+    unsigned long long total = atomic_load(&hits[i]);
+    uint64_t quota = atomic_load(&quotas[i]);
+
+    /* An uncapped cache is measured against what it actually holds */
+    uint64_t bytes = quota == UINT64_MAX ? atomic_load(&usage[i]) : quota;
+    double mebibytes = bytes / (1024.0 * 1024.0);
+    if (mebibytes < 1) {
+      mebibytes = 1;
+    }
+
+    double sample = (total - last_hits[i]) / seconds / mebibytes;
+    utility[i] = (utility[i] * 3 + sample) / 4;
+    last_hits[i] = total;
+  }
+}
+
+/**
+ * rebalance - Move memory between the caches according to their utility
+ *
+ * Must be called with broker_lock held and a budget set.
+ */
+static void rebalance(void) {
+  uint64_t budget = get_config()->memory_budget_bytes;
+  uint64_t floor = budget / (CONSUMERS * 4);
+  uint64_t shared = budget - floor * CONSUMERS;
+
+  double total_utility = 0;
+  for (unsigned int i = 0; i < CONSUMERS; i++) {
+    total_utility += utility[i];
+  }
+
+  for (unsigned int i = 0; i < CONSUMERS; i++) {
+    uint64_t target = floor;
+    if (total_utility > 0) {
+      target += shared * (utility[i] / total_utility);
+    } else {
+      target += shared / CONSUMERS;
+    }
+
+    uint64_t old = atomic_load(&quotas[i]);
+    uint64_t quota = old / 2 + target / 2;
+    atomic_store(&quotas[i], quota);
+
+    uint64_t change = quota > old ? quota - old : old - quota;
+    if (i == CONSUMER_RESIDENT && change > old / 8) {
+      resident_refresh();
+    }
+  }
+}
+
+/**
+ * rebalance_run - Body of the periodic rebalance task
+ * @arg: Unused
+ *
+ * Without a budget we still measure utility, so that the metrics show which
+ * caches would deserve more memory.
+ */
+static void rebalance_run(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&broker_lock);
+  measure();
+  if (get_config()->memory_budget_bytes > 0) {
+    rebalance();
+  }
+  pthread_mutex_unlock(&broker_lock);
+
+  executor_schedule(TASK_BROKER, rebalance_run, NULL, NULL, BROKER_INTERVAL);
+}
+
+/**
+ * write_metrics - Write the memory budget section of the metrics file
+ * @out: Stream to write to
+ */
+static void write_metrics(FILE *out) {
+  pthread_mutex_lock(&broker_lock);
+  double utilities[CONSUMERS];
+  for (unsigned int i = 0; i < CONSUMERS; i++) {
+    utilities[i] = utility[i];
+  }
+  pthread_mutex_unlock(&broker_lock);
+
+  fprintf(out, "filmfs_memory_budget_bytes %llu\n",
+          get_config()->memory_budget_bytes);
+  for (unsigned int i = 0; i < CONSUMERS; i++) {
+    uint64_t quota = atomic_load(&quotas[i]);
+    if (quota != UINT64_MAX) {
+      fprintf(out, "filmfs_memory_quota_bytes{consumer=\"%s\"} %llu\n",
+              consumer_names[i], (unsigned long long)quota);
+    }
+    fprintf(out, "filmfs_memory_usage_bytes{consumer=\"%s\"} %llu\n",
+            consumer_names[i], (unsigned long long)atomic_load(&usage[i]));
+    fprintf(out, "filmfs_memory_hit_bytes_total{consumer=\"%s\"} %llu\n",
+            consumer_names[i], atomic_load(&hits[i]));
+    fprintf(out, "filmfs_memory_utility{consumer=\"%s\"} %.3f\n",
+            consumer_names[i], utilities[i]);
+  }
+}
+
+/**
+ * broker_start - Set the first quotas and start rebalancing
+ *
+ * Every cache starts with an equal share of the budget. This must be called
+ * after the executor has been started and before any cache is.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int broker_start(void) {
+  uint64_t budget = get_config()->memory_budget_bytes;
+  for (unsigned int i = 0; i < CONSUMERS; i++) {
+    atomic_store(&quotas[i], budget > 0 ? budget / CONSUMERS : fixed_quota(i));
+  }
+
+  pthread_mutex_lock(&broker_lock);
+  clock_gettime(CLOCK_MONOTONIC, &last_time);
+  pthread_mutex_unlock(&broker_lock);
+
+  if (metrics_register(write_metrics) == -1) {
+    return -1;
+  }
+  return executor_schedule(TASK_BROKER, rebalance_run, NULL, NULL,
+                           BROKER_INTERVAL);
+}
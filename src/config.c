@@ -14,6 +14,8 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
 #include <linux/limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -72,9 +74,10 @@ char *construct_config_path(void) {
  * count_vars - Count the number of configuration variables in the file
  * @config_file_contents: String containing entire config file
  *
- * Counts the number of '=' characters to determine how many config variables
- * are present. We use this information to know how much memory to allocate for
- * our struct array.
+ * Counts the number of lines with a '=' character to determine how many config
+ * variables are present. We use this information to know how much memory to
+ * allocate for our struct array. POLICY and MOUNT values contain '='s of their
+ * own, so we only count the first one on each line.
  *
  * Return: Number of configuration variables found (minimum 1 to prevent calling
  * malloc with 0).
@@ -86,11 +89,11 @@ unsigned int count_vars(char *config_file_contents) {
    * This might look a little confusing at first. We:
    * 1. Start at the beginning of the file
    * 2. Advance the pointer to the first occurence of '='
-   * 3. Advance one more character to get us past '='
-   * 4. Repeat for as many '=' as there are in the string
+   * 3. Advance to the end of that line to get us past the rest of it
+   * 4. Repeat for as many lines with a '=' as there are in the string
    */
   for (const char *temp = config_file_contents; (temp = strchr(temp, '='));
-       temp += 1) {
+       temp += strcspn(temp, "\n")) {
     config_count++;
   }
 
@@ -121,6 +124,322 @@ void cleanup_vars(void) {
   free(config.vars);
 }
 
+/**
+ * parse_number - Parse a non-negative integer configuration value
+ * @name: Name of the setting, used in error messages
+ * @value: String value from the configuration file
+ * @number: Output for the parsed number
+ *
+ * strtoull() stops at the first character that isn't a digit, so we check
+ * where it stopped to reject values like "30s" rather than silently using 30.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int parse_number(const char *name, const char *value,
+                        unsigned long long *number) {
+  char *end;
+
+  errno = 0;
+  *number = strtoull(value, &end, 10);
+  if (errno != 0 || end == value || *end != '\0' || value[0] == '-') {
+    fprintf(stderr, "%s must be a non-negative integer.\n", name);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * parse_yes_no - Parse a yes or no value of a POLICY option
+ * @name: Name of the option, used in error messages
+ * @value: String value of the option
+ * @flag: Output for the parsed value
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int parse_yes_no(const char *name, const char *value, bool *flag) {
+  if (strcmp(value, "yes") == 0) {
+    *flag = true;
+  } else if (strcmp(value, "no") == 0) {
+    *flag = false;
+  } else {
+    fprintf(stderr, "POLICY option %s must be yes or no.\n", name);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * is_policy_option - Check whether a word of a POLICY value is an option
+ * @word: The word, and the rest of the value after it
+ *
+ * Return: true if the word starts with the name of an option and a '='
+ */
+static bool is_policy_option(const char *word) {
+  static const char *options[] = {"lookahead", "readahead", "direct_io",
+                                  "cache",     "resident",  "log"};
+
+  for (unsigned int i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+    size_t len = strlen(options[i]);
+    if (strncmp(word, options[i], len) == 0 && word[len] == '=') {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * parse_layout - Parse a value of LAYOUT or of the layout option of MOUNT
+ * @name: Name of the setting, used in error messages
+ * @value: String value from the configuration file
+ * @layout: Output for the layout, LAYOUT_*
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int parse_layout(const char *name, const char *value, int *layout) {
+  if (strcmp(value, "FLAT") == 0) {
+    *layout = LAYOUT_FLAT;
+  } else if (strcmp(value, "LETTER") == 0) {
+    *layout = LAYOUT_LETTER;
+  } else if (strcmp(value, "YEAR") == 0) {
+    *layout = LAYOUT_YEAR;
+  } else if (strcmp(value, "RANGE") == 0) {
+    *layout = LAYOUT_RANGE;
+  } else {
+    fprintf(stderr, "%s must be FLAT, LETTER, YEAR or RANGE.\n", name);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * parse_range_size - Parse a value of LAYOUT_RANGE_SIZE or of the range_size
+ * option of MOUNT
+ * @name: Name of the setting, used in error messages
+ * @value: String value from the configuration file
+ * @size: Output for the number of films per directory
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int parse_range_size(const char *name, const char *value,
+                            unsigned int *size) {
+  unsigned long long number;
+  if (parse_number(name, value, &number) == -1) {
+    return -1;
+  }
+  if (number == 0 || number > UINT_MAX) {
+    fprintf(stderr, "%s must be at least 1.\n", name);
+    return -1;
+  }
+  *size = number;
+  return 0;
+}
+
+/**
+ * is_mount_option - Check whether a word of a MOUNT value is an option
+ * @word: The word, and the rest of the value after it
+ *
+ * Return: true if the word starts with the name of an option and a '='
+ */
+static bool is_mount_option(const char *word) {
+  static const char *options[] = {"layout", "range_size", "fuse"};
+
+  for (unsigned int i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+    size_t len = strlen(options[i]);
+    if (strncmp(word, options[i], len) == 0 && word[len] == '=') {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * parse_mount - Compile a MOUNT value into the next mount
+ * @value: "<mountpoint> <option>=<value> ...", which we modify
+ *
+ * Like the glob of a POLICY, the mountpoint ends where the first option
+ * starts. Options that are left out take the value of the global LAYOUT and
+ * LAYOUT_RANGE_SIZE.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int parse_mount(char *value) {
+  if (config.mount_count == MOUNTS_MAX) {
+    fprintf(stderr, "Too many MOUNT settings, at most %d are supported.\n",
+            MOUNTS_MAX);
+    return -1;
+  }
+
+  char *options = NULL;
+  for (char *space = strchr(value, ' '); space;
+       space = strchr(space + 1, ' ')) {
+    if (is_mount_option(space + 1)) {
+      *space = '\0';
+      options = space + 1;
+      break;
+    }
+  }
+  if (value[0] != '/') {
+    fprintf(stderr, "MOUNT must be an absolute path followed by options.\n");
+    return -1;
+  }
+
+  struct mount_config *mount = &config.mounts[config.mount_count];
+  *mount = (struct mount_config){
+      .mountpoint = value,
+      .layout = config.layout,
+      .layout_range_size = config.layout_range_size,
+      .fuse_options = NULL,
+  };
+
+  char *save;
+  for (char *option = options ? strtok_r(options, " ", &save) : NULL; option;
+       option = strtok_r(NULL, " ", &save)) {
+    char *equal_sign = strchr(option, '=');
+    if (!equal_sign || equal_sign[1] == '\0') {
+      fprintf(stderr, "Invalid MOUNT option %s.\n", option);
+      return -1;
+    }
+    *equal_sign = '\0';
+    const char *option_value = equal_sign + 1;
+
+    int result = 0;
+    if (strcmp(option, "layout") == 0) {
+      result =
+          parse_layout("MOUNT option layout", option_value, &mount->layout);
+    } else if (strcmp(option, "range_size") == 0) {
+      result = parse_range_size("MOUNT option range_size", option_value,
+                                &mount->layout_range_size);
+    } else if (strcmp(option, "fuse") == 0) {
+      mount->fuse_options = option_value;
+    } else {
+      fprintf(stderr, "Unknown MOUNT option %s.\n", option);
+      result = -1;
+    }
+    if (result == -1) {
+      return -1;
+    }
+  }
+
+  config.mount_count++;
+  return 0;
+}
+
+/**
+ * parse_policy - Compile a POLICY value into the next policy
+ * @value: "<glob> <option>=<value> ...", which we modify
+ *
+ * The glob ends where the first option starts, so that it may contain spaces
+ * like directory names often do. Options that a rule leaves out keep the value
+ * of the default policy.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int parse_policy(char *value) {
+  if (config.policy_count == POLICIES_MAX) {
+    fprintf(stderr, "Too many POLICY rules, at most %d are supported.\n",
+            POLICIES_MAX - 1);
+    return -1;
+  }
+
+  char *options = NULL;
+  for (char *space = strchr(value, ' '); space;
+       space = strchr(space + 1, ' ')) {
+    if (is_policy_option(space + 1)) {
+      *space = '\0';
+      options = space + 1;
+      break;
+    }
+  }
+  if (!options || value[0] == '\0') {
+    fprintf(stderr, "POLICY must be a glob followed by options.\n");
+    return -1;
+  }
+
+  struct film_policy *policy = &config.policies[config.policy_count];
+  *policy = config.policies[0];
+  policy->glob = value;
+
+  char *save;
+  for (char *option = strtok_r(options, " ", &save); option;
+       option = strtok_r(NULL, " ", &save)) {
+    char *equal_sign = strchr(option, '=');
+    if (!equal_sign) {
+      fprintf(stderr, "Invalid POLICY option %s.\n", option);
+      return -1;
+    }
+    *equal_sign = '\0';
+    const char *option_value = equal_sign + 1;
+
+    int result = 0;
+    if (strcmp(option, "lookahead") == 0) {
+      unsigned long long seconds;
+      result = parse_number("POLICY option lookahead", option_value, &seconds);
+      policy->lookahead_seconds = seconds;
+    } else if (strcmp(option, "readahead") == 0) {
+      if (strcmp(option_value, "normal") == 0) {
+        policy->readahead = READAHEAD_NORMAL;
+      } else if (strcmp(option_value, "sequential") == 0) {
+        policy->readahead = READAHEAD_SEQUENTIAL;
+      } else if (strcmp(option_value, "random") == 0) {
+        policy->readahead = READAHEAD_RANDOM;
+      } else {
+        fprintf(stderr, "POLICY option readahead must be normal, sequential "
+                        "or random.\n");
+        result = -1;
+      }
+    } else if (strcmp(option, "direct_io") == 0) {
+      result = parse_yes_no(option, option_value, &policy->direct_io);
+    } else if (strcmp(option, "cache") == 0) {
+      result = parse_yes_no(option, option_value, &policy->cache);
+    } else if (strcmp(option, "resident") == 0) {
+      result = parse_yes_no(option, option_value, &policy->resident);
+    } else if (strcmp(option, "log") == 0) {
+      result = parse_yes_no(option, option_value, &policy->log);
+    } else {
+      fprintf(stderr, "Unknown POLICY option %s.\n", option);
+      result = -1;
+    }
+    if (result == -1) {
+      return -1;
+    }
+  }
+
+  config.policy_count++;
+  return 0;
+}
+
+/**
+ * match_policy - Find the policy of a film
+ * @path: Full path of the film
+ *
+ * Globs are matched against the path relative to LIBRARY_PATH without
+ * FNM_PATHNAME, so a '*' after "Archive/" covers every film under Archive,
+ * however deep.
+ * This runs once per film when it is added to the index, not on every read.
+ *
+ * Return: ID of the policy, 0 if no rule matches
+ */
+uint8_t match_policy(const char *path) {
+  size_t root_len = strlen(config.library_path);
+  const char *relative = path;
+  if (strncmp(path, config.library_path, root_len) == 0) {
+    relative += root_len;
+  } else if (config.remote_url) {
+    /* Remote films are matched by their path relative to the remote index */
+    size_t base_len = strrchr(config.remote_url, '/') + 1 - config.remote_url;
+    if (strncmp(path, config.remote_url, base_len) == 0) {
+      relative += base_len;
+    }
+  }
+
+  for (unsigned int i = 1; i < config.policy_count; i++) {
+    if (fnmatch(config.policies[i].glob, relative, 0) == 0) {
+      return i;
+    }
+  }
+  return 0;
+}
+
 /** parse_configuration - Parse config file contents into struct array
  * @config_file_contents: String containing entire config file
  *
@@ -130,13 +449,35 @@ void cleanup_vars(void) {
  * Return: 0 on success, -1 on error
  */
 int parse_configuration(char *config_file_contents) {
+  /* Settings that are left out of the file keep these default values */
+  config.lookahead_seconds = LOOKAHEAD_SECONDS_DEFAULT;
+  config.lookahead_max_bytes = LOOKAHEAD_MAX_MB_DEFAULT * 1024ULL * 1024ULL;
+  config.resident_films = RESIDENT_FILMS_DEFAULT;
+  config.resident_seconds = RESIDENT_SECONDS_DEFAULT;
+  config.resident_max_bytes = RESIDENT_MAX_MB_DEFAULT * 1024ULL * 1024ULL;
+  config.mmap_max_bytes = MMAP_MAX_MB_DEFAULT * 1024ULL * 1024ULL;
+  config.change_tracking = CHANGE_TRACKING_NONE;
+  config.rescan_seconds = RESCAN_SECONDS_DEFAULT;
+  config.memory_budget_bytes = MEMORY_BUDGET_MB_DEFAULT * 1024ULL * 1024ULL;
+  config.first_byte_alert_ms = FIRST_BYTE_ALERT_MS_DEFAULT;
+  config.layout = LAYOUT_FLAT;
+  config.layout_range_size = LAYOUT_RANGE_SIZE_DEFAULT;
+  config.workers_min = WORKERS_MIN_DEFAULT;
+  config.workers_max = WORKERS_MAX_DEFAULT;
+  config.log_mode = LOG_MODE_FUSE;
+  config.remote_cache_bytes = REMOTE_CACHE_MB_DEFAULT * 1024ULL * 1024ULL;
+  config.remote_chunk_bytes = REMOTE_CHUNK_MB_DEFAULT * 1024ULL * 1024ULL;
+  config.remote_connections = REMOTE_CONNECTIONS_DEFAULT;
+
   config.vars_count = count_vars(config_file_contents);
 
   /*
    * We cap the number of config variables to the number of supported config
-   * variables. Currently we only support LIBRARY_PATH and DEBUG.
+   * variables. POLICY may be given once for every policy but the default one,
+   * and MOUNT once for every mount.
    */
-  if (config.vars_count > NUM_OF_SUPPORTED_CONFIG) {
+  if (config.vars_count >
+      NUM_OF_SUPPORTED_CONFIG - 2 + POLICIES_MAX - 1 + MOUNTS_MAX) {
     fprintf(stderr, "Too many configuration values given.");
     return -1;
   }
@@ -247,6 +588,267 @@ int parse_configuration(char *config_file_contents) {
       } else {
         config.debug = 0;
       }
+      continue;
+    }
+    if (strcmp(config.vars[i].name, "LOOKAHEAD_SECONDS") == 0) {
+      unsigned long long seconds;
+      if (parse_number(config.vars[i].name, config.vars[i].value, &seconds) ==
+          -1) {
+        cleanup_vars();
+        return -1;
+      }
+      config.lookahead_seconds = seconds;
+      continue;
+    }
+    if (strcmp(config.vars[i].name, "LOOKAHEAD_MAX_MB") == 0) {
+      unsigned long long megabytes;
+      if (parse_number(config.vars[i].name, config.vars[i].value,
+                       &megabytes) == -1) {
+        cleanup_vars();
+        return -1;
+      }
+      config.lookahead_max_bytes = megabytes * 1024ULL * 1024ULL;
+      continue;
+    }
+    if (strcmp(config.vars[i].name, "RESIDENT_FILMS") == 0) {
+      unsigned long long films;
+      if (parse_number(config.vars[i].name, config.vars[i].value, &films) ==
+          -1) {
+        cleanup_vars();
+        return -1;
+      }
+      config.resident_films = films;
+      continue;
+    }
+    if (strcmp(config.vars[i].name, "RESIDENT_SECONDS") == 0) {
+      unsigned long long seconds;
+      if (parse_number(config.vars[i].name, config.vars[i].value, &seconds) ==
+          -1) {
+        cleanup_vars();
+        return -1;
+      }
+      config.resident_seconds = seconds;
+      continue;
+    }
+    if (strcmp(config.vars[i].name, "RESIDENT_MAX_MB") == 0) {
+      unsigned long long megabytes;
+      if (parse_number(config.vars[i].name, config.vars[i].value,
+                       &megabytes) == -1) {
+        cleanup_vars();
+        return -1;
+      }
+      config.resident_max_bytes = megabytes * 1024ULL * 1024ULL;
+      continue;
+    }
+    if (strcmp(config.vars[i].name, "MMAP_MAX_MB") == 0) {
+      unsigned long long megabytes;
+      if (parse_number(config.vars[i].name, config.vars[i].value,
+                       &megabytes) == -1) {
+        cleanup_vars();
+        return -1;
+      }
+      config.mmap_max_bytes = megabytes * 1024ULL * 1024ULL;
+      continue;
+    }
+    if (strcmp(config.vars[i].name, "CHANGE_TRACKING") == 0) {
+      if (strcmp(config.vars[i].value, "FANOTIFY") == 0) {
+        config.change_tracking = CHANGE_TRACKING_FANOTIFY;
+      } else if (strcmp(config.vars[i].value, "NONE") == 0) {
+        config.change_tracking = CHANGE_TRACKING_NONE;
+      } else {
+        fprintf(stderr, "CHANGE_TRACKING must be FANOTIFY or NONE.\n");
+        cleanup_vars();
+        return -1;
+      }
+      continue;
+    }
+    if (strcmp(config.vars[i].name, "RESCAN_SECONDS") == 0) {
+      unsigned long long seconds;
+      if (parse_number(config.vars[i].name, config.vars[i].value, &seconds) ==
+          -1) {
+        cleanup_vars();
+        return -1;
+      }
+      config.rescan_seconds = seconds;
+      continue;
+    }
+    if (strcmp(config.vars[i].name, "MEMORY_BUDGET_MB") == 0) {
+      unsigned long long megabytes;
+      if (parse_number(config.vars[i].name, config.vars[i].value,
+                       &megabytes) == -1) {
+        cleanup_vars();
+        return -1;
+      }
+      config.memory_budget_bytes = megabytes * 1024ULL * 1024ULL;
+      continue;
+    }
+    if (strcmp(config.vars[i].name, "FIRST_BYTE_ALERT_MS") == 0) {
+      if (parse_number(config.vars[i].name, config.vars[i].value,
+                       &config.first_byte_alert_ms) == -1) {
+        cleanup_vars();
+        return -1;
+      }
+      continue;
+    }
+    if (strcmp(config.vars[i].name, "RESIDENT_CACHE_DIR") == 0) {
+      /* An empty directory tells the resident set not to keep a warm cache */
+      if (strcmp(config.vars[i].value, "NONE") == 0) {
+        config.vars[i].value[0] = '\0';
+      }
+      config.resident_cache_dir = config.vars[i].value;
+      continue;
+    }
+    if (strcmp(config.vars[i].name, "LAYOUT") == 0) {
+      if (parse_layout(config.vars[i].name, config.vars[i].value,
+                       &config.layout) == -1) {
+        cleanup_vars();
+        return -1;
+      }
+      continue;
+    }
+    if (strcmp(config.vars[i].name, "LAYOUT_RANGE_SIZE") == 0) {
+      if (parse_range_size(config.vars[i].name, config.vars[i].value,
+                           &config.layout_range_size) == -1) {
+        cleanup_vars();
+        return -1;
+      }
+      continue;
+    }
+    if (strcmp(config.vars[i].name, "WORKERS_MIN") == 0 ||
+        strcmp(config.vars[i].name, "WORKERS_MAX") == 0) {
+      unsigned long long workers;
+      if (parse_number(config.vars[i].name, config.vars[i].value, &workers) ==
+          -1) {
+        cleanup_vars();
+        return -1;
+      }
+      if (workers == 0 || workers > WORKERS_LIMIT) {
+        fprintf(stderr, "%s must be between 1 and %d.\n", config.vars[i].name,
+                WORKERS_LIMIT);
+        cleanup_vars();
+        return -1;
+      }
+      if (strcmp(config.vars[i].name, "WORKERS_MIN") == 0) {
+        config.workers_min = workers;
+      } else {
+        config.workers_max = workers;
+      }
+      continue;
+    }
+    if (strcmp(config.vars[i].name, "LOG_MODE") == 0) {
+      if (strcmp(config.vars[i].value, "FUSE") == 0) {
+        config.log_mode = LOG_MODE_FUSE;
+      } else if (strcmp(config.vars[i].value, "FANOTIFY") == 0) {
+        config.log_mode = LOG_MODE_FANOTIFY;
+      } else {
+        fprintf(stderr, "LOG_MODE must be FUSE or FANOTIFY.\n");
+        cleanup_vars();
+        return -1;
+      }
+      continue;
+    }
+    if (strcmp(config.vars[i].name, "REMOTE_URL") == 0) {
+      /* Films are looked for next to the index, so it needs a directory */
+      const char *value = config.vars[i].value;
+      size_t scheme_len = strlen(REMOTE_SCHEME);
+      if (strncmp(value, REMOTE_SCHEME, scheme_len) != 0 ||
+          !strchr(value + scheme_len, '/') || value[scheme_len] == '/') {
+        fprintf(stderr, "REMOTE_URL must be an http:// URL of an index, like "
+                        "http://host/films/index.txt.\n");
+        cleanup_vars();
+        return -1;
+      }
+      config.remote_url = config.vars[i].value;
+      continue;
+    }
+    if (strcmp(config.vars[i].name, "REMOTE_CACHE_DIR") == 0) {
+      config.remote_cache_dir = config.vars[i].value;
+      continue;
+    }
+    if (strcmp(config.vars[i].name, "REMOTE_CACHE_MB") == 0 ||
+        strcmp(config.vars[i].name, "REMOTE_CHUNK_MB") == 0) {
+      unsigned long long megabytes;
+      if (parse_number(config.vars[i].name, config.vars[i].value,
+                       &megabytes) == -1) {
+        cleanup_vars();
+        return -1;
+      }
+      if (megabytes == 0) {
+        fprintf(stderr, "%s must be at least 1.\n", config.vars[i].name);
+        cleanup_vars();
+        return -1;
+      }
+      if (strcmp(config.vars[i].name, "REMOTE_CACHE_MB") == 0) {
+        config.remote_cache_bytes = megabytes * 1024ULL * 1024ULL;
+      } else {
+        config.remote_chunk_bytes = megabytes * 1024ULL * 1024ULL;
+      }
+      continue;
+    }
+    if (strcmp(config.vars[i].name, "REMOTE_CONNECTIONS") == 0) {
+      unsigned long long connections;
+      if (parse_number(config.vars[i].name, config.vars[i].value,
+                       &connections) == -1) {
+        cleanup_vars();
+        return -1;
+      }
+      if (connections == 0 || connections > REMOTE_CONNECTIONS_LIMIT) {
+        fprintf(stderr, "REMOTE_CONNECTIONS must be between 1 and %d.\n",
+                REMOTE_CONNECTIONS_LIMIT);
+        cleanup_vars();
+        return -1;
+      }
+      config.remote_connections = connections;
+    }
+  }
+
+  /* The bounds may be given in either order, so we check them together */
+  if (config.workers_min > config.workers_max) {
+    fprintf(stderr, "WORKERS_MIN must not be more than WORKERS_MAX.\n");
+    cleanup_vars();
+    return -1;
+  }
+
+  /* Every chunk that is being fetched needs room in the cache */
+  if (config.remote_cache_bytes <
+      config.remote_chunk_bytes * config.remote_connections) {
+    fprintf(stderr, "REMOTE_CACHE_MB must be at least REMOTE_CHUNK_MB times "
+                    "REMOTE_CONNECTIONS.\n");
+    cleanup_vars();
+    return -1;
+  }
+
+  /* The default policy is made of the global settings */
+  config.policies[0] = (struct film_policy){
+      .glob = NULL,
+      .lookahead_seconds = config.lookahead_seconds,
+      .readahead = READAHEAD_NORMAL,
+      .direct_io = false,
+      .cache = true,
+      .resident = true,
+      .log = true,
+  };
+  config.policy_count = 1;
+
+  /*
+   * We compile the POLICY rules once all the global settings are known, since
+   * the rules start from them.
+   */
+  for (unsigned int i = 0; i < config.vars_count; i++) {
+    if (strcmp(config.vars[i].name, "POLICY") == 0 &&
+        parse_policy(config.vars[i].value) == -1) {
+      cleanup_vars();
+      return -1;
+    }
+  }
+
+  /* Likewise, mounts start from the global LAYOUT and LAYOUT_RANGE_SIZE */
+  config.mount_count = 0;
+  for (unsigned int i = 0; i < config.vars_count; i++) {
+    if (strcmp(config.vars[i].name, "MOUNT") == 0 &&
+        parse_mount(config.vars[i].value) == -1) {
+      cleanup_vars();
+      return -1;
     }
   }
   return 0;
@@ -16,9 +16,27 @@
  * - TITLE: Film title (extracted from the filename)
  * - WATCHCOUNT: Number of times watched
  * - LASTWATCHED: Timestamp of most recent viewing
+ * - NORMKEY: Normalized key of the title, see normalize.c, which is indexed
+ *
+ * KEYS:
+ * The same film is often watched under more than one filename, like two
+ * releases of it. A viewing is counted for the row whose key matches the
+ * filename's, if there is one, and only gets a row of its own otherwise. The
+ * key also joins the history to the library, whose files are looked up by key
+ * in video.c. The NORMALIZE_VERSION that the keys were computed with is kept
+ * in user_version, and when it changes, or the column is missing from an
+ * older database, db_init() computes every key again.
+ *
+ * STARTUP:
+ * Opening the database and checking its schema can take a while on a slow
+ * disk, so main() runs db_init() in a thread alongside the library scan and
+ * starts serving files without waiting for it. Watches logged before the
+ * database is open are queued and written as soon as it is, and queries wait
+ * for it.
  */
 #include <errno.h>
 #include <linux/limits.h>
+#include <pthread.h>
 #include <sqlite3.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,10 +45,37 @@
 
 #include "config.h"
 #include "database.h"
+#include "normalize.h"
 
 /* File-static database handle */
 static sqlite3 *db;
 
+/**
+ * A watch that was logged before the database was open:
+ * path - FUSE path of the film that was watched
+ * next - the next queued watch, in the order they were logged
+ */
+struct queued_watch {
+  char *path;
+  struct queued_watch *next;
+};
+
+/* Whether db_init() is still running, has succeeded or has failed */
+enum db_state { DB_OPENING, DB_READY, DB_FAILED };
+
+/* The state and queued watches are protected by state_lock */
+static enum db_state state = DB_OPENING;
+static struct queued_watch *queue_head = NULL;
+static struct queued_watch *queue_tail = NULL;
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t state_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * sqlite3_changes() counts the last statement on the connection from any
+ * thread, so a viewing's update and insert are made under this lock.
+ */
+static pthread_mutex_t insert_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /**
  * db_cleanup - Close database connection
  *
@@ -39,7 +84,72 @@ static sqlite3 *db;
 void db_cleanup(void) { sqlite3_close(db); }
 
 /**
- * db_insert - Log a film viewing to the database
+ * run_sql - Run SQL statements that don't return rows
+ * @sql: The statements
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int run_sql(const char *sql) {
+  char *error_msg_buffer = 0;
+  if (sqlite3_exec(db, sql, NULL, 0, &error_msg_buffer) != SQLITE_OK) {
+    fprintf(stderr, "SQL Error: %s\n", error_msg_buffer);
+    /*
+     * SQLite has its own approach to allocating memory, so we use its function
+     * to free the error_msg_buffer.
+     */
+    sqlite3_free(error_msg_buffer);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * count_watch - Run the statements that record a viewing
+ * @title: Title of the film
+ * @key: Normalized key of the filename
+ *
+ * The update counts the viewing for the row with the same key, preferring the
+ * one with the same title, and the insert runs only if there is none. Both
+ * bind the title and key as parameters ?1 and ?2 rather than pasting them into
+ * the SQL, so no filename can change what the SQL does.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int count_watch(const char *title, const char *key) {
+  static const char *update_sql =
+      "UPDATE FILMS SET WATCHCOUNT = WATCHCOUNT + 1, "
+      "LASTWATCHED = current_timestamp "
+      "WHERE ID = (SELECT ID FROM FILMS WHERE NORMKEY = ?2 "
+      "ORDER BY TITLE = ?1 DESC, WATCHCOUNT DESC LIMIT 1);";
+  static const char *insert_sql =
+      "INSERT INTO FILMS (TITLE, NORMKEY, WATCHCOUNT) VALUES (?1, ?2, 1) "
+      "ON CONFLICT(TITLE) DO UPDATE SET NORMKEY = ?2, "
+      "WATCHCOUNT = WATCHCOUNT + 1, LASTWATCHED = current_timestamp;";
+  const char *sqls[] = {update_sql, insert_sql};
+
+  for (int i = 0; i < 2; i++) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sqls[i], -1, &stmt, NULL) != SQLITE_OK) {
+      fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(db));
+      return -1;
+    }
+    sqlite3_bind_text(stmt, 1, title, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, key, -1, SQLITE_STATIC);
+    int result = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (result != SQLITE_DONE) {
+      fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(db));
+      return -1;
+    }
+    if (sqlite3_changes(db) > 0) {
+      return 0;
+    }
+  }
+  return 0;
+}
+
+/**
+ * insert_watch - Write a film viewing to the database
  * @path: FUSE path to the film ("/file.mp4")
  *
  * This records that a film was watched by inserting a new row if we haven't
@@ -48,9 +158,7 @@ void db_cleanup(void) { sqlite3_close(db); }
  *
  * Return: 0 on success, -1 on error
  */
-int db_insert(const char *path) {
-  char *error_msg_buffer = 0;
-
+static int insert_watch(const char *path) {
   /* This duplicates everything after the leading slash into a malloc'd string*/
   char *title = strdup(path + 1);
   if (!title) {
@@ -71,47 +179,183 @@ int db_insert(const char *path) {
 
   *extension = '\0';
 
-  /**
-   * 8192 bytes should be more than enough for our command template and even
-   * long film titles.
-   */
-  char *sql = malloc(SQL_COMMAND_MAX);
-  if (!sql) {
-    fprintf(stderr, "Memory allocation failed for sql command string: %s",
+  /* The key is never longer than the filename */
+  char *key = malloc(strlen(path + 1) + 1);
+  if (!key) {
+    fprintf(stderr, "Memory allocation failed for title key: %s",
             strerror(errno));
     free(title);
     return -1;
   }
+  normalize_title(path + 1, key);
 
-  /**
-   * The approach that we use here of embedding the title into the SQL string is
-   * NOT SAFE because the user could inject commands through clever file
-   * naming. Though this is primarily an educational project, this will likely
-   * be changed to use prepared statements in the future.
-   */
-  snprintf(sql, SQL_COMMAND_MAX,
-           "INSERT INTO FILMS (TITLE, WATCHCOUNT) "
-           "VALUES ('%s', 1) "
-           "ON CONFLICT(TITLE) DO UPDATE SET "
-           "WATCHCOUNT = WATCHCOUNT + 1, LASTWATCHED = current_timestamp;",
-           title);
+  pthread_mutex_lock(&insert_lock);
+  int result = count_watch(title, key);
+  pthread_mutex_unlock(&insert_lock);
 
+  free(key);
   free(title);
+  return result;
+}
 
-  /* This is where the SQL statement is prepared and executed. */
-  if (sqlite3_exec(db, sql, NULL, 0, &error_msg_buffer) != SQLITE_OK) {
-    fprintf(stderr, "SQL Error: %s\n", error_msg_buffer);
-    /*
-     * SQLite has its own approach to allocating memory, so we use its function
-     * to free the error_msg_buffer.
-     */
-    sqlite3_free(error_msg_buffer);
-    error_msg_buffer = NULL;
-    free(sql);
+/**
+ * db_insert - Log a film viewing to the database
+ * @path: FUSE path to the film ("/file.mp4")
+ *
+ * If the database isn't open yet, we queue the viewing and db_init() writes it
+ * once it is.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int db_insert(const char *path) {
+  pthread_mutex_lock(&state_lock);
+  if (state == DB_FAILED) {
+    pthread_mutex_unlock(&state_lock);
+    return -1;
+  }
+
+  if (state == DB_OPENING) {
+    struct queued_watch *watch = malloc(sizeof(struct queued_watch));
+    char *path_copy = strdup(path);
+    if (!watch || !path_copy) {
+      fprintf(stderr, "Memory allocation failed for queued watch: %s",
+              strerror(errno));
+      free(watch);
+      free(path_copy);
+      pthread_mutex_unlock(&state_lock);
+      return -1;
+    }
+    watch->path = path_copy;
+    watch->next = NULL;
+    if (queue_tail) {
+      queue_tail->next = watch;
+    } else {
+      queue_head = watch;
+    }
+    queue_tail = watch;
+    pthread_mutex_unlock(&state_lock);
+    return 0;
+  }
+
+  pthread_mutex_unlock(&state_lock);
+  return insert_watch(path);
+}
+
+/**
+ * wait_until_open - Wait for db_init() to finish
+ *
+ * Return: 0 if the database is open, -1 if it failed to open
+ */
+static int wait_until_open(void) {
+  pthread_mutex_lock(&state_lock);
+  while (state == DB_OPENING) {
+    pthread_cond_wait(&state_cond, &state_lock);
+  }
+  enum db_state result = state;
+  pthread_mutex_unlock(&state_lock);
+
+  return result == DB_READY ? 0 : -1;
+}
+
+/**
+ * finish_opening - Record whether db_init() succeeded and handle queued watches
+ * @success: Whether the database was opened
+ *
+ * We write the queued watches while holding the lock, so a watch logged in the
+ * meantime waits and is written after them, keeping them in order.
+ */
+static void finish_opening(int success) {
+  pthread_mutex_lock(&state_lock);
+
+  while (queue_head) {
+    struct queued_watch *watch = queue_head;
+    queue_head = watch->next;
+    if (success) {
+      insert_watch(watch->path);
+    }
+    free(watch->path);
+    free(watch);
+  }
+  queue_tail = NULL;
+
+  state = success ? DB_READY : DB_FAILED;
+  pthread_cond_broadcast(&state_cond);
+  pthread_mutex_unlock(&state_lock);
+}
+
+/**
+ * db_top_keys - Get the keys of the most watched films
+ * @limit: Maximum number of keys to return
+ * @keys: Output for a malloc'd array of malloc'd keys
+ * @count: Output for the number of keys in the array
+ *
+ * Like db_insert(), this uses a prepared statement: the SQL is compiled once
+ * with a placeholder (?) and the limit is bound to it separately, so no value
+ * is ever pasted into the SQL text. Rows that were counted separately before
+ * they had keys are added up.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int db_top_keys(unsigned int limit, char ***keys, unsigned int *count) {
+  static const char *sql = "SELECT NORMKEY FROM FILMS "
+                           "WHERE NORMKEY IS NOT NULL GROUP BY NORMKEY "
+                           "ORDER BY SUM(WATCHCOUNT) DESC, "
+                           "MAX(LASTWATCHED) DESC LIMIT ?;";
+  sqlite3_stmt *stmt;
+
+  *keys = NULL;
+  *count = 0;
+
+  if (limit == 0) {
+    return 0;
+  }
+
+  if (wait_until_open() == -1) {
+    return -1;
+  }
+
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+  sqlite3_bind_int(stmt, 1, limit);
+
+  *keys = malloc(limit * sizeof(char *));
+  if (!*keys) {
+    fprintf(stderr, "Memory allocation failed for keys: %s",
+            strerror(errno));
+    sqlite3_finalize(stmt);
     return -1;
   }
 
-  free(sql);
+  /* sqlite3_step() returns SQLITE_ROW once for each row of the result */
+  int result;
+  while ((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const unsigned char *key = sqlite3_column_text(stmt, 0);
+    if (!key) {
+      continue;
+    }
+    (*keys)[*count] = strdup((const char *)key);
+    if (!(*keys)[*count]) {
+      fprintf(stderr, "Failed to duplicate key: %s", strerror(errno));
+      break;
+    }
+    (*count)++;
+  }
+
+  if (result != SQLITE_DONE) {
+    fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(db));
+    for (unsigned int i = 0; i < *count; i++) {
+      free((*keys)[i]);
+    }
+    free(*keys);
+    *keys = NULL;
+    *count = 0;
+    sqlite3_finalize(stmt);
+    return -1;
+  }
+
+  sqlite3_finalize(stmt);
   return 0;
 }
 
@@ -128,7 +372,8 @@ int create_table(void) {
               "ID INTEGER PRIMARY KEY AUTOINCREMENT,"
               "TITLE  TEXT NOT NULL UNIQUE,"
               "WATCHCOUNT INT NOT NULL,"
-              "LASTWATCHED TEXT NOT NULL DEFAULT current_timestamp);";
+              "LASTWATCHED TEXT NOT NULL DEFAULT current_timestamp,"
+              "NORMKEY TEXT);";
 
   char *error_msg_buffer = 0;
 
@@ -142,13 +387,109 @@ int create_table(void) {
 }
 
 /**
- * db_init - Initialize database connection and create the schema
+ * update_keys - Compute the keys of every title again
  *
- * Opens (or creates if needed) the SQLite database file and sets up the schema.
+ * The caller has started a transaction, so that the keys are replaced all at
+ * once.
  *
  * Return: 0 on success, -1 on error
  */
-int db_init(void) {
+static int update_keys(void) {
+  sqlite3_stmt *select;
+  sqlite3_stmt *update;
+  if (sqlite3_prepare_v2(db, "SELECT ID, TITLE FROM FILMS;", -1, &select,
+                         NULL) != SQLITE_OK) {
+    fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+  if (sqlite3_prepare_v2(db, "UPDATE FILMS SET NORMKEY = ? WHERE ID = ?;", -1,
+                         &update, NULL) != SQLITE_OK) {
+    fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(select);
+    return -1;
+  }
+
+  int result;
+  while ((result = sqlite3_step(select)) == SQLITE_ROW) {
+    const char *title = (const char *)sqlite3_column_text(select, 1);
+    if (!title) {
+      continue;
+    }
+    char *key = malloc(strlen(title) + 1);
+    if (!key) {
+      fprintf(stderr, "Memory allocation failed for title key: %s",
+              strerror(errno));
+      break;
+    }
+    normalize_title(title, key);
+
+    sqlite3_bind_text(update, 1, key, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(update, 2, sqlite3_column_int64(select, 0));
+    int update_result = sqlite3_step(update);
+    sqlite3_reset(update);
+    free(key);
+    if (update_result != SQLITE_DONE) {
+      break;
+    }
+  }
+
+  if (result != SQLITE_DONE) {
+    fprintf(stderr, "Failed to update title keys: %s\n", sqlite3_errmsg(db));
+  }
+  sqlite3_finalize(update);
+  sqlite3_finalize(select);
+  return result == SQLITE_DONE ? 0 : -1;
+}
+
+/**
+ * prepare_keys - Make sure every title in the FILMS table has an up to date key
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int prepare_keys(void) {
+  sqlite3_stmt *stmt;
+
+  /* Only a database from before keys existed lacks the column */
+  if (sqlite3_prepare_v2(db, "SELECT NORMKEY FROM FILMS;", -1, &stmt, NULL) ==
+      SQLITE_OK) {
+    sqlite3_finalize(stmt);
+  } else if (run_sql("ALTER TABLE FILMS ADD COLUMN NORMKEY TEXT;") == -1) {
+    return -1;
+  }
+
+  if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, NULL) !=
+      SQLITE_OK) {
+    fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+  int version = -1;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    version = sqlite3_column_int(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+
+  if (version != NORMALIZE_VERSION) {
+    char sql[64];
+    snprintf(sql, sizeof(sql), "PRAGMA user_version = %d; COMMIT;",
+             NORMALIZE_VERSION);
+    if (run_sql("BEGIN;") == -1) {
+      return -1;
+    }
+    if (update_keys() == -1 || run_sql(sql) == -1) {
+      run_sql("ROLLBACK;");
+      return -1;
+    }
+  }
+
+  return run_sql("CREATE INDEX IF NOT EXISTS FILMS_NORMKEY ON FILMS(NORMKEY);");
+}
+
+/**
+ * open_database - Open the database file and create the schema
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int open_database(void) {
   static const int dir_path_permissions = 0700; // RWE for owner, none otherwise
   const char *home = get_config()->home;
 
@@ -180,7 +521,8 @@ int db_init(void) {
   struct stat buffer;
   /* We make the configuration directory if it doesn't exist */
   if (stat(dir_path, &buffer) == -1) {
-    if (mkdir(dir_path, dir_path_permissions) == -1) {
+    /* The index may be saved at the same time, and make it first */
+    if (mkdir(dir_path, dir_path_permissions) == -1 && errno != EEXIST) {
       fprintf(stderr, "Failed to make config directory: %s", strerror(errno));
       free(db_path);
       free(dir_path);
@@ -198,7 +540,7 @@ int db_init(void) {
   }
 
   /* Create the FILMS table if it doesn't exist */
-  if (create_table() == -1) {
+  if (create_table() == -1 || prepare_keys() == -1) {
     free(db_path);
     free(dir_path);
     return -1;
@@ -209,3 +551,17 @@ int db_init(void) {
 
   return 0;
 }
+
+/**
+ * db_init - Initialize database connection and create the schema
+ *
+ * Opens (or creates if needed) the SQLite database file and sets up the schema,
+ * then writes any watches that were logged in the meantime.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int db_init(void) {
+  int result = open_database();
+  finish_opening(result == 0);
+  return result;
+}
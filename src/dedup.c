@@ -0,0 +1,410 @@
+/**
+ * dedup.c
+ *
+ * Content-level deduplication of the video library.
+ *
+ * OVERVIEW:
+ * The same film can exist under several names in LIBRARY_PATH, for example a
+ * renamed copy of a file. Without deduplication each copy is read and cached
+ * independently, so playing one copy does nothing to speed up the others.
+ *
+ * We find identical files in a background task so that the FUSE callbacks
+ * never wait on it:
+ * 1. stat() every file. Two files can only be identical if they have the same
+ *    size, so most files are ruled out without reading any of their data.
+ * 2. For files that share a size with another file, we compute a fingerprint
+ *    by hashing a few evenly spaced blocks of the file.
+ * 3. Files with the same size and fingerprint are only candidates, since the
+ *    samples leave most of each file unread. Two releases of the same length
+ *    can differ in between, in their audio or subtitles for example. We compare
+ *    the whole contents of each candidate with every distinct file before it
+ *    in its group until one matches, and only identical files are given the
+ *    same content ID, which is the index of the first of them in video_files.
+ *
+ * Comparing reads both files in full, but only for the few files that passed
+ * the first two steps, and only once: files that already share a content ID
+ * aren't compared again. It runs with idle I/O priority like the rest of the
+ * task.
+ *
+ * Reads, caching and prefetching go through the content ID, while the watch
+ * history is still logged under the name that the user actually opened.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dedup.h"
+#include "executor.h"
+#include "video.h"
+
+/**
+ * This stores what we know about the contents of one file:
+ * size - the size of the file in bytes
+ * hash - the fingerprint of the sampled blocks (0 if not computed)
+ * index - the index of the file in video_files
+ */
+struct fingerprint {
+  off_t size;
+  uint64_t hash;
+  unsigned int index;
+};
+
+/* Whether a pass is queued but hasn't started yet */
+static bool pass_queued = false;
+static pthread_mutex_t queued_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * compare_size - qsort() comparison function ordering fingerprints by size
+ *
+ * Return: negative, zero or positive like strcmp()
+ */
+static int compare_size(const void *a, const void *b) {
+  const struct fingerprint *fa = a;
+  const struct fingerprint *fb = b;
+
+  if (fa->size != fb->size) {
+    return fa->size < fb->size ? -1 : 1;
+  }
+  return 0;
+}
+
+/**
+ * compare_content - qsort() comparison function ordering fingerprints by size,
+ * then hash, then index
+ *
+ * Ordering by index last means that the first file of a group of identical
+ * files is always the one with the lowest index, which we use as the group's
+ * content ID.
+ *
+ * Return: negative, zero or positive like strcmp()
+ */
+static int compare_content(const void *a, const void *b) {
+  const struct fingerprint *fa = a;
+  const struct fingerprint *fb = b;
+
+  if (fa->size != fb->size) {
+    return fa->size < fb->size ? -1 : 1;
+  }
+  if (fa->hash != fb->hash) {
+    return fa->hash < fb->hash ? -1 : 1;
+  }
+  if (fa->index != fb->index) {
+    return fa->index < fb->index ? -1 : 1;
+  }
+  return 0;
+}
+
+/**
+ * hash_bytes - Add bytes to a 64-bit FNV-1a hash
+ * @hash: Hash value so far
+ * @data: Bytes to add
+ * @len: Number of bytes to add
+ *
+ * FNV-1a is not a cryptographic hash, but it is fast, simple and spreads its
+ * values well enough to tell different films of the same size apart.
+ *
+ * Return: Updated hash value
+ */
+static uint64_t hash_bytes(uint64_t hash, const unsigned char *data,
+                           size_t len) {
+  static const uint64_t fnv_prime = 1099511628211ULL;
+
+  for (size_t i = 0; i < len; i++) {
+    hash ^= data[i];
+    hash *= fnv_prime;
+  }
+  return hash;
+}
+
+/**
+ * fingerprint_file - Compute the fingerprint of a file from sampled blocks
+ * @path: Path to the file
+ * @size: Size of the file in bytes
+ * @block: Scratch buffer of FINGERPRINT_BLOCK_SIZE bytes
+ *
+ * We read FINGERPRINT_SAMPLES blocks spread evenly from the start to the end
+ * of the file rather than the whole file, because hashing every byte of a
+ * large library would take hours on a hard drive.
+ *
+ * Return: Fingerprint on success, 0 on error
+ */
+static uint64_t fingerprint_file(const char *path, off_t size,
+                                 unsigned char *block) {
+  static const uint64_t fnv_offset_basis = 14695981039346656037ULL;
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open %s: %s", path, strerror(errno));
+    return 0;
+  }
+
+  uint64_t hash = fnv_offset_basis;
+  off_t last_block = size > FINGERPRINT_BLOCK_SIZE
+                         ? size - FINGERPRINT_BLOCK_SIZE
+                         : 0;
+
+  for (int i = 0; i < FINGERPRINT_SAMPLES; i++) {
+    off_t offset = last_block / (FINGERPRINT_SAMPLES - 1) * i;
+    if (i == FINGERPRINT_SAMPLES - 1) {
+      offset = last_block;
+    }
+
+    ssize_t result = pread(fd, block, FINGERPRINT_BLOCK_SIZE, offset);
+    if (result == -1) {
+      fprintf(stderr, "Failed to read from file for %s: %s", path,
+              strerror(errno));
+      close(fd);
+      return 0;
+    }
+    hash = hash_bytes(hash, block, result);
+  }
+
+  /**
+   * We don't want our sampled blocks to push data that is actually being
+   * watched out of the page cache, so we tell the kernel we are done with them.
+   */
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+  if (close(fd) == -1) {
+    fprintf(stderr, "Failed to close %s: %s", path, strerror(errno));
+  }
+
+  /* 0 means "not computed", so we avoid it as a real fingerprint */
+  return hash == 0 ? 1 : hash;
+}
+
+/**
+ * read_full - Read a block of a file, retrying short reads
+ * @fd: File descriptor
+ * @buffer: Buffer to fill
+ * @len: Number of bytes to read
+ * @offset: Position in the file
+ *
+ * Return: Number of bytes read, less than len only at the end of the file, -1
+ * on error
+ */
+static ssize_t read_full(int fd, unsigned char *buffer, size_t len,
+                         off_t offset) {
+  size_t bytes_read = 0;
+  while (bytes_read < len) {
+    ssize_t result =
+        pread(fd, buffer + bytes_read, len - bytes_read, offset + bytes_read);
+    if (result == -1) {
+      return -1;
+    }
+    if (result == 0) {
+      break;
+    }
+    bytes_read += result;
+  }
+  return bytes_read;
+}
+
+/**
+ * same_contents - Check whether two files have identical contents
+ * @path_a: Path to the first file
+ * @path_b: Path to the second file
+ * @size: Size of both files in bytes
+ * @blocks: Scratch buffer of 2 * COMPARE_BLOCK_SIZE bytes
+ *
+ * Return: true if every byte of the two files is the same
+ */
+static bool same_contents(const char *path_a, const char *path_b, off_t size,
+                          unsigned char *blocks) {
+  int fd_a = open(path_a, O_RDONLY);
+  if (fd_a == -1) {
+    fprintf(stderr, "Failed to open %s: %s", path_a, strerror(errno));
+    return false;
+  }
+  int fd_b = open(path_b, O_RDONLY);
+  if (fd_b == -1) {
+    fprintf(stderr, "Failed to open %s: %s", path_b, strerror(errno));
+    close(fd_a);
+    return false;
+  }
+  posix_fadvise(fd_a, 0, 0, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(fd_b, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  bool same = true;
+  for (off_t offset = 0; same && offset < size; offset += COMPARE_BLOCK_SIZE) {
+    /* Comparing can take minutes, so we check for an unmount as we go */
+    if (executor_stopping()) {
+      same = false;
+      break;
+    }
+
+    size_t len = size - offset < COMPARE_BLOCK_SIZE ? size - offset
+                                                    : COMPARE_BLOCK_SIZE;
+    ssize_t read_a = read_full(fd_a, blocks, len, offset);
+    ssize_t read_b = read_full(fd_b, blocks + COMPARE_BLOCK_SIZE, len, offset);
+    same = read_a == (ssize_t)len && read_b == (ssize_t)len &&
+           memcmp(blocks, blocks + COMPARE_BLOCK_SIZE, len) == 0;
+  }
+
+  /* Like the samples, what we compared shouldn't push out what is watched */
+  posix_fadvise(fd_a, 0, 0, POSIX_FADV_DONTNEED);
+  posix_fadvise(fd_b, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd_a);
+  close(fd_b);
+  return same;
+}
+
+/**
+ * dedup_run - Body of the deduplication task
+ * @arg: Unused
+ *
+ * Fingerprints files with colliding sizes, compares the candidates in full
+ * and points the content IDs of identical files at the first of them.
+ */
+static void dedup_run(void *arg) {
+  (void)arg;
+
+  /* Changes from now on need another pass, so they queue one */
+  pthread_mutex_lock(&queued_lock);
+  pass_queued = false;
+  pthread_mutex_unlock(&queued_lock);
+
+  /*
+   * Files added from now on are left for the next pass. If a file changes
+   * while we work, the generation changes and we don't merge anything.
+   */
+  unsigned int since = video_generation();
+  unsigned int count = video_count();
+  if (count < 2) {
+    return;
+  }
+
+  struct fingerprint *prints = calloc(count, sizeof(struct fingerprint));
+  unsigned char *block = malloc(FINGERPRINT_BLOCK_SIZE > 2 * COMPARE_BLOCK_SIZE
+                                    ? FINGERPRINT_BLOCK_SIZE
+                                    : 2 * COMPARE_BLOCK_SIZE);
+  bool *distinct = calloc(count, sizeof(bool));
+  if (!prints || !block || !distinct) {
+    fprintf(stderr, "Memory allocation failed for fingerprints: %s",
+            strerror(errno));
+    free(prints);
+    free(block);
+    free(distinct);
+    return;
+  }
+
+  /* Step 1: get the size of every file */
+  for (unsigned int i = 0; i < count; i++) {
+    struct stat file_stat;
+    prints[i].index = i;
+    /* Negative sizes never match, so unreadable files are never merged */
+    prints[i].size =
+        video_removed(i) || stat(video_path(i), &file_stat) == -1
+            ? -1 - (off_t)i
+            : file_stat.st_size;
+  }
+
+  /* Step 2: fingerprint only the files that share their size with another */
+  qsort(prints, count, sizeof(struct fingerprint), compare_size);
+  for (unsigned int i = 0; i < count; i++) {
+    /* Fingerprinting can take minutes, so we check for an unmount as we go */
+    if (executor_stopping()) {
+      goto out;
+    }
+
+    bool same_as_prev = i > 0 && prints[i].size == prints[i - 1].size;
+    bool same_as_next = i + 1 < count && prints[i].size == prints[i + 1].size;
+    if (prints[i].size > 0 && (same_as_prev || same_as_next)) {
+      prints[i].hash = fingerprint_file(video_path(prints[i].index),
+                                        prints[i].size, block);
+    }
+  }
+
+  /**
+   * Step 3: files with the same size and fingerprint are only candidates, since
+   * the fingerprint samples them. We compare each candidate in full with the
+   * distinct files found so far in its group, and give it the content ID of
+   * the one it matches. A candidate that matches none of them is distinct
+   * itself, and the candidates after it are compared with it too.
+   */
+  qsort(prints, count, sizeof(struct fingerprint), compare_content);
+  unsigned int duplicates = 0;
+  unsigned int first = 0;
+  for (unsigned int i = 0; i < count; i++) {
+    if (i == 0 || prints[i].hash == 0 ||
+        prints[i].size != prints[first].size ||
+        prints[i].hash != prints[first].hash) {
+      first = i;
+      distinct[i] = true;
+      continue;
+    }
+
+    bool matched = false;
+    for (unsigned int j = first; j < i && !matched; j++) {
+      if (!distinct[j]) {
+        continue;
+      }
+
+      /* A distinct file already holds the content ID of its copies */
+      unsigned int content_id = video_content_id(prints[j].index);
+      if (video_content_id(prints[i].index) == content_id) {
+        matched = true;
+      } else if (same_contents(video_path(prints[j].index),
+                               video_path(prints[i].index), prints[i].size,
+                               block)) {
+        matched = true;
+        if (video_merge_content(prints[i].index, content_id, since) == 0) {
+          duplicates++;
+        }
+      } else if (executor_stopping()) {
+        goto out;
+      }
+    }
+    distinct[i] = !matched;
+  }
+
+  if (get_config()->debug) {
+    printf("Found %u duplicate video files.\n", duplicates);
+  }
+
+out:
+  free(prints);
+  free(block);
+  free(distinct);
+}
+
+/**
+ * dedup_discard - Forget a pass that never ran
+ * @arg: Unused
+ */
+static void dedup_discard(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&queued_lock);
+  pass_queued = false;
+  pthread_mutex_unlock(&queued_lock);
+}
+
+/**
+ * dedup_start - Queue fingerprinting of the library as a background task
+ *
+ * If a pass is already waiting to run, it will see the latest files, so we
+ * don't queue another one.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int dedup_start(void) {
+  int result = 0;
+
+  pthread_mutex_lock(&queued_lock);
+  if (!pass_queued) {
+    result = executor_submit(TASK_FINGERPRINT, dedup_run, dedup_discard, NULL);
+    pass_queued = result == 0;
+  }
+  pthread_mutex_unlock(&queued_lock);
+  return result;
+}
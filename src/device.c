@@ -0,0 +1,287 @@
+/**
+ * device.c
+ *
+ * Per-device read accounting and utilisation.
+ *
+ * OVERVIEW:
+ * A library spread over several disks is only as fast as its busiest one. For
+ * every device that films are stored on we keep:
+ * - the number of films on it, from the device of each film's directory
+ * - the reads that went to its backing files through pread(), with their bytes
+ *   and time. Reads served from the resident set or a memory mapping never
+ *   touch the device, so they aren't counted.
+ * - what the kernel says about the whole device in DISKSTATS_PATH, sampled
+ *   every DEVICE_INTERVAL seconds: its reads, the bytes and time they took, how
+ *   many requests are in flight, and its utilisation, the share of the interval
+ *   it spent doing I/O
+ *
+ * Our own counts next to the kernel's show whether a busy device is busy with
+ * films or with something else, and utilisation near 1 means the device is
+ * saturated and films should be spread to others.
+ *
+ * Devices without an entry in DISKSTATS_PATH, like network filesystems, only
+ * have our own counts.
+ *
+ * CONCURRENCY:
+ * Reads look up their device without a lock. Entries are only ever added, and
+ * an entry is filled in before the count that makes it visible is raised.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+
+#include "device.h"
+#include "executor.h"
+#include "metrics.h"
+#include "video.h"
+
+/* The size of a sector in DISKSTATS_PATH, whatever the device's own is */
+#define DISKSTATS_SECTOR 512
+
+/**
+ * One device:
+ * dev - the device number
+ * reads, read_bytes, read_ns - our reads from files on the device
+ * films - the number of films on the device at the last sample
+ * sampled - whether the device has an entry in DISKSTATS_PATH
+ * name - the kernel's name for the device, like "sda1"
+ * disk_reads, disk_sectors, disk_read_ms - reads of the whole device
+ * in_flight - requests in flight at the last sample
+ * io_ms - time the device has spent doing I/O
+ * utilization - share of the last interval that the device was doing I/O
+ *
+ * The fields from films on are protected by sample_lock.
+ */
+struct device {
+  dev_t dev;
+  atomic_ullong reads;
+  atomic_ullong read_bytes;
+  atomic_ullong read_ns;
+  unsigned int films;
+  bool sampled;
+  char name[32];
+  unsigned long long disk_reads;
+  unsigned long long disk_sectors;
+  unsigned long long disk_read_ms;
+  unsigned long long in_flight;
+  unsigned long long io_ms;
+  double utilization;
+};
+
+static struct device devices[DEVICES_MAX];
+static atomic_uint device_count = 0;
+static pthread_mutex_t add_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t sample_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* When DISKSTATS_PATH was last sampled, protected by sample_lock */
+static struct timespec last_sample;
+
+/**
+ * find_device - Find or add the entry of a device
+ * @dev: Device number
+ *
+ * Return: The entry, NULL if there are already DEVICES_MAX devices
+ */
+static struct device *find_device(dev_t dev) {
+  unsigned int count = atomic_load(&device_count);
+  for (unsigned int i = 0; i < count; i++) {
+    if (devices[i].dev == dev) {
+      return &devices[i];
+    }
+  }
+
+  /* Another thread may have added it since we looked */
+  pthread_mutex_lock(&add_lock);
+  count = atomic_load(&device_count);
+  for (unsigned int i = 0; i < count; i++) {
+    if (devices[i].dev == dev) {
+      pthread_mutex_unlock(&add_lock);
+      return &devices[i];
+    }
+  }
+  struct device *device = NULL;
+  if (count < DEVICES_MAX) {
+    device = &devices[count];
+    device->dev = dev;
+    atomic_store(&device_count, count + 1);
+  }
+  pthread_mutex_unlock(&add_lock);
+  return device;
+}
+
+/**
+ * device_account - Account a read to a device
+ * @dev: Device of the backing file
+ * @bytes: Bytes read
+ * @ns: Time the read took in nanoseconds
+ */
+void device_account(dev_t dev, size_t bytes, uint64_t ns) {
+  struct device *device = find_device(dev);
+  if (!device) {
+    return;
+  }
+  atomic_fetch_add(&device->reads, 1);
+  atomic_fetch_add(&device->read_bytes, bytes);
+  atomic_fetch_add(&device->read_ns, ns);
+}
+
+/**
+ * count_films - Count the films on every device
+ *
+ * Devices that films are on get an entry even before anything is read from
+ * them. Must be called with sample_lock held.
+ */
+static void count_films(void) {
+  unsigned int films[DEVICES_MAX] = {0};
+
+  unsigned int count = video_count();
+  for (unsigned int i = 0; i < count; i++) {
+    dev_t dev = video_dev(i);
+    if (video_removed(i) || dev == 0) {
+      continue;
+    }
+    struct device *device = find_device(dev);
+    if (device) {
+      films[device - devices]++;
+    }
+  }
+
+  unsigned int devices_count = atomic_load(&device_count);
+  for (unsigned int i = 0; i < devices_count; i++) {
+    devices[i].films = films[i];
+  }
+}
+
+/**
+ * read_diskstats - Update the devices from DISKSTATS_PATH
+ * @elapsed_ms: Milliseconds since the last sample, or 0 for the first one
+ *
+ * Each line holds the major and minor numbers and name of a device followed
+ * by its counters, of which we use reads completed (1), sectors read (3), time
+ * spent reading (4), I/Os in progress (9) and time spent doing I/O (10). Must
+ * be called with sample_lock held.
+ */
+static void read_diskstats(double elapsed_ms) {
+  FILE *stats = fopen(DISKSTATS_PATH, "r");
+  if (!stats) {
+    return;
+  }
+
+  char line[256];
+  while (fgets(line, sizeof(line), stats)) {
+    unsigned int dev_major, dev_minor;
+    char name[32];
+    unsigned long long reads, sectors, read_ms, in_flight, io_ms;
+    if (sscanf(line,
+               " %u %u %31s %llu %*u %llu %llu %*u %*u %*u %*u %llu %llu",
+               &dev_major, &dev_minor, name, &reads, &sectors, &read_ms,
+               &in_flight, &io_ms) != 8) {
+      continue;
+    }
+
+    unsigned int count = atomic_load(&device_count);
+    for (unsigned int i = 0; i < count; i++) {
+      struct device *device = &devices[i];
+      if (major(device->dev) != dev_major || minor(device->dev) != dev_minor) {
+        continue;
+      }
+
+      if (device->sampled && elapsed_ms > 0) {
+        double busy = (io_ms - device->io_ms) / elapsed_ms;
+        device->utilization = busy < 1 ? busy : 1;
+      }
+      device->sampled = true;
+      snprintf(device->name, sizeof(device->name), "%s", name);
+      device->disk_reads = reads;
+      device->disk_sectors = sectors;
+      device->disk_read_ms = read_ms;
+      device->in_flight = in_flight;
+      device->io_ms = io_ms;
+    }
+  }
+  fclose(stats);
+}
+
+/**
+ * sample_run - Body of the periodic sampling task
+ * @arg: Unused
+ */
+static void sample_run(void *arg) {
+  (void)arg;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&sample_lock);
+  double elapsed_ms = last_sample.tv_sec == 0
+                          ? 0
+                          : (now.tv_sec - last_sample.tv_sec) * 1e3 +
+                                (now.tv_nsec - last_sample.tv_nsec) / 1e6;
+  last_sample = now;
+  count_films();
+  read_diskstats(elapsed_ms);
+  pthread_mutex_unlock(&sample_lock);
+
+  executor_schedule(TASK_DEVICES, sample_run, NULL, NULL, DEVICE_INTERVAL);
+}
+
+/**
+ * write_metrics - Write the per-device section of the metrics file
+ * @out: Stream to write to
+ */
+static void write_metrics(FILE *out) {
+  unsigned int count = atomic_load(&device_count);
+
+  pthread_mutex_lock(&sample_lock);
+  for (unsigned int i = 0; i < count; i++) {
+    struct device *device = &devices[i];
+    char label[32];
+    snprintf(label, sizeof(label), "device=\"%u:%u\"", major(device->dev),
+             minor(device->dev));
+
+    fprintf(out, "filmfs_device_films{%s} %u\n", label, device->films);
+    fprintf(out, "filmfs_device_reads_total{%s} %llu\n", label,
+            atomic_load(&device->reads));
+    fprintf(out, "filmfs_device_read_bytes_total{%s} %llu\n", label,
+            atomic_load(&device->read_bytes));
+    fprintf(out, "filmfs_device_read_seconds_total{%s} %.6f\n", label,
+            atomic_load(&device->read_ns) / 1e9);
+    if (!device->sampled) {
+      continue;
+    }
+
+    fprintf(out, "filmfs_device_info{%s,name=\"%s\"} 1\n", label,
+            device->name);
+    fprintf(out, "filmfs_device_utilization{%s} %.3f\n", label,
+            device->utilization);
+    fprintf(out, "filmfs_device_in_flight{%s} %llu\n", label,
+            device->in_flight);
+    fprintf(out, "filmfs_device_disk_reads_total{%s} %llu\n", label,
+            device->disk_reads);
+    fprintf(out, "filmfs_device_disk_read_bytes_total{%s} %llu\n", label,
+            device->disk_sectors * DISKSTATS_SECTOR);
+    fprintf(out, "filmfs_device_disk_read_seconds_total{%s} %.3f\n", label,
+            device->disk_read_ms / 1e3);
+  }
+  pthread_mutex_unlock(&sample_lock);
+}
+
+/**
+ * device_start - Register the per-device metrics and start sampling
+ *
+ * The first sample runs right away, so the devices of the library show up as
+ * soon as it is mounted.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int device_start(void) {
+  if (metrics_register(write_metrics) == -1) {
+    return -1;
+  }
+  return executor_submit(TASK_DEVICES, sample_run, NULL, NULL);
+}
@@ -0,0 +1,663 @@
+/**
+ * executor.c
+ *
+ * The shared pool of background worker threads.
+ *
+ * OVERVIEW:
+ * Fingerprinting, prefetching and building the resident set all happen in the
+ * background. If each of them had its own threads, they would compete with the
+ * FUSE request threads and each other for the CPU and the disk. Instead, they
+ * all submit tasks to this executor.
+ *
+ * SCHEDULING:
+ * Each worker has its own queue for every priority level. Tasks submitted from
+ * a worker go on that worker's queue, and other tasks are spread over the
+ * workers in turn. A worker looks for the highest priority task it can run,
+ * starting with its own queues, and steals from the queues of other workers if
+ * its own are empty, so no worker sits idle while another has a backlog.
+ *
+ * BUDGETS:
+ * Every task has a class, which limits how many workers may run tasks of that
+ * class at once and sets the I/O priority the worker runs it with. Tasks of a
+ * class that is at its limit stay queued until a running one finishes.
+ *
+ * Prefetching is the only work that playback waits on, so EXECUTOR_HIGH_WORKERS
+ * of the workers are kept for PRIORITY_HIGH tasks: at most the rest of them run
+ * normal and low priority tasks at once, and a burst of fingerprinting or
+ * rescans can't leave a prefetch queued behind it.
+ *
+ * The workers lower their own CPU priority with setpriority() when they start,
+ * and switch their I/O priority with the ioprio_set system call. Fingerprinting
+ * uses the idle I/O class, which only gets the disk when nothing else wants it.
+ *
+ * DELAYED TASKS:
+ * Periodic work like rescanning the library is scheduled to run after a delay.
+ * Those tasks wait on a list sorted by when they are due, and idle workers
+ * sleep with a timeout until the first of them is due, instead of a separate
+ * timer thread.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "executor.h"
+#include "metrics.h"
+
+/**
+ * glibc doesn't wrap ioprio_set, so we call it with syscall() and define the
+ * constants from the kernel's include/uapi/linux/ioprio.h ourselves.
+ */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_PRIO_VALUE(class, level)                                        \
+  (((class) << IOPRIO_CLASS_SHIFT) | (level))
+
+/**
+ * The budget of a task class:
+ * name - label used in the metrics
+ * priority - which queue the class's tasks go on
+ * max_running - how many workers may run tasks of the class at once
+ * ioprio - I/O priority that workers run the class's tasks with
+ */
+struct class_budget {
+  const char *name;
+  enum task_priority priority;
+  unsigned int max_running;
+  int ioprio;
+};
+
+/**
+ * Prefetching is what keeps playback smooth, so it gets the most room. It
+ * still runs at the lowest best-effort I/O priority, below the reads that FUSE
+ * is waiting on.
+ */
+static const struct class_budget budgets[TASK_CLASSES] = {
+    [TASK_PREFETCH] = {"prefetch", PRIORITY_HIGH, 2,
+                       IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7)},
+    [TASK_RESIDENT] = {"resident", PRIORITY_NORMAL, 1,
+                       IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7)},
+    [TASK_FINGERPRINT] = {"fingerprint", PRIORITY_LOW, 1,
+                          IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)},
+    [TASK_RESCAN] = {"rescan", PRIORITY_LOW, 1,
+                     IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7)},
+    [TASK_BROKER] = {"broker", PRIORITY_NORMAL, 1,
+                     IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7)},
+    [TASK_RESIDENCY] = {"residency", PRIORITY_LOW, 1,
+                        IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)},
+    [TASK_FUSECONN] = {"fuseconn", PRIORITY_NORMAL, 1,
+                       IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7)},
+    [TASK_DEVICES] = {"devices", PRIORITY_NORMAL, 1,
+                      IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7)},
+    [TASK_WORKERS] = {"workers", PRIORITY_NORMAL, 1,
+                      IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7)},
+};
+
+static const char *priority_names[PRIORITIES] = {"high", "normal", "low"};
+
+/**
+ * A queued task:
+ * fn - function that does the work
+ * discard - function that frees arg if the task never runs, may be NULL
+ * arg - argument for fn and discard
+ * task_class - class of the task
+ * submitted - when the task was queued, for the wait time metrics. For a
+ *             delayed task, when it is due until it is queued.
+ * next - next task in the same queue
+ */
+struct task {
+  task_fn fn;
+  task_fn discard;
+  void *arg;
+  enum task_class task_class;
+  struct timespec submitted;
+  struct task *next;
+};
+
+/**
+ * A worker thread and its queues, which are protected by lock since other
+ * workers steal from them.
+ */
+struct worker {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  struct task *head[PRIORITIES];
+  struct task *tail[PRIORITIES];
+};
+
+static struct worker workers[EXECUTOR_WORKERS];
+static unsigned int workers_started = 0;
+
+/**
+ * Submissions hold a read lock from checking that the executor runs until
+ * their task is queued, and executor_stop() takes the write lock to set
+ * stopping and to clear workers_started. That way no task is queued while the
+ * queues are being emptied, or spread over a pool of no workers.
+ */
+static pthread_rwlock_t submit_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* The worker that the current thread is, or NULL outside the pool */
+static _Thread_local struct worker *self = NULL;
+
+/**
+ * Idle workers sleep on idle_cond until generation changes. It changes every
+ * time a task is queued or finishes, since a finished task may let a queued
+ * task of the same class run.
+ */
+static unsigned long generation = 0;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond;
+
+/* Tasks that aren't due yet, soonest first, protected by idle_lock */
+static struct task *delayed = NULL;
+
+static atomic_bool stopping = false;
+static atomic_uint next_worker = 0;
+
+/* The number of workers running tasks below PRIORITY_HIGH */
+static atomic_uint background_running = 0;
+
+/* Counters for the metrics file */
+static atomic_uint queued[PRIORITIES];
+static atomic_uint running[TASK_CLASSES];
+static atomic_ullong tasks_run[TASK_CLASSES];
+static atomic_ullong wait_ns[TASK_CLASSES];
+static atomic_ullong run_ns[TASK_CLASSES];
+static atomic_ullong max_wait_ns[TASK_CLASSES];
+
+/**
+ * elapsed_ns - Nanoseconds between two monotonic timestamps
+ *
+ * Return: end - start in nanoseconds
+ */
+static unsigned long long elapsed_ns(const struct timespec *start,
+                                     const struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * 1000000000ULL + end->tv_nsec -
+         start->tv_nsec;
+}
+
+/**
+ * due_by - Check whether a monotonic timestamp is not after another one
+ * @due: When something is due
+ * @now: The time to compare with
+ *
+ * Return: true if due is at or before now
+ */
+static bool due_by(const struct timespec *due, const struct timespec *now) {
+  return due->tv_sec < now->tv_sec ||
+         (due->tv_sec == now->tv_sec && due->tv_nsec <= now->tv_nsec);
+}
+
+/**
+ * wake_workers - Tell sleeping workers that there may be work to do
+ */
+static void wake_workers(void) {
+  pthread_mutex_lock(&idle_lock);
+  generation++;
+  pthread_cond_broadcast(&idle_cond);
+  pthread_mutex_unlock(&idle_lock);
+}
+
+/**
+ * new_task - Allocate a task
+ * @task_class: Class of the task
+ * @fn: Function that does the work
+ * @discard: Function that frees arg if the task never runs, may be NULL
+ * @arg: Argument for fn and discard
+ *
+ * Return: The task on success, NULL on error
+ */
+static struct task *new_task(enum task_class task_class, task_fn fn,
+                             task_fn discard, void *arg) {
+  struct task *task = malloc(sizeof(struct task));
+  if (!task) {
+    fprintf(stderr, "Memory allocation failed for task: %s", strerror(errno));
+    return NULL;
+  }
+  task->fn = fn;
+  task->discard = discard;
+  task->arg = arg;
+  task->task_class = task_class;
+  task->next = NULL;
+  return task;
+}
+
+/**
+ * enqueue - Put a task on a worker's queue
+ * @task: Task to queue
+ *
+ * The caller wakes the workers afterwards.
+ */
+static void enqueue(struct task *task) {
+  clock_gettime(CLOCK_MONOTONIC, &task->submitted);
+  task->next = NULL;
+
+  /* Work submitted by a task stays on its worker, since its data is warm */
+  struct worker *worker = self;
+  if (!worker) {
+    worker = &workers[atomic_fetch_add(&next_worker, 1) % workers_started];
+  }
+
+  enum task_priority priority = budgets[task->task_class].priority;
+  pthread_mutex_lock(&worker->lock);
+  if (worker->tail[priority]) {
+    worker->tail[priority]->next = task;
+  } else {
+    worker->head[priority] = task;
+  }
+  worker->tail[priority] = task;
+  pthread_mutex_unlock(&worker->lock);
+
+  atomic_fetch_add(&queued[priority], 1);
+}
+
+/**
+ * executor_submit - Queue a background task
+ * @task_class: Class of the task
+ * @fn: Function that does the work
+ * @discard: Function that frees arg if the task never runs, may be NULL
+ * @arg: Argument for fn and discard
+ *
+ * Return: 0 on success, -1 on error
+ */
+int executor_submit(enum task_class task_class, task_fn fn, task_fn discard,
+                    void *arg) {
+  pthread_rwlock_rdlock(&submit_lock);
+  if (workers_started == 0 || atomic_load(&stopping)) {
+    pthread_rwlock_unlock(&submit_lock);
+    return -1;
+  }
+
+  struct task *task = new_task(task_class, fn, discard, arg);
+  if (!task) {
+    pthread_rwlock_unlock(&submit_lock);
+    return -1;
+  }
+  enqueue(task);
+  pthread_rwlock_unlock(&submit_lock);
+
+  wake_workers();
+  return 0;
+}
+
+/**
+ * executor_schedule - Queue a background task after a delay
+ * @task_class: Class of the task
+ * @fn: Function that does the work
+ * @discard: Function that frees arg if the task never runs, may be NULL
+ * @arg: Argument for fn and discard
+ * @delay: Seconds to wait before queuing the task
+ *
+ * Return: 0 on success, -1 on error
+ */
+int executor_schedule(enum task_class task_class, task_fn fn, task_fn discard,
+                      void *arg, unsigned int delay) {
+  pthread_rwlock_rdlock(&submit_lock);
+  if (workers_started == 0 || atomic_load(&stopping)) {
+    pthread_rwlock_unlock(&submit_lock);
+    return -1;
+  }
+
+  struct task *task = new_task(task_class, fn, discard, arg);
+  if (!task) {
+    pthread_rwlock_unlock(&submit_lock);
+    return -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &task->submitted);
+  task->submitted.tv_sec += delay;
+
+  pthread_mutex_lock(&idle_lock);
+  struct task **link = &delayed;
+  while (*link && due_by(&(*link)->submitted, &task->submitted)) {
+    link = &(*link)->next;
+  }
+  task->next = *link;
+  *link = task;
+
+  /* Sleeping workers may need to wake up sooner than they planned */
+  generation++;
+  pthread_cond_broadcast(&idle_cond);
+  pthread_mutex_unlock(&idle_lock);
+  pthread_rwlock_unlock(&submit_lock);
+  return 0;
+}
+
+/**
+ * queue_due - Move the delayed tasks that are due onto the queues
+ * @now: Current monotonic time
+ *
+ * The caller holds idle_lock.
+ *
+ * Return: true if any task was queued
+ */
+static bool queue_due(const struct timespec *now) {
+  bool queued_any = false;
+  while (delayed && due_by(&delayed->submitted, now)) {
+    struct task *task = delayed;
+    delayed = task->next;
+    enqueue(task);
+    queued_any = true;
+  }
+  if (queued_any) {
+    generation++;
+    pthread_cond_broadcast(&idle_cond);
+  }
+  return queued_any;
+}
+
+/**
+ * background_limit - The number of workers that may run tasks below
+ * PRIORITY_HIGH at once
+ *
+ * If fewer workers started than we keep for high priority tasks, one of them
+ * still runs the rest, or that work would never run at all.
+ *
+ * Return: The limit
+ */
+static unsigned int background_limit(void) {
+  if (workers_started <= EXECUTOR_HIGH_WORKERS) {
+    return 1;
+  }
+  return workers_started - EXECUTOR_HIGH_WORKERS;
+}
+
+/**
+ * take_from - Take the first runnable task of a priority from a worker's queue
+ * @worker: Worker whose queue to look in
+ * @priority: Priority of the queue
+ *
+ * A task is runnable if its class is below its limit of running tasks, and if
+ * it is below PRIORITY_HIGH, if fewer than background_limit() workers are
+ * running such tasks. We reserve both slots before unlinking the task, so two
+ * workers can't both take the last slot.
+ *
+ * Return: The task on success, NULL if the queue has no runnable task
+ */
+static struct task *take_from(struct worker *worker,
+                              enum task_priority priority) {
+  if (priority != PRIORITY_HIGH &&
+      atomic_fetch_add(&background_running, 1) >= background_limit()) {
+    atomic_fetch_sub(&background_running, 1);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&worker->lock);
+
+  struct task *prev = NULL;
+  for (struct task *task = worker->head[priority]; task; task = task->next) {
+    enum task_class task_class = task->task_class;
+    unsigned int was_running = atomic_fetch_add(&running[task_class], 1);
+    if (was_running >= budgets[task_class].max_running) {
+      atomic_fetch_sub(&running[task_class], 1);
+      prev = task;
+      continue;
+    }
+
+    if (prev) {
+      prev->next = task->next;
+    } else {
+      worker->head[priority] = task->next;
+    }
+    if (worker->tail[priority] == task) {
+      worker->tail[priority] = prev;
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    atomic_fetch_sub(&queued[priority], 1);
+    return task;
+  }
+
+  pthread_mutex_unlock(&worker->lock);
+  if (priority != PRIORITY_HIGH) {
+    atomic_fetch_sub(&background_running, 1);
+  }
+  return NULL;
+}
+
+/**
+ * take_task - Find the next task for a worker to run
+ * @worker: Worker looking for work
+ *
+ * We look at every priority level in order, checking our own queue before
+ * stealing from the other workers, so a high priority task on another worker
+ * always beats a low priority task on our own.
+ *
+ * Return: The task on success, NULL if there is nothing to run
+ */
+static struct task *take_task(struct worker *worker) {
+  unsigned int own = worker - workers;
+
+  for (int priority = 0; priority < PRIORITIES; priority++) {
+    for (unsigned int i = 0; i < workers_started; i++) {
+      struct task *task =
+          take_from(&workers[(own + i) % workers_started], priority);
+      if (task) {
+        return task;
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+ * run_task - Run a task with its class's I/O priority and record its timings
+ * @task: Task to run, which we free
+ * @ioprio: The worker's current I/O priority, updated if we change it
+ */
+static void run_task(struct task *task, int *ioprio) {
+  enum task_class task_class = task->task_class;
+  pid_t tid = syscall(SYS_gettid);
+
+  if (*ioprio != budgets[task_class].ioprio) {
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+                budgets[task_class].ioprio) == 0) {
+      *ioprio = budgets[task_class].ioprio;
+    }
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  task->fn(task->arg);
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  unsigned long long waited = elapsed_ns(&task->submitted, &start);
+  atomic_fetch_add(&tasks_run[task_class], 1);
+  atomic_fetch_add(&wait_ns[task_class], waited);
+  atomic_fetch_add(&run_ns[task_class], elapsed_ns(&start, &end));
+
+  /* The maximum only ever grows, so we retry until ours isn't larger */
+  unsigned long long max = atomic_load(&max_wait_ns[task_class]);
+  while (waited > max &&
+         !atomic_compare_exchange_weak(&max_wait_ns[task_class], &max, waited))
+    ;
+
+  atomic_fetch_sub(&running[task_class], 1);
+  if (budgets[task_class].priority != PRIORITY_HIGH) {
+    atomic_fetch_sub(&background_running, 1);
+  }
+  free(task);
+}
+
+/**
+ * worker_run - Body of a worker thread
+ * @arg: The worker
+ *
+ * Return: NULL
+ */
+static void *worker_run(void *arg) {
+  struct worker *worker = arg;
+  self = worker;
+
+  /* On Linux, nice values apply to individual threads */
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), EXECUTOR_NICE);
+  int ioprio = -1;
+
+  while (!atomic_load(&stopping)) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&idle_lock);
+    queue_due(&now);
+    unsigned long seen = generation;
+    pthread_mutex_unlock(&idle_lock);
+
+    struct task *task = take_task(worker);
+    if (task) {
+      run_task(task, &ioprio);
+      wake_workers();
+      continue;
+    }
+
+    /*
+     * Nothing to run, so we sleep until something is queued or finishes, or
+     * until the next delayed task is due
+     */
+    pthread_mutex_lock(&idle_lock);
+    while (!atomic_load(&stopping) && generation == seen) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (queue_due(&now)) {
+        break;
+      }
+      if (delayed) {
+        pthread_cond_timedwait(&idle_cond, &idle_lock, &delayed->submitted);
+      } else {
+        pthread_cond_wait(&idle_cond, &idle_lock);
+      }
+    }
+    pthread_mutex_unlock(&idle_lock);
+  }
+
+  return NULL;
+}
+
+/**
+ * executor_stopping - Check whether the executor is being stopped
+ *
+ * Return: true if executor_stop() has been called
+ */
+bool executor_stopping(void) { return atomic_load(&stopping); }
+
+/**
+ * write_metrics - Write the executor section of the metrics file
+ * @out: Stream to write to
+ */
+static void write_metrics(FILE *out) {
+  for (int i = 0; i < PRIORITIES; i++) {
+    fprintf(out, "filmfs_executor_queued{priority=\"%s\"} %u\n",
+            priority_names[i], atomic_load(&queued[i]));
+  }
+
+  for (int i = 0; i < TASK_CLASSES; i++) {
+    const char *name = budgets[i].name;
+    fprintf(out, "filmfs_executor_running{class=\"%s\"} %u\n", name,
+            atomic_load(&running[i]));
+    fprintf(out, "filmfs_executor_tasks_total{class=\"%s\"} %llu\n", name,
+            atomic_load(&tasks_run[i]));
+    fprintf(out, "filmfs_executor_wait_seconds_total{class=\"%s\"} %.6f\n",
+            name, atomic_load(&wait_ns[i]) / 1e9);
+    fprintf(out, "filmfs_executor_run_seconds_total{class=\"%s\"} %.6f\n",
+            name, atomic_load(&run_ns[i]) / 1e9);
+    fprintf(out, "filmfs_executor_max_wait_seconds{class=\"%s\"} %.6f\n", name,
+            atomic_load(&max_wait_ns[i]) / 1e9);
+  }
+}
+
+/**
+ * executor_start - Start the worker threads
+ *
+ * Return: 0 on success, -1 on error
+ */
+int executor_start(void) {
+  if (metrics_register(write_metrics) == -1) {
+    return -1;
+  }
+
+  atomic_store(&stopping, false);
+
+  /* Delayed tasks are due on the monotonic clock, so timeouts must be too */
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&idle_cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  for (unsigned int i = 0; i < EXECUTOR_WORKERS; i++) {
+    memset(&workers[i], 0, sizeof(struct worker));
+    pthread_mutex_init(&workers[i].lock, NULL);
+  }
+
+  for (unsigned int i = 0; i < EXECUTOR_WORKERS; i++) {
+    int result =
+        pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+    if (result != 0) {
+      fprintf(stderr, "Failed to create worker thread: %s", strerror(result));
+      break;
+    }
+    workers_started++;
+  }
+
+  return workers_started > 0 ? 0 : -1;
+}
+
+/**
+ * executor_stop - Stop the worker threads
+ *
+ * Tasks that are already running are allowed to finish, and should check
+ * executor_stopping() to finish early. Queued tasks are discarded.
+ */
+void executor_stop(void) {
+  pthread_rwlock_wrlock(&submit_lock);
+  if (workers_started == 0) {
+    pthread_rwlock_unlock(&submit_lock);
+    return;
+  }
+  atomic_store(&stopping, true);
+  pthread_rwlock_unlock(&submit_lock);
+  wake_workers();
+
+  for (unsigned int i = 0; i < workers_started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  for (unsigned int i = 0; i < workers_started; i++) {
+    for (int priority = 0; priority < PRIORITIES; priority++) {
+      while (workers[i].head[priority]) {
+        struct task *task = workers[i].head[priority];
+        workers[i].head[priority] = task->next;
+        if (task->discard) {
+          task->discard(task->arg);
+        }
+        atomic_fetch_sub(&queued[priority], 1);
+        free(task);
+      }
+    }
+    pthread_mutex_destroy(&workers[i].lock);
+  }
+
+  while (delayed) {
+    struct task *task = delayed;
+    delayed = task->next;
+    if (task->discard) {
+      task->discard(task->arg);
+    }
+    free(task);
+  }
+
+  pthread_cond_destroy(&idle_cond);
+
+  pthread_rwlock_wrlock(&submit_lock);
+  workers_started = 0;
+  pthread_rwlock_unlock(&submit_lock);
+}
@@ -0,0 +1,238 @@
+/**
+ * filmfs.c
+ *
+ * The C API of libfilmfs.
+ *
+ * OVERVIEW:
+ * Every read through the mountpoint crosses into the kernel and back out to
+ * us, and the data is copied once more on the way back. A program on the same
+ * host can skip all of that by linking libfilmfs and calling into the same
+ * sessions that our FUSE callbacks use:
+ * - filmfs_find() looks films up by title in the index of the library
+ * - filmfs_begin(), filmfs_read() and filmfs_end() wrap a session, which reads
+ *   from the resident set, a memory mapping, the backing file or the remote
+ *   server and prefetches ahead of the reads
+ * - filmfs_log() logs a viewing to the database, for sessions begun with
+ *   FILMFS_LOG and for media players reading through the mountpoint
+ *
+ * The FUSE callbacks in operations.c start and stop the background work with
+ * filmfs_start() and filmfs_stop() as well, and only add what is particular to
+ * FUSE: the connection and per-process measurements and the worker pool.
+ *
+ * A program using the library runs its own copy of the caches, so a film read
+ * both through it and through a mountpoint is cached twice.
+ */
+
+#include <errno.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "broker.h"
+#include "config.h"
+#include "database.h"
+#include "dedup.h"
+#include "device.h"
+#include "executor.h"
+#include "filmfs.h"
+#include "filmstats.h"
+#include "firstbyte.h"
+#include "lookahead.h"
+#include "mapcache.h"
+#include "remote.h"
+#include "residency.h"
+#include "resident.h"
+#include "session.h"
+#include "video.h"
+#include "watch.h"
+
+/**
+ * A session of the API, which wraps a session of the filesystem so that
+ * programs using the library don't see its internals:
+ * session - the session of the filesystem
+ */
+struct filmfs_session {
+  struct session *session;
+};
+
+/**
+ * filmfs_init - Set up everything that reading films needs
+ *
+ * Return: 0 on success, -1 on error
+ */
+int filmfs_init(void) {
+  if (load_config() == -1) {
+    return -1;
+  }
+  if (db_init() == -1) {
+    fprintf(stderr, "Failed to initialize database.\n");
+    return -1;
+  }
+  if (library_init() == -1) {
+    db_cleanup();
+    return -1;
+  }
+  filmfs_start();
+  return 0;
+}
+
+/**
+ * filmfs_cleanup - Free everything that filmfs_init() set up
+ */
+void filmfs_cleanup(void) {
+  filmfs_stop();
+
+  files_cleanup();
+  db_cleanup();
+}
+
+/**
+ * filmfs_start - Start the background work
+ *
+ * The executor goes first, since the others queue tasks on it, and the memory
+ * broker next, since the caches ask it for their quotas.
+ */
+void filmfs_start(void) {
+  executor_start();
+  broker_start();
+  session_start();
+  dedup_start();
+  lookahead_start();
+  resident_start();
+  mapcache_start();
+  residency_start();
+  firstbyte_start();
+  device_start();
+  filmstats_start();
+  watch_start();
+  remote_start();
+}
+
+/**
+ * filmfs_stop - Stop the background work
+ *
+ * We stop the executor first, so that no background task is using what the
+ * others free.
+ */
+void filmfs_stop(void) {
+  /* The watch thread queues deduplication tasks, so it stops first */
+  watch_stop();
+  executor_stop();
+  mapcache_stop();
+  resident_stop();
+  remote_stop();
+
+  /* Nothing changes the index anymore, so the next startup can begin here */
+  video_save_index();
+}
+
+/**
+ * filmfs_find - Find a film by its title
+ * @title: Name of the film's file
+ *
+ * Return: ID of the film, -1 if there is no such film
+ */
+int filmfs_find(const char *title) {
+  /* The index is looked up by FUSE path, which is the title after a '/' */
+  char path[NAME_MAX + 2];
+  if (strlen(title) > NAME_MAX || strchr(title, '/')) {
+    return -1;
+  }
+  snprintf(path, sizeof(path), "/%s", title);
+  return video_find(path);
+}
+
+/**
+ * filmfs_count - Get the number of film IDs
+ *
+ * Return: Number of IDs, including those of removed films
+ */
+unsigned int filmfs_count(void) { return video_count(); }
+
+/**
+ * filmfs_title - Get the title of a film
+ * @id: ID of the film
+ *
+ * Return: The title, NULL if the film has been removed
+ */
+const char *filmfs_title(unsigned int id) {
+  if (id >= video_count() || video_removed(id)) {
+    return NULL;
+  }
+  return video_name(id);
+}
+
+/**
+ * filmfs_begin - Begin reading a film
+ * @id: ID of the film
+ * @flags: FILMFS_LOG to log a viewing of the film
+ *
+ * Return: The session on success, NULL with errno set on error
+ */
+struct filmfs_session *filmfs_begin(unsigned int id, int flags) {
+  if (id >= video_count() || video_removed(id)) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  struct filmfs_session *api_session = malloc(sizeof(struct filmfs_session));
+  if (!api_session) {
+    return NULL;
+  }
+  api_session->session = session_open(id);
+  if (!api_session->session) {
+    free(api_session);
+    return NULL;
+  }
+
+  /* A failure to log isn't a failure to read */
+  if ((flags & FILMFS_LOG) &&
+      get_config()->policies[api_session->session->policy].log &&
+      filmfs_log(video_name(id)) == -1) {
+    fprintf(stderr, "Failed to log viewing of %s.\n", video_name(id));
+  }
+  return api_session;
+}
+
+/**
+ * filmfs_read - Read from a film
+ * @session: The session of the film
+ * @buffer: Buffer to fill with film data
+ * @size: Number of bytes to read
+ * @offset: Position in the film to read from
+ *
+ * Return: Number of bytes read on success, -ERRNO on failure
+ */
+ssize_t filmfs_read(struct filmfs_session *session, void *buffer, size_t size,
+                    uint64_t offset) {
+  return session_read(session->session, buffer, size, offset, NULL);
+}
+
+/**
+ * filmfs_end - End a session
+ * @session: The session of the film
+ */
+void filmfs_end(struct filmfs_session *session) {
+  session_close(session->session);
+  free(session);
+}
+
+/**
+ * filmfs_log - Log a viewing of a film
+ * @title: Name of the film's file
+ *
+ * Return: 0 on success, -1 on error
+ */
+int filmfs_log(const char *title) {
+  /* The database logs films by FUSE path */
+  char path[NAME_MAX + 2];
+  snprintf(path, sizeof(path), "/%s", title);
+  if (db_insert(path) == -1) {
+    return -1;
+  }
+
+  /* The watch history changed, so the most watched films may have too */
+  resident_refresh();
+  return 0;
+}
@@ -0,0 +1,225 @@
+/**
+ * filmstats.c
+ *
+ * Per-film I/O counters.
+ *
+ * OVERVIEW:
+ * Watch counts say which films are popular, but not which ones keep the disk
+ * busy. For every film we count its opens, its reads and the bytes they
+ * returned, split into the bytes served from memory, by the resident set or a
+ * memory mapping, and the bytes read from its backing file. From those follow
+ * its average request size and the share of its bytes that memory served, and
+ * a film with many backing bytes and a low share is a good candidate for an
+ * SSD.
+ *
+ * The counters are shown in METRICS_DIR/films.tsv, one line per film that has
+ * been opened or read, and for each film in its FILMSTATS_XATTR attribute.
+ *
+ * CONCURRENCY:
+ * The counters are kept in chunks of FILMSTATS_CHUNK films, allocated the
+ * first time one of their films is used and never moved or freed, so unlike
+ * the arrays of video_files they need no lock to be reached. Counting is a few
+ * relaxed atomic additions, since nothing is ordered by them. Readers of the
+ * counters copy them without stopping the writers, so a line may be a read
+ * ahead in one column, which is harmless for statistics.
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filmstats.h"
+#include "metrics.h"
+#include "video.h"
+
+/**
+ * The counters of one film:
+ * opens - times it was opened
+ * reads - reads of it
+ * memory_bytes - bytes served from the resident set or a memory mapping
+ * backing_bytes - bytes read from its backing file
+ */
+struct film_stats {
+  atomic_ullong opens;
+  atomic_ullong reads;
+  atomic_ullong memory_bytes;
+  atomic_ullong backing_bytes;
+};
+
+/**
+ * A copy of the counters of one film, with the values that follow from them:
+ * bytes - all bytes returned
+ * average_read - bytes per read
+ * hit_ratio - share of the bytes that memory served
+ */
+struct film_stats_copy {
+  unsigned long long opens;
+  unsigned long long reads;
+  unsigned long long memory_bytes;
+  unsigned long long backing_bytes;
+  unsigned long long bytes;
+  double average_read;
+  double hit_ratio;
+};
+
+static struct film_stats *_Atomic chunks[FILMSTATS_CHUNKS_MAX];
+
+/**
+ * find_stats - Find the counters of a film
+ * @index: Index of the film
+ * @create: Whether to allocate its chunk if it has none yet
+ *
+ * Two threads may allocate the same chunk at once, in which case the one that
+ * loses frees its own and uses the winner's.
+ *
+ * Return: The counters, NULL if there are none
+ */
+static struct film_stats *find_stats(unsigned int index, bool create) {
+  unsigned int chunk = index / FILMSTATS_CHUNK;
+  if (chunk >= FILMSTATS_CHUNKS_MAX) {
+    return NULL;
+  }
+
+  struct film_stats *stats = atomic_load(&chunks[chunk]);
+  if (!stats && create) {
+    struct film_stats *allocated =
+        calloc(FILMSTATS_CHUNK, sizeof(struct film_stats));
+    if (!allocated) {
+      return NULL;
+    }
+    if (atomic_compare_exchange_strong(&chunks[chunk], &stats, allocated)) {
+      stats = allocated;
+    } else {
+      free(allocated);
+    }
+  }
+  return stats ? &stats[index % FILMSTATS_CHUNK] : NULL;
+}
+
+/**
+ * copy_stats - Copy the counters of a film
+ * @index: Index of the film
+ * @copy: Output for the copy
+ *
+ * Return: true if the film has been opened or read
+ */
+static bool copy_stats(unsigned int index, struct film_stats_copy *copy) {
+  struct film_stats *stats = find_stats(index, false);
+  if (!stats) {
+    return false;
+  }
+
+  copy->opens = atomic_load_explicit(&stats->opens, memory_order_relaxed);
+  copy->reads = atomic_load_explicit(&stats->reads, memory_order_relaxed);
+  copy->memory_bytes =
+      atomic_load_explicit(&stats->memory_bytes, memory_order_relaxed);
+  copy->backing_bytes =
+      atomic_load_explicit(&stats->backing_bytes, memory_order_relaxed);
+  if (copy->opens == 0 && copy->reads == 0) {
+    return false;
+  }
+
+  copy->bytes = copy->memory_bytes + copy->backing_bytes;
+  copy->average_read = copy->reads > 0 ? (double)copy->bytes / copy->reads : 0;
+  copy->hit_ratio = copy->bytes > 0 ? (double)copy->memory_bytes / copy->bytes
+                                    : 0;
+  return true;
+}
+
+/**
+ * filmstats_open - Count an open of a film
+ * @index: Index of the film
+ */
+void filmstats_open(unsigned int index) {
+  struct film_stats *stats = find_stats(index, true);
+  if (stats) {
+    atomic_fetch_add_explicit(&stats->opens, 1, memory_order_relaxed);
+  }
+}
+
+/**
+ * filmstats_read - Count a read of a film
+ * @index: Index of the film
+ * @memory_bytes: Bytes served from the resident set or a memory mapping
+ * @backing_bytes: Bytes read from the backing file
+ */
+void filmstats_read(unsigned int index, size_t memory_bytes,
+                    size_t backing_bytes) {
+  struct film_stats *stats = find_stats(index, true);
+  if (!stats) {
+    return;
+  }
+  atomic_fetch_add_explicit(&stats->reads, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&stats->memory_bytes, memory_bytes,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&stats->backing_bytes, backing_bytes,
+                            memory_order_relaxed);
+}
+
+/**
+ * filmstats_xattr - Get the FILMSTATS_XATTR attribute of a film
+ * @index: Index of the film
+ * @value: Buffer for the attribute
+ * @size: Size of value, or 0 to only measure the attribute
+ *
+ * The attribute holds the same columns as films.tsv, as name=value pairs on
+ * one line. A film that hasn't been used has all of them at 0.
+ *
+ * Return: The length of the attribute, -ERANGE if size is too small
+ */
+int filmstats_xattr(unsigned int index, char *value, size_t size) {
+  struct film_stats_copy copy = {0};
+  copy_stats(index, &copy);
+
+  char buffer[256];
+  int len = snprintf(buffer, sizeof(buffer),
+                     "opens=%llu reads=%llu bytes=%llu average_read=%.0f "
+                     "backing_bytes=%llu hit_ratio=%.3f\n",
+                     copy.opens, copy.reads, copy.bytes, copy.average_read,
+                     copy.backing_bytes, copy.hit_ratio);
+  if (size == 0) {
+    return len;
+  }
+  if ((size_t)len > size) {
+    return -ERANGE;
+  }
+  memcpy(value, buffer, len);
+  return len;
+}
+
+/**
+ * write_films - Write the films.tsv file
+ * @out: Stream to write to
+ *
+ * Films are listed in index order. Tabs and newlines in names would break the
+ * table, so they are written as spaces.
+ */
+static void write_films(FILE *out) {
+  fprintf(out, "name\topens\treads\tbytes\taverage_read\tbacking_bytes\t"
+               "hit_ratio\n");
+
+  unsigned int count = video_count();
+  for (unsigned int i = 0; i < count; i++) {
+    struct film_stats_copy copy;
+    if (!copy_stats(i, &copy)) {
+      continue;
+    }
+
+    for (const char *c = video_name(i); *c; c++) {
+      fputc(*c == '\t' || *c == '\n' ? ' ' : *c, out);
+    }
+    fprintf(out, "\t%llu\t%llu\t%llu\t%.0f\t%llu\t%.3f\n", copy.opens,
+            copy.reads, copy.bytes, copy.average_read, copy.backing_bytes,
+            copy.hit_ratio);
+  }
+}
+
+/**
+ * filmstats_start - Add films.tsv to the metrics directory
+ *
+ * Return: 0 on success, -1 on error
+ */
+int filmstats_start(void) { return metrics_add_file("films.tsv", write_films); }
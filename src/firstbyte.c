@@ -0,0 +1,375 @@
+/**
+ * firstbyte.c
+ *
+ * Open-to-first-byte timing.
+ *
+ * OVERVIEW:
+ * What a viewer notices is how long a film takes to start after pressing play.
+ * For every film opened through the mountpoint we time the stages between
+ * fs_open() being called and the first read() on that handle returning, see
+ * enum first_byte_stage, and add the total to:
+ * - a histogram for the caller class of the program that opened it
+ * - a histogram for the device that the backing file is on
+ * - a count, total, maximum and latest time for the film
+ *
+ * The stages show where a slow start went: a long STAGE_OPEN or STAGE_IO is
+ * filmFS or the disk, while a long STAGE_WAIT is the player itself doing
+ * something else between open() and read().
+ *
+ * Films can be opened by every program in the library, so we keep per-film
+ * totals rather than a histogram for each film, to keep the metrics file short.
+ *
+ * SLOW STARTS:
+ * If FIRST_BYTE_ALERT_MS is set, starts that take longer than it are counted
+ * and the last FIRSTBYTE_SLOW_MAX of them are kept with their stages in
+ * /.filmfs/slow_starts, so that a stutter reported after the fact can still be
+ * looked up.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+
+#include "config.h"
+#include "firstbyte.h"
+#include "metrics.h"
+#include "video.h"
+
+/* Names of the caller classes and stages in the metrics */
+static const char *caller_names[CALLERS] = {"player", "scanner", "other"};
+static const char *stage_names[STAGES] = {"lookup", "classify", "open",
+                                          "wait",   "log",      "io"};
+
+/* Command names of the programs in the player and scanner classes */
+static const char *player_comms[] = {"demux",    "vlc",       "mpv",
+                                     "mplayer",  "ffplay",    "kodi.bin",
+                                     "celluloid", "totem",    "smplayer",
+                                     "haruna",   "jellyfin",  NULL};
+static const char *scanner_comms[] = {
+    "ffprobe",         "mediainfo",       "ffmpegthumbnail", "tumblerd",
+    "totem-video-thu", "tracker-extract", "baloo_file_extr", NULL};
+
+/* Upper bounds of the histogram buckets in nanoseconds, from 1 ms to 5 s */
+static const unsigned long long bounds[FIRSTBYTE_BUCKETS - 1] = {
+    1000000,   5000000,   10000000,   50000000,  100000000,
+    250000000, 500000000, 1000000000, 5000000000};
+
+/* Histograms and stage totals by caller class */
+static atomic_ullong caller_counts[CALLERS][FIRSTBYTE_BUCKETS];
+static atomic_ullong caller_sum_ns[CALLERS];
+static atomic_ullong caller_stage_ns[CALLERS][STAGES];
+
+/**
+ * The histogram of one backing device:
+ * dev - the device number
+ * counts - count of starts in each bucket
+ * sum_ns - total of all starts in nanoseconds
+ */
+struct device_first_byte {
+  dev_t dev;
+  atomic_ullong counts[FIRSTBYTE_BUCKETS];
+  atomic_ullong sum_ns;
+};
+
+/**
+ * The starts of one film:
+ * index - index of the film
+ * count - number of starts
+ * sum_ns, max_ns, last_ns - total, longest and latest start in nanoseconds
+ */
+struct film_first_byte {
+  unsigned int index;
+  unsigned long long count;
+  uint64_t sum_ns;
+  uint64_t max_ns;
+  uint64_t last_ns;
+};
+
+/**
+ * A start that took longer than FIRST_BYTE_ALERT_MS:
+ * when - wall clock time that it finished
+ * index - index of the film
+ * dev - device of the backing file
+ * timing - its stages
+ */
+struct slow_start {
+  time_t when;
+  unsigned int index;
+  dev_t dev;
+  struct first_byte timing;
+};
+
+/* The tables below are protected by record_lock, starts are rare enough */
+static struct device_first_byte devices[FIRSTBYTE_DEVICES_MAX];
+static unsigned int device_count = 0;
+static struct film_first_byte *films = NULL;
+static unsigned int film_count = 0;
+static unsigned int film_capacity = 0;
+static struct slow_start slow_starts[FIRSTBYTE_SLOW_MAX];
+static unsigned long long slow_count = 0;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * firstbyte_begin - Start timing a start
+ * @timing: Timing to fill in
+ */
+void firstbyte_begin(struct first_byte *timing) {
+  memset(timing, 0, sizeof(struct first_byte));
+  timing->caller = CALLER_OTHER;
+  clock_gettime(CLOCK_MONOTONIC, &timing->mark);
+}
+
+/**
+ * firstbyte_stage - End a stage of a start
+ * @timing: Timing of the start
+ * @stage: The stage that just ended
+ */
+void firstbyte_stage(struct first_byte *timing, enum first_byte_stage stage) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  timing->stage_ns[stage] +=
+      (now.tv_sec - timing->mark.tv_sec) * 1000000000ULL + now.tv_nsec -
+      timing->mark.tv_nsec;
+  timing->mark = now;
+}
+
+/**
+ * in_list - Check if a command name is in a NULL-terminated list
+ * @comm: Command name
+ * @list: List of command names
+ *
+ * Return: true if comm is in list
+ */
+static bool in_list(const char *comm, const char **list) {
+  for (unsigned int i = 0; list[i]; i++) {
+    if (strcmp(comm, list[i]) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * firstbyte_caller_class - Work out the caller class of a program
+ * @comm: Command name of the program, or NULL if we couldn't read it
+ *
+ * VLC names its threads "vlc:<purpose>", so we treat any of them as a player.
+ *
+ * Return: The caller class
+ */
+enum caller_class firstbyte_caller_class(const char *comm) {
+  if (!comm) {
+    return CALLER_OTHER;
+  }
+  if (in_list(comm, player_comms) || strncmp(comm, "vlc:", 4) == 0) {
+    return CALLER_PLAYER;
+  }
+  if (in_list(comm, scanner_comms)) {
+    return CALLER_SCANNER;
+  }
+  return CALLER_OTHER;
+}
+
+/**
+ * find_film - Find or add the entry of a film
+ * @index: Index of the film
+ *
+ * Must be called with record_lock held.
+ *
+ * Return: The entry of the film, NULL on error
+ */
+static struct film_first_byte *find_film(unsigned int index) {
+  for (unsigned int i = 0; i < film_count; i++) {
+    if (films[i].index == index) {
+      return &films[i];
+    }
+  }
+
+  if (film_count == film_capacity) {
+    unsigned int capacity = film_capacity ? film_capacity * 2 : FILES_MAX;
+    struct film_first_byte *grown =
+        realloc(films, capacity * sizeof(struct film_first_byte));
+    if (!grown) {
+      return NULL;
+    }
+    films = grown;
+    film_capacity = capacity;
+  }
+
+  struct film_first_byte *film = &films[film_count++];
+  memset(film, 0, sizeof(struct film_first_byte));
+  film->index = index;
+  return film;
+}
+
+/**
+ * find_device - Find or add the histogram of a device
+ * @dev: Device number
+ *
+ * Must be called with record_lock held.
+ *
+ * Return: The histogram of the device, NULL if there are too many devices
+ */
+static struct device_first_byte *find_device(dev_t dev) {
+  for (unsigned int i = 0; i < device_count; i++) {
+    if (devices[i].dev == dev) {
+      return &devices[i];
+    }
+  }
+  if (device_count == FIRSTBYTE_DEVICES_MAX) {
+    return NULL;
+  }
+  devices[device_count].dev = dev;
+  return &devices[device_count++];
+}
+
+/**
+ * firstbyte_record - Add a finished start to the metrics
+ * @timing: Timing of the start
+ * @index: Index of the film that was started
+ * @dev: Device of the backing file
+ */
+void firstbyte_record(const struct first_byte *timing, unsigned int index,
+                      dev_t dev) {
+  uint64_t total = 0;
+  for (unsigned int s = 0; s < STAGES; s++) {
+    total += timing->stage_ns[s];
+    atomic_fetch_add(&caller_stage_ns[timing->caller][s], timing->stage_ns[s]);
+  }
+
+  unsigned int bucket = metrics_bucket(bounds, FIRSTBYTE_BUCKETS, total);
+  atomic_fetch_add(&caller_counts[timing->caller][bucket], 1);
+  atomic_fetch_add(&caller_sum_ns[timing->caller], total);
+
+  pthread_mutex_lock(&record_lock);
+  struct device_first_byte *device = find_device(dev);
+  if (device) {
+    atomic_fetch_add(&device->counts[bucket], 1);
+    atomic_fetch_add(&device->sum_ns, total);
+  }
+
+  struct film_first_byte *film = find_film(index);
+  if (film) {
+    film->count++;
+    film->sum_ns += total;
+    film->max_ns = total > film->max_ns ? total : film->max_ns;
+    film->last_ns = total;
+  }
+
+  unsigned long long alert_ms = get_config()->first_byte_alert_ms;
+  if (alert_ms > 0 && total > alert_ms * 1000000ULL) {
+    struct slow_start *slow = &slow_starts[slow_count++ % FIRSTBYTE_SLOW_MAX];
+    slow->when = time(NULL);
+    slow->index = index;
+    slow->dev = dev;
+    slow->timing = *timing;
+  }
+  pthread_mutex_unlock(&record_lock);
+}
+
+/**
+ * write_metrics - Write the open-to-first-byte section of the metrics file
+ * @out: Stream to write to
+ */
+static void write_metrics(FILE *out) {
+  char labels[64];
+
+  for (unsigned int c = 0; c < CALLERS; c++) {
+    snprintf(labels, sizeof(labels), "class=\"%s\"", caller_names[c]);
+    metrics_write_histogram(out, "filmfs_first_byte_seconds", labels, bounds,
+                            caller_counts[c], FIRSTBYTE_BUCKETS,
+                            atomic_load(&caller_sum_ns[c]), 1e9);
+    for (unsigned int s = 0; s < STAGES; s++) {
+      fprintf(out,
+              "filmfs_first_byte_stage_seconds_total{class=\"%s\","
+              "stage=\"%s\"} %.6f\n",
+              caller_names[c], stage_names[s],
+              atomic_load(&caller_stage_ns[c][s]) / 1e9);
+    }
+  }
+
+  pthread_mutex_lock(&record_lock);
+  for (unsigned int d = 0; d < device_count; d++) {
+    snprintf(labels, sizeof(labels), "device=\"%u:%u\"",
+             major(devices[d].dev), minor(devices[d].dev));
+    metrics_write_histogram(out, "filmfs_first_byte_device_seconds", labels,
+                            bounds, devices[d].counts, FIRSTBYTE_BUCKETS,
+                            atomic_load(&devices[d].sum_ns), 1e9);
+  }
+
+  for (unsigned int i = 0; i < film_count; i++) {
+    struct film_first_byte *film = &films[i];
+    const char *name = video_name(film->index);
+
+    fputs("filmfs_film_starts_total{film=", out);
+    metrics_write_label(out, name);
+    fprintf(out, "} %llu\n", film->count);
+    fputs("filmfs_film_first_byte_seconds_total{film=", out);
+    metrics_write_label(out, name);
+    fprintf(out, "} %.6f\n", film->sum_ns / 1e9);
+    fputs("filmfs_film_first_byte_max_seconds{film=", out);
+    metrics_write_label(out, name);
+    fprintf(out, "} %.6f\n", film->max_ns / 1e9);
+    fputs("filmfs_film_first_byte_last_seconds{film=", out);
+    metrics_write_label(out, name);
+    fprintf(out, "} %.6f\n", film->last_ns / 1e9);
+  }
+
+  fprintf(out, "filmfs_first_byte_alert_seconds %.3f\n",
+          get_config()->first_byte_alert_ms / 1e3);
+  fprintf(out, "filmfs_first_byte_alerts_total %llu\n", slow_count);
+  pthread_mutex_unlock(&record_lock);
+}
+
+/**
+ * write_slow_starts - Write the slow starts file
+ * @out: Stream to write to
+ *
+ * Each line is one slow start, oldest first: when it happened, how long it
+ * took, the caller class, the backing device, the time of each stage in
+ * milliseconds and the film.
+ */
+static void write_slow_starts(FILE *out) {
+  pthread_mutex_lock(&record_lock);
+  unsigned long long first =
+      slow_count > FIRSTBYTE_SLOW_MAX ? slow_count - FIRSTBYTE_SLOW_MAX : 0;
+  for (unsigned long long n = first; n < slow_count; n++) {
+    const struct slow_start *slow = &slow_starts[n % FIRSTBYTE_SLOW_MAX];
+
+    char when[32];
+    struct tm local;
+    localtime_r(&slow->when, &local);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &local);
+
+    uint64_t total = 0;
+    for (unsigned int s = 0; s < STAGES; s++) {
+      total += slow->timing.stage_ns[s];
+    }
+
+    fprintf(out, "%s %.1fms %s %u:%u", when, total / 1e6,
+            caller_names[slow->timing.caller], major(slow->dev),
+            minor(slow->dev));
+    for (unsigned int s = 0; s < STAGES; s++) {
+      fprintf(out, " %s=%.1f", stage_names[s], slow->timing.stage_ns[s] / 1e6);
+    }
+    fprintf(out, " %s\n", video_name(slow->index));
+  }
+  pthread_mutex_unlock(&record_lock);
+}
+
+/**
+ * firstbyte_start - Register the open-to-first-byte metrics
+ *
+ * Return: 0 on success, -1 on error
+ */
+int firstbyte_start(void) {
+  if (metrics_register(write_metrics) == -1 ||
+      metrics_add_file("slow_starts", write_slow_starts) == -1) {
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,242 @@
+/**
+ * fuseconn.c
+ *
+ * Sampling of the kernel side of our FUSE connections.
+ *
+ * OVERVIEW:
+ * When reads are slow, either filmFS is slow to answer them or the kernel is
+ * holding them back. The kernel shows the state of each FUSE connection under
+ * FUSECONN_DIR/<id>/, where:
+ * - waiting is the number of requests that have been sent to us, or are
+ *   queued to be, and haven't been answered yet
+ * - max_background is how many background requests, like readahead, may be
+ *   outstanding at once
+ * - congestion_threshold is how many of those make the kernel treat the
+ *   connection as congested and hold back further readahead
+ *
+ * Every FUSECONN_INTERVAL seconds we read all three for every mountpoint, since
+ * each MOUNT view has a connection and a queue of its own, and label them with
+ * the mountpoint. If waiting stays near the number of FUSE threads, filmFS is
+ * the bottleneck and needs more threads. If it stays near max_background while
+ * our threads are idle, the kernel limits need raising instead.
+ *
+ * CONNECTION ID:
+ * The name of a connection's directory is the device number of the mounted
+ * filesystem, in the kernel's encoding of 20 bits of minor number below the
+ * major number. We find it with stat() on the mountpoint, which goes through
+ * our own getattr(), so we do it on the first sample rather than in fs_init(),
+ * where it would wait for fs_init() itself to return.
+ */
+
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "executor.h"
+#include "fuseconn.h"
+#include "metrics.h"
+
+/**
+ * The latest sample of a connection, protected by sample_lock:
+ * mountpoint - where the connection's filesystem is mounted
+ * found - whether we have found the connection's directory
+ * id - the connection ID
+ * waiting - requests waiting for an answer at the last sample
+ * waiting_max - the most requests ever seen waiting
+ * waiting_sum - the sum of waiting over all samples, for the average
+ * max_background - the limit on outstanding background requests
+ * congestion_threshold - when background requests count as congested
+ * samples - the number of samples taken
+ */
+struct connection {
+  const char *mountpoint;
+  bool found;
+  unsigned long id;
+  unsigned long long waiting;
+  unsigned long long waiting_max;
+  unsigned long long waiting_sum;
+  unsigned long long max_background;
+  unsigned long long congestion_threshold;
+  unsigned long long samples;
+};
+
+/* One connection for each mountpoint, the one on the command line first */
+static struct connection connections[MOUNTS_MAX + 1];
+static unsigned int connection_count = 0;
+static pthread_mutex_t sample_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * read_counter - Read a number from a file of our connection
+ * @id: Connection ID
+ * @name: Name of the file
+ * @value: Output for the number
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int read_counter(unsigned long id, const char *name,
+                        unsigned long long *value) {
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s/%lu/%s", FUSECONN_DIR, id, name);
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+
+  char buffer[32];
+  ssize_t len = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+  if (len <= 0) {
+    return -1;
+  }
+  buffer[len] = '\0';
+
+  char *end;
+  *value = strtoull(buffer, &end, 10);
+  return end == buffer ? -1 : 0;
+}
+
+/**
+ * find_connection - Work out the ID of a connection
+ * @mountpoint: Where the connection's filesystem is mounted
+ * @id: Output for the connection ID
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int find_connection(const char *mountpoint, unsigned long *id) {
+  struct stat mount_stat;
+  if (!mountpoint || stat(mountpoint, &mount_stat) == -1) {
+    return -1;
+  }
+
+  *id = (unsigned long)major(mount_stat.st_dev) << 20 |
+        minor(mount_stat.st_dev);
+  return 0;
+}
+
+/**
+ * sample_connection - Take a sample of one connection
+ * @connection: Connection to sample
+ *
+ * If fusectl isn't mounted, or the connection isn't in it, we try to find it
+ * again on the next sample.
+ */
+static void sample_connection(struct connection *connection) {
+  pthread_mutex_lock(&sample_lock);
+  bool found = connection->found;
+  unsigned long id = connection->id;
+  pthread_mutex_unlock(&sample_lock);
+
+  if (!found && find_connection(connection->mountpoint, &id) == -1) {
+    return;
+  }
+
+  unsigned long long waiting, max_background, congestion_threshold;
+  if (read_counter(id, "waiting", &waiting) == -1 ||
+      read_counter(id, "max_background", &max_background) == -1 ||
+      read_counter(id, "congestion_threshold", &congestion_threshold) == -1) {
+    pthread_mutex_lock(&sample_lock);
+    connection->found = false;
+    pthread_mutex_unlock(&sample_lock);
+    return;
+  }
+
+  pthread_mutex_lock(&sample_lock);
+  connection->found = true;
+  connection->id = id;
+  connection->waiting = waiting;
+  if (waiting > connection->waiting_max) {
+    connection->waiting_max = waiting;
+  }
+  connection->waiting_sum += waiting;
+  connection->max_background = max_background;
+  connection->congestion_threshold = congestion_threshold;
+  connection->samples++;
+  pthread_mutex_unlock(&sample_lock);
+}
+
+/**
+ * sample_run - Body of the periodic sampling task
+ * @arg: Unused
+ */
+static void sample_run(void *arg) {
+  (void)arg;
+
+  for (unsigned int i = 0; i < connection_count; i++) {
+    sample_connection(&connections[i]);
+  }
+  executor_schedule(TASK_FUSECONN, sample_run, NULL, NULL, FUSECONN_INTERVAL);
+}
+
+/**
+ * write_metric - Write one metric of a connection
+ * @out: Stream to write to
+ * @name: Name of the metric
+ * @connection: Connection that the metric is about
+ * @value: Value of the metric
+ */
+static void write_metric(FILE *out, const char *name,
+                         const struct connection *connection,
+                         unsigned long long value) {
+  fprintf(out, "%s{mountpoint=", name);
+  metrics_write_label(out, connection->mountpoint);
+  fprintf(out, "} %llu\n", value);
+}
+
+/**
+ * write_metrics - Write the FUSE connection section of the metrics file
+ * @out: Stream to write to
+ *
+ * Dividing waiting_sum by samples gives the average number of requests waiting.
+ */
+static void write_metrics(FILE *out) {
+  pthread_mutex_lock(&sample_lock);
+  for (unsigned int i = 0; i < connection_count; i++) {
+    const struct connection *connection = &connections[i];
+    if (connection->samples == 0) {
+      continue;
+    }
+    write_metric(out, "filmfs_fuse_waiting", connection, connection->waiting);
+    write_metric(out, "filmfs_fuse_waiting_max", connection,
+                 connection->waiting_max);
+    write_metric(out, "filmfs_fuse_waiting_sum", connection,
+                 connection->waiting_sum);
+    write_metric(out, "filmfs_fuse_samples_total", connection,
+                 connection->samples);
+    write_metric(out, "filmfs_fuse_max_background", connection,
+                 connection->max_background);
+    write_metric(out, "filmfs_fuse_congestion_threshold", connection,
+                 connection->congestion_threshold);
+  }
+  pthread_mutex_unlock(&sample_lock);
+}
+
+/**
+ * fuseconn_start - Register the connection metrics and start sampling
+ *
+ * Return: 0 on success, -1 on error
+ */
+int fuseconn_start(void) {
+  if (metrics_register(write_metrics) == -1) {
+    return -1;
+  }
+
+  /* MOUNT views are mounted before the event loop starts, so all are known */
+  struct config_ctx *config = get_config();
+  connection_count = 0;
+  if (config->mountpoint) {
+    connections[connection_count++].mountpoint = config->mountpoint;
+  }
+  for (unsigned int i = 0; i < config->mount_count; i++) {
+    connections[connection_count++].mountpoint = config->mounts[i].mountpoint;
+  }
+  return executor_schedule(TASK_FUSECONN, sample_run, NULL, NULL,
+                           FUSECONN_INTERVAL);
+}
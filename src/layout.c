@@ -0,0 +1,463 @@
+/**
+ * layout.c
+ *
+ * Virtual directories for huge libraries.
+ *
+ * OVERVIEW:
+ * Many TV clients give up listing a directory of tens of thousands of films.
+ * With LAYOUT set, the root directory only holds buckets, and each film is in
+ * the bucket that its name puts it in:
+ * - LETTER: the first letter of the name, "0-9" for digits and "#" for
+ *   anything else
+ * - YEAR: the last year from 1900 to 2099 in the name, like "Film (1999).mkv",
+ *   or "Unknown"
+ * - RANGE: LAYOUT_RANGE_SIZE films at a time in name order, named after the
+ *   positions of their first and last film, like "00001-01000", with as many
+ *   digits as the library needs
+ *
+ * SORTED INDEX:
+ * Films are sorted by bucket and then by name, ignoring case, and each bucket
+ * records where its slice of the sorted films starts. Listing a bucket walks
+ * only its slice, and the bucket itself is found by a binary search, so it
+ * costs the size of the bucket rather than of the library. The index is built
+ * again on the next lookup after a film appears or disappears, which
+ * video_listing() tells us about.
+ *
+ * Looking a film up only needs the name, which is unique in the library. We
+ * then check that the film is in the bucket of the path, so each film appears
+ * in exactly one place.
+ *
+ * VIEWS:
+ * One daemon may serve the library at several mountpoints, each with its own
+ * layout, see main.c. Everything here lives in a struct layout per
+ * mountpoint, while the films themselves are shared.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "config.h"
+#include "layout.h"
+#include "video.h"
+
+/**
+ * One virtual directory:
+ * name - its name in the root directory
+ * start - position of its first film in names
+ * count - number of films in it
+ */
+struct layout_bucket {
+  char name[LAYOUT_BUCKET_NAME_MAX];
+  unsigned int start;
+  unsigned int count;
+};
+
+/**
+ * One film while the index is being sorted:
+ * index - its index in video_files
+ * name - its name
+ * key - the name of its bucket, empty with LAYOUT_RANGE
+ */
+struct sort_entry {
+  unsigned int index;
+  const char *name;
+  char key[LAYOUT_BUCKET_NAME_MAX];
+};
+
+/**
+ * letter_key - Get the bucket of a film with LAYOUT_LETTER
+ * @name: Name of the film
+ * @key: Buffer of LAYOUT_BUCKET_NAME_MAX bytes for the bucket name
+ */
+static void letter_key(const char *name, char *key) {
+  unsigned char first = name[0];
+  if (first < 128 && isalpha(first)) {
+    key[0] = toupper(first);
+    key[1] = '\0';
+  } else if (first < 128 && isdigit(first)) {
+    strcpy(key, "0-9");
+  } else {
+    strcpy(key, "#");
+  }
+}
+
+/**
+ * year_key - Get the bucket of a film with LAYOUT_YEAR
+ * @name: Name of the film
+ * @key: Buffer of LAYOUT_BUCKET_NAME_MAX bytes for the bucket name
+ *
+ * A year is four digits starting with 19 or 20 that aren't part of a longer
+ * number. We take the last one, since a title may start with a number, like
+ * "2001 A Space Odyssey (1968)".
+ */
+static void year_key(const char *name, char *key) {
+  const char *year = NULL;
+  for (const char *c = name; *c; c++) {
+    if (!isdigit((unsigned char)*c) ||
+        (c > name && isdigit((unsigned char)c[-1]))) {
+      continue;
+    }
+    size_t digits = 0;
+    while (isdigit((unsigned char)c[digits])) {
+      digits++;
+    }
+    if (digits == 4 && (strncmp(c, "19", 2) == 0 || strncmp(c, "20", 2) == 0)) {
+      year = c;
+    }
+  }
+
+  if (year) {
+    memcpy(key, year, 4);
+    key[4] = '\0';
+  } else {
+    strcpy(key, "Unknown");
+  }
+}
+
+/**
+ * compare_entries - Order films by bucket and then by name
+ * @a: First film
+ * @b: Second film
+ *
+ * Names that only differ in case fall back to a case-sensitive comparison, so
+ * that the order is always the same.
+ *
+ * Return: Negative if a comes first, positive if b does, 0 if equal
+ */
+static int compare_entries(const void *a, const void *b) {
+  const struct sort_entry *first = a, *second = b;
+  int result = strcmp(first->key, second->key);
+  if (result == 0) {
+    result = strcasecmp(first->name, second->name);
+  }
+  if (result == 0) {
+    result = strcmp(first->name, second->name);
+  }
+  return result;
+}
+
+/**
+ * add_buckets - Divide the sorted films into buckets
+ * @layout: The layout
+ * @entries: The sorted films
+ * @count: Number of films
+ *
+ * Must be called with the write lock held.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int add_buckets(struct layout *layout, const struct sort_entry *entries,
+                       unsigned int count) {
+  unsigned int range = layout->range_size;
+
+  /* Positions are padded to the same width so that buckets sort by name */
+  int width = 5;
+  for (unsigned int rest = count / 100000; rest > 0 && width < 10; rest /= 10) {
+    width++;
+  }
+
+  free(layout->buckets);
+  layout->bucket_count = 0;
+  layout->buckets = malloc((count ? count : 1) * sizeof(struct layout_bucket));
+  if (!layout->buckets) {
+    fprintf(stderr, "Memory allocation failed for layout buckets: %s",
+            strerror(errno));
+    return -1;
+  }
+
+  struct layout_bucket *buckets = layout->buckets;
+  for (unsigned int i = 0; i < count; i++) {
+    unsigned int last_bucket = layout->bucket_count - 1;
+    bool same = layout->bucket_count > 0 &&
+                (layout->mode == LAYOUT_RANGE
+                     ? i % range != 0
+                     : strcmp(buckets[last_bucket].name, entries[i].key) == 0);
+    if (same) {
+      buckets[last_bucket].count++;
+      continue;
+    }
+
+    struct layout_bucket *bucket = &buckets[layout->bucket_count++];
+    bucket->start = i;
+    bucket->count = 1;
+    if (layout->mode == LAYOUT_RANGE) {
+      unsigned int last = i + range < count ? i + range : count;
+      snprintf(bucket->name, LAYOUT_BUCKET_NAME_MAX, "%0*u-%0*u", width, i + 1,
+               width, last);
+    } else {
+      memcpy(bucket->name, entries[i].key, LAYOUT_BUCKET_NAME_MAX);
+    }
+  }
+  return 0;
+}
+
+/**
+ * build - Build the sorted index
+ * @layout: The layout
+ *
+ * Must be called with the write lock held.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int build(struct layout *layout) {
+  unsigned int version = video_listing();
+  unsigned int count = video_count();
+
+  struct sort_entry *entries = malloc((count ? count : 1) *
+                                      sizeof(struct sort_entry));
+  const char **new_names = malloc((count ? count : 1) * sizeof(char *));
+  unsigned int *new_positions =
+      malloc((count ? count : 1) * sizeof(unsigned int));
+  if (!entries || !new_names || !new_positions) {
+    fprintf(stderr, "Memory allocation failed for layout index: %s",
+            strerror(errno));
+    free(entries);
+    free(new_names);
+    free(new_positions);
+    return -1;
+  }
+
+  unsigned int films = 0;
+  for (unsigned int i = 0; i < count; i++) {
+    new_positions[i] = UINT_MAX;
+    if (video_removed(i)) {
+      continue;
+    }
+    struct sort_entry *entry = &entries[films++];
+    entry->index = i;
+    entry->name = video_name(i);
+    entry->key[0] = '\0';
+    if (layout->mode == LAYOUT_LETTER) {
+      letter_key(entry->name, entry->key);
+    } else if (layout->mode == LAYOUT_YEAR) {
+      year_key(entry->name, entry->key);
+    }
+  }
+  qsort(entries, films, sizeof(struct sort_entry), compare_entries);
+
+  if (add_buckets(layout, entries, films) == -1) {
+    free(entries);
+    free(new_names);
+    free(new_positions);
+    return -1;
+  }
+  for (unsigned int i = 0; i < films; i++) {
+    new_names[i] = entries[i].name;
+    new_positions[entries[i].index] = i;
+  }
+  free(entries);
+
+  free(layout->names);
+  free(layout->positions);
+  layout->names = new_names;
+  layout->positions = new_positions;
+  layout->position_count = count;
+  layout->listing = version;
+  layout->built = true;
+  return 0;
+}
+
+/**
+ * lock_index - Take the read lock on an up to date sorted index
+ * @layout: The layout
+ *
+ * Return: 0 with the read lock held, -1 if the index couldn't be built
+ */
+static int lock_index(struct layout *layout) {
+  pthread_rwlock_rdlock(&layout->lock);
+  if (layout->built && layout->listing == video_listing()) {
+    return 0;
+  }
+  pthread_rwlock_unlock(&layout->lock);
+
+  /* Another thread may have built it while we waited for the write lock */
+  pthread_rwlock_wrlock(&layout->lock);
+  int result = 0;
+  if (!layout->built || layout->listing != video_listing()) {
+    result = build(layout);
+  }
+  pthread_rwlock_unlock(&layout->lock);
+  if (result == -1) {
+    return -1;
+  }
+
+  pthread_rwlock_rdlock(&layout->lock);
+  return 0;
+}
+
+/**
+ * find_bucket - Find a bucket by name
+ * @layout: The layout
+ * @name: Name of the bucket
+ * @len: Length of name, which needn't end in '\0'
+ *
+ * Must be called with the read lock held.
+ *
+ * Return: The bucket, NULL if there is none
+ */
+static struct layout_bucket *find_bucket(struct layout *layout,
+                                         const char *name, size_t len) {
+  if (len >= LAYOUT_BUCKET_NAME_MAX) {
+    return NULL;
+  }
+
+  struct layout_bucket *buckets = layout->buckets;
+  unsigned int low = 0, high = layout->bucket_count;
+  while (low < high) {
+    unsigned int middle = low + (high - low) / 2;
+    int result = strncmp(buckets[middle].name, name, len);
+    if (result == 0 && buckets[middle].name[len] != '\0') {
+      result = 1;
+    }
+    if (result == 0) {
+      return &buckets[middle];
+    }
+    if (result < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * layout_init - Set up an empty layout
+ * @layout: The layout
+ * @mode: LAYOUT_FLAT, LAYOUT_LETTER, LAYOUT_YEAR or LAYOUT_RANGE
+ * @range_size: Films per directory with LAYOUT_RANGE
+ */
+void layout_init(struct layout *layout, int mode, unsigned int range_size) {
+  *layout = (struct layout){.mode = mode, .range_size = range_size};
+  pthread_rwlock_init(&layout->lock, NULL);
+}
+
+/**
+ * layout_find - Find the film at a path in the mountpoint
+ * @layout: The layout of the mountpoint
+ * @path: Path to the film
+ *
+ * Return: Index of the film, -1 if there is none at path
+ */
+int layout_find(struct layout *layout, const char *path) {
+  if (layout->mode == LAYOUT_FLAT) {
+    return video_find(path);
+  }
+
+  /* Films are only ever one directory deep */
+  const char *slash = strchr(path + 1, '/');
+  if (!slash || strchr(slash + 1, '/')) {
+    return -1;
+  }
+
+  /* The slash before the name makes it a path that video_find() takes */
+  int index = video_find(slash);
+  if (index == -1 || lock_index(layout) == -1) {
+    return -1;
+  }
+
+  struct layout_bucket *bucket =
+      find_bucket(layout, path + 1, slash - path - 1);
+  unsigned int position = (unsigned int)index < layout->position_count
+                              ? layout->positions[index]
+                              : UINT_MAX;
+  if (!bucket || position < bucket->start ||
+      position >= bucket->start + bucket->count) {
+    index = -1;
+  }
+  pthread_rwlock_unlock(&layout->lock);
+  return index;
+}
+
+/**
+ * layout_is_bucket - Check whether a path is one of the virtual directories
+ * @layout: The layout of the mountpoint
+ * @path: Path in the mountpoint
+ *
+ * Return: true if path is a bucket
+ */
+bool layout_is_bucket(struct layout *layout, const char *path) {
+  if (layout->mode == LAYOUT_FLAT || strchr(path + 1, '/') ||
+      lock_index(layout) == -1) {
+    return false;
+  }
+  bool found = find_bucket(layout, path + 1, strlen(path + 1)) != NULL;
+  pthread_rwlock_unlock(&layout->lock);
+  return found;
+}
+
+/**
+ * layout_list - List a directory of the layout
+ * @layout: The layout of the mountpoint
+ * @path: Path of the directory
+ * @fn: Called with the name of each entry
+ * @arg: Passed through to fn
+ *
+ * Return: 0 on success, -1 if path isn't a directory of the layout
+ */
+int layout_list(struct layout *layout, const char *path,
+                void (*fn)(const char *name, void *arg), void *arg) {
+  bool root = strcmp(path, "/") == 0;
+
+  /* The flat layout lists the library in the order it was found in */
+  if (layout->mode == LAYOUT_FLAT) {
+    if (!root) {
+      return -1;
+    }
+    unsigned int count = video_count();
+    for (unsigned int i = 0; i < count; i++) {
+      if (!video_removed(i)) {
+        fn(video_name(i), arg);
+      }
+    }
+    return 0;
+  }
+
+  if (lock_index(layout) == -1) {
+    return -1;
+  }
+
+  int result = 0;
+  if (root) {
+    for (unsigned int i = 0; i < layout->bucket_count; i++) {
+      fn(layout->buckets[i].name, arg);
+    }
+  } else {
+    struct layout_bucket *bucket =
+        strchr(path + 1, '/') ? NULL
+                              : find_bucket(layout, path + 1, strlen(path + 1));
+    if (bucket) {
+      for (unsigned int i = 0; i < bucket->count; i++) {
+        fn(layout->names[bucket->start + i], arg);
+      }
+    } else {
+      result = -1;
+    }
+  }
+  pthread_rwlock_unlock(&layout->lock);
+  return result;
+}
+
+/**
+ * layout_cleanup - Free the sorted index
+ * @layout: The layout
+ */
+void layout_cleanup(struct layout *layout) {
+  pthread_rwlock_wrlock(&layout->lock);
+  free(layout->names);
+  free(layout->buckets);
+  free(layout->positions);
+  layout->names = NULL;
+  layout->buckets = NULL;
+  layout->positions = NULL;
+  layout->bucket_count = 0;
+  layout->position_count = 0;
+  layout->built = false;
+  pthread_rwlock_unlock(&layout->lock);
+}
@@ -0,0 +1,469 @@
+/**
+ * lookahead.c
+ *
+ * Time-based prefetching for streams that are being played.
+ *
+ * OVERVIEW:
+ * A byte-count readahead can't tell a 2 Mbit/s SD film from an 80 Mbit/s 4K
+ * remux: a window that is generous for one under-runs the other. Instead, we
+ * measure how fast each session is consuming its film from the timestamps and
+ * sizes of its reads, and keep LOOKAHEAD_SECONDS of playback at that rate
+ * prefetched ahead of its read position.
+ *
+ * RATE ESTIMATION:
+ * Every LOOKAHEAD_SAMPLE_NS of sequential reading we compute the rate of that
+ * sample and blend it into the stream's estimate, giving the new sample a
+ * quarter of the weight. This smooths over players reading in bursts. A seek
+ * restarts the current sample and discards the buffer, but keeps the estimate,
+ * since the bitrate of a film doesn't change when you skip ahead in it.
+ *
+ * CANCELLATION:
+ * Discarding the buffer raises the stream's generation. Every prefetch
+ * remembers the generation it was queued in and stops at its next chunk once
+ * that has moved on, so a seek doesn't leave the disk busy reading data that
+ * the player skipped past. A read interrupted by the kernel, which happens
+ * when a player seeks with reads outstanding, discards the buffer right away
+ * instead of waiting for the first read at the new position. The metrics show
+ * the bytes dropped at seeks, how many of those had already been prefetched
+ * and were wasted, and how many cancelling saved.
+ *
+ * PREFETCHING:
+ * Prefetching means asking the kernel to read data into the page cache with
+ * posix_fadvise(POSIX_FADV_WILLNEED), or for a remote film, fetching its
+ * chunks into the chunk cache on disk. Each request runs as a high priority
+ * background task so that the FUSE callbacks never wait for it. Requests for
+ * the same content ID that overlap are merged while they wait to run, so
+ * identical copies of a film playing at once don't prefetch the same data
+ * twice.
+ *
+ * MEMORY CAP:
+ * The buffers of all streams together may not exceed LOOKAHEAD_MAX_MB, or the
+ * quota the broker grants us if MEMORY_BUDGET_MB is set. Each stream may grow
+ * its buffer into whatever the other streams aren't using. Sequential reads of
+ * data that we had already asked for count as hits towards that quota.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "broker.h"
+#include "config.h"
+#include "executor.h"
+#include "lookahead.h"
+#include "metrics.h"
+#include "remote.h"
+#include "session.h"
+#include "video.h"
+
+/**
+ * A range of a film waiting to be prefetched. We hold a reference to the
+ * session so that its file descriptor stays open until we are done.
+ */
+struct prefetch_request {
+  struct session *session;
+  unsigned int generation;
+  off_t start;
+  off_t end;
+  struct prefetch_request *next;
+};
+
+/**
+ * Requests whose tasks haven't started yet. A request leaves this list when its
+ * task starts, after which it can no longer be merged with.
+ */
+static struct prefetch_request *pending = NULL;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bytes buffered ahead of all streams combined, protected by budget_lock */
+static uint64_t total_buffered = 0;
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Total bytes that we have asked the kernel to prefetch since mounting */
+static atomic_ullong prefetched_bytes = 0;
+
+/**
+ * Bytes of buffers dropped at seeks, the part of them that had already been
+ * prefetched, and the bytes that prefetches skipped because they were stale
+ */
+static atomic_ullong dropped_bytes = 0;
+static atomic_ullong wasted_bytes = 0;
+static atomic_ullong cancelled_bytes = 0;
+
+/**
+ * elapsed_ns - Nanoseconds between two monotonic timestamps
+ *
+ * Return: end - start in nanoseconds
+ */
+static uint64_t elapsed_ns(const struct timespec *start,
+                           const struct timespec *end) {
+  return (uint64_t)(end->tv_sec - start->tv_sec) * 1000000000ULL +
+         end->tv_nsec - start->tv_nsec;
+}
+
+/**
+ * take_pending - Remove a request from the pending list
+ * @request: Request to remove
+ */
+static void take_pending(struct prefetch_request *request) {
+  pthread_mutex_lock(&pending_lock);
+  for (struct prefetch_request **r = &pending; *r; r = &(*r)->next) {
+    if (*r == request) {
+      *r = request->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pending_lock);
+}
+
+/**
+ * prefetch_run - Body of a prefetch task
+ * @arg: The prefetch request
+ *
+ * We ask the kernel to read the range into the page cache a chunk at a time,
+ * so that a closed session, a dropped buffer or an unmount stops us between
+ * chunks rather than after a whole buffer.
+ */
+static void prefetch_run(void *arg) {
+  struct prefetch_request *request = arg;
+  take_pending(request);
+
+  struct session *session = request->session;
+  struct lookahead *lookahead = &session->lookahead;
+  for (off_t offset = request->start; offset < request->end;
+       offset += LOOKAHEAD_CHUNK) {
+    if (atomic_load(&session->closed) || executor_stopping()) {
+      break;
+    }
+    if (atomic_load(&lookahead->generation) != request->generation) {
+      atomic_fetch_add(&cancelled_bytes, request->end - offset);
+      break;
+    }
+
+    off_t len = request->end - offset;
+    if (len > LOOKAHEAD_CHUNK) {
+      len = LOOKAHEAD_CHUNK;
+    }
+    if (session->remote) {
+      remote_prefetch(session->remote, offset, len);
+    } else {
+      posix_fadvise(session->fd, offset, len, POSIX_FADV_WILLNEED);
+    }
+    atomic_fetch_add(&prefetched_bytes, len);
+
+    /* A buffer dropped while we were asking no longer owns the range */
+    long long fetched = atomic_load(&lookahead->fetched_end);
+    while (atomic_load(&lookahead->generation) == request->generation &&
+           fetched < offset + len &&
+           !atomic_compare_exchange_weak(&lookahead->fetched_end, &fetched,
+                                         offset + len)) {
+    }
+  }
+
+  session_put(session);
+  free(request);
+}
+
+/**
+ * prefetch_discard - Drop a prefetch request whose task never ran
+ * @arg: The prefetch request
+ */
+static void prefetch_discard(void *arg) {
+  struct prefetch_request *request = arg;
+  take_pending(request);
+  session_put(request->session);
+  free(request);
+}
+
+/**
+ * queue_prefetch - Queue a range to be prefetched
+ * @session: Session that the range belongs to
+ * @start: Start of the range
+ * @end: End of the range
+ *
+ * If a pending request for the same content overlaps the range, we grow that
+ * request instead of queueing another one.
+ */
+static void queue_prefetch(struct session *session, off_t start, off_t end) {
+  unsigned int generation = atomic_load(&session->lookahead.generation);
+  pthread_mutex_lock(&pending_lock);
+
+  for (struct prefetch_request *r = pending; r; r = r->next) {
+    if (r->session->content_id == session->content_id && start <= r->end &&
+        end >= r->start) {
+      /* A stale request of this stream is taken over by the new range */
+      if (r->session == session && r->generation != generation) {
+        r->generation = generation;
+        r->start = start;
+        r->end = end;
+      } else {
+        r->start = start < r->start ? start : r->start;
+        r->end = end > r->end ? end : r->end;
+      }
+      pthread_mutex_unlock(&pending_lock);
+      return;
+    }
+  }
+
+  struct prefetch_request *request = malloc(sizeof(struct prefetch_request));
+  if (!request) {
+    /* Prefetching is only an optimization, so we just skip it */
+    pthread_mutex_unlock(&pending_lock);
+    return;
+  }
+
+  session_get(session);
+  request->session = session;
+  request->generation = generation;
+  request->start = start;
+  request->end = end;
+  request->next = pending;
+  pending = request;
+  pthread_mutex_unlock(&pending_lock);
+
+  if (executor_submit(TASK_PREFETCH, prefetch_run, prefetch_discard,
+                      request) == -1) {
+    prefetch_discard(request);
+  }
+}
+
+/**
+ * drop_buffer - Discard a stream's buffer
+ * @lookahead: Lookahead state of the stream
+ *
+ * Raising the generation stops the prefetches still queued for the buffer.
+ * Must be called with the session's lock held.
+ */
+static void drop_buffer(struct lookahead *lookahead) {
+  off_t fetched_end = atomic_load(&lookahead->fetched_end);
+  if (fetched_end > lookahead->prefetched_end) {
+    fetched_end = lookahead->prefetched_end;
+  }
+  if (lookahead->prefetched_end > lookahead->position) {
+    atomic_fetch_add(&dropped_bytes,
+                     lookahead->prefetched_end - lookahead->position);
+  }
+  if (fetched_end > lookahead->position) {
+    atomic_fetch_add(&wasted_bytes, fetched_end - lookahead->position);
+  }
+
+  atomic_fetch_add(&lookahead->generation, 1);
+  atomic_store(&lookahead->fetched_end, 0);
+  lookahead->prefetched_end = lookahead->position;
+}
+
+/**
+ * lookahead_on_read - Update a stream's lookahead after a read
+ * @session: Session that was read from
+ * @offset: Offset of the read
+ * @bytes: Number of bytes read
+ */
+void lookahead_on_read(struct session *session, off_t offset, size_t bytes) {
+  if (bytes == 0) {
+    return;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&session->lock);
+  struct lookahead *lookahead = &session->lookahead;
+  off_t end = offset + bytes;
+  uint64_t hit = 0;
+
+  bool first_read = lookahead->sample_start.tv_sec == 0 &&
+                    lookahead->sample_start.tv_nsec == 0;
+  bool sequential = offset >= lookahead->position - LOOKAHEAD_SEEK_SLACK &&
+                    offset <= lookahead->position + LOOKAHEAD_SEEK_SLACK;
+
+  if (first_read || !sequential) {
+    /* We start measuring again from here and drop the old buffer */
+    drop_buffer(lookahead);
+    lookahead->position = end;
+    lookahead->prefetched_end = end;
+    lookahead->sample_start = now;
+    lookahead->sample_bytes = 0;
+  } else {
+    off_t hit_end = end < lookahead->prefetched_end ? end
+                                                    : lookahead->prefetched_end;
+    hit = hit_end > offset ? hit_end - offset : 0;
+    if (end > lookahead->position) {
+      lookahead->position = end;
+    }
+    lookahead->sample_bytes += bytes;
+
+    uint64_t elapsed = elapsed_ns(&lookahead->sample_start, &now);
+    if (elapsed >= LOOKAHEAD_SAMPLE_NS) {
+      uint64_t sample_rate = lookahead->sample_bytes * 1000000000ULL / elapsed;
+      if (lookahead->rate == 0) {
+        lookahead->rate = sample_rate;
+      } else {
+        lookahead->rate = (lookahead->rate * 3 + sample_rate) / 4;
+      }
+      lookahead->sample_start = now;
+      lookahead->sample_bytes = 0;
+    }
+  }
+
+  if (lookahead->prefetched_end < lookahead->position) {
+    lookahead->prefetched_end = lookahead->position;
+  }
+
+  /*
+   * How many bytes LOOKAHEAD_SECONDS of playback is at the measured rate, or
+   * the film's policy's number of seconds if it sets one
+   */
+  uint64_t wanted = lookahead->rate *
+                    get_config()->policies[session->policy].lookahead_seconds;
+  if ((off_t)wanted > session->size - lookahead->position) {
+    wanted = session->size > lookahead->position
+                 ? session->size - lookahead->position
+                 : 0;
+  }
+
+  off_t prefetch_start = 0;
+  off_t prefetch_end = 0;
+
+  pthread_mutex_lock(&budget_lock);
+  uint64_t cap = broker_quota(CONSUMER_LOOKAHEAD);
+  uint64_t others = total_buffered - lookahead->accounted;
+  uint64_t available = cap > others ? cap - others : 0;
+  if (wanted > available) {
+    wanted = available;
+  }
+
+  off_t target = lookahead->position + wanted;
+  if (target >= lookahead->prefetched_end + LOOKAHEAD_MIN_REQUEST) {
+    prefetch_start = lookahead->prefetched_end;
+    prefetch_end = target;
+    lookahead->prefetched_end = target;
+  }
+
+  lookahead->accounted = lookahead->prefetched_end - lookahead->position;
+  total_buffered = others + lookahead->accounted;
+  broker_set_usage(CONSUMER_LOOKAHEAD, total_buffered);
+  pthread_mutex_unlock(&budget_lock);
+
+  pthread_mutex_unlock(&session->lock);
+
+  if (hit > 0) {
+    broker_add_hits(CONSUMER_LOOKAHEAD, hit);
+  }
+
+  if (prefetch_end > prefetch_start) {
+    queue_prefetch(session, prefetch_start, prefetch_end);
+  }
+}
+
+/**
+ * lookahead_cancel - Drop a stream's buffer and stop its prefetches
+ * @session: Session whose buffer to drop
+ *
+ * The next read is treated like the first one, so it starts measuring and
+ * prefetching again from wherever it lands.
+ */
+void lookahead_cancel(struct session *session) {
+  pthread_mutex_lock(&session->lock);
+  struct lookahead *lookahead = &session->lookahead;
+  drop_buffer(lookahead);
+  lookahead->sample_start.tv_sec = 0;
+  lookahead->sample_start.tv_nsec = 0;
+
+  pthread_mutex_lock(&budget_lock);
+  total_buffered -= lookahead->accounted;
+  lookahead->accounted = 0;
+  broker_set_usage(CONSUMER_LOOKAHEAD, total_buffered);
+  pthread_mutex_unlock(&budget_lock);
+  pthread_mutex_unlock(&session->lock);
+}
+
+/**
+ * lookahead_forget - Give back a session's share of the lookahead budget
+ * @session: Session that is being closed
+ *
+ * We also remember the rate the film was consumed at, so that features like
+ * the resident set can convert seconds of playback into bytes for it later.
+ */
+void lookahead_forget(struct session *session) {
+  pthread_mutex_lock(&session->lock);
+  if (session->lookahead.rate != 0) {
+    video_set_byte_rate(session->index, session->lookahead.rate);
+  }
+
+  pthread_mutex_lock(&budget_lock);
+  total_buffered -= session->lookahead.accounted;
+  session->lookahead.accounted = 0;
+  broker_set_usage(CONSUMER_LOOKAHEAD, total_buffered);
+  pthread_mutex_unlock(&budget_lock);
+  pthread_mutex_unlock(&session->lock);
+}
+
+/**
+ * write_session_metrics - Write the lookahead metrics of one session
+ * @session: Session to write
+ * @arg: Stream to write to
+ */
+static void write_session_metrics(struct session *session, void *arg) {
+  FILE *out = arg;
+  const char *name = video_name(session->index);
+
+  pthread_mutex_lock(&session->lock);
+  uint64_t buffered = session->lookahead.prefetched_end -
+                      session->lookahead.position;
+  uint64_t rate = session->lookahead.rate;
+  pthread_mutex_unlock(&session->lock);
+
+  fprintf(out, "filmfs_session_buffer_bytes{session=\"%lu\",film=",
+          session->id);
+  metrics_write_label(out, name);
+  fprintf(out, "} %llu\n", (unsigned long long)buffered);
+
+  fprintf(out, "filmfs_session_buffer_seconds{session=\"%lu\",film=",
+          session->id);
+  metrics_write_label(out, name);
+  fprintf(out, "} %.1f\n", rate ? (double)buffered / rate : 0.0);
+
+  fprintf(out, "filmfs_session_rate_bytes_per_second{session=\"%lu\",film=",
+          session->id);
+  metrics_write_label(out, name);
+  fprintf(out, "} %llu\n", (unsigned long long)rate);
+}
+
+/**
+ * write_metrics - Write the lookahead section of the metrics file
+ * @out: Stream to write to
+ */
+static void write_metrics(FILE *out) {
+  pthread_mutex_lock(&budget_lock);
+  uint64_t buffered = total_buffered;
+  pthread_mutex_unlock(&budget_lock);
+
+  fprintf(out, "filmfs_lookahead_seconds %u\n",
+          get_config()->lookahead_seconds);
+  fprintf(out, "filmfs_lookahead_budget_bytes %llu\n",
+          (unsigned long long)broker_quota(CONSUMER_LOOKAHEAD));
+  fprintf(out, "filmfs_lookahead_buffered_bytes %llu\n",
+          (unsigned long long)buffered);
+  fprintf(out, "filmfs_lookahead_prefetched_bytes_total %llu\n",
+          atomic_load(&prefetched_bytes));
+  fprintf(out, "filmfs_lookahead_dropped_bytes_total %llu\n",
+          atomic_load(&dropped_bytes));
+  fprintf(out, "filmfs_lookahead_wasted_bytes_total %llu\n",
+          atomic_load(&wasted_bytes));
+  fprintf(out, "filmfs_lookahead_cancelled_bytes_total %llu\n",
+          atomic_load(&cancelled_bytes));
+
+  session_foreach(write_session_metrics, out);
+}
+
+/**
+ * lookahead_start - Register the lookahead metrics
+ *
+ * Return: 0 on success, -1 on error
+ */
+int lookahead_start(void) { return metrics_register(write_metrics); }
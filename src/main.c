@@ -6,17 +6,301 @@
  * OVERVIEW:
  * This file orchestrates the startup sequence and cleanup.
  *
- * fuse_main() blocks until the filesystem is unmounted. When it returns, we can
- * clean up resources.
+ * Startup does the steps of fuse_main() itself so that it can overlap them:
+ * 1. We parse the arguments, mount the filesystem and fork into the
+ *    background. The parent doesn't exit until the background process tells
+ *    it how the library scan went, through a pipe, so that a wrong
+ *    LIBRARY_PATH still makes filmfs print an error and exit with
+ *    EXIT_FAILURE.
+ * 2. We open the database in a thread of the background process, since a
+ *    thread started before the fork would not survive it.
+ * 3. Meanwhile, we scan the library. Serving files only needs the library, so
+ *    once the scan is done we report back to the parent, stop using its
+ *    terminal and start the event loop, whether or not the database is open
+ *    yet. Watches logged before it is are queued. If it fails to open, the
+ *    database thread stops the event loop.
+ *
+ * The event loop blocks until the filesystem is unmounted. When it returns, we
+ * can clean up resources.
+ *
+ * MOUNT settings ask for more mountpoints, each with a layout and FUSE
+ * options of its own, like a flat view for one user next to one grouped by
+ * year that everyone may read with allow_other. We mount them before forking,
+ * and the background process inherits them. They share the library, the
+ * caches, the database and the pool of threads answering requests, so each
+ * only costs its layout. The mountpoint on the command line comes first:
+ * unmounting it stops the daemon and unmounts the others.
+ *
+ * With LOG_MODE=FANOTIFY we mount nothing, and only open the database and log
+ * the viewings of films read straight from the library, see accesslog.c.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "accesslog.h"
 #include "config.h"
 #include "database.h"
 #include "fuse.h"
+#include "layout.h"
 #include "operations.h"
 #include "video.h"
+#include "workers.h"
+
+/**
+ * The mounted filesystems and the layout of each. The first is the one on the
+ * command line.
+ */
+static struct fuse *fuses[MOUNTS_MAX + 1];
+static struct layout layouts[MOUNTS_MAX + 1];
+static unsigned int fuse_count = 0;
+
+/* When main() started, for the startup timings printed in debug mode */
+static struct timespec startup;
+
+/* The result of db_init() in the database thread */
+static int db_result = 0;
+
+/* The thread that runs the event loop, which the database thread stops */
+static pthread_t main_thread;
+
+/**
+ * ms_since_startup - Milliseconds since main() started
+ *
+ * Return: Elapsed time in milliseconds
+ */
+static double ms_since_startup(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - startup.tv_sec) * 1e3 +
+         (now.tv_nsec - startup.tv_nsec) / 1e6;
+}
+
+/**
+ * db_open_run - Body of the database thread
+ * @arg: Unused
+ *
+ * If the database can't be opened we can't log anything, so we stop the event
+ * loop, just like a failed db_init() used to stop us from mounting. We send
+ * SIGTERM to the thread running the loop, whose handler exits the session and
+ * whose wait for requests the signal interrupts, so that it sees it.
+ *
+ * Return: NULL
+ */
+static void *db_open_run(void *arg) {
+  (void)arg;
+
+  db_result = db_init();
+  if (db_result == -1) {
+    fprintf(stderr, "Failed to initialize database, unmounting.\n");
+    pthread_kill(main_thread, SIGTERM);
+    return NULL;
+  }
+
+  if (get_config()->debug) {
+    printf("Database ready after %.1f ms.\n", ms_since_startup());
+  }
+  return NULL;
+}
+
+/**
+ * daemonize_start - Fork into the background, keeping the terminal for now
+ * @foreground: Whether we were asked to stay in the foreground with -f
+ * @status_fd: Output for the pipe to report startup through, -1 if we didn't
+ *             fork
+ *
+ * Unlike fuse_daemonize(), the parent waits for daemonize_finish() and exits
+ * with the status it is given, or with EXIT_FAILURE if the background process
+ * dies first. Only the background process returns.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int daemonize_start(int foreground, int *status_fd) {
+  *status_fd = -1;
+  if (foreground) {
+    return 0;
+  }
+
+  int fds[2];
+  if (pipe(fds) == -1) {
+    fprintf(stderr, "Failed to create startup pipe: %s\n", strerror(errno));
+    return -1;
+  }
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    fprintf(stderr, "Failed to fork into the background: %s\n",
+            strerror(errno));
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  if (pid > 0) {
+    char status = EXIT_FAILURE;
+    close(fds[1]);
+    if (read(fds[0], &status, 1) != 1) {
+      status = EXIT_FAILURE;
+    }
+    _exit(status);
+  }
+
+  close(fds[0]);
+  setsid();
+  *status_fd = fds[1];
+  return 0;
+}
+
+/**
+ * daemonize_finish - Report how startup went to the waiting parent
+ * @status_fd: The pipe from daemonize_start(), -1 if we didn't fork
+ * @result: 0 if startup succeeded, -1 if it failed
+ *
+ * Once startup has succeeded, we let go of the terminal like fuse_daemonize()
+ * does.
+ */
+static void daemonize_finish(int status_fd, int result) {
+  if (status_fd == -1) {
+    return;
+  }
+
+  if (result == 0) {
+    if (chdir("/") == -1) {
+      fprintf(stderr, "Failed to change directory to /: %s\n",
+              strerror(errno));
+    }
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd != -1) {
+      dup2(null_fd, STDIN_FILENO);
+      dup2(null_fd, STDOUT_FILENO);
+      dup2(null_fd, STDERR_FILENO);
+      if (null_fd > STDERR_FILENO) {
+        close(null_fd);
+      }
+    }
+  }
+
+  char status = result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  if (write(status_fd, &status, 1) != 1) {
+    fprintf(stderr, "Failed to report startup: %s\n", strerror(errno));
+  }
+  close(status_fd);
+}
+
+/**
+ * run_without_mount - Log viewings with fanotify until we are stopped
+ * @argc: Argument count
+ * @argv: Argument array
+ *
+ * Like a mount, we fork into the background unless we were asked to stay in
+ * the foreground with -f, and open the database only once we have.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int run_without_mount(int argc, char *argv[]) {
+  int foreground = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-f") == 0) {
+      foreground = 1;
+    }
+  }
+  int status_fd;
+  if (daemonize_start(foreground, &status_fd) == -1) {
+    return -1;
+  }
+
+  if (db_init() == -1) {
+    fprintf(stderr, "Failed to initialize database.\n");
+    daemonize_finish(status_fd, -1);
+    return -1;
+  }
+  daemonize_finish(status_fd, 0);
+  int result = accesslog_run();
+  db_cleanup();
+  return result;
+}
+
+/**
+ * mount_views - Mount the mountpoints of the MOUNT settings
+ * @program: Name the program was run as, which FUSE expects as the first
+ *           argument
+ *
+ * They take the places after the first in fuses.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int mount_views(const char *program) {
+  struct config_ctx *config = get_config();
+  fuse_count = 1;
+
+  for (unsigned int i = 0; i < config->mount_count; i++) {
+    struct mount_config *mount = &config->mounts[i];
+    struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+    if (fuse_opt_add_arg(&args, program) == -1 ||
+        fuse_opt_add_arg(&args, "-ointr") == -1 ||
+        (mount->fuse_options &&
+         (fuse_opt_add_arg(&args, "-o") == -1 ||
+          fuse_opt_add_arg(&args, mount->fuse_options) == -1))) {
+      fuse_opt_free_args(&args);
+      return -1;
+    }
+
+    struct fuse_chan *channel = fuse_mount(mount->mountpoint, &args);
+    if (!channel) {
+      fprintf(stderr, "Failed to mount %s.\n", mount->mountpoint);
+      fuse_opt_free_args(&args);
+      return -1;
+    }
+
+    struct layout *layout = &layouts[fuse_count];
+    layout_init(layout, mount->layout, mount->layout_range_size);
+    struct fuse *fuse = fuse_new(channel, &args, get_operations(),
+                                 sizeof(struct fuse_operations), layout);
+    fuse_opt_free_args(&args);
+    if (!fuse) {
+      fprintf(stderr, "Failed to set up %s.\n", mount->mountpoint);
+      fuse_unmount(mount->mountpoint, channel);
+      layout_cleanup(layout);
+      return -1;
+    }
+    fuses[fuse_count++] = fuse;
+  }
+  return 0;
+}
+
+/**
+ * unmount_views - Unmount the mountpoints of the MOUNT settings
+ *
+ * The first mountpoint is left to fuse_teardown().
+ */
+static void unmount_views(void) {
+  struct config_ctx *config = get_config();
+
+  for (unsigned int i = 1; i < fuse_count; i++) {
+    struct fuse_chan *channel =
+        fuse_session_next_chan(fuse_get_session(fuses[i]), NULL);
+    fuse_unmount(config->mounts[i - 1].mountpoint, channel);
+    fuse_destroy(fuses[i]);
+    layout_cleanup(&layouts[i]);
+  }
+  fuse_count = 1;
+}
+
+/**
+ * teardown - Unmount every mountpoint and free FUSE's resources
+ * @mountpoint: The mountpoint given on the command line
+ */
+static void teardown(char *mountpoint) {
+  unmount_views();
+  fuse_teardown(fuses[0], mountpoint);
+  layout_cleanup(&layouts[0]);
+}
 
 /**
  * main - Entry point
@@ -28,6 +312,8 @@
  * Return: EXIT_SUCCESS or EXIT_FAILURE
  */
 int main(int argc, char *argv[]) {
+  clock_gettime(CLOCK_MONOTONIC, &startup);
+
   /*
    * We load the configuration from ~/.config/filmfs/config and save the
    * settings within to our config struct, which we access from other files via
@@ -37,32 +323,136 @@ int main(int argc, char *argv[]) {
     exit(EXIT_FAILURE);
   }
 
-  /* We initialize the SQLite database and create the FILMS table if needed */
-  if (db_init() == -1) {
+  /* Players read the library directly, so there is nothing to mount */
+  if (get_config()->log_mode == LOG_MODE_FANOTIFY) {
+    exit(run_without_mount(argc, argv) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  /**
+   * FUSE only passes interrupts on to us with the intr option, which lets
+   * fs_read() give up reads that a player abandoned when it seeked.
+   */
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  if (fuse_opt_add_arg(&args, "-ointr") == -1) {
     exit(EXIT_FAILURE);
   }
 
+  /**
+   * These are the steps of fuse_setup(), which would fork before we could
+   * find out whether the rest of startup works.
+   */
+  char *mountpoint = NULL;
+  int multithreaded;
+  int foreground;
+  if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) ==
+      -1) {
+    fuse_opt_free_args(&args);
+    exit(EXIT_FAILURE);
+  }
+
+  /* Only the multithreaded event loop can wait on several mountpoints */
+  struct config_ctx *config = get_config();
+  if (!multithreaded && config->mount_count > 0) {
+    fprintf(stderr, "MOUNT can't be used with -s.\n");
+    fuse_opt_free_args(&args);
+    free(mountpoint);
+    exit(EXIT_FAILURE);
+  }
+
+  struct fuse_chan *channel = fuse_mount(mountpoint, &args);
+  if (!channel) {
+    fuse_opt_free_args(&args);
+    free(mountpoint);
+    exit(EXIT_FAILURE);
+  }
+
+  layout_init(&layouts[0], config->layout, config->layout_range_size);
+  fuses[0] = fuse_new(channel, &args, get_operations(),
+                      sizeof(struct fuse_operations), &layouts[0]);
+  fuse_opt_free_args(&args);
+  if (!fuses[0] ||
+      fuse_set_signal_handlers(fuse_get_session(fuses[0])) == -1) {
+    if (fuses[0]) {
+      fuse_destroy(fuses[0]);
+    }
+    fuse_unmount(mountpoint, channel);
+    free(mountpoint);
+    layout_cleanup(&layouts[0]);
+    exit(EXIT_FAILURE);
+  }
+  config->mountpoint = mountpoint;
+
+  int status_fd;
+  if (mount_views(argv[0]) == -1 ||
+      daemonize_start(foreground, &status_fd) == -1) {
+    teardown(mountpoint);
+    exit(EXIT_FAILURE);
+  }
+
+  /**
+   * We initialize the SQLite database and create the FILMS table if needed in
+   * the background. If we can't start a thread, we do it here instead.
+   */
+  main_thread = pthread_self();
+  pthread_t db_thread;
+  int thread_result = pthread_create(&db_thread, NULL, db_open_run, NULL);
+  if (thread_result != 0) {
+    fprintf(stderr, "Failed to create database thread: %s\n",
+            strerror(thread_result));
+    db_open_run(NULL);
+  }
+
   /**
    * We store the names and paths of all video files in LIBRARY_PATH in memory
    * for the sake of efficiency.
    */
-  if (library_init() == -1) {
+  int library_result = library_init();
+  if (library_result == 0 && config->debug) {
+    printf("Library ready after %.1f ms.\n", ms_since_startup());
+  }
+
+  /* Without a database thread, a failed db_init() is reported like the scan */
+  if (library_result == -1 || (thread_result != 0 && db_result == -1)) {
+    if (thread_result == 0) {
+      pthread_join(db_thread, NULL);
+    }
+    teardown(mountpoint);
+    if (library_result == 0) {
+      files_cleanup();
+    }
+    db_cleanup();
+    daemonize_finish(status_fd, -1);
     exit(EXIT_FAILURE);
   }
+  daemonize_finish(status_fd, 0);
 
   /**
-   * This is the entry point for the FUSE library. It parses argc and argv,
-   * mounts the filesystem, starts the event loop to handle filesystem
-   * operations, blocks until the filesystem is unmounted, then returns the exit
-   * status.
+   * The event loop handles filesystem operations until the filesystem is
+   * unmounted. The multithreaded loop handles several requests at once, on a
+   * pool of threads that grows and shrinks with the load.
    */
-  int result = fuse_main(argc, argv, get_operations(), NULL);
+  int result =
+      multithreaded ? workers_loop(fuses, fuse_count) : fuse_loop(fuses[0]);
+
+  /* The database may still be opening if we were unmounted right away */
+  if (thread_result == 0) {
+    pthread_join(db_thread, NULL);
+  }
+  if (db_result == -1) {
+    result = -1;
+  }
+
+  /**
+   * We unmount the filesystems and free FUSE's resources, along with the
+   * sorted indices of the layouts, before the names they point to.
+   */
+  teardown(mountpoint);
 
   /* We free the cached names and path arrays*/
   files_cleanup();
 
   /* We close the SQLite database connection */
   db_cleanup();
-  
-  exit(result);
+
+  exit(result == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
 }
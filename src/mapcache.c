@@ -0,0 +1,353 @@
+/**
+ * mapcache.c
+ *
+ * Memory-mapped reading of small films.
+ *
+ * OVERVIEW:
+ * Reading through pread() costs a system call for every chunk that FUSE asks
+ * for. For small files, such as trailers and samples, it is cheaper to map the
+ * whole file into memory once with mmap() and serve every read with memcpy().
+ *
+ * We map files read-only, ask the kernel with MADV_WILLNEED to read the whole
+ * file into the page cache in the background, and keep up to MAPCACHE_MAX
+ * mappings around after their films are closed so that the next open doesn't
+ * have to map them again. If MEMORY_BUDGET_MB is set, the mappings together
+ * are also kept within the quota the broker grants us, evicting the least
+ * recently used ones to make room.
+ *
+ * LOCKING:
+ * mappings_lock is shared by every open, read and close of a mapped film, so
+ * it is never held across mmap(). A new mapping reserves its slot and its
+ * bytes of the quota under the lock, is mapped without it, and is published
+ * under it again.
+ *
+ * TRUNCATION:
+ * If a mapped file is truncated while we are reading it, touching a page past
+ * the new end of the file raises SIGBUS, which would normally kill the whole
+ * filesystem. We catch it: mapcache_read() records a jump point before copying,
+ * and our SIGBUS handler jumps back to it. The mapping is then marked invalid
+ * and the caller falls back to pread(), which simply returns fewer bytes.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "broker.h"
+#include "config.h"
+#include "mapcache.h"
+#include "metrics.h"
+#include "video.h"
+
+static struct mapping mappings[MAPCACHE_MAX];
+static pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Increases every time a mapping is handed out, so older means smaller */
+static unsigned long long use_clock = 0;
+
+/* The size of all mappings combined, protected by mappings_lock */
+static uint64_t mapped_bytes = 0;
+
+/**
+ * The jump point of the copy this thread is doing from a mapping, or NULL if it
+ * isn't copying from one. Each thread has its own, since several FUSE threads
+ * can be copying at once.
+ */
+static _Thread_local sigjmp_buf *bus_jump = NULL;
+
+/* The SIGBUS action that was installed before ours */
+static struct sigaction previous_action;
+static bool handler_installed = false;
+
+/* Counters for the metrics file */
+static atomic_ullong truncations = 0;
+
+/**
+ * bus_handler - SIGBUS handler
+ * @sig: Signal number
+ * @info: Details of the signal (unused)
+ * @context: Interrupted context (unused)
+ *
+ * If the fault happened while this thread was copying from a mapping, we jump
+ * back into mapcache_read(). Otherwise it's a real bug, so we restore the
+ * previous action and return, which faults again and lets it happen.
+ */
+static void bus_handler(int sig, siginfo_t *info, void *context) {
+  (void)sig;
+  (void)info;
+  (void)context;
+
+  if (bus_jump) {
+    siglongjmp(*bus_jump, 1);
+  }
+  sigaction(SIGBUS, &previous_action, NULL);
+}
+
+/**
+ * unmap - Unmap a cached mapping and free its slot
+ * @mapping: Mapping with no references
+ */
+static void unmap(struct mapping *mapping) {
+  munmap(mapping->addr, mapping->size);
+  mapping->addr = NULL;
+  mapped_bytes -= mapping->size;
+  broker_set_usage(CONSUMER_MMAP, mapped_bytes);
+}
+
+/**
+ * least_recently_used - Find the mapping to evict next
+ *
+ * Must be called with mappings_lock held.
+ *
+ * Return: The least recently used mapping with no references, NULL if every
+ * mapping is in use
+ */
+static struct mapping *least_recently_used(void) {
+  struct mapping *oldest = NULL;
+  for (unsigned int i = 0; i < MAPCACHE_MAX; i++) {
+    struct mapping *mapping = &mappings[i];
+    if (mapping->addr && mapping->refs == 0 &&
+        (!oldest || mapping->last_used < oldest->last_used)) {
+      oldest = mapping;
+    }
+  }
+  return oldest;
+}
+
+/**
+ * mapcache_get - Get a mapping of a small backing file
+ * @content_id: Content ID of the film
+ * @fd: File descriptor of the backing file
+ * @file_stat: Current status of the backing file
+ *
+ * Return: Referenced mapping on success, NULL otherwise
+ */
+struct mapping *mapcache_get(unsigned int content_id, int fd,
+                             const struct stat *file_stat) {
+  if (!handler_installed || file_stat->st_size == 0 ||
+      (unsigned long long)file_stat->st_size > get_config()->mmap_max_bytes) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&mappings_lock);
+
+  /* We reuse a mapping of the same content if the file hasn't changed */
+  struct mapping *free_slot = NULL;
+  for (unsigned int i = 0; i < MAPCACHE_MAX; i++) {
+    struct mapping *mapping = &mappings[i];
+    if (!mapping->addr) {
+      if (!mapping->reserved) {
+        free_slot = free_slot ? free_slot : mapping;
+      }
+      continue;
+    }
+
+    if (mapping->content_id == content_id && atomic_load(&mapping->valid) &&
+        mapping->size == file_stat->st_size &&
+        mapping->mtime.tv_sec == file_stat->st_mtim.tv_sec &&
+        mapping->mtime.tv_nsec == file_stat->st_mtim.tv_nsec) {
+      mapping->refs++;
+      mapping->last_used = ++use_clock;
+      pthread_mutex_unlock(&mappings_lock);
+      return mapping;
+    }
+
+    /* Stale mappings of the content are dropped once no one uses them */
+    if (mapping->content_id == content_id && mapping->refs == 0) {
+      unmap(mapping);
+      free_slot = free_slot ? free_slot : mapping;
+      continue;
+    }
+  }
+
+  /* If every slot is taken, we evict the least recently used unused mapping */
+  if (!free_slot && (free_slot = least_recently_used())) {
+    unmap(free_slot);
+  }
+  if (!free_slot) {
+    pthread_mutex_unlock(&mappings_lock);
+    return NULL;
+  }
+
+  /* We also evict until the new mapping fits in our quota, or give up */
+  uint64_t quota = broker_quota(CONSUMER_MMAP);
+  while (mapped_bytes + file_stat->st_size > quota) {
+    struct mapping *victim = least_recently_used();
+    if (!victim || (uint64_t)file_stat->st_size > quota) {
+      pthread_mutex_unlock(&mappings_lock);
+      return NULL;
+    }
+    unmap(victim);
+  }
+
+  /* The slot and its bytes are ours while we map the file without the lock */
+  free_slot->reserved = true;
+  mapped_bytes += file_stat->st_size;
+  pthread_mutex_unlock(&mappings_lock);
+
+  /**
+   * MADV_WILLNEED starts reading the whole file into the page cache without
+   * waiting for it, so the open returns at once and later reads rarely wait
+   * on a page fault.
+   */
+  void *addr = mmap(NULL, file_stat->st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (addr != MAP_FAILED) {
+    madvise(addr, file_stat->st_size, MADV_WILLNEED);
+  }
+
+  pthread_mutex_lock(&mappings_lock);
+  free_slot->reserved = false;
+  if (addr == MAP_FAILED) {
+    mapped_bytes -= file_stat->st_size;
+    pthread_mutex_unlock(&mappings_lock);
+    return NULL;
+  }
+
+  free_slot->content_id = content_id;
+  free_slot->addr = addr;
+  free_slot->size = file_stat->st_size;
+  free_slot->mtime = file_stat->st_mtim;
+  free_slot->refs = 1;
+  atomic_store(&free_slot->valid, true);
+  free_slot->last_used = ++use_clock;
+  broker_set_usage(CONSUMER_MMAP, mapped_bytes);
+
+  pthread_mutex_unlock(&mappings_lock);
+  return free_slot;
+}
+
+/**
+ * mapcache_put - Drop a reference to a mapping
+ * @mapping: Mapping returned by mapcache_get()
+ *
+ * Valid mappings stay cached for the next open. Invalid ones are unmapped as
+ * soon as no one is using them.
+ */
+void mapcache_put(struct mapping *mapping) {
+  pthread_mutex_lock(&mappings_lock);
+  mapping->refs--;
+  if (mapping->refs == 0 && !atomic_load(&mapping->valid)) {
+    unmap(mapping);
+  }
+  pthread_mutex_unlock(&mappings_lock);
+}
+
+/**
+ * mapcache_read - Copy part of a mapped film
+ * @mapping: Mapping of the film
+ * @buffer: Buffer to fill
+ * @size: Number of bytes requested
+ * @offset: Position in the film to read from
+ *
+ * sigsetjmp() returns 0 when it records the jump point, and 1 when the SIGBUS
+ * handler jumps back to it. The 1 passed as its second argument makes
+ * siglongjmp() restore our signal mask, since SIGBUS is blocked while its
+ * handler runs.
+ *
+ * Return: Number of bytes copied on success, -1 if the file was truncated
+ */
+ssize_t mapcache_read(struct mapping *mapping, char *buffer, size_t size,
+                      off_t offset) {
+  if (!atomic_load(&mapping->valid)) {
+    return -1;
+  }
+  if (offset >= mapping->size) {
+    return 0;
+  }
+  if (size > (size_t)(mapping->size - offset)) {
+    size = mapping->size - offset;
+  }
+
+  sigjmp_buf jump;
+  if (sigsetjmp(jump, 1) != 0) {
+    bus_jump = NULL;
+    atomic_store(&mapping->valid, false);
+    atomic_fetch_add(&truncations, 1);
+    return -1;
+  }
+
+  bus_jump = &jump;
+  memcpy(buffer, (char *)mapping->addr + offset, size);
+  bus_jump = NULL;
+
+  broker_add_hits(CONSUMER_MMAP, size);
+  return size;
+}
+
+/**
+ * write_metrics - Write the mapping section of the metrics file
+ * @out: Stream to write to
+ */
+static void write_metrics(FILE *out) {
+  unsigned int count = 0;
+  unsigned long long bytes = 0;
+
+  pthread_mutex_lock(&mappings_lock);
+  for (unsigned int i = 0; i < MAPCACHE_MAX; i++) {
+    if (mappings[i].addr) {
+      count++;
+      bytes += mappings[i].size;
+    }
+  }
+  pthread_mutex_unlock(&mappings_lock);
+
+  fprintf(out, "filmfs_mmap_threshold_bytes %llu\n",
+          get_config()->mmap_max_bytes);
+  fprintf(out, "filmfs_mmap_mappings %u\n", count);
+  fprintf(out, "filmfs_mmap_bytes %llu\n", bytes);
+  fprintf(out, "filmfs_mmap_truncations_total %llu\n",
+          atomic_load(&truncations));
+}
+
+/**
+ * mapcache_start - Install the SIGBUS handler
+ *
+ * SA_SIGINFO selects the three-argument handler. We install the handler once
+ * for the whole process, but it only acts on threads that are copying from a
+ * mapping.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int mapcache_start(void) {
+  if (metrics_register(write_metrics) == -1) {
+    return -1;
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(struct sigaction));
+  action.sa_sigaction = bus_handler;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+
+  if (sigaction(SIGBUS, &action, &previous_action) == -1) {
+    fprintf(stderr, "Failed to install SIGBUS handler: %s", strerror(errno));
+    return -1;
+  }
+
+  handler_installed = true;
+  return 0;
+}
+
+/**
+ * mapcache_stop - Unmap cached mappings and restore the SIGBUS handler
+ */
+void mapcache_stop(void) {
+  pthread_mutex_lock(&mappings_lock);
+  for (unsigned int i = 0; i < MAPCACHE_MAX; i++) {
+    if (mappings[i].addr && mappings[i].refs == 0) {
+      unmap(&mappings[i]);
+    }
+  }
+  pthread_mutex_unlock(&mappings_lock);
+
+  if (handler_installed) {
+    sigaction(SIGBUS, &previous_action, NULL);
+    handler_installed = false;
+  }
+}
@@ -0,0 +1,300 @@
+/**
+ * metrics.c
+ *
+ * Metrics collection and the /.filmfs virtual directory.
+ *
+ * OVERVIEW:
+ * Subsystems such as the lookahead buffers register a function that writes
+ * their current values as text. When a program opens one of the virtual files
+ * in METRICS_DIR we call those functions to build a snapshot of the file, and
+ * reads of that open file are then served from the snapshot.
+ *
+ * Using files in the mountpoint means that metrics can be inspected with
+ * nothing more than cat, for example:
+ *   cat ~/Films/.filmfs/metrics
+ *
+ * METRICS_DIR isn't listed in the root directory, so media players and library
+ * scanners never see it, but it can still be opened by path.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+
+/**
+ * A virtual file in METRICS_DIR:
+ * name - the filename shown in METRICS_DIR
+ * generate - writes the contents of the file
+ */
+struct metrics_file {
+  const char *name;
+  metrics_fn generate;
+};
+
+static metrics_fn sources[METRICS_SOURCES_MAX];
+static unsigned int sources_count = 0;
+
+static struct metrics_file files[METRICS_FILES_MAX];
+static unsigned int files_count = 0;
+
+/* Registration can happen from background threads, so we protect the tables */
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * write_sources - Write every registered source into the metrics file
+ * @out: Stream to write to
+ */
+static void write_sources(FILE *out) {
+  pthread_mutex_lock(&metrics_lock);
+  unsigned int count = sources_count;
+  pthread_mutex_unlock(&metrics_lock);
+
+  /* Sources are never removed, so the first count entries stay valid */
+  for (unsigned int i = 0; i < count; i++) {
+    sources[i](out);
+  }
+}
+
+/**
+ * metrics_write_label - Write an escaped label value
+ * @out: Stream to write to
+ * @value: Label value, such as a filename
+ */
+void metrics_write_label(FILE *out, const char *value) {
+  fputc('"', out);
+  for (const char *c = value; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      fputc('\\', out);
+      fputc(*c, out);
+    } else if (*c == '\n') {
+      fputs("\\n", out);
+    } else {
+      fputc(*c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+/**
+ * metrics_bucket - Find the histogram bucket of a value
+ * @bounds: Upper bounds of every bucket but the last
+ * @count: Number of buckets
+ * @value: Value to find the bucket of
+ *
+ * Return: Index of the first bucket whose bound is at least value
+ */
+unsigned int metrics_bucket(const unsigned long long *bounds,
+                            unsigned int count, unsigned long long value) {
+  unsigned int i = 0;
+  while (i < count - 1 && value > bounds[i]) {
+    i++;
+  }
+  return i;
+}
+
+/**
+ * metrics_write_histogram - Write a histogram in the cumulative form that
+ * Prometheus uses
+ * @out: Stream to write to
+ * @name: Name of the histogram
+ * @labels: Labels of the histogram, such as class="player", or NULL
+ * @bounds: Upper bounds of every bucket but the last
+ * @counts: Count of each bucket
+ * @count: Number of buckets
+ * @sum: Total of all values counted
+ * @scale: What to divide bounds and sum by, to convert them to the unit of the
+ *         metric
+ */
+void metrics_write_histogram(FILE *out, const char *name, const char *labels,
+                             const unsigned long long *bounds,
+                             atomic_ullong *counts, unsigned int count,
+                             unsigned long long sum, double scale) {
+  const char *separator = labels ? "," : "";
+  labels = labels ? labels : "";
+
+  unsigned long long total = 0;
+  for (unsigned int i = 0; i < count; i++) {
+    total += atomic_load(&counts[i]);
+    if (i < count - 1) {
+      fprintf(out, "%s_bucket{%s%sle=\"%.10g\"} %llu\n", name, labels,
+              separator, bounds[i] / scale, total);
+    } else {
+      fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels,
+              separator, total);
+    }
+  }
+
+  const char *open = *labels ? "{" : "";
+  const char *close = *labels ? "}" : "";
+  fprintf(out, "%s_sum%s%s%s %.10g\n", name, open, labels, close, sum / scale);
+  fprintf(out, "%s_count%s%s%s %llu\n", name, open, labels, close, total);
+}
+
+/**
+ * metrics_add_file - Add a virtual file to METRICS_DIR
+ * @name: Filename of the virtual file
+ * @fn: Function that writes the contents of the file
+ *
+ * Return: 0 on success, -1 on error
+ */
+int metrics_add_file(const char *name, metrics_fn fn) {
+  pthread_mutex_lock(&metrics_lock);
+  if (files_count == METRICS_FILES_MAX) {
+    pthread_mutex_unlock(&metrics_lock);
+    fprintf(stderr, "Too many virtual files in %s.\n", METRICS_DIR);
+    return -1;
+  }
+  files[files_count].name = name;
+  files[files_count].generate = fn;
+  files_count++;
+  pthread_mutex_unlock(&metrics_lock);
+  return 0;
+}
+
+/**
+ * metrics_register - Add a section to the metrics virtual file
+ * @fn: Function that writes the section
+ *
+ * The metrics file itself is created the first time a source is registered.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int metrics_register(metrics_fn fn) {
+  pthread_mutex_lock(&metrics_lock);
+  if (sources_count == METRICS_SOURCES_MAX) {
+    pthread_mutex_unlock(&metrics_lock);
+    fprintf(stderr, "Too many metrics sources registered.\n");
+    return -1;
+  }
+  sources[sources_count++] = fn;
+  int first_source = sources_count == 1;
+  pthread_mutex_unlock(&metrics_lock);
+
+  if (first_source) {
+    return metrics_add_file("metrics", write_sources);
+  }
+  return 0;
+}
+
+/**
+ * find_file - Find the virtual file that a FUSE path refers to
+ * @path: FUSE path ("/.filmfs/metrics")
+ *
+ * Return: Pointer to the virtual file, NULL if there is no such file
+ */
+static struct metrics_file *find_file(const char *path) {
+  size_t dir_len = strlen(METRICS_DIR);
+  if (strncmp(path, METRICS_DIR, dir_len) != 0 || path[dir_len] != '/') {
+    return NULL;
+  }
+
+  const char *name = path + dir_len + 1;
+  struct metrics_file *file = NULL;
+
+  pthread_mutex_lock(&metrics_lock);
+  for (unsigned int i = 0; i < files_count; i++) {
+    if (strcmp(name, files[i].name) == 0) {
+      file = &files[i];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&metrics_lock);
+
+  return file;
+}
+
+/**
+ * metrics_path_type - Check whether a FUSE path is one of our virtual paths
+ * @path: FUSE path
+ *
+ * Return: METRICS_PATH_DIR, METRICS_PATH_FILE or METRICS_PATH_NONE
+ */
+int metrics_path_type(const char *path) {
+  if (strcmp(path, METRICS_DIR) == 0) {
+    return METRICS_PATH_DIR;
+  }
+  if (find_file(path)) {
+    return METRICS_PATH_FILE;
+  }
+  return METRICS_PATH_NONE;
+}
+
+/**
+ * metrics_file_count - Get the number of virtual files
+ *
+ * Return: Number of virtual files in METRICS_DIR
+ */
+unsigned int metrics_file_count(void) {
+  pthread_mutex_lock(&metrics_lock);
+  unsigned int count = files_count;
+  pthread_mutex_unlock(&metrics_lock);
+  return count;
+}
+
+/**
+ * metrics_file_name - Get the name of a virtual file
+ * @i: Position of the file, less than metrics_file_count()
+ *
+ * Return: Filename of the virtual file
+ */
+const char *metrics_file_name(unsigned int i) { return files[i].name; }
+
+/**
+ * metrics_generate - Build a snapshot of a virtual file
+ * @path: FUSE path of the virtual file
+ *
+ * open_memstream() gives us a FILE* that writes into a growing malloc'd
+ * buffer, so sources can use fprintf() without knowing how long their output
+ * will be.
+ *
+ * Return: Malloc'd snapshot on success, NULL on error
+ */
+struct metrics_snapshot *metrics_generate(const char *path) {
+  struct metrics_file *file = find_file(path);
+  if (!file) {
+    return NULL;
+  }
+
+  struct metrics_snapshot *snapshot = malloc(sizeof(struct metrics_snapshot));
+  if (!snapshot) {
+    fprintf(stderr, "Memory allocation failed for metrics snapshot: %s",
+            strerror(errno));
+    return NULL;
+  }
+
+  FILE *out = open_memstream(&snapshot->data, &snapshot->len);
+  if (!out) {
+    fprintf(stderr, "Failed to open memory stream: %s", strerror(errno));
+    free(snapshot);
+    return NULL;
+  }
+
+  file->generate(out);
+
+  /* The buffer and length are only guaranteed to be up to date after fclose */
+  if (fclose(out) == EOF) {
+    fprintf(stderr, "Failed to close memory stream: %s", strerror(errno));
+    free(snapshot->data);
+    free(snapshot);
+    return NULL;
+  }
+
+  return snapshot;
+}
+
+/**
+ * metrics_snapshot_free - Free a snapshot returned by metrics_generate()
+ * @snapshot: Snapshot to free
+ */
+void metrics_snapshot_free(struct metrics_snapshot *snapshot) {
+  if (!snapshot) {
+    return;
+  }
+  free(snapshot->data);
+  free(snapshot);
+}
@@ -22,6 +22,10 @@
  * - open: Open a file
  * - read: Read file contents
  *
+ * We also implement release, to clean up after open, and init and destroy,
+ * which FUSE calls when the filesystem is mounted and unmounted, to manage our
+ * background threads.
+ *
  * This is a read-only filesystem, so we don't need to implement modifying calls
  * like write().
  *
@@ -34,6 +38,8 @@
 
 #include <errno.h>
 #include <linux/limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -43,9 +49,34 @@
 
 #include "config.h"
 #include "database.h"
+#include "filmfs.h"
+#include "filmstats.h"
+#include "firstbyte.h"
 #include "fuse.h"
+#include "fuseconn.h"
+#include "layout.h"
+#include "metrics.h"
 #include "operations.h"
+#include "player.h"
+#include "proctable.h"
+#include "session.h"
 #include "video.h"
+#include "workers.h"
+
+/* The number of mountpoints that have been initialized and not yet destroyed */
+static atomic_uint views = 0;
+
+/**
+ * current_layout - Get the layout of the mountpoint a request was made in
+ *
+ * Every mountpoint passes its own layout to FUSE as its private data, see
+ * main.c, and FUSE hands it back in the context of each request.
+ *
+ * Return: The layout
+ */
+static struct layout *current_layout(void) {
+  return fuse_get_context()->private_data;
+}
 
 /**
  * get_file_status - Get metadata for a file in our virtual filesystem
@@ -56,28 +87,29 @@
  * Return: 0 on success, -ENOENT if file not found
  */
 static int get_file_status(const char *path, struct stat *file_stat) {
-  struct video_files *files = get_files();
-  /* Linear search through all video files, this could be changed to a more
-   * efficient method in a future commit. */
-  for (unsigned int i = 0; i < files->count; i++) {
-    /* Skip the leading slash in path */
-    if (strcmp(path + 1, files->names[i]) == 0) {
-      /**
-       * We get the metadata for the real file, which is important because FUSE
-       * needs to report accurate sizes to function properly.
-       */
-      int result = stat(files->paths[i], file_stat);
-      if (result == -1) {
-        fprintf(stderr, "Failed to get file status for %s: %s", path,
-                strerror(errno));
-        return result;
-      }
-      return 0;
-    }
+  int index = layout_find(current_layout(), path);
+  if (index == -1) {
+    /* Return NO ENTry, the standard POSIX error code for a nonexistent file. */
+    return -ENOENT;
   }
 
-  /* Return NO ENTry, the standard POSIX error code for a nonexistent file. */
-  return -ENOENT;
+  /* Remote films have no file to stat, only the size the remote index lists */
+  if (video_remote(index)) {
+    file_stat->st_size = video_remote_size(index);
+    return 0;
+  }
+
+  /**
+   * We get the metadata for the real file, which is important because FUSE
+   * needs to report accurate sizes to function properly.
+   */
+  int result = stat(video_path(index), file_stat);
+  if (result == -1) {
+    fprintf(stderr, "Failed to get file status for %s: %s", path,
+            strerror(errno));
+    return result;
+  }
+  return 0;
 }
 
 /**
@@ -126,6 +158,32 @@ static int fs_getattr(const char *path, struct stat *st) {
     return 0;
   }
 
+  /* The virtual directories of the layout hold films */
+  if (layout_is_bucket(current_layout(), path)) {
+    st->st_mode = S_IFDIR | dir_permissions;
+    st->st_nlink = 2;
+    return 0;
+  }
+
+  /* The hidden metrics directory and its virtual files are read-only */
+  int metrics_type = metrics_path_type(path);
+  if (metrics_type == METRICS_PATH_DIR) {
+    st->st_mode = S_IFDIR | 0555;
+    st->st_nlink = 2;
+    return 0;
+  }
+  if (metrics_type == METRICS_PATH_FILE) {
+    /**
+     * The contents are only generated when the file is opened, so we can't know
+     * the size here. fs_open() turns on direct I/O for these files, which makes
+     * the kernel read until we return 0 bytes instead of trusting st_size.
+     */
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_size = 0;
+    return 0;
+  }
+
   /* We set the permissions for regular files */
   st->st_mode = S_IFREG | file_permissions;
   /* Regular files typically have link count of 1 (no hard links) */
@@ -148,6 +206,24 @@ static int fs_getattr(const char *path, struct stat *st) {
   return 0;
 }
 
+/**
+ * The arguments of a FUSE filler, for adding entries through layout_list()
+ */
+struct fill_context {
+  void *buffer;
+  fuse_fill_dir_t filler;
+};
+
+/**
+ * fill_entry - Add an entry to a directory listing
+ * @name: Name of the entry
+ * @arg: The fill_context of the listing
+ */
+static void fill_entry(const char *name, void *arg) {
+  struct fill_context *context = arg;
+  context->filler(context->buffer, name, NULL, 0);
+}
+
 /**
  * fs_readdir - FUSE readdir callback
  * @path: Directory path to list
@@ -156,9 +232,9 @@ static int fs_getattr(const char *path, struct stat *st) {
  * @offset: Offset for pagination (irrelevant to our usecase)
  * @fi: File info (irrelevant to our usecase)
  *
- * This is called when a program lists directory contents. We only support
- * listing the root directory. We return all the video files from the library
- * path.
+ * This is called when a program lists directory contents. Which films, or
+ * virtual directories of them, each directory holds is up to the layout, see
+ * layout.c.
  *
  * FUSE provides a callback function 'filler' that adds one entry to the
  * directory listing per call.
@@ -174,8 +250,6 @@ static int fs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
   (void)offset;
   (void)(fi);
 
-  struct video_files *files = get_files();
-
   /*
    * We add standard UNIX directories to allow for proper directory navigation.
    * If we ommitted them, tools like cd and pwd would be borked.
@@ -184,12 +258,17 @@ static int fs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
   filler(buffer, "..", NULL, 0); // Parent Directory
 
   /**
-   * We only list files if we are looking at the root directories, as we do not
-   * support subdirectories.
+   * The root directory lists the films, or the virtual directories that they
+   * are grouped into, and each of those lists its own films.
    */
-  if (strcmp(path, "/") == 0) {
-    for (unsigned int i = 0; i < files->count; i++) {
-      filler(buffer, files->names[i], NULL, 0);
+  struct fill_context context = {buffer, filler};
+  layout_list(current_layout(), path, fill_entry, &context);
+
+  /* The metrics directory only contains our virtual files */
+  if (metrics_path_type(path) == METRICS_PATH_DIR) {
+    unsigned int count = metrics_file_count();
+    for (unsigned int i = 0; i < count; i++) {
+      filler(buffer, metrics_file_name(i), NULL, 0);
     }
   }
 
@@ -197,306 +276,287 @@ static int fs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
 }
 
 /**
- * get_proc_name - Get name of process making FUSE request
- *
- * Reads /proc/<pid>/comm to determine if the program accessing our filesystem
- * is a media player.
+ * fs_read - FUSE read callback
+ * @path: Path to file being read
+ * @buffer: Buffer to fill with file data
+ * @size: Number of bytes requested
+ * @offset: Position in file to read from
+ * @fi: File info structure (contains the session if we opened it)
  *
- * PROC FILESYSTEM:
- * Linux exposes process information through /proc/. Each process has a
- * directory /proc/<pid/ that contains various information files. We only care
- * about comm, which gives us the command name.
+ * This is called when a program reads from a file in our filesystem. We call
+ * player_log_access() first to potentially log the access before actually
+ * reading the file through its session.
  *
- * Return: Allocated string with process name, or NULL on error
+ * Return: Number of bytes read on success, -ERRNO on failure
  */
-char *get_proc_name(void) {
-  /*
-   * The kernel truncates any process names longer than 16 characters including
-   * null terminator.
-   */
-  static const int proc_comm_len = 16;
-
-  char *proc_name = malloc(proc_comm_len);
-  if (!proc_name) {
-    fprintf(stderr, "Memory allocation failed for full_path: %s",
-            strerror(errno));
-    return NULL;
+static int fs_read(const char *path, char *buffer, size_t size, off_t offset,
+                   struct fuse_file_info *fi) {
+  /* Virtual files are served from the snapshot taken when they were opened */
+  if (metrics_path_type(path) == METRICS_PATH_FILE) {
+    struct metrics_snapshot *snapshot =
+        (struct metrics_snapshot *)(uintptr_t)fi->fh;
+    if ((size_t)offset >= snapshot->len) {
+      return 0;
+    }
+    if (size > snapshot->len - offset) {
+      size = snapshot->len - offset;
+    }
+    memcpy(buffer, snapshot->data + offset, size);
+    return size;
   }
 
-  /* We build the path to the comm file */
-  char *proc_path = malloc(PATH_MAX);
-  if (!proc_path) {
-    fprintf(stderr, "Memory allocation failed for full_path: %s",
-            strerror(errno));
-    free(proc_name);
-    return NULL;
-  }
-  /* fuse_get_context() returns information about the current FUSE request
-   * including:
-   * - pid: Process ID of the program making the request
-   * - uid: User ID
-   * - gid: Group ID
-   * - private_data: Custom data that we could store per-mount
+  /**
+   * Use the session from fi if available, otherwise start a session just for
+   * this read.
+   *
+   * If fs_open() was called first, fi->fh points to the session. Otherwise, fi
+   * is NULL and we need to open the film ourselves.
    */
-  snprintf(proc_path, PATH_MAX, "/proc/%d/comm", fuse_get_context()->pid);
-
-  /* We open the comm file for reading. */
-  int fd = open(proc_path, O_RDONLY);
-  if (fd == -1) {
-    fprintf(stderr, "Failed to open %s: %s", proc_path, strerror(errno));
-    free(proc_name);
-    free(proc_path);
-    return NULL;
-  }
+  struct session *session = NULL;
+  if (fi == NULL) {
+    int index = layout_find(current_layout(), path);
+    if (index == -1) {
+      return -ENOENT;
+    }
 
-  /* We read the process name into proc_name */
-  if (read(fd, proc_name, proc_comm_len) == -1) {
-    fprintf(stderr, "Failed to read from file for %s: %s", proc_path,
-            strerror(errno));
-    if (close(fd) == -1) {
-      fprintf(stderr, "Failed to close %s: %s", proc_path, strerror(errno));
+    session = session_open(index);
+    if (!session) {
+      return -errno;
     }
-    free(proc_name);
-    free(proc_path);
-    return NULL;
+  } else {
+    session = (struct session *)(uintptr_t)fi->fh;
   }
 
-  /* We don't need the file anymore, so we close the file descriptor */
-  if (close(fd) == -1) {
-    fprintf(stderr, "Failed to close %s: %s", proc_path, strerror(errno));
-    free(proc_name);
-    free(proc_path);
-    return NULL;
+  /* The first read of an open film finishes timing its start */
+  bool first_read = fi && !atomic_exchange(&session->first_read, true);
+  if (first_read) {
+    firstbyte_stage(&session->first_byte, STAGE_WAIT);
   }
 
-  free(proc_path);
+  /**
+   * Attempt to log access, unless the film's policy turns logging off. Films
+   * are logged by name, whichever directory of the layout they're in.
+   */
+  ssize_t result = 0;
+  if (get_config()->policies[session->policy].log) {
+    result = player_log_access(fuse_get_context()->pid, strrchr(path, '/') + 1);
+    if (result != 0) {
+      fprintf(stderr, "Failed to log read.\n");
+    }
+  }
+  if (first_read) {
+    firstbyte_stage(&session->first_byte, STAGE_LOG);
+  }
 
-  /* Remove the trailing newline from the process name, replacing it with '\0'
+  /**
+   * With -o intr, the kernel tells us about reads that the caller gave up on,
+   * for example after a seek. One that was interrupted while it waited in the
+   * queue needn't be read at all, and session_read() asks again before each
+   * chunk it reads from the disk.
    */
-  proc_name[strcspn(proc_name, "\n")] = 0;
+  if (result == 0 && fuse_interrupted()) {
+    session_interrupted(session, size);
+    result = -EINTR;
+  }
 
-  return proc_name;
+  if (result == 0) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    result = session_read(session, buffer, size, offset, fuse_interrupted);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (result > 0) {
+      proctable_read(fuse_get_context()->pid, result,
+                     (end.tv_sec - start.tv_sec) * 1000000000ULL +
+                         end.tv_nsec - start.tv_nsec);
+    }
+  }
+  if (first_read) {
+    firstbyte_stage(&session->first_byte, STAGE_IO);
+    firstbyte_record(&session->first_byte, session->index, session->dev);
+  }
+  if (fi == NULL) {
+    session_close(session);
+  }
+  return result;
 }
 
 /**
- * logging_handle - Log film viewing if request is from media player
- * @path: FUSE path being accessed
- *
- * We detect when media players read files and log those accesses as watches.
- *
- * DETECTION STRATEGY:
- * 1. Get the name of the process making the request
- * 2. Check if it's a known media player
- * 3. If it is, and it's a new process (not a continued read), we log it
- *
- * SUPPORTED MEDIA PLAYERS:
- * - "demux": VLC's demuxer thread
- * - "vlc:disk$0": VLC disk reading thread
+ * fs_open - FUSE open callback
+ * @path: Path to file being opened
+ * @fi: File info structure to store the session in
  *
- * These are VLC-specific thread names. To support other players, we'd add their
- * process names to the array.
+ * This is called when a program opens a file. We start a session for the film,
+ * which opens the real file, and store a pointer to it in fi->fh so that
+ * subsequent read() calls can use it.
  *
- * We track the last PID we logged to avoid duplicate entries, as players make
- * many read() calls for a single viewing.
+ * fi->fh is a 64-bit integer that FUSE passes back to us in read() and
+ * release() calls, which allows us to avoid repeatedly opening and closing the
+ * file.
  *
  * Return: 0 on success, -ERRNO on failure
  */
-int logging_handle(const char *path) {
-  static const char *media_player_comm[NUM_OF_MEDIA_PLAYERS] = {"demux",
-                                                                "vlc:disk$0"};
-  /* We initialize this to -1 since it is an impossible PID */
-  static pid_t last_pid = -1;
-
-  /* Get the name of the process making the request */
-  char *proc_name = get_proc_name();
-  if (!proc_name) {
-    fprintf(stderr, "FAILED TO GET PROCESS NAME\n");
-    return -EIO;
+static int fs_open(const char *path, struct fuse_file_info *fi) {
+  /* Opening a virtual file takes a snapshot of its contents */
+  if (metrics_path_type(path) == METRICS_PATH_FILE) {
+    struct metrics_snapshot *snapshot = metrics_generate(path);
+    if (!snapshot) {
+      return -EIO;
+    }
+    fi->fh = (uintptr_t)snapshot;
+    fi->direct_io = 1;
+    return 0;
   }
 
-  /* Check if this process is a known media player */
-  int caller_is_media_player = 0;
-  for (unsigned int i = 0; i < NUM_OF_MEDIA_PLAYERS; i++) {
-    if (strcmp(proc_name, media_player_comm[i]) == 0) {
-      caller_is_media_player = 1;
-      break;
-    }
+  /* We time every stage until the first data of the film is returned */
+  struct first_byte timing;
+  firstbyte_begin(&timing);
+
+  /* Find the file and open it */
+  int index = layout_find(current_layout(), path);
+  if (index == -1) {
+    return -ENOENT;
   }
+  firstbyte_stage(&timing, STAGE_LOOKUP);
 
+  /* fuse_get_context() tells us which process made the request */
+  char *proc_name = player_proc_name(fuse_get_context()->pid);
+  timing.caller = firstbyte_caller_class(proc_name);
   free(proc_name);
+  firstbyte_stage(&timing, STAGE_CLASSIFY);
+
+  struct session *session = session_open(index);
+  if (!session) {
+    return -errno;
+  }
+  firstbyte_stage(&timing, STAGE_OPEN);
+  session->first_byte = timing;
 
-  /* Get the PID of the calling process */
-  pid_t current_pid = fuse_get_context()->pid;
+  proctable_open(fuse_get_context()->pid);
 
   /**
-   * Only log to database if the caller is a media player and this is a new
-   * process. We do this because media players might make thousands of read()
-   * calls during one viewing.
+   * We store the session in FUSE file info structure so that subsequent read
+   * calls can read from the file without reopening it.
    */
-  if (caller_is_media_player == 1 && current_pid != last_pid) {
-    last_pid = current_pid;
-    if (db_insert(path) == -1) {
-      return -EFAULT;
-    }
-  }
+  fi->fh = (uintptr_t)session;
 
+  /* The film's policy may keep its reads out of the page cache */
+  fi->direct_io = get_config()->policies[session->policy].direct_io;
   return 0;
 }
 
 /**
- * fs_read - FUSE read callback
- * @path: Path to file being read
- * @buffer: Buffer to fill with file data
- * @size: Number of bytes requested
- * @offset: Position in file to read from
- * @fi: File info structure (contains file descriptor if we opened it)
+ * fs_release - FUSE release callback
+ * @path: Path to file being closed
+ * @fi: File info structure holding the session
  *
- * This is called when a program reads from a file in our filesystem. We call
- * logging_handle() first to potentially log the access before actually reading
- * the file.
+ * This is called once the last file descriptor for an opened file is closed.
+ * We end the session, which closes the real file, or free the snapshot of a
+ * virtual file.
  *
- * We use pread() which reads from a specific offset without changing the file
- * position. This is important because multiple threads might read from the same
- * file simultaneously.
- *
- * Return: Number of bytes read on success, -ERRNO on failure
+ * Return: 0
  */
-static int fs_read(const char *path, char *buffer, size_t size, off_t offset,
-                   struct fuse_file_info *fi) {
-  struct video_files *files = get_files();
-
-  /* Attempt to log access */
-  int log_res = logging_handle(path);
-  if (log_res != 0) {
-    fprintf(stderr, "Failed to log read.\n");
-    return log_res;
+static int fs_release(const char *path, struct fuse_file_info *fi) {
+  if (metrics_path_type(path) == METRICS_PATH_FILE) {
+    metrics_snapshot_free((struct metrics_snapshot *)(uintptr_t)fi->fh);
+    return 0;
   }
 
-  int fd;
-  ssize_t result;
-
-  /* Find the file in our list and read it */
-  for (unsigned int i = 0; i < files->count; i++) {
-    if (strcmp(path + 1, files->names[i]) != 0) {
-      continue;
-    }
-
-    /* Build the full path to read file in libary */
-    char *full_path = malloc(PATH_MAX);
-    if (!full_path) {
-      fprintf(stderr, "Memory allocation failed for full_path: %s",
-              strerror(errno));
-      return -errno;
-    }
-
-    snprintf(full_path, PATH_MAX, "%s%s", get_config()->library_path,
-             files->names[i]);
-
-    /**
-     * Use file descriptor from fi if available, otherwise open the file.
-     *
-     * If fs_open() was called first, fi->fh contains the file descriptor.
-     * Otherwise, fi is NULL and we need to open it ourselves.
-     */
-    if (fi == NULL) {
-      fd = open(full_path, O_RDONLY);
-    } else {
-      fd = fi->fh;
-    }
-
-    if (fd == -1) {
-      fprintf(stderr, "Failed to open %s: %s", full_path, strerror(errno));
-      free(full_path);
-      return -errno;
-    }
-
-    /**
-     * We use a loop for reading the data because pread() can return fewer bytes
-     * than requested. We keep reading until we get everything or hit an
-     * error/EOF.
-     */
-    size_t bytes_read = 0;
-    while (bytes_read < size) {
-      result = pread(fd, buffer + bytes_read, size - bytes_read,
-                     offset + bytes_read);
-      if (result <= 0) {
-        break;
-      }
-      bytes_read += result;
-    }
-
-    if (result == -1) {
-      fprintf(stderr, "Failed to read from file for %s: %s", full_path,
-              strerror(errno));
-      free(full_path);
-      return -errno;
-    }
-
-    /**
-     * If we opened the file, we have to close it. If fs_open opened it,
-     * fs_open()'s corresponding close will happen later.
-     */
-    if (fi == NULL) {
-      if (close(fd) == -1) {
-        fprintf(stderr, "Failed to close %s: %s", full_path, strerror(errno));
-        free(full_path);
-        return -errno;
-      }
-    }
+  session_close((struct session *)(uintptr_t)fi->fh);
+  return 0;
+}
 
-    free(full_path);
+/**
+ * fs_getxattr - FUSE getxattr callback
+ * @path: Path to the file
+ * @name: Name of the extended attribute
+ * @value: Buffer to fill with the attribute
+ * @size: Size of value, or 0 if the caller only wants the attribute's length
+ *
+ * Films have one attribute, FILMSTATS_XATTR, holding their I/O counters.
+ *
+ * Return: Length of the attribute on success, -ERRNO on failure
+ */
+static int fs_getxattr(const char *path, const char *name, char *value,
+                       size_t size) {
+  int index = layout_find(current_layout(), path);
+  if (index == -1 || strcmp(name, FILMSTATS_XATTR) != 0) {
+    /* No DATA is what Linux reports for an attribute that doesn't exist */
+    return -ENODATA;
+  }
+  return filmstats_xattr(index, value, size);
+}
 
-    return bytes_read;
+/**
+ * fs_listxattr - FUSE listxattr callback
+ * @path: Path to the file
+ * @list: Buffer to fill with the names of the attributes, each ending in '\0'
+ * @size: Size of list, or 0 if the caller only wants the length of the names
+ *
+ * Return: Length of the names on success, -ERRNO on failure
+ */
+static int fs_listxattr(const char *path, char *list, size_t size) {
+  if (layout_find(current_layout(), path) == -1) {
+    return 0;
   }
-  return -ENOENT;
+  if (size == 0) {
+    return sizeof(FILMSTATS_XATTR);
+  }
+  if (size < sizeof(FILMSTATS_XATTR)) {
+    return -ERANGE;
+  }
+  memcpy(list, FILMSTATS_XATTR, sizeof(FILMSTATS_XATTR));
+  return sizeof(FILMSTATS_XATTR);
 }
 
 /**
- * fs_open - FUSE open callback
- * @path: Path to file being opened
- * @fi: File info structure to store file descriptor
+ * fs_init - FUSE init callback
+ * @conn: Capabilities of the FUSE connection (irrelevant to our usecase)
  *
- * This is called when a program opens a file. We open the real file and store
- * the file descriptor in fi->fh so that subsequent read() calls can use it.
+ * This is called once the filesystem is mounted. main() forks into the
+ * background before the event loop calls it, so this is where we start the
+ * executor that runs our background work. Threads started before the fork
+ * would not survive it.
  *
- * fi->fh is where we store the file descriptor. FUSE passes the fi structure to
- * read() and release() calls, which allows us to avoid repeatedly opening and
- * closing the file.
+ * Every mountpoint is initialized, but they all share the background work, so
+ * only the first one starts it.
  *
- * Return: 0 on success, -ERRNO on failure
+ * Return: Private data for the filesystem, which is the layout of the
+ * mountpoint that it was created with
  */
-static int fs_open(const char *path, struct fuse_file_info *fi) {
-  struct video_files *files = get_files();
+static void *fs_init(struct fuse_conn_info *conn) {
+  (void)conn;
 
-  char *full_path = malloc(PATH_MAX);
-  if (!full_path) {
-    fprintf(stderr, "Memory allocation failed for full_path: %s",
-            strerror(errno));
-    return -errno;
+  /**
+   * The background work is shared with libfilmfs. We add the measurements of
+   * the FUSE connection and the processes using the mountpoint, and the
+   * controller of the worker pool, which are optimizations too, so we keep
+   * serving files if they fail to start.
+   */
+  if (atomic_fetch_add(&views, 1) == 0) {
+    filmfs_start();
+    fuseconn_start();
+    proctable_start();
+    workers_start();
   }
 
-  /* Find the file and open it */
-  for (unsigned int i = 0; i < files->count; i++) {
-    if (strcmp(path + 1, files->names[i]) == 0) {
-      snprintf(full_path, PATH_MAX, "%s%s", get_config()->library_path,
-               files->names[i]);
-      int fd = open(full_path, O_RDONLY);
-      if (fd == -1) {
-        fprintf(stderr, "Failed to open %s: %s", full_path, strerror(errno));
-        free(full_path);
-        return -errno;
-      }
-      free(full_path);
-
-      /**
-       * We store the file descriptor in FUSE file info structure so that
-       * subsequent read calls can read from the file without reopening it.
-       */
-      fi->fh = fd;
-      return 0;
-    }
+  return current_layout();
+}
+
+/**
+ * fs_destroy - FUSE destroy callback
+ * @private_data: Private data returned by fs_init() (unused)
+ *
+ * This is called when the filesystem is unmounted. Once the last mountpoint
+ * is, we stop the background work, which saves the index of the library for
+ * the next startup.
+ */
+static void fs_destroy(void *private_data) {
+  (void)private_data;
+
+  if (atomic_fetch_sub(&views, 1) == 1) {
+    filmfs_stop();
+    proctable_stop();
   }
-  return -ENOENT;
 }
 
 /**
@@ -507,7 +567,12 @@ static int fs_open(const char *path, struct fuse_file_info *fi) {
 static struct fuse_operations operations = {.getattr = fs_getattr,
                                             .readdir = fs_readdir,
                                             .read = fs_read,
-                                            .open = fs_open};
+                                            .open = fs_open,
+                                            .release = fs_release,
+                                            .getxattr = fs_getxattr,
+                                            .listxattr = fs_listxattr,
+                                            .init = fs_init,
+                                            .destroy = fs_destroy};
 
 /**
  * get_operations - Get pointer to FUSE operations structure
@@ -0,0 +1,165 @@
+/**
+ * player.c
+ *
+ * Recognizing media players and logging the films they play.
+ *
+ * OVERVIEW:
+ * A film counts as watched when a known media player reads it. We tell media
+ * players apart from other programs, like file managers making thumbnails, by
+ * the name of the thread doing the reading. The FUSE callbacks and the
+ * fanotify logging mode both log viewings through here, so they count the same
+ * way.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "filmfs.h"
+#include "player.h"
+
+/* The last thread we logged a viewing for, -1 since it is an impossible PID */
+static atomic_int last_pid = -1;
+
+/**
+ * player_proc_name - Get the name of a process
+ * @pid: ID of the process, or of one of its threads
+ *
+ * Reads /proc/<pid>/comm to determine if the program accessing a film is a
+ * media player.
+ *
+ * PROC FILESYSTEM:
+ * Linux exposes process information through /proc/. Each process has a
+ * directory /proc/<pid/ that contains various information files. We only care
+ * about comm, which gives us the command name.
+ *
+ * Return: Allocated string with process name, or NULL on error
+ */
+char *player_proc_name(pid_t pid) {
+  /*
+   * The kernel truncates any process names longer than 16 characters including
+   * null terminator.
+   */
+  static const int proc_comm_len = 16;
+
+  char *proc_name = malloc(proc_comm_len);
+  if (!proc_name) {
+    fprintf(stderr, "Memory allocation failed for full_path: %s",
+            strerror(errno));
+    return NULL;
+  }
+
+  /* We build the path to the comm file */
+  char *proc_path = malloc(PATH_MAX);
+  if (!proc_path) {
+    fprintf(stderr, "Memory allocation failed for full_path: %s",
+            strerror(errno));
+    free(proc_name);
+    return NULL;
+  }
+  snprintf(proc_path, PATH_MAX, "/proc/%d/comm", pid);
+
+  /* We open the comm file for reading. */
+  int fd = open(proc_path, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open %s: %s", proc_path, strerror(errno));
+    free(proc_name);
+    free(proc_path);
+    return NULL;
+  }
+
+  /* We read the process name into proc_name */
+  if (read(fd, proc_name, proc_comm_len) == -1) {
+    fprintf(stderr, "Failed to read from file for %s: %s", proc_path,
+            strerror(errno));
+    if (close(fd) == -1) {
+      fprintf(stderr, "Failed to close %s: %s", proc_path, strerror(errno));
+    }
+    free(proc_name);
+    free(proc_path);
+    return NULL;
+  }
+
+  /* We don't need the file anymore, so we close the file descriptor */
+  if (close(fd) == -1) {
+    fprintf(stderr, "Failed to close %s: %s", proc_path, strerror(errno));
+    free(proc_name);
+    free(proc_path);
+    return NULL;
+  }
+
+  free(proc_path);
+
+  /* Remove the trailing newline from the process name, replacing it with '\0'
+   */
+  proc_name[strcspn(proc_name, "\n")] = 0;
+
+  return proc_name;
+}
+
+/**
+ * player_log_access - Log film viewing if the access is from a media player
+ * @pid: ID of the thread accessing the film
+ * @title: Name of the film's file
+ *
+ * We detect when media players read files and log those accesses as watches,
+ * whether they read them through the mountpoint or, in LOG_MODE=FANOTIFY,
+ * straight from the library.
+ *
+ * DETECTION STRATEGY:
+ * 1. Get the name of the process making the request
+ * 2. Check if it's a known media player
+ * 3. If it is, and it's a new process (not a continued read), we log it
+ *
+ * SUPPORTED MEDIA PLAYERS:
+ * - "demux": VLC's demuxer thread
+ * - "vlc:disk$0": VLC disk reading thread
+ *
+ * These are VLC-specific thread names. To support other players, we'd add their
+ * process names to the array.
+ *
+ * We track the last PID we logged to avoid duplicate entries, as players make
+ * many read() calls for a single viewing.
+ *
+ * Return: 0 on success, -ERRNO on failure
+ */
+int player_log_access(pid_t pid, const char *title) {
+  static const char *media_player_comm[NUM_OF_MEDIA_PLAYERS] = {"demux",
+                                                                "vlc:disk$0"};
+
+  /* Get the name of the process making the request */
+  char *proc_name = player_proc_name(pid);
+  if (!proc_name) {
+    fprintf(stderr, "FAILED TO GET PROCESS NAME\n");
+    return -EIO;
+  }
+
+  /* Check if this process is a known media player */
+  int caller_is_media_player = 0;
+  for (unsigned int i = 0; i < NUM_OF_MEDIA_PLAYERS; i++) {
+    if (strcmp(proc_name, media_player_comm[i]) == 0) {
+      caller_is_media_player = 1;
+      break;
+    }
+  }
+
+  free(proc_name);
+
+  /**
+   * Only log to database if the caller is a media player and this is a new
+   * process. We do this because media players might make thousands of read()
+   * calls during one viewing.
+   */
+  if (caller_is_media_player == 1 && atomic_exchange(&last_pid, pid) != pid) {
+    if (filmfs_log(title) == -1) {
+      return -EFAULT;
+    }
+  }
+
+  return 0;
+}
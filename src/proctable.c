@@ -0,0 +1,234 @@
+/**
+ * proctable.c
+ *
+ * Per-process accounting of the reads served by filmFS.
+ *
+ * OVERVIEW:
+ * The metrics file says how busy filmFS is, but not who is keeping it busy. A
+ * library scanner crawling every film looks much like two players, until it is
+ * split by process. For every process that opens or reads a film we count its
+ * opens, reads, bytes and the time its reads took, using the PID that FUSE
+ * gives us for each request.
+ *
+ * The table lives in shared memory named PROCTABLE_NAME rather than in a
+ * virtual file of the mount, so that filmfs-top can still show it when the
+ * mount is too congested to answer, which is exactly when it is needed.
+ *
+ * CONCURRENCY:
+ * Slots are found by probing from the PID's hash, stopping at the first slot
+ * that was never used, and counting is a handful of atomic additions, so reads
+ * never take a lock. Claiming a slot takes table_lock. When the table is full,
+ * the least recently active process is replaced: its slot is marked
+ * PROCTABLE_BUSY while it is reset, and the new PID is stored last. A read
+ * racing with the replacement may be counted against the new process, which
+ * is harmless for a view that shows rates.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "firstbyte.h"
+#include "proctable.h"
+
+static struct proc_table *table = NULL;
+static char table_name[32];
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * now_ns - Get the monotonic time in nanoseconds
+ *
+ * Return: The time
+ */
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * lookup - Find the slot of a process
+ * @pid: Process ID
+ *
+ * Return: The slot, NULL if the process has none
+ */
+static struct proc_entry *lookup(pid_t pid) {
+  for (unsigned int i = 0; i < PROCTABLE_SLOTS; i++) {
+    struct proc_entry *entry =
+        &table->entries[(pid + i) % PROCTABLE_SLOTS];
+    pid_t found = atomic_load(&entry->pid);
+    if (found == pid) {
+      return entry;
+    }
+    if (found == PROCTABLE_FREE) {
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * claim - Give a process a slot
+ * @pid: Process ID
+ *
+ * Takes the first unused slot along the probe sequence, or else the slot of
+ * the least recently active process in it. As a replaced slot is never freed,
+ * every process already in the table stays reachable from its hash.
+ *
+ * Return: The slot
+ */
+static struct proc_entry *claim(pid_t pid) {
+  pthread_mutex_lock(&table_lock);
+
+  /* Another thread may have claimed it since we looked */
+  struct proc_entry *entry = lookup(pid);
+  if (entry) {
+    pthread_mutex_unlock(&table_lock);
+    return entry;
+  }
+
+  struct proc_entry *oldest = NULL;
+  for (unsigned int i = 0; i < PROCTABLE_SLOTS; i++) {
+    struct proc_entry *candidate =
+        &table->entries[(pid + i) % PROCTABLE_SLOTS];
+    if (atomic_load(&candidate->pid) == PROCTABLE_FREE) {
+      oldest = candidate;
+      break;
+    }
+    if (!oldest ||
+        atomic_load(&candidate->last_active) <
+            atomic_load(&oldest->last_active)) {
+      oldest = candidate;
+    }
+  }
+  entry = oldest;
+
+  atomic_store(&entry->pid, PROCTABLE_BUSY);
+  atomic_store(&entry->opens, 0);
+  atomic_store(&entry->reads, 0);
+  atomic_store(&entry->bytes, 0);
+  atomic_store(&entry->read_ns, 0);
+  atomic_store(&entry->last_active, now_ns());
+
+  memset(entry->comm, 0, sizeof(entry->comm));
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "/proc/%d/comm", pid);
+  FILE *comm = fopen(path, "r");
+  if (comm) {
+    if (fgets(entry->comm, sizeof(entry->comm), comm)) {
+      entry->comm[strcspn(entry->comm, "\n")] = '\0';
+    }
+    fclose(comm);
+  }
+  entry->caller = firstbyte_caller_class(entry->comm);
+
+  atomic_store(&entry->pid, pid);
+  pthread_mutex_unlock(&table_lock);
+  return entry;
+}
+
+/**
+ * find_entry - Find or claim the slot of a process
+ * @pid: Process ID
+ *
+ * Return: The slot, NULL if there is no table
+ */
+static struct proc_entry *find_entry(pid_t pid) {
+  if (!table || pid <= 0) {
+    return NULL;
+  }
+  struct proc_entry *entry = lookup(pid);
+  return entry ? entry : claim(pid);
+}
+
+/**
+ * proctable_open - Count a film that a process opened
+ * @pid: Process ID of the caller
+ */
+void proctable_open(pid_t pid) {
+  struct proc_entry *entry = find_entry(pid);
+  if (!entry) {
+    return;
+  }
+  atomic_fetch_add(&entry->opens, 1);
+  atomic_store(&entry->last_active, now_ns());
+}
+
+/**
+ * proctable_read - Count a read that a process made
+ * @pid: Process ID of the caller
+ * @bytes: Bytes read
+ * @ns: Time the read took in nanoseconds
+ */
+void proctable_read(pid_t pid, size_t bytes, uint64_t ns) {
+  struct proc_entry *entry = find_entry(pid);
+  if (!entry) {
+    return;
+  }
+  atomic_fetch_add(&entry->reads, 1);
+  atomic_fetch_add(&entry->bytes, bytes);
+  atomic_fetch_add(&entry->read_ns, ns);
+  atomic_store(&entry->last_active, now_ns());
+}
+
+/**
+ * proctable_start - Create the shared memory table
+ *
+ * A table left behind by a filesystem that didn't exit cleanly is replaced.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int proctable_start(void) {
+  snprintf(table_name, sizeof(table_name), PROCTABLE_NAME, getuid());
+
+  shm_unlink(table_name);
+  int fd = shm_open(table_name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to create process table %s: %s\n", table_name,
+            strerror(errno));
+    return -1;
+  }
+
+  if (ftruncate(fd, sizeof(struct proc_table)) == -1) {
+    fprintf(stderr, "Failed to size process table: %s\n", strerror(errno));
+    close(fd);
+    shm_unlink(table_name);
+    return -1;
+  }
+
+  void *mapping = mmap(NULL, sizeof(struct proc_table),
+                       PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "Failed to map process table: %s\n", strerror(errno));
+    shm_unlink(table_name);
+    return -1;
+  }
+
+  table = mapping;
+  table->slots = PROCTABLE_SLOTS;
+  table->owner = getpid();
+  table->version = PROCTABLE_VERSION;
+  table->magic = PROCTABLE_MAGIC;
+  return 0;
+}
+
+/**
+ * proctable_stop - Remove the shared memory table
+ *
+ * Must be called once no more requests are being served.
+ */
+void proctable_stop(void) {
+  if (!table) {
+    return;
+  }
+  munmap(table, sizeof(struct proc_table));
+  table = NULL;
+  shm_unlink(table_name);
+}
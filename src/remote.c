@@ -0,0 +1,1362 @@
+/**
+ * remote.c
+ *
+ * Films read from an HTTP server, cached on local disk a chunk at a time.
+ *
+ * OVERVIEW:
+ * Part of a collection may live on an object store or web server that we can
+ * only reach over HTTP. Rather than mounting it with another FUSE filesystem
+ * underneath us, we read it ourselves. REMOTE_URL points at a plain text index
+ * of the films, one per line, each with its size in bytes and its path
+ * relative to the index:
+ *
+ *   1825361100 Film (1999).mkv
+ *   734003200 Shorts/Short (2004).mp4
+ *
+ * The films join the library like local ones, with their URL as their path, and
+ * sessions read them through remote_read() instead of a file descriptor.
+ *
+ * CHUNKS:
+ * Films are fetched in chunks of REMOTE_CHUNK_MB, each with one range request,
+ * and every chunk is kept as a file in REMOTE_CACHE_DIR. A read copies from
+ * the chunk files, fetching the ones it covers first if they aren't cached, so
+ * a film that has been played once plays again without the network. When the
+ * chunks take more than REMOTE_CACHE_MB, the least recently read ones are
+ * deleted. Chunk files are named after a hash of the film's URL and size and
+ * of REMOTE_CHUNK_MB, so a film that is replaced by one of another size, or a
+ * change of REMOTE_CHUNK_MB, doesn't read stale chunks, and the chunks survive
+ * restarts. A cached chunk must also be exactly as long as its number says,
+ * or it is fetched again.
+ *
+ * Two readers that want the same chunk, like a read and the lookahead, don't
+ * both fetch it: the second waits for the first to finish.
+ *
+ * CONNECTIONS:
+ * We keep up to REMOTE_CONNECTIONS connections to the server open with HTTP/1.1
+ * keep-alive and reuse them, so a chunk costs one round trip instead of a TCP
+ * handshake as well. A request that finds every connection busy waits for one.
+ * The server may close a connection that sat idle at any time, so a request
+ * that fails on a reused connection is tried again on another one.
+ *
+ * We speak plain HTTP only. A server that is only reachable over HTTPS needs a
+ * TLS-terminating proxy on the local network.
+ *
+ * PREFETCHING:
+ * The lookahead treats remote films like local ones, except that prefetching a
+ * range fetches its chunks into the cache rather than asking the kernel to read
+ * them into the page cache. Its prefetches run on the executor, so sequential
+ * streams find their next chunks on disk before they read them.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "executor.h"
+#include "metrics.h"
+#include "remote.h"
+#include "video.h"
+
+/* Where chunks are cached by default, relative to the home directory */
+#define REMOTE_CACHE_DIR_DEFAULT "/.filmfs/remote"
+
+/**
+ * A remote film being read:
+ * url - URL of the film, which stays valid until unmount
+ * size - size of the film in bytes
+ * key - hash of the URL and size, which names the film's chunk files
+ * lock - protects chunk and fd
+ * chunk - number of the chunk that fd has open
+ * fd - file descriptor of a cached chunk file, or -1
+ */
+struct remote_file {
+  const char *url;
+  off_t size;
+  uint64_t key;
+  pthread_mutex_t lock;
+  unsigned long chunk;
+  int fd;
+};
+
+/**
+ * A chunk in the cache:
+ * key - key of the film that the chunk belongs to
+ * number - position of the chunk in the film, in chunks
+ * bytes - size of the chunk file, which is less than a chunk at the end
+ * last_used - when the chunk was last read, in nanoseconds since the epoch
+ * fetching - set while the chunk is being fetched, when it has no file yet
+ */
+struct chunk {
+  uint64_t key;
+  unsigned long number;
+  off_t bytes;
+  unsigned long long last_used;
+  bool fetching;
+};
+
+/**
+ * A response from the server:
+ * status - the HTTP status code
+ * body - malloc'd body of the response
+ * length - number of bytes in body
+ * keep_alive - whether the connection may be used for another request
+ */
+struct response {
+  int status;
+  char *body;
+  size_t length;
+  bool keep_alive;
+};
+
+/* Whether REMOTE_URL is set and remote_start() has set everything up */
+static bool running = false;
+
+/* The host and port to connect to, and the Host header we send */
+static char host[256];
+static char port[8];
+static char authority[300];
+
+/**
+ * The length of the URL of the index's directory, which every film URL starts
+ * with, and the length of the origin ("http://host:port") that precedes its
+ * path
+ */
+static size_t base_len = 0;
+static size_t origin_len = 0;
+
+/* Where chunks are cached, with no trailing '/' */
+static char cache_dir[PATH_MAX];
+
+/* Idle connections, the most recently used last */
+static int idle[REMOTE_CONNECTIONS_LIMIT];
+static unsigned int idle_count = 0;
+
+/* Connections that are open, whether idle or in use */
+static unsigned int open_count = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+/* The chunks in the cache, or being fetched into it */
+static struct chunk *chunks = NULL;
+static unsigned int chunk_count = 0;
+static unsigned int chunk_capacity = 0;
+static unsigned long long cache_bytes = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+
+/* Requests and connections */
+static atomic_ullong requests = 0;
+static atomic_ullong request_ns = 0;
+static atomic_ullong request_errors = 0;
+static atomic_ullong received_bytes = 0;
+static atomic_ullong connects = 0;
+static atomic_ullong connection_waits = 0;
+
+/* Chunks found in the cache, fetched for reads and for the lookahead */
+static atomic_ullong chunk_hits = 0;
+static atomic_ullong chunk_misses = 0;
+static atomic_ullong chunks_prefetched = 0;
+static atomic_ullong chunks_evicted = 0;
+
+/* Refreshes of the index, and the number of films it listed last time */
+static atomic_ullong refreshes = 0;
+static atomic_ullong refresh_errors = 0;
+static atomic_uint listed_films = 0;
+
+/**
+ * now_ns - Get the time for the last use of a chunk
+ *
+ * We use the real time rather than the monotonic one, since it is compared
+ * with the modification times of chunk files from earlier runs.
+ *
+ * Return: Nanoseconds since the epoch
+ */
+static unsigned long long now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * write_metrics - Write the remote section of the metrics file
+ * @out: Stream to write to
+ *
+ * Connection waits that keep rising mean REMOTE_CONNECTIONS is too low for the
+ * streams playing, and misses that keep rising while films play sequentially
+ * mean the lookahead doesn't keep up with the server.
+ */
+static void write_metrics(FILE *out) {
+  pthread_mutex_lock(&pool_lock);
+  unsigned int idle_now = idle_count;
+  unsigned int open_now = open_count;
+  pthread_mutex_unlock(&pool_lock);
+  pthread_mutex_lock(&cache_lock);
+  unsigned long long bytes = cache_bytes;
+  unsigned int count = chunk_count;
+  pthread_mutex_unlock(&cache_lock);
+
+  fprintf(out, "filmfs_remote_films %u\n", atomic_load(&listed_films));
+  fprintf(out, "filmfs_remote_refreshes_total %llu\n",
+          atomic_load(&refreshes));
+  fprintf(out, "filmfs_remote_refresh_errors_total %llu\n",
+          atomic_load(&refresh_errors));
+  fprintf(out, "filmfs_remote_connections{state=\"idle\"} %u\n", idle_now);
+  fprintf(out, "filmfs_remote_connections{state=\"busy\"} %u\n",
+          open_now - idle_now);
+  fprintf(out, "filmfs_remote_connections_opened_total %llu\n",
+          atomic_load(&connects));
+  fprintf(out, "filmfs_remote_connection_waits_total %llu\n",
+          atomic_load(&connection_waits));
+  fprintf(out, "filmfs_remote_requests_total %llu\n", atomic_load(&requests));
+  fprintf(out, "filmfs_remote_request_seconds_total %.6f\n",
+          atomic_load(&request_ns) / 1e9);
+  fprintf(out, "filmfs_remote_request_errors_total %llu\n",
+          atomic_load(&request_errors));
+  fprintf(out, "filmfs_remote_received_bytes_total %llu\n",
+          atomic_load(&received_bytes));
+  fprintf(out, "filmfs_remote_chunk_hits_total %llu\n",
+          atomic_load(&chunk_hits));
+  fprintf(out, "filmfs_remote_chunk_misses_total %llu\n",
+          atomic_load(&chunk_misses));
+  fprintf(out, "filmfs_remote_chunks_prefetched_total %llu\n",
+          atomic_load(&chunks_prefetched));
+  fprintf(out, "filmfs_remote_chunks_evicted_total %llu\n",
+          atomic_load(&chunks_evicted));
+  fprintf(out, "filmfs_remote_cache_chunks %u\n", count);
+  fprintf(out, "filmfs_remote_cache_bytes %llu\n", bytes);
+  fprintf(out, "filmfs_remote_cache_max_bytes %llu\n",
+          get_config()->remote_cache_bytes);
+}
+
+/**
+ * parse_url - Split REMOTE_URL into the parts we connect and send requests with
+ *
+ * The host may be an IPv6 address in brackets, like "http://[::1]:8080/".
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int parse_url(void) {
+  const char *url = get_config()->remote_url;
+  const char *start = url + strlen(REMOTE_SCHEME);
+  const char *path = strchr(start, '/');
+  size_t authority_len = path - start;
+  if (authority_len >= sizeof(authority)) {
+    fprintf(stderr, "The host of REMOTE_URL is too long.\n");
+    return -1;
+  }
+  memcpy(authority, start, authority_len);
+  authority[authority_len] = '\0';
+
+  const char *host_start = authority;
+  const char *host_end;
+  if (authority[0] == '[') {
+    host_start++;
+    host_end = strchr(host_start, ']');
+    if (!host_end) {
+      fprintf(stderr, "REMOTE_URL has an unclosed '['.\n");
+      return -1;
+    }
+  } else {
+    host_end = strchr(authority, ':');
+    if (!host_end) {
+      host_end = authority + authority_len;
+    }
+  }
+  memcpy(host, host_start, host_end - host_start);
+  host[host_end - host_start] = '\0';
+
+  const char *port_start = strchr(host_end, ':');
+  snprintf(port, sizeof(port), "%s", port_start ? port_start + 1 : "80");
+
+  origin_len = path - url;
+  base_len = strrchr(url, '/') + 1 - url;
+  return 0;
+}
+
+/**
+ * hash_key - Hash the URL and size of a film into the key of its chunks
+ * @url: URL of the film
+ * @size: Size of the film
+ *
+ * This is the 64-bit FNV-1a hash, like the lookup tables of the library use.
+ * The chunk size is hashed too, since chunk N of one size holds other bytes
+ * than chunk N of another.
+ *
+ * Return: Key of the film's chunks
+ */
+static uint64_t hash_key(const char *url, off_t size) {
+  unsigned long long chunk_bytes = get_config()->remote_chunk_bytes;
+  uint64_t hash = 14695981039346656037ULL;
+  for (const unsigned char *c = (const unsigned char *)url; *c; c++) {
+    hash ^= *c;
+    hash *= 1099511628211ULL;
+  }
+  for (unsigned int i = 0; i < sizeof(size); i++) {
+    hash ^= (size >> (i * 8)) & 0xff;
+    hash *= 1099511628211ULL;
+  }
+  for (unsigned int i = 0; i < sizeof(chunk_bytes); i++) {
+    hash ^= (chunk_bytes >> (i * 8)) & 0xff;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/**
+ * connect_server - Open a new connection to the server
+ *
+ * Return: Socket on success, -1 with errno set on error
+ */
+static int connect_server(void) {
+  struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+  struct addrinfo *addresses;
+  int result = getaddrinfo(host, port, &hints, &addresses);
+  if (result != 0) {
+    fprintf(stderr, "Failed to resolve %s: %s\n", host, gai_strerror(result));
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+
+  struct timeval timeout = {.tv_sec = REMOTE_TIMEOUT};
+  int fd = -1;
+  int connect_errno = 0;
+  for (struct addrinfo *address = addresses; address;
+       address = address->ai_next) {
+    fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC,
+                address->ai_protocol);
+    if (fd == -1) {
+      connect_errno = errno;
+      continue;
+    }
+    /* On Linux, the send timeout applies to connect() as well */
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+      break;
+    }
+    connect_errno = errno;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addresses);
+
+  if (fd == -1) {
+    fprintf(stderr, "Failed to connect to %s: %s\n", authority,
+            strerror(connect_errno));
+    errno = connect_errno;
+    return -1;
+  }
+
+  /* We send each request in one go and wait for its answer */
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  atomic_fetch_add(&connects, 1);
+  return fd;
+}
+
+/**
+ * take_connection - Get a connection to send a request on
+ * @reused: Set to whether the connection has carried a request before
+ *
+ * Idle connections are reused most recently used first, since the server is
+ * least likely to have closed those. If none is idle and REMOTE_CONNECTIONS are
+ * already open, we wait for one to be given back.
+ *
+ * Return: Socket on success, -1 with errno set on error
+ */
+static int take_connection(bool *reused) {
+  pthread_mutex_lock(&pool_lock);
+  if (idle_count == 0 && open_count >= get_config()->remote_connections) {
+    atomic_fetch_add(&connection_waits, 1);
+    while (idle_count == 0 &&
+           open_count >= get_config()->remote_connections) {
+      pthread_cond_wait(&pool_cond, &pool_lock);
+    }
+  }
+
+  if (idle_count > 0) {
+    int fd = idle[--idle_count];
+    pthread_mutex_unlock(&pool_lock);
+    *reused = true;
+    return fd;
+  }
+  open_count++;
+  pthread_mutex_unlock(&pool_lock);
+
+  *reused = false;
+  int fd = connect_server();
+  if (fd == -1) {
+    int connect_errno = errno;
+    pthread_mutex_lock(&pool_lock);
+    open_count--;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+    errno = connect_errno;
+  }
+  return fd;
+}
+
+/**
+ * give_back - Return a connection taken with take_connection()
+ * @fd: The connection
+ * @keep: Whether it can carry another request, otherwise we close it
+ */
+static void give_back(int fd, bool keep) {
+  pthread_mutex_lock(&pool_lock);
+  if (keep && running) {
+    idle[idle_count++] = fd;
+  } else {
+    close(fd);
+    open_count--;
+  }
+  pthread_cond_signal(&pool_cond);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * send_all - Send a whole buffer on a connection
+ * @fd: The connection
+ * @buffer: Data to send
+ * @len: Number of bytes
+ *
+ * Return: 0 on success, -1 with errno set on error
+ */
+static int send_all(int fd, const char *buffer, size_t len) {
+  while (len > 0) {
+    /* A server that closed the connection shouldn't kill us with SIGPIPE */
+    ssize_t sent = send(fd, buffer, len, MSG_NOSIGNAL);
+    if (sent == -1) {
+      return -1;
+    }
+    buffer += sent;
+    len -= sent;
+  }
+  return 0;
+}
+
+/**
+ * parse_headers - Read the status and the headers we need from a response
+ * @headers: The status line and headers, ending in '\0'
+ * @response: Output for the status and keep_alive
+ * @content_length: Set to the Content-Length, or -1 if there is none
+ *
+ * Return: 0 on success, -1 with errno set if the response isn't one we can
+ * read
+ */
+static int parse_headers(const char *headers, struct response *response,
+                         long long *content_length) {
+  int major, minor;
+  if (sscanf(headers, "HTTP/%d.%d %d", &major, &minor, &response->status) !=
+      3) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  /* HTTP/1.1 keeps connections open unless told otherwise, 1.0 the opposite */
+  response->keep_alive = major > 1 || (major == 1 && minor >= 1);
+  *content_length = -1;
+  for (const char *line = strstr(headers, "\r\n"); line;
+       line = strstr(line, "\r\n")) {
+    line += 2;
+    if (strncasecmp(line, "Content-Length:", 15) == 0) {
+      *content_length = strtoll(line + 15, NULL, 10);
+    } else if (strncasecmp(line, "Connection:", 11) == 0) {
+      const char *value = line + 11 + strspn(line + 11, " \t");
+      if (strncasecmp(value, "close", 5) == 0) {
+        response->keep_alive = false;
+      } else if (strncasecmp(value, "keep-alive", 10) == 0) {
+        response->keep_alive = true;
+      }
+    } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+      /* Ranges and files always have a length, so we don't decode chunks */
+      fprintf(stderr, "The remote server sent a chunked response, which we "
+                      "don't support.\n");
+      errno = EPROTO;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * exchange - Send a request on a connection and read the response
+ * @fd: The connection
+ * @request: The request
+ * @max_body: Largest body that we accept
+ * @response: Output for the response
+ *
+ * Return: 0 on success, -1 with errno set on error
+ */
+static int exchange(int fd, const char *request, size_t max_body,
+                    struct response *response) {
+  if (send_all(fd, request, strlen(request)) == -1) {
+    return -1;
+  }
+
+  /* recv() may give us the start of the body along with the headers */
+  char headers[REMOTE_HEADER_MAX + 1];
+  size_t received = 0;
+  char *headers_end = NULL;
+  while (!headers_end) {
+    if (received == REMOTE_HEADER_MAX) {
+      errno = EPROTO;
+      return -1;
+    }
+    ssize_t len = recv(fd, headers + received, REMOTE_HEADER_MAX - received, 0);
+    if (len <= 0) {
+      /* The server closed the connection, most likely because it sat idle */
+      if (len == 0) {
+        errno = ECONNRESET;
+      }
+      return -1;
+    }
+    received += len;
+    headers[received] = '\0';
+    headers_end = strstr(headers, "\r\n\r\n");
+  }
+  *headers_end = '\0';
+  size_t body_start = headers_end + 4 - headers;
+
+  long long content_length;
+  if (parse_headers(headers, response, &content_length) == -1) {
+    return -1;
+  }
+  if (content_length > (long long)max_body) {
+    errno = EFBIG;
+    return -1;
+  }
+
+  /* Without a length, the body ends where the connection does */
+  size_t capacity = content_length >= 0 ? (size_t)content_length : max_body;
+  if (content_length < 0) {
+    response->keep_alive = false;
+  }
+  response->body = malloc(capacity + 1);
+  if (!response->body) {
+    return -1;
+  }
+
+  size_t length = received - body_start;
+  if (length > capacity) {
+    length = capacity;
+  }
+  memcpy(response->body, headers + body_start, length);
+  while (length < capacity) {
+    ssize_t len = recv(fd, response->body + length, capacity - length, 0);
+    if (len == 0 && content_length < 0) {
+      break;
+    }
+    if (len <= 0) {
+      if (len == 0) {
+        errno = ECONNRESET;
+      }
+      free(response->body);
+      return -1;
+    }
+    length += len;
+  }
+
+  response->length = length;
+  atomic_fetch_add(&received_bytes, body_start + length);
+  return 0;
+}
+
+/**
+ * request_path - Build the path that a request for a URL asks for
+ * @url: URL of the index or of a film
+ * @path: Buffer of PATH_MAX bytes for the path
+ *
+ * The part of a film's URL that came from the index is percent-encoded, since
+ * names may contain spaces and other characters that can't go in a request.
+ * The rest was given in REMOTE_URL, which is already a valid URL.
+ *
+ * Return: 0 on success, -1 if the path is too long
+ */
+static int request_path(const char *url, char *path) {
+  static const char *hex = "0123456789ABCDEF";
+  size_t prefix_len = strlen(url) < base_len ? strlen(url) : base_len;
+  size_t len = prefix_len - origin_len;
+  memcpy(path, url + origin_len, len);
+
+  for (const unsigned char *c = (const unsigned char *)url + prefix_len; *c;
+       c++) {
+    if (len + 4 > PATH_MAX) {
+      return -1;
+    }
+    if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') ||
+        (*c >= '0' && *c <= '9') || strchr("-._~/", *c)) {
+      path[len++] = *c;
+    } else {
+      path[len++] = '%';
+      path[len++] = hex[*c >> 4];
+      path[len++] = hex[*c & 0xf];
+    }
+  }
+  path[len] = '\0';
+  return 0;
+}
+
+/**
+ * http_get - Send a GET request to the server
+ * @url: URL to get
+ * @start: Start of the range to get
+ * @length: Length of the range, 0 for the whole resource
+ * @max_body: Largest body that we accept
+ * @response: Output for the response
+ *
+ * Return: 0 on success, -ERRNO on failure
+ */
+static int http_get(const char *url, off_t start, size_t length,
+                    size_t max_body, struct response *response) {
+  char path[PATH_MAX];
+  if (request_path(url, path) == -1) {
+    return -ENAMETOOLONG;
+  }
+
+  char request[PATH_MAX + 512];
+  if (length > 0) {
+    snprintf(request, sizeof(request),
+             "GET %s HTTP/1.1\r\nHost: %s\r\nRange: bytes=%lld-%lld\r\n\r\n",
+             path, authority, (long long)start,
+             (long long)(start + length - 1));
+  } else {
+    snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+             path, authority);
+  }
+
+  /*
+   * Each failed reused connection is closed, so this ends once we have tried a
+   * new one
+   */
+  while (true) {
+    bool reused;
+    int fd = take_connection(&reused);
+    if (fd == -1) {
+      atomic_fetch_add(&request_errors, 1);
+      return -errno;
+    }
+
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    int result = exchange(fd, request, max_body, response);
+    int exchange_errno = errno;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    atomic_fetch_add(&requests, 1);
+    atomic_fetch_add(&request_ns, (end.tv_sec - begin.tv_sec) * 1000000000ULL +
+                                      end.tv_nsec - begin.tv_nsec);
+
+    give_back(fd, result == 0 && response->keep_alive);
+    if (result == 0) {
+      return 0;
+    }
+    if (!reused || exchange_errno == EINTR) {
+      atomic_fetch_add(&request_errors, 1);
+      fprintf(stderr, "Failed to get %s: %s\n", url,
+              strerror(exchange_errno));
+      return -exchange_errno;
+    }
+  }
+}
+
+/**
+ * chunk_path - Build the path of a chunk file
+ * @key: Key of the film
+ * @number: Number of the chunk
+ * @suffix: Appended to the path, for the temporary file we write first
+ * @path: Buffer of PATH_MAX bytes for the path
+ *
+ * Return: 0 on success, -1 if the path is too long
+ */
+static int chunk_path(uint64_t key, unsigned long number, const char *suffix,
+                      char *path) {
+  if (snprintf(path, PATH_MAX, "%s/%016llx.%lu%s", cache_dir,
+               (unsigned long long)key, number, suffix) >= PATH_MAX) {
+    fprintf(stderr, "Chunk path exceeds PATH_MAX.\n");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * find_chunk - Find a chunk in the cache
+ * @key: Key of the film
+ * @number: Number of the chunk
+ *
+ * The cache holds at most REMOTE_CACHE_MB / REMOTE_CHUNK_MB chunks, a few
+ * thousand, and is searched once per chunk that a session moves on to, so a
+ * linear search is fine. Must be called with cache_lock held.
+ *
+ * Return: Index of the chunk in chunks, -1 if it isn't there
+ */
+static int find_chunk(uint64_t key, unsigned long number) {
+  for (unsigned int i = 0; i < chunk_count; i++) {
+    if (chunks[i].key == key && chunks[i].number == number) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * add_chunk - Add a chunk to the cache
+ * @key: Key of the film
+ * @number: Number of the chunk
+ * @bytes: Size of the chunk file, 0 while it is being fetched
+ * @last_used: When the chunk was last read
+ *
+ * Must be called with cache_lock held.
+ *
+ * Return: Index of the chunk in chunks on success, -1 on error
+ */
+static int add_chunk(uint64_t key, unsigned long number, off_t bytes,
+                     unsigned long long last_used) {
+  if (chunk_count == chunk_capacity) {
+    unsigned int new_capacity = chunk_capacity ? chunk_capacity * 2 : 64;
+    struct chunk *new_chunks =
+        realloc(chunks, new_capacity * sizeof(struct chunk));
+    if (!new_chunks) {
+      fprintf(stderr, "Memory allocation failed for chunks: %s",
+              strerror(errno));
+      return -1;
+    }
+    chunks = new_chunks;
+    chunk_capacity = new_capacity;
+  }
+
+  chunks[chunk_count] = (struct chunk){.key = key,
+                                       .number = number,
+                                       .bytes = bytes,
+                                       .last_used = last_used,
+                                       .fetching = bytes == 0};
+  cache_bytes += bytes;
+  return chunk_count++;
+}
+
+/**
+ * remove_chunk - Remove a chunk from the cache, without deleting its file
+ * @i: Index of the chunk in chunks
+ *
+ * Must be called with cache_lock held.
+ */
+static void remove_chunk(unsigned int i) {
+  cache_bytes -= chunks[i].bytes;
+  chunks[i] = chunks[--chunk_count];
+}
+
+/**
+ * evict - Delete the least recently read chunks until the cache fits its cap
+ *
+ * Chunks being fetched have no file yet and are skipped. Sessions that have a
+ * deleted chunk open can still read it until they move on. Must be called with
+ * cache_lock held.
+ */
+static void evict(void) {
+  unsigned long long cap = get_config()->remote_cache_bytes;
+  while (cache_bytes > cap) {
+    int oldest = -1;
+    for (unsigned int i = 0; i < chunk_count; i++) {
+      if (!chunks[i].fetching &&
+          (oldest == -1 || chunks[i].last_used < chunks[oldest].last_used)) {
+        oldest = i;
+      }
+    }
+    if (oldest == -1) {
+      return;
+    }
+
+    char path[PATH_MAX];
+    if (chunk_path(chunks[oldest].key, chunks[oldest].number, "", path) == 0 &&
+        unlink(path) == -1 && errno != ENOENT) {
+      fprintf(stderr, "Failed to delete %s: %s\n", path, strerror(errno));
+    }
+    remove_chunk(oldest);
+    atomic_fetch_add(&chunks_evicted, 1);
+  }
+}
+
+/**
+ * chunk_length - Get the length of a chunk of a film
+ * @file: The remote film
+ * @number: Number of the chunk
+ *
+ * Return: REMOTE_CHUNK_MB in bytes, or less for the last chunk of the film
+ */
+static off_t chunk_length(const struct remote_file *file,
+                          unsigned long number) {
+  off_t chunk_bytes = get_config()->remote_chunk_bytes;
+  off_t start = number * chunk_bytes;
+  return file->size - start < chunk_bytes ? file->size - start : chunk_bytes;
+}
+
+/**
+ * download_chunk - Fetch a chunk from the server into its file
+ * @file: The remote film
+ * @number: Number of the chunk
+ *
+ * We write to a temporary file and rename it into place, so a crash doesn't
+ * leave a partial chunk that a later run would read as a whole one.
+ *
+ * Return: Size of the chunk on success, -ERRNO on failure
+ */
+static off_t download_chunk(const struct remote_file *file,
+                            unsigned long number) {
+  off_t start = number * get_config()->remote_chunk_bytes;
+  size_t length = chunk_length(file, number);
+
+  struct response response;
+  int result = http_get(file->url, start, length, length, &response);
+  if (result < 0) {
+    return result;
+  }
+
+  /* A server may answer a range that covers the whole film with all of it */
+  bool whole = response.status == 200 && start == 0 &&
+               (off_t)length == file->size;
+  if ((response.status != 206 && !whole) || response.length != length) {
+    fprintf(stderr,
+            "Failed to get chunk %lu of %s: the server answered %d with %zu "
+            "bytes instead of 206 with %zu\n",
+            number, file->url, response.status, response.length, length);
+    free(response.body);
+    return -EIO;
+  }
+
+  char path[PATH_MAX];
+  char tmp_path[PATH_MAX];
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%d.tmp", getpid());
+  if (chunk_path(file->key, number, "", path) == -1 ||
+      chunk_path(file->key, number, suffix, tmp_path) == -1) {
+    free(response.body);
+    return -ENAMETOOLONG;
+  }
+
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    int open_errno = errno;
+    fprintf(stderr, "Failed to open %s: %s\n", tmp_path, strerror(errno));
+    free(response.body);
+    return -open_errno;
+  }
+
+  size_t written = 0;
+  while (written < length) {
+    ssize_t len = write(fd, response.body + written, length - written);
+    if (len == -1) {
+      break;
+    }
+    written += len;
+  }
+  int write_errno = errno;
+  free(response.body);
+  if (close(fd) == -1 || written < length || rename(tmp_path, path) == -1) {
+    if (written == length) {
+      write_errno = errno;
+    }
+    fprintf(stderr, "Failed to write %s: %s\n", path, strerror(write_errno));
+    unlink(tmp_path);
+    return -write_errno;
+  }
+  return length;
+}
+
+/**
+ * fetch_chunk - Make sure that a chunk is in the cache
+ * @file: The remote film
+ * @number: Number of the chunk
+ * @prefetch: Whether the lookahead is asking, rather than a read
+ *
+ * If someone else is already fetching the chunk, we wait for them instead of
+ * fetching it twice, and try ourselves if they failed.
+ *
+ * Return: 0 on success, -ERRNO on failure
+ */
+static int fetch_chunk(struct remote_file *file, unsigned long number,
+                       bool prefetch) {
+  pthread_mutex_lock(&cache_lock);
+  int i;
+  while ((i = find_chunk(file->key, number)) != -1 && chunks[i].fetching) {
+    pthread_cond_wait(&cache_cond, &cache_lock);
+  }
+
+  /* A chunk file of the wrong length would serve bytes from another offset */
+  if (i != -1 && chunks[i].bytes != chunk_length(file, number)) {
+    char path[PATH_MAX];
+    if (chunk_path(file->key, number, "", path) == 0 && unlink(path) == -1 &&
+        errno != ENOENT) {
+      fprintf(stderr, "Failed to delete %s: %s\n", path, strerror(errno));
+    }
+    remove_chunk(i);
+    i = -1;
+  }
+  if (i != -1) {
+    chunks[i].last_used = now_ns();
+    pthread_mutex_unlock(&cache_lock);
+    if (!prefetch) {
+      atomic_fetch_add(&chunk_hits, 1);
+    }
+    return 0;
+  }
+  if (add_chunk(file->key, number, 0, now_ns()) == -1) {
+    pthread_mutex_unlock(&cache_lock);
+    return -ENOMEM;
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  atomic_fetch_add(prefetch ? &chunks_prefetched : &chunk_misses, 1);
+  off_t bytes = download_chunk(file, number);
+
+  pthread_mutex_lock(&cache_lock);
+  i = find_chunk(file->key, number);
+  if (bytes < 0) {
+    remove_chunk(i);
+  } else {
+    chunks[i].fetching = false;
+    chunks[i].bytes = bytes;
+    chunks[i].last_used = now_ns();
+    cache_bytes += bytes;
+    evict();
+  }
+  pthread_cond_broadcast(&cache_cond);
+  pthread_mutex_unlock(&cache_lock);
+  return bytes < 0 ? bytes : 0;
+}
+
+/**
+ * forget_chunk - Drop a chunk whose file has gone missing from the cache
+ * @key: Key of the film
+ * @number: Number of the chunk
+ */
+static void forget_chunk(uint64_t key, unsigned long number) {
+  pthread_mutex_lock(&cache_lock);
+  int i = find_chunk(key, number);
+  if (i != -1 && !chunks[i].fetching) {
+    remove_chunk(i);
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * open_chunk - Open the file of the chunk that a read continues in
+ * @file: The remote film, with its lock held
+ * @number: Number of the chunk
+ *
+ * The chunk may be evicted between fetching and opening it, or deleted by
+ * someone else, so we fetch it once more if its file is missing. Opening a
+ * chunk counts as using it, and we touch its file so that the next run loads
+ * it with the same age.
+ *
+ * Return: 0 on success, -ERRNO on failure
+ */
+static int open_chunk(struct remote_file *file, unsigned long number) {
+  if (file->fd != -1 && file->chunk == number) {
+    return 0;
+  }
+  if (file->fd != -1) {
+    close(file->fd);
+    file->fd = -1;
+  }
+
+  char path[PATH_MAX];
+  if (chunk_path(file->key, number, "", path) == -1) {
+    return -ENAMETOOLONG;
+  }
+  for (int attempt = 0; attempt < 2; attempt++) {
+    int result = fetch_chunk(file, number, false);
+    if (result < 0) {
+      return result;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+      futimens(fd, NULL);
+      file->fd = fd;
+      file->chunk = number;
+      return 0;
+    }
+    if (errno != ENOENT) {
+      int open_errno = errno;
+      fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+      return -open_errno;
+    }
+    forget_chunk(file->key, number);
+  }
+  return -EIO;
+}
+
+/**
+ * remote_open - Start reading a remote film
+ * @index: Index of the film in video_files
+ *
+ * Return: The remote file on success, NULL with errno set on error
+ */
+struct remote_file *remote_open(unsigned int index) {
+  if (!running) {
+    errno = EIO;
+    return NULL;
+  }
+
+  struct remote_file *file = malloc(sizeof(struct remote_file));
+  if (!file) {
+    fprintf(stderr, "Memory allocation failed for remote file: %s",
+            strerror(errno));
+    return NULL;
+  }
+  file->url = video_path(index);
+  file->size = video_remote_size(index);
+  file->key = hash_key(file->url, file->size);
+  file->chunk = 0;
+  file->fd = -1;
+  pthread_mutex_init(&file->lock, NULL);
+  return file;
+}
+
+/**
+ * remote_close - End reading a remote film
+ * @file: The remote file
+ */
+void remote_close(struct remote_file *file) {
+  if (file->fd != -1) {
+    close(file->fd);
+  }
+  pthread_mutex_destroy(&file->lock);
+  free(file);
+}
+
+/**
+ * remote_read - Read from a remote film
+ * @file: The remote file
+ * @buffer: Buffer to fill with film data
+ * @size: Number of bytes requested
+ * @offset: Position in the film to read from
+ *
+ * A read that crosses into the next chunk is copied from both. We hold the
+ * file's lock throughout, since reads of one session at once almost always
+ * want the same chunk anyway.
+ *
+ * Return: Number of bytes read on success, -ERRNO on failure
+ */
+ssize_t remote_read(struct remote_file *file, char *buffer, size_t size,
+                    off_t offset) {
+  if (offset >= file->size) {
+    return 0;
+  }
+  if ((off_t)size > file->size - offset) {
+    size = file->size - offset;
+  }
+
+  off_t chunk_bytes = get_config()->remote_chunk_bytes;
+  size_t done = 0;
+  pthread_mutex_lock(&file->lock);
+  while (done < size) {
+    off_t position = offset + done;
+    unsigned long number = position / chunk_bytes;
+    int result = open_chunk(file, number);
+    if (result < 0) {
+      pthread_mutex_unlock(&file->lock);
+      return result;
+    }
+
+    off_t in_chunk = position - (off_t)number * chunk_bytes;
+    size_t len = size - done;
+    if ((off_t)len > chunk_bytes - in_chunk) {
+      len = chunk_bytes - in_chunk;
+    }
+    ssize_t copied = pread(file->fd, buffer + done, len, in_chunk);
+    if (copied <= 0) {
+      /* A chunk file shorter than its chunk is damaged, so we fetch it again */
+      int read_errno = copied == -1 ? errno : EIO;
+      close(file->fd);
+      file->fd = -1;
+      forget_chunk(file->key, number);
+      pthread_mutex_unlock(&file->lock);
+      return -read_errno;
+    }
+    done += copied;
+  }
+  pthread_mutex_unlock(&file->lock);
+  return done;
+}
+
+/**
+ * remote_prefetch - Fetch the chunks that cover a range into the cache
+ * @file: The remote file
+ * @offset: Start of the range
+ * @len: Length of the range
+ */
+void remote_prefetch(struct remote_file *file, off_t offset, off_t len) {
+  off_t chunk_bytes = get_config()->remote_chunk_bytes;
+  off_t end = offset + len < file->size ? offset + len : file->size;
+  for (off_t position = offset - offset % chunk_bytes; position < end;
+       position += chunk_bytes) {
+    if (executor_stopping() ||
+        fetch_chunk(file, position / chunk_bytes, true) < 0) {
+      return;
+    }
+  }
+}
+
+/**
+ * refresh - Fetch the index and replace the remote films with its listing
+ *
+ * Lines that aren't a size followed by a path to a video file are skipped.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int refresh(void) {
+  const char *url = get_config()->remote_url;
+  atomic_fetch_add(&refreshes, 1);
+
+  struct response response;
+  if (http_get(url, 0, 0, REMOTE_INDEX_MAX, &response) < 0) {
+    atomic_fetch_add(&refresh_errors, 1);
+    return -1;
+  }
+  if (response.status != 200) {
+    fprintf(stderr, "Failed to get %s: the server answered %d\n", url,
+            response.status);
+    free(response.body);
+    atomic_fetch_add(&refresh_errors, 1);
+    return -1;
+  }
+  response.body[response.length] = '\0';
+
+  /* Every line is at least a digit, a space, a name and a newline */
+  struct remote_film *films =
+      malloc((response.length / 4 + 1) * sizeof(struct remote_film));
+  if (!films) {
+    fprintf(stderr, "Memory allocation failed for remote films: %s",
+            strerror(errno));
+    free(response.body);
+    return -1;
+  }
+
+  unsigned int count = 0;
+  char *save;
+  for (char *line = strtok_r(response.body, "\r\n", &save); line;
+       line = strtok_r(NULL, "\r\n", &save)) {
+    char *name;
+    long long size = strtoll(line, &name, 10);
+    if (name == line || *name != ' ' || size < 0) {
+      continue;
+    }
+    name += strspn(name, " ");
+    if (*name == '/' || !has_video_extension(name) ||
+        base_len + strlen(name) >= PATH_MAX) {
+      continue;
+    }
+
+    films[count].url = malloc(base_len + strlen(name) + 1);
+    if (!films[count].url) {
+      continue;
+    }
+    memcpy(films[count].url, url, base_len);
+    strcpy(films[count].url + base_len, name);
+    films[count].size = size;
+    count++;
+  }
+  free(response.body);
+
+  int changes = video_set_remote(films, count);
+  for (unsigned int i = 0; i < count; i++) {
+    free(films[i].url);
+  }
+  free(films);
+  if (changes == -1) {
+    atomic_fetch_add(&refresh_errors, 1);
+    return -1;
+  }
+
+  atomic_store(&listed_films, count);
+  if (get_config()->debug) {
+    printf("The remote index lists %u films, %d changed.\n", count, changes);
+  }
+  return 0;
+}
+
+/**
+ * refresh_run - Body of the periodic refresh task
+ * @arg: Unused
+ *
+ * Like rescans, the task schedules the next refresh itself when it finishes.
+ */
+static void refresh_run(void *arg) {
+  (void)arg;
+  refresh();
+  executor_schedule(TASK_RESCAN, refresh_run, NULL, NULL,
+                    get_config()->rescan_seconds);
+}
+
+/**
+ * load_cache - Set up the cache directory and load the chunks already in it
+ *
+ * Temporary files are left over from fetches that a crash cut short, so we
+ * delete them.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int load_cache(void) {
+  struct config_ctx *config = get_config();
+  const char *dir = config->remote_cache_dir;
+  int len;
+  if (dir && strncmp(dir, "~/", 2) == 0) {
+    len = snprintf(cache_dir, PATH_MAX, "%s%s", config->home, dir + 1);
+  } else if (dir) {
+    len = snprintf(cache_dir, PATH_MAX, "%s", dir);
+  } else {
+    len = snprintf(cache_dir, PATH_MAX, "%s%s", config->home,
+                   REMOTE_CACHE_DIR_DEFAULT);
+  }
+  if (len >= PATH_MAX - 64) {
+    fprintf(stderr, "Remote cache path exceeds PATH_MAX.\n");
+    return -1;
+  }
+  while (len > 1 && cache_dir[len - 1] == '/') {
+    cache_dir[--len] = '\0';
+  }
+
+  /* The default directory is in ~/.filmfs, which may not exist yet */
+  if (!dir) {
+    char *last_slash = strrchr(cache_dir, '/');
+    *last_slash = '\0';
+    mkdir(cache_dir, 0700);
+    *last_slash = '/';
+  }
+  if (mkdir(cache_dir, 0700) == -1 && errno != EEXIST) {
+    fprintf(stderr, "Failed to make %s: %s\n", cache_dir, strerror(errno));
+    return -1;
+  }
+
+  DIR *cache = opendir(cache_dir);
+  if (!cache) {
+    fprintf(stderr, "Failed to open directory %s: %s\n", cache_dir,
+            strerror(errno));
+    return -1;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  struct dirent *entry;
+  while ((entry = readdir(cache))) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+
+    struct stat chunk_stat;
+    if (fstatat(dirfd(cache), entry->d_name, &chunk_stat, 0) == -1 ||
+        !S_ISREG(chunk_stat.st_mode)) {
+      continue;
+    }
+    unsigned long long key;
+    unsigned long number;
+    int end = 0;
+    size_t name_len = strlen(entry->d_name);
+    if (sscanf(entry->d_name, "%16llx.%lu%n", &key, &number, &end) != 2 ||
+        (size_t)end != name_len || chunk_stat.st_size == 0) {
+      if (name_len > 4 && strcmp(entry->d_name + name_len - 4, ".tmp") == 0) {
+        unlinkat(dirfd(cache), entry->d_name, 0);
+      }
+      continue;
+    }
+
+    /**
+     * No chunk is longer than REMOTE_CHUNK_MB. The exact length of each also
+     * depends on the size of its film, which is checked when it is read.
+     */
+    if ((unsigned long long)chunk_stat.st_size > config->remote_chunk_bytes) {
+      unlinkat(dirfd(cache), entry->d_name, 0);
+      continue;
+    }
+
+    unsigned long long last_used =
+        chunk_stat.st_mtim.tv_sec * 1000000000ULL + chunk_stat.st_mtim.tv_nsec;
+    if (add_chunk(key, number, chunk_stat.st_size, last_used) == -1) {
+      break;
+    }
+  }
+
+  /* REMOTE_CACHE_MB may have been lowered since the last run */
+  evict();
+  pthread_mutex_unlock(&cache_lock);
+  closedir(cache);
+
+  if (config->debug) {
+    printf("Loaded %u cached chunks of remote films, %llu bytes.\n",
+           chunk_count, cache_bytes);
+  }
+  return 0;
+}
+
+/**
+ * remote_start - Set up the chunk cache and list the remote films
+ *
+ * A server that can't be reached doesn't stop us from mounting, we only list
+ * its films once a refresh gets through.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int remote_start(void) {
+  if (running || !get_config()->remote_url) {
+    return 0;
+  }
+  if (parse_url() == -1 || load_cache() == -1 ||
+      metrics_register(write_metrics) == -1) {
+    return -1;
+  }
+  running = true;
+
+  refresh();
+  unsigned int rescan_seconds = get_config()->rescan_seconds;
+  if (rescan_seconds > 0 &&
+      executor_schedule(TASK_RESCAN, refresh_run, NULL, NULL,
+                        rescan_seconds) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * remote_stop - Close the idle connections and forget the cached chunks
+ *
+ * The executor has stopped by now, so nothing is fetching. The chunk files
+ * stay on disk for the next run.
+ */
+void remote_stop(void) {
+  if (!running) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  running = false;
+  while (idle_count > 0) {
+    close(idle[--idle_count]);
+    open_count--;
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  pthread_mutex_lock(&cache_lock);
+  free(chunks);
+  chunks = NULL;
+  chunk_count = 0;
+  chunk_capacity = 0;
+  cache_bytes = 0;
+  pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,460 @@
+/**
+ * residency.c
+ *
+ * Page cache residency of the films being played.
+ *
+ * OVERVIEW:
+ * When a film stutters, the first question is whether its data was in the page
+ * cache or had to come off the disk. Every RESIDENCY_INTERVAL seconds a
+ * background task looks at the backing file of every film that is open, or
+ * that was open in the last RESIDENCY_KEEP_SECONDS, and records:
+ * - how many bytes of it are cached
+ * - how many of its pages are dirty, under writeback, evicted or recently
+ *   evicted, where the kernel can tell us
+ * - a map of how much of each of RESIDENCY_CLUSTERS equal parts is cached
+ *
+ * The counts go to the metrics file, and the maps to /.filmfs/residency, where
+ * a film with its opening resident and a lookahead buffer ahead of the player
+ * looks like "##3...........##6................................2.........#".
+ *
+ * CACHESTAT:
+ * The cachestat() system call (Linux 6.5) counts the cached pages of a range of
+ * a file without mapping it, and also knows about dirty and evicted pages. On
+ * older kernels it fails with ENOSYS, and we fall back to mapping the file a
+ * window at a time and asking mincore() which pages are cached. Mapping a file
+ * doesn't read it, so sampling never pulls data into the cache itself.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "executor.h"
+#include "metrics.h"
+#include "residency.h"
+#include "session.h"
+#include "video.h"
+
+/* cachestat() is newer than most C libraries, so we call it ourselves */
+#ifndef __NR_cachestat
+#define __NR_cachestat 451
+#endif
+
+/* The range argument and result of cachestat(), see linux/mman.h */
+struct page_cache_range {
+  uint64_t off;
+  uint64_t len;
+};
+
+struct page_cache_stat {
+  uint64_t nr_cache;
+  uint64_t nr_dirty;
+  uint64_t nr_writeback;
+  uint64_t nr_evicted;
+  uint64_t nr_recently_evicted;
+};
+
+/**
+ * The last sample of one film:
+ * content_id - content ID of the film
+ * last_active - when we last saw a session of the film, in monotonic seconds
+ * sampled - whether the fields below have been filled in yet
+ * size - size of the backing file
+ * stat - page counts of the whole file, only nr_cache is set by mincore()
+ * clusters - percentage of each part of the file that is cached
+ */
+struct film_residency {
+  unsigned int content_id;
+  time_t last_active;
+  bool sampled;
+  off_t size;
+  struct page_cache_stat stat;
+  uint8_t clusters[RESIDENCY_CLUSTERS];
+};
+
+/* The films we are sampling, protected by films_lock */
+static struct film_residency films[RESIDENCY_FILMS_MAX];
+static unsigned int film_count = 0;
+static pthread_mutex_t films_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Cleared the first time cachestat() turns out not to exist */
+static atomic_bool use_cachestat = true;
+
+/* Counters for the metrics file */
+static atomic_ullong samples = 0;
+
+/**
+ * monotonic_seconds - Get the current monotonic time in whole seconds
+ *
+ * Return: Seconds since an arbitrary point
+ */
+static time_t monotonic_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+/**
+ * note_active - Record that a film has an open session
+ * @session: An open session
+ * @arg: The current monotonic time
+ *
+ * Called with the session list locked, and films_lock held by our caller.
+ */
+static void note_active(struct session *session, void *arg) {
+  time_t now = *(time_t *)arg;
+
+  unsigned int oldest = 0;
+  for (unsigned int i = 0; i < film_count; i++) {
+    if (films[i].content_id == session->content_id) {
+      films[i].last_active = now;
+      return;
+    }
+    if (films[i].last_active < films[oldest].last_active) {
+      oldest = i;
+    }
+  }
+
+  /* A new film takes a free entry, or that of the least recently played one */
+  unsigned int i = film_count < RESIDENCY_FILMS_MAX ? film_count++ : oldest;
+  memset(&films[i], 0, sizeof(struct film_residency));
+  films[i].content_id = session->content_id;
+  films[i].last_active = now;
+}
+
+/**
+ * cluster_bounds - Get the byte range of one part of a file
+ * @size: Size of the file
+ * @cluster: Number of the part
+ * @start: Output for the start of the part
+ * @end: Output for the end of the part
+ */
+static void cluster_bounds(off_t size, unsigned int cluster, off_t *start,
+                           off_t *end) {
+  *start = size * cluster / RESIDENCY_CLUSTERS;
+  *end = size * (cluster + 1) / RESIDENCY_CLUSTERS;
+}
+
+/**
+ * percent_of - Get a count as a whole percentage, rounding partial ones away
+ * from 0 and 100 so that the map only shows those for empty and full parts
+ * @part: The count
+ * @whole: What it is out of
+ *
+ * Return: Percentage from 0 to 100
+ */
+static uint8_t percent_of(uint64_t part, uint64_t whole) {
+  if (whole == 0 || part == 0) {
+    return 0;
+  }
+  if (part >= whole) {
+    return 100;
+  }
+  uint64_t percent = part * 100 / whole;
+  return percent == 0 ? 1 : (percent == 100 ? 99 : percent);
+}
+
+/**
+ * sample_cachestat - Sample a file with cachestat()
+ * @fd: File descriptor of the backing file
+ * @film: Film with size set, to fill in
+ *
+ * A length of 0 means the rest of the file.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int sample_cachestat(int fd, struct film_residency *film) {
+  long page_size = sysconf(_SC_PAGESIZE);
+
+  struct page_cache_range range = {0, 0};
+  if (syscall(__NR_cachestat, fd, &range, &film->stat, 0) == -1) {
+    return -1;
+  }
+
+  for (unsigned int c = 0; c < RESIDENCY_CLUSTERS; c++) {
+    off_t start, end;
+    cluster_bounds(film->size, c, &start, &end);
+
+    /* cachestat() counts whole pages, so we round the part out to pages */
+    start -= start % page_size;
+    range.off = start;
+    range.len = end - start;
+
+    struct page_cache_stat stat;
+    if (range.len == 0 ||
+        syscall(__NR_cachestat, fd, &range, &stat, 0) == -1) {
+      film->clusters[c] = 0;
+      continue;
+    }
+    film->clusters[c] =
+        percent_of(stat.nr_cache, (range.len + page_size - 1) / page_size);
+  }
+  return 0;
+}
+
+/**
+ * sample_mincore - Sample a file with mincore()
+ * @fd: File descriptor of the backing file
+ * @film: Film with size set, to fill in
+ *
+ * The lowest bit of each byte that mincore() fills in says whether that page
+ * is in memory.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int sample_mincore(int fd, struct film_residency *film) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  uint64_t pages = (film->size + page_size - 1) / page_size;
+  uint64_t window_pages = RESIDENCY_WINDOW / page_size;
+
+  unsigned char *vec = malloc(window_pages);
+  if (!vec) {
+    fprintf(stderr, "Memory allocation failed for residency sample: %s",
+            strerror(errno));
+    return -1;
+  }
+
+  uint64_t cached[RESIDENCY_CLUSTERS] = {0};
+  uint64_t total[RESIDENCY_CLUSTERS] = {0};
+  memset(&film->stat, 0, sizeof(struct page_cache_stat));
+
+  for (uint64_t first = 0; first < pages; first += window_pages) {
+    uint64_t count = pages - first;
+    if (count > window_pages) {
+      count = window_pages;
+    }
+
+    off_t offset = first * page_size;
+    size_t len = film->size - offset < (off_t)(count * page_size)
+                     ? (size_t)(film->size - offset)
+                     : count * page_size;
+    void *addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, offset);
+    if (addr == MAP_FAILED) {
+      free(vec);
+      return -1;
+    }
+    int result = mincore(addr, len, vec);
+    munmap(addr, len);
+    if (result == -1) {
+      free(vec);
+      return -1;
+    }
+
+    for (uint64_t p = 0; p < count; p++) {
+      unsigned int c = (first + p) * RESIDENCY_CLUSTERS / pages;
+      total[c]++;
+      if (vec[p] & 1) {
+        cached[c]++;
+        film->stat.nr_cache++;
+      }
+    }
+  }
+  free(vec);
+
+  for (unsigned int c = 0; c < RESIDENCY_CLUSTERS; c++) {
+    film->clusters[c] = percent_of(cached[c], total[c]);
+  }
+  return 0;
+}
+
+/**
+ * sample_film - Sample the page cache residency of a film
+ * @film: Film with content_id set, to fill in
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int sample_film(struct film_residency *film) {
+  const char *path = video_path(film->content_id);
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1 || file_stat.st_size == 0) {
+    close(fd);
+    return -1;
+  }
+  film->size = file_stat.st_size;
+
+  int result = -1;
+  if (atomic_load(&use_cachestat)) {
+    result = sample_cachestat(fd, film);
+    if (result == -1 && errno == ENOSYS) {
+      atomic_store(&use_cachestat, false);
+    }
+  }
+  if (result == -1 && !atomic_load(&use_cachestat)) {
+    result = sample_mincore(fd, film);
+  }
+
+  close(fd);
+  return result;
+}
+
+/**
+ * sample_run - Body of the periodic sampling task
+ * @arg: Unused
+ *
+ * We sample copies of the entries without holding films_lock, so that
+ * the metrics never wait on the system calls.
+ */
+static void sample_run(void *arg) {
+  (void)arg;
+
+  time_t now = monotonic_seconds();
+  struct film_residency sampling[RESIDENCY_FILMS_MAX];
+
+  pthread_mutex_lock(&films_lock);
+  session_foreach(note_active, &now);
+
+  /* We forget films that haven't been played for a while */
+  unsigned int kept = 0;
+  for (unsigned int i = 0; i < film_count; i++) {
+    if (now - films[i].last_active <= RESIDENCY_KEEP_SECONDS) {
+      films[kept++] = films[i];
+    }
+  }
+  film_count = kept;
+  unsigned int count = film_count;
+  memcpy(sampling, films, count * sizeof(struct film_residency));
+  pthread_mutex_unlock(&films_lock);
+
+  for (unsigned int i = 0; i < count && !executor_stopping(); i++) {
+    sampling[i].sampled = sample_film(&sampling[i]) == 0;
+    atomic_fetch_add(&samples, 1);
+  }
+
+  /* Films may have been added or dropped meanwhile, so we match by content */
+  pthread_mutex_lock(&films_lock);
+  for (unsigned int i = 0; i < count; i++) {
+    for (unsigned int j = 0; j < film_count; j++) {
+      if (films[j].content_id == sampling[i].content_id &&
+          sampling[i].sampled) {
+        sampling[i].last_active = films[j].last_active;
+        films[j] = sampling[i];
+      }
+    }
+  }
+  pthread_mutex_unlock(&films_lock);
+
+  executor_schedule(TASK_RESIDENCY, sample_run, NULL, NULL,
+                    RESIDENCY_INTERVAL);
+}
+
+/**
+ * write_film_metric - Write one metric of a film
+ * @out: Stream to write to
+ * @metric: Name of the metric
+ * @film: Film the metric belongs to
+ * @value: Value of the metric
+ */
+static void write_film_metric(FILE *out, const char *metric,
+                              const struct film_residency *film,
+                              unsigned long long value) {
+  fprintf(out, "%s{film=", metric);
+  metrics_write_label(out, video_name(film->content_id));
+  fprintf(out, "} %llu\n", value);
+}
+
+/**
+ * write_metrics - Write the page cache section of the metrics file
+ * @out: Stream to write to
+ *
+ * mincore() can't tell dirty or evicted pages apart, so we leave those metrics
+ * out when we are using it.
+ */
+static void write_metrics(FILE *out) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  bool detailed = atomic_load(&use_cachestat);
+
+  fprintf(out, "filmfs_residency_cachestat %d\n", detailed);
+  fprintf(out, "filmfs_residency_samples_total %llu\n",
+          atomic_load(&samples));
+
+  pthread_mutex_lock(&films_lock);
+  for (unsigned int i = 0; i < film_count; i++) {
+    const struct film_residency *film = &films[i];
+    if (!film->sampled) {
+      continue;
+    }
+
+    write_film_metric(out, "filmfs_film_size_bytes", film, film->size);
+    write_film_metric(out, "filmfs_film_cached_bytes", film,
+                      film->stat.nr_cache * page_size);
+    if (detailed) {
+      write_film_metric(out, "filmfs_film_dirty_pages", film,
+                        film->stat.nr_dirty);
+      write_film_metric(out, "filmfs_film_writeback_pages", film,
+                        film->stat.nr_writeback);
+      write_film_metric(out, "filmfs_film_evicted_pages", film,
+                        film->stat.nr_evicted);
+      write_film_metric(out, "filmfs_film_recently_evicted_pages", film,
+                        film->stat.nr_recently_evicted);
+    }
+  }
+  pthread_mutex_unlock(&films_lock);
+}
+
+/**
+ * write_map - Write the residency map file
+ * @out: Stream to write to
+ *
+ * Each line is the map of one film, its cached percentage and its name. In the
+ * map, every character is one part of the film: '.' if none of it is cached,
+ * '#' if all of it is, and a digit from 1 to 9 for the tenths in between.
+ */
+static void write_map(FILE *out) {
+  long page_size = sysconf(_SC_PAGESIZE);
+
+  pthread_mutex_lock(&films_lock);
+  for (unsigned int i = 0; i < film_count; i++) {
+    const struct film_residency *film = &films[i];
+    if (!film->sampled) {
+      continue;
+    }
+
+    char map[RESIDENCY_CLUSTERS + 1];
+    for (unsigned int c = 0; c < RESIDENCY_CLUSTERS; c++) {
+      uint8_t percent = film->clusters[c];
+      if (percent == 0) {
+        map[c] = '.';
+      } else if (percent == 100) {
+        map[c] = '#';
+      } else {
+        map[c] = '1' + (percent - 1) * 9 / 99;
+      }
+    }
+    map[RESIDENCY_CLUSTERS] = '\0';
+
+    fprintf(out, "%s %3u%% %s\n", map,
+            percent_of(film->stat.nr_cache * page_size, film->size),
+            video_name(film->content_id));
+  }
+  pthread_mutex_unlock(&films_lock);
+}
+
+/**
+ * residency_start - Register the page cache metrics and start sampling
+ *
+ * Return: 0 on success, -1 on error
+ */
+int residency_start(void) {
+  if (metrics_register(write_metrics) == -1 ||
+      metrics_add_file("residency", write_map) == -1) {
+    return -1;
+  }
+  return executor_schedule(TASK_RESIDENCY, sample_run, NULL, NULL,
+                           RESIDENCY_INTERVAL);
+}
@@ -0,0 +1,914 @@
+/**
+ * resident.c
+ *
+ * Keeping the openings of the most watched films in memory.
+ *
+ * OVERVIEW:
+ * When a film is started, the player reads the container header at the start
+ * of the file, often the index at the end of the file, and then the first few
+ * seconds of video. On a hard drive each of those waits for the disk to spin
+ * up and seek, even for films that the FILMS table says we watch every week.
+ *
+ * The resident set holds those parts of the top RESIDENT_FILMS films, ranked
+ * by watch count and then by how recently they were watched, in memory:
+ * - the first RESIDENT_SECONDS of playback, converted to bytes using the rate
+ *   the film was last played at (or RESIDENT_DEFAULT_RATE if we don't know it)
+ * - the last RESIDENT_TAIL_SIZE bytes of the file
+ *
+ * The memory is locked with mlock() where the RLIMIT_MEMLOCK limit allows, so
+ * that the kernel can't swap it out. Each region is mapped with its own
+ * anonymous mmap() of whole pages, so locking it never locks the heap around
+ * it and unmapping it gives the pages back. The whole set is kept within
+ * RESIDENT_MAX_MB, or within the quota the broker grants us if MEMORY_BUDGET_MB
+ * is set.
+ *
+ * WHEN IT IS BUILT:
+ * A background task builds the set when the filesystem is mounted and again
+ * whenever resident_refresh() is called after the watch history changes. Films
+ * that stay in the set keep their memory rather than being read again. The
+ * executor never runs two resident tasks at once, so rebuilds never overlap.
+ *
+ * WARM CACHE:
+ * A set that took minutes of disk reads to build would otherwise be lost on
+ * every remount, and the first plays after it would wait on the disk again.
+ * Whenever a rebuild changes the set, we save it to RESIDENT_CACHE_DIR, which
+ * is best placed on a local SSD:
+ * - RESIDENT_CACHE_DATA holds the head and tail of every film back to back
+ * - RESIDENT_CACHE_MANIFEST says where each film's data starts, along with its
+ *   name, the size and modification time of its backing file, its playback
+ *   rate and a checksum of its data
+ *
+ * The first task after mounting loads the saved set before it builds a new
+ * one, so the filesystem is answering reads while that happens and hits resume
+ * as soon as the data has been read back from the SSD. A film is only loaded
+ * if its backing file still has the size and modification time it was saved
+ * with and its data matches the checksum, so a film that changed, or a data
+ * file left half written by a crash, is read from the library instead. The
+ * saved playback rates are restored too, which makes the rebuild that follows
+ * choose the same openings and keep the loaded memory.
+ *
+ * STALE FILMS:
+ * A backing file can be replaced or rewritten while its film is resident.
+ * Sessions compare the size and modification time of the file they open with
+ * the resident film, as mapcache.c does for its mappings, through
+ * resident_check(). A film that no longer matches is marked stale, which stops
+ * reads from being served from it at once, and a rebuild is queued that reads
+ * it again. watch.c also queues a rebuild whenever the library changes.
+ *
+ * CONCURRENCY:
+ * Readers take a read lock on the set while copying from it. A rebuild builds
+ * a complete new set first, and only holds the write lock to swap it in. The
+ * published set is never changed: films that the new set takes over are only
+ * marked as such, and left alone when the old set is freed after the swap.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "broker.h"
+#include "config.h"
+#include "database.h"
+#include "executor.h"
+#include "metrics.h"
+#include "resident.h"
+#include "video.h"
+
+/**
+ * The resident parts of one film:
+ * content_id - content ID of the film
+ * size - size of the backing file when it was read
+ * mtime - modification time of the backing file when it was read
+ * head - the first head_len bytes of the film
+ * tail - the last tail_len bytes of the film, starting at tail_offset
+ * locked - whether mlock() succeeded for head and tail
+ * stale - set once a session saw the backing file with another size or
+ *         modification time, after which the film is no longer read from
+ */
+struct resident_film {
+  unsigned int content_id;
+  off_t size;
+  struct timespec mtime;
+  char *head;
+  size_t head_len;
+  char *tail;
+  off_t tail_offset;
+  size_t tail_len;
+  bool locked;
+  atomic_bool stale;
+};
+
+/**
+ * A complete resident set:
+ * films - the resident films, most watched first
+ * count - the number of resident films
+ * bytes - the memory used by all resident films
+ */
+struct resident_set {
+  struct resident_film *films;
+  unsigned int count;
+  uint64_t bytes;
+};
+
+/* The set that reads are currently served from, protected by set_lock */
+static struct resident_set *current = NULL;
+static pthread_rwlock_t set_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Whether a rebuild task is queued but hasn't started yet */
+static bool rebuild_queued = false;
+static pthread_mutex_t refresh_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Whether the saved set has been loaded, only used by the resident task */
+static bool cache_loaded = false;
+
+/* Counters for the metrics file */
+static atomic_ullong hits = 0;
+static atomic_ullong hit_bytes = 0;
+static atomic_uint warm_films = 0;
+static _Atomic uint64_t warm_bytes = 0;
+static atomic_uint warm_rejected = 0;
+static atomic_ullong cache_saves = 0;
+
+/**
+ * region_size - Get the size of the mapping that holds a region
+ * @len: Length of the region
+ *
+ * Return: len rounded up to whole pages, at least one page
+ */
+static size_t region_size(size_t len) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  return len ? (len + page - 1) / page * page : page;
+}
+
+/**
+ * free_region - Unmap the memory of a region
+ * @buffer: Buffer returned by read_region(), may be NULL
+ * @len: Length of the region
+ *
+ * Unmapping also unlocks the pages if they were locked.
+ */
+static void free_region(char *buffer, size_t len) {
+  if (buffer) {
+    munmap(buffer, region_size(len));
+  }
+}
+
+/**
+ * free_film - Unmap the memory of a resident film
+ * @film: Film to free
+ */
+static void free_film(struct resident_film *film) {
+  free_region(film->head, film->head_len);
+  free_region(film->tail, film->tail_len);
+  film->head = NULL;
+  film->tail = NULL;
+}
+
+/**
+ * free_set - Free a resident set and all of its films
+ * @set: Set to free, may be NULL
+ * @taken: For each film of the set, whether a newer set took over its memory,
+ *         NULL if none did
+ */
+static void free_set(struct resident_set *set, const bool *taken) {
+  if (!set) {
+    return;
+  }
+  for (unsigned int i = 0; i < set->count; i++) {
+    if (!taken || !taken[i]) {
+      free_film(&set->films[i]);
+    }
+  }
+  free(set->films);
+  free(set);
+}
+
+/**
+ * read_region - Read part of a file into a new buffer
+ * @fd: File descriptor of the backing file
+ * @offset: Start of the region
+ * @len: Length of the region
+ *
+ * Return: Buffer of region_size(len) bytes on success, to be freed with
+ * free_region(), NULL on error
+ */
+static char *read_region(int fd, off_t offset, size_t len) {
+  char *buffer = mmap(NULL, region_size(len), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer == MAP_FAILED) {
+    fprintf(stderr, "Memory allocation failed for resident film: %s",
+            strerror(errno));
+    return NULL;
+  }
+
+  size_t bytes_read = 0;
+  while (bytes_read < len) {
+    ssize_t result =
+        pread(fd, buffer + bytes_read, len - bytes_read, offset + bytes_read);
+    if (result <= 0) {
+      free_region(buffer, len);
+      return NULL;
+    }
+    bytes_read += result;
+  }
+  return buffer;
+}
+
+/**
+ * lock_film - Try to lock the memory of a resident film
+ * @film: Film whose head and tail have been read
+ *
+ * mlock() fails if we would exceed RLIMIT_MEMLOCK, which is only 8 MiB for
+ * unprivileged users on many systems. The memory is still useful unlocked,
+ * the kernel can just swap it out under pressure.
+ */
+static void lock_film(struct resident_film *film) {
+  film->locked = mlock(film->head, region_size(film->head_len)) == 0;
+  if (film->locked && mlock(film->tail, region_size(film->tail_len)) != 0) {
+    munlock(film->head, region_size(film->head_len));
+    film->locked = false;
+  }
+}
+
+/**
+ * load_film - Fill in the memory of a film chosen for the resident set
+ * @film: Film with content_id, size, mtime and region lengths set
+ * @old: The previous resident set, whose memory we take over if we can
+ * @taken: For each film of old, whether its memory has been taken over
+ * @read_from_disk: Set to true if the film had to be read from its backing
+ *                  file
+ *
+ * Readers may still be copying from old, so we never change it. The films we
+ * take over are marked in taken instead, and free_set() leaves them alone once
+ * old has been swapped out.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int load_film(struct resident_film *film, const struct resident_set *old,
+                     bool *taken, bool *read_from_disk) {
+  /* A film that was already resident and hasn't changed keeps its memory */
+  for (unsigned int i = 0; old && i < old->count; i++) {
+    const struct resident_film *prev = &old->films[i];
+    if (!taken[i] && !atomic_load(&prev->stale) &&
+        prev->content_id == film->content_id &&
+        prev->size == film->size &&
+        prev->mtime.tv_sec == film->mtime.tv_sec &&
+        prev->mtime.tv_nsec == film->mtime.tv_nsec &&
+        prev->head_len == film->head_len && prev->tail_len == film->tail_len) {
+      *film = *prev;
+      taken[i] = true;
+      return 0;
+    }
+  }
+
+  *read_from_disk = true;
+  const char *path = video_path(film->content_id);
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  film->head = read_region(fd, 0, film->head_len);
+  film->tail = read_region(fd, film->tail_offset, film->tail_len);
+  close(fd);
+
+  if (!film->head || !film->tail) {
+    free_film(film);
+    return -1;
+  }
+
+  lock_film(film);
+  return 0;
+}
+
+/**
+ * checksum - Add data to a running checksum
+ * @sum: Checksum so far, RESIDENT_CHECKSUM_SEED to start a new one
+ * @data: Data to add
+ * @len: Length of data
+ *
+ * This is 64-bit FNV-1a, the same hash the index tables use. It is only meant
+ * to catch data that was torn or went stale, not tampering.
+ *
+ * Return: The new checksum
+ */
+static uint64_t checksum(uint64_t sum, const char *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    sum ^= (unsigned char)data[i];
+    sum *= 1099511628211ULL;
+  }
+  return sum;
+}
+
+/**
+ * cache_file_path - Build the path of a warm cache file
+ * @name: RESIDENT_CACHE_MANIFEST or RESIDENT_CACHE_DATA
+ * @suffix: Appended to the path, for the temporary file that we write first
+ * @path: Buffer of PATH_MAX bytes for the path
+ *
+ * Return: 0 on success, -1 if the cache is off or the path is too long
+ */
+static int cache_file_path(const char *name, const char *suffix, char *path) {
+  struct config_ctx *config = get_config();
+  if (config->resident_cache_dir && config->resident_cache_dir[0] == '\0') {
+    return -1;
+  }
+
+  /* A directory under the home directory may be given as ~/ */
+  int len;
+  const char *dir = config->resident_cache_dir;
+  if (dir && strncmp(dir, "~/", 2) == 0) {
+    len = snprintf(path, PATH_MAX, "%s%s/%s%s", config->home, dir + 1, name,
+                   suffix);
+  } else if (dir) {
+    len = snprintf(path, PATH_MAX, "%s/%s%s", dir, name, suffix);
+  } else {
+    len = snprintf(path, PATH_MAX, "%s/.filmfs/%s%s", config->home, name,
+                   suffix);
+  }
+  if (len >= PATH_MAX) {
+    fprintf(stderr, "Warm cache path exceeds PATH_MAX.\n");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * write_cache - Write a resident set to the warm cache files
+ * @set: The set to write
+ * @manifest: Stream for the manifest
+ * @data: Stream for the data
+ *
+ * The manifest starts with RESIDENT_CACHE_HEADER and LIBRARY_PATH, followed by
+ * one record per film that ends in '\0', since names may contain newlines:
+ *
+ *   F<rate> <size> <mtime seconds>.<mtime nanoseconds> <head length>
+ *    <tail offset> <tail length> <data offset> <checksum> <name>
+ *
+ * all on one line.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int write_cache(struct resident_set *set, FILE *manifest, FILE *data) {
+  fprintf(manifest, "%s%s%c", RESIDENT_CACHE_HEADER,
+          get_config()->library_path, '\0');
+
+  unsigned long long data_offset = 0;
+  for (unsigned int i = 0; i < set->count; i++) {
+    struct resident_film *film = &set->films[i];
+    uint64_t sum = checksum(RESIDENT_CHECKSUM_SEED, film->head, film->head_len);
+    sum = checksum(sum, film->tail, film->tail_len);
+
+    if (fwrite(film->head, 1, film->head_len, data) != film->head_len ||
+        fwrite(film->tail, 1, film->tail_len, data) != film->tail_len) {
+      return -1;
+    }
+
+    fprintf(manifest, "F%llu %lld %lld.%09ld %zu %lld %zu %llu %016llx %s%c",
+            (unsigned long long)video_byte_rate(film->content_id),
+            (long long)film->size, (long long)film->mtime.tv_sec,
+            film->mtime.tv_nsec, film->head_len, (long long)film->tail_offset,
+            film->tail_len, data_offset, (unsigned long long)sum,
+            video_name(film->content_id), '\0');
+    data_offset += film->head_len + film->tail_len;
+  }
+  return ferror(manifest) || ferror(data) ? -1 : 0;
+}
+
+/**
+ * save_cache - Save a resident set as the warm cache
+ * @set: The set to save
+ *
+ * Both files are written under temporary names and renamed into place, the
+ * data first. A crash between the renames pairs the old manifest with the new
+ * data, which the checksums catch.
+ */
+static void save_cache(struct resident_set *set) {
+  char manifest_path[PATH_MAX], manifest_tmp[PATH_MAX];
+  char data_path[PATH_MAX], data_tmp[PATH_MAX];
+  if (cache_file_path(RESIDENT_CACHE_MANIFEST, "", manifest_path) == -1 ||
+      cache_file_path(RESIDENT_CACHE_MANIFEST, ".tmp", manifest_tmp) == -1 ||
+      cache_file_path(RESIDENT_CACHE_DATA, "", data_path) == -1 ||
+      cache_file_path(RESIDENT_CACHE_DATA, ".tmp", data_tmp) == -1) {
+    return;
+  }
+
+  /* The database may not have made the directory yet */
+  char *last_slash = strrchr(data_tmp, '/');
+  *last_slash = '\0';
+  if (mkdir(data_tmp, 0700) == -1 && errno != EEXIST) {
+    fprintf(stderr, "Failed to make warm cache directory: %s",
+            strerror(errno));
+    return;
+  }
+  *last_slash = '/';
+
+  FILE *manifest = fopen(manifest_tmp, "w");
+  FILE *data = fopen(data_tmp, "w");
+  int result = manifest && data ? write_cache(set, manifest, data) : -1;
+  if (manifest && fclose(manifest) == -1) {
+    result = -1;
+  }
+  if (data && fclose(data) == -1) {
+    result = -1;
+  }
+
+  if (result == -1 || rename(data_tmp, data_path) == -1 ||
+      rename(manifest_tmp, manifest_path) == -1) {
+    fprintf(stderr, "Failed to save the warm cache to %s: %s", manifest_path,
+            strerror(errno));
+    unlink(manifest_tmp);
+    unlink(data_tmp);
+    return;
+  }
+  atomic_fetch_add(&cache_saves, 1);
+}
+
+/**
+ * load_cached_film - Load one film of the warm cache
+ * @set: Set to add the film to
+ * @record: Manifest record of the film, after its 'F'
+ * @data_fd: File descriptor of the data file
+ *
+ * Return: 0 if the film was loaded, -1 if it was stale, corrupt or didn't fit
+ */
+static int load_cached_film(struct resident_set *set, const char *record,
+                            int data_fd) {
+  struct config_ctx *config = get_config();
+  unsigned long long rate, data_offset, sum;
+  long long size, mtime_sec, tail_offset;
+  long mtime_nsec;
+  size_t head_len, tail_len;
+  int name_start;
+  if (sscanf(record, "%llu %lld %lld.%ld %zu %lld %zu %llu %llx %n", &rate,
+             &size, &mtime_sec, &mtime_nsec, &head_len, &tail_offset,
+             &tail_len, &data_offset, &sum, &name_start) != 9 ||
+      set->count == config->resident_films) {
+    return -1;
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "/%s", record + name_start);
+  int index = video_find(path);
+  if (index == -1 || video_removed(index) ||
+      !config->policies[video_policy(index)].resident) {
+    return -1;
+  }
+
+  /* Only a backing file that hasn't changed still holds the saved data */
+  unsigned int content_id = video_content_id(index);
+  struct stat file_stat;
+  if (stat(video_path(content_id), &file_stat) == -1 ||
+      file_stat.st_size != size || file_stat.st_mtim.tv_sec != mtime_sec ||
+      file_stat.st_mtim.tv_nsec != mtime_nsec ||
+      set->bytes + head_len + tail_len > broker_quota(CONSUMER_RESIDENT)) {
+    return -1;
+  }
+
+  struct resident_film *film = &set->films[set->count];
+  memset(film, 0, sizeof(struct resident_film));
+  film->content_id = content_id;
+  film->size = size;
+  film->mtime = file_stat.st_mtim;
+  film->head_len = head_len;
+  film->tail_offset = tail_offset;
+  film->tail_len = tail_len;
+  film->head = read_region(data_fd, data_offset, head_len);
+  film->tail = read_region(data_fd, data_offset + head_len, tail_len);
+  if (!film->head || !film->tail ||
+      checksum(checksum(RESIDENT_CHECKSUM_SEED, film->head, head_len),
+               film->tail, tail_len) != sum) {
+    free_film(film);
+    return -1;
+  }
+  lock_film(film);
+
+  if (rate > 0 && video_byte_rate(index) == 0) {
+    video_set_byte_rate(index, rate);
+  }
+  set->count++;
+  set->bytes += head_len + tail_len;
+  return 0;
+}
+
+/**
+ * load_cache - Load the resident set saved by the last mount
+ *
+ * A cache that is for another LIBRARY_PATH or version is ignored.
+ *
+ * Return: The loaded set, NULL if there is none or no film in it was usable
+ */
+static struct resident_set *load_cache(void) {
+  char manifest_path[PATH_MAX], data_path[PATH_MAX];
+  if (cache_file_path(RESIDENT_CACHE_MANIFEST, "", manifest_path) == -1 ||
+      cache_file_path(RESIDENT_CACHE_DATA, "", data_path) == -1) {
+    return NULL;
+  }
+
+  FILE *manifest = fopen(manifest_path, "r");
+  if (!manifest) {
+    return NULL;
+  }
+  int data_fd = open(data_path, O_RDONLY);
+
+  struct config_ctx *config = get_config();
+  struct resident_set *set = calloc(1, sizeof(struct resident_set));
+  if (set) {
+    set->films = calloc(config->resident_films ? config->resident_films : 1,
+                        sizeof(struct resident_film));
+  }
+
+  char *record = NULL;
+  size_t record_size = 0;
+  size_t header_len = strlen(RESIDENT_CACHE_HEADER);
+  if (set && set->films && data_fd != -1 &&
+      getdelim(&record, &record_size, '\0', manifest) > 0 &&
+      strncmp(record, RESIDENT_CACHE_HEADER, header_len) == 0 &&
+      strcmp(record + header_len, config->library_path) == 0) {
+    while (getdelim(&record, &record_size, '\0', manifest) > 0) {
+      if (record[0] != 'F' ||
+          load_cached_film(set, record + 1, data_fd) == -1) {
+        atomic_fetch_add(&warm_rejected, 1);
+      }
+    }
+  }
+  free(record);
+  fclose(manifest);
+  if (data_fd != -1) {
+    close(data_fd);
+  }
+
+  if (!set || !set->films || set->count == 0) {
+    free_set(set, NULL);
+    return NULL;
+  }
+  atomic_store(&warm_films, set->count);
+  atomic_store(&warm_bytes, set->bytes);
+  if (config->debug) {
+    printf("Loaded %u films from the warm cache.\n", set->count);
+  }
+  return set;
+}
+
+/**
+ * choose_films - Pick the films of a new resident set and the size of their
+ * resident regions
+ * @set: Set to add the films to
+ * @keys: Normalized keys of the most watched films, most watched first
+ * @key_count: Number of keys
+ *
+ * Every file whose name normalizes to one of the keys is a copy of that film,
+ * whatever release it is, so we look them up by key rather than comparing
+ * every title with every file.
+ */
+static void choose_films(struct resident_set *set, char **keys,
+                         unsigned int key_count) {
+  struct config_ctx *config = get_config();
+  uint64_t budget = broker_quota(CONSUMER_RESIDENT);
+
+  for (unsigned int k = 0; k < key_count; k++) {
+    for (int i = video_find_key(keys[k]); i != -1;
+         i = video_next_with_key(i)) {
+      if (!config->policies[video_policy(i)].resident) {
+        continue;
+      }
+
+      /* Identical copies share their content, so we only keep it once */
+      unsigned int content_id = video_content_id(i);
+      bool chosen = false;
+      for (unsigned int j = 0; j < set->count; j++) {
+        if (set->films[j].content_id == content_id) {
+          chosen = true;
+        }
+      }
+      if (chosen) {
+        continue;
+      }
+
+      struct stat file_stat;
+      if (stat(video_path(content_id), &file_stat) == -1) {
+        continue;
+      }
+
+      uint64_t rate = video_byte_rate(i);
+      if (rate == 0) {
+        rate = RESIDENT_DEFAULT_RATE;
+      }
+
+      uint64_t size = file_stat.st_size;
+      uint64_t head_len = rate * config->resident_seconds;
+      if (head_len > size) {
+        head_len = size;
+      }
+      uint64_t tail_len = size - head_len;
+      if (tail_len > RESIDENT_TAIL_SIZE) {
+        tail_len = RESIDENT_TAIL_SIZE;
+      }
+
+      /* Once the budget runs out we trim the opening, or stop altogether */
+      uint64_t remaining = budget - set->bytes;
+      if (head_len + tail_len > remaining) {
+        if (remaining < tail_len + RESIDENT_MIN_HEAD) {
+          return;
+        }
+        head_len = remaining - tail_len;
+      }
+
+      struct resident_film *film = &set->films[set->count++];
+      memset(film, 0, sizeof(struct resident_film));
+      film->content_id = content_id;
+      film->size = file_stat.st_size;
+      film->mtime = file_stat.st_mtim;
+      film->head_len = head_len;
+      film->tail_offset = size - tail_len;
+      film->tail_len = tail_len;
+      set->bytes += head_len + tail_len;
+
+      if (set->count == config->resident_films) {
+        return;
+      }
+    }
+  }
+}
+
+/**
+ * rebuild - Build a new resident set and swap it in for the current one
+ */
+static void rebuild(void) {
+  struct config_ctx *config = get_config();
+
+  /* The first rebuild starts from the set that the last mount saved */
+  if (!cache_loaded) {
+    cache_loaded = true;
+    struct resident_set *warm = load_cache();
+    if (warm) {
+      pthread_rwlock_wrlock(&set_lock);
+      current = warm;
+      pthread_rwlock_unlock(&set_lock);
+      broker_set_usage(CONSUMER_RESIDENT, warm->bytes);
+    }
+  }
+
+  char **keys;
+  unsigned int key_count;
+  if (db_top_keys(config->resident_films, &keys, &key_count) == -1) {
+    return;
+  }
+
+  struct resident_set *set = calloc(1, sizeof(struct resident_set));
+  if (set) {
+    set->films = calloc(config->resident_films ? config->resident_films : 1,
+                        sizeof(struct resident_film));
+  }
+  /* Only a rebuild ever replaces current, so we can read it unlocked */
+  struct resident_set *old = current;
+  bool *taken = calloc(old && old->count ? old->count : 1, sizeof(bool));
+  if (!set || !set->films || !taken) {
+    fprintf(stderr, "Memory allocation failed for resident set: %s",
+            strerror(errno));
+    free_set(set, NULL);
+    free(taken);
+    goto out;
+  }
+
+  choose_films(set, keys, key_count);
+
+  unsigned int loaded = 0;
+  bool changed = false;
+  set->bytes = 0;
+  for (unsigned int i = 0; i < set->count; i++) {
+    if (load_film(&set->films[i], old, taken, &changed) == 0) {
+      set->films[loaded++] = set->films[i];
+      set->bytes += set->films[i].head_len + set->films[i].tail_len;
+    }
+  }
+  set->count = loaded;
+
+  /* Films of the old set that weren't taken over have dropped out of it */
+  for (unsigned int i = 0; old && i < old->count; i++) {
+    if (!taken[i]) {
+      changed = true;
+    }
+  }
+
+  pthread_rwlock_wrlock(&set_lock);
+  current = set;
+  pthread_rwlock_unlock(&set_lock);
+  broker_set_usage(CONSUMER_RESIDENT, set->bytes);
+
+  /* No reader can see old any more, so its remaining films can go */
+  free_set(old, taken);
+  free(taken);
+
+  /* Only this task replaces current, so the set stays valid while we save */
+  if (changed) {
+    save_cache(set);
+  }
+
+out:
+  for (unsigned int i = 0; i < key_count; i++) {
+    free(keys[i]);
+  }
+  free(keys);
+}
+
+/**
+ * rebuild_run - Body of the rebuild task
+ * @arg: Unused
+ */
+static void rebuild_run(void *arg) {
+  (void)arg;
+
+  /* Refreshes requested from now on need another pass, so they queue one */
+  pthread_mutex_lock(&refresh_lock);
+  rebuild_queued = false;
+  pthread_mutex_unlock(&refresh_lock);
+
+  rebuild();
+}
+
+/**
+ * rebuild_discard - Forget a rebuild task that never ran
+ * @arg: Unused
+ */
+static void rebuild_discard(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&refresh_lock);
+  rebuild_queued = false;
+  pthread_mutex_unlock(&refresh_lock);
+}
+
+/**
+ * resident_read - Copy the start of a read from the resident set
+ * @content_id: Content ID of the film being read
+ * @buffer: Buffer to fill
+ * @size: Number of bytes requested
+ * @offset: Position in the film to read from
+ *
+ * Return: Number of bytes copied, 0 if offset isn't resident
+ */
+size_t resident_read(unsigned int content_id, char *buffer, size_t size,
+                     off_t offset) {
+  size_t copied = 0;
+
+  pthread_rwlock_rdlock(&set_lock);
+  for (unsigned int i = 0; current && i < current->count; i++) {
+    struct resident_film *film = &current->films[i];
+    if (film->content_id != content_id) {
+      continue;
+    }
+    if (atomic_load(&film->stale)) {
+      break;
+    }
+
+    if (offset < (off_t)film->head_len) {
+      copied = film->head_len - offset;
+      copied = copied < size ? copied : size;
+      memcpy(buffer, film->head + offset, copied);
+    } else if (offset >= film->tail_offset &&
+               offset < film->tail_offset + (off_t)film->tail_len) {
+      copied = film->tail_offset + film->tail_len - offset;
+      copied = copied < size ? copied : size;
+      memcpy(buffer, film->tail + (offset - film->tail_offset), copied);
+    }
+    break;
+  }
+  pthread_rwlock_unlock(&set_lock);
+
+  if (copied > 0) {
+    atomic_fetch_add(&hits, 1);
+    atomic_fetch_add(&hit_bytes, copied);
+    broker_add_hits(CONSUMER_RESIDENT, copied);
+  }
+  return copied;
+}
+
+/**
+ * resident_check - Compare a film's backing file with its resident parts
+ * @content_id: Content ID of the film
+ * @file_stat: Status of the backing file that was just opened
+ *
+ * If the file's size or modification time changed since the film was read,
+ * the film is marked stale and a rebuild is queued to read it again.
+ */
+void resident_check(unsigned int content_id, const struct stat *file_stat) {
+  bool stale = false;
+
+  pthread_rwlock_rdlock(&set_lock);
+  for (unsigned int i = 0; current && i < current->count; i++) {
+    struct resident_film *film = &current->films[i];
+    if (film->content_id != content_id) {
+      continue;
+    }
+
+    if (film->size != file_stat->st_size ||
+        film->mtime.tv_sec != file_stat->st_mtim.tv_sec ||
+        film->mtime.tv_nsec != file_stat->st_mtim.tv_nsec) {
+      stale = !atomic_exchange(&film->stale, true);
+    }
+    break;
+  }
+  pthread_rwlock_unlock(&set_lock);
+
+  if (stale) {
+    resident_refresh();
+  }
+}
+
+/**
+ * write_metrics - Write the resident set section of the metrics file
+ * @out: Stream to write to
+ */
+static void write_metrics(FILE *out) {
+  pthread_rwlock_rdlock(&set_lock);
+  unsigned int count = current ? current->count : 0;
+  uint64_t bytes = current ? current->bytes : 0;
+  uint64_t locked_bytes = 0;
+  for (unsigned int i = 0; i < count; i++) {
+    struct resident_film *film = &current->films[i];
+    if (film->locked) {
+      locked_bytes += region_size(film->head_len) + region_size(film->tail_len);
+    }
+  }
+
+  fprintf(out, "filmfs_resident_budget_bytes %llu\n",
+          (unsigned long long)broker_quota(CONSUMER_RESIDENT));
+  fprintf(out, "filmfs_resident_films %u\n", count);
+  fprintf(out, "filmfs_resident_bytes %llu\n", (unsigned long long)bytes);
+  fprintf(out, "filmfs_resident_locked_bytes %llu\n",
+          (unsigned long long)locked_bytes);
+  fprintf(out, "filmfs_resident_hits_total %llu\n", atomic_load(&hits));
+  fprintf(out, "filmfs_resident_hit_bytes_total %llu\n",
+          atomic_load(&hit_bytes));
+  fprintf(out, "filmfs_resident_warm_films %u\n", atomic_load(&warm_films));
+  fprintf(out, "filmfs_resident_warm_bytes %llu\n",
+          (unsigned long long)atomic_load(&warm_bytes));
+  fprintf(out, "filmfs_resident_warm_rejected %u\n",
+          atomic_load(&warm_rejected));
+  fprintf(out, "filmfs_resident_cache_saves_total %llu\n",
+          atomic_load(&cache_saves));
+
+  for (unsigned int i = 0; i < count; i++) {
+    struct resident_film *film = &current->films[i];
+    fputs("filmfs_resident_film_bytes{film=", out);
+    metrics_write_label(out, video_name(film->content_id));
+    fprintf(out, "} %llu\n",
+            (unsigned long long)(film->head_len + film->tail_len));
+  }
+  pthread_rwlock_unlock(&set_lock);
+}
+
+/**
+ * resident_refresh - Ask for the resident set to be rebuilt
+ *
+ * If a rebuild is already waiting to run it will see the latest watch history,
+ * so we don't queue another one.
+ */
+void resident_refresh(void) {
+  pthread_mutex_lock(&refresh_lock);
+  if (!rebuild_queued &&
+      executor_submit(TASK_RESIDENT, rebuild_run, rebuild_discard, NULL) == 0) {
+    rebuild_queued = true;
+  }
+  pthread_mutex_unlock(&refresh_lock);
+}
+
+/**
+ * resident_start - Register the resident set metrics and build the first set
+ *
+ * Return: 0 on success, -1 on error
+ */
+int resident_start(void) {
+  if (metrics_register(write_metrics) == -1) {
+    return -1;
+  }
+
+  resident_refresh();
+  return 0;
+}
+
+/**
+ * resident_stop - Free the resident set
+ *
+ * This must be called after the executor has been stopped, so that no rebuild
+ * is running.
+ */
+void resident_stop(void) {
+  pthread_rwlock_wrlock(&set_lock);
+  free_set(current, NULL);
+  current = NULL;
+  pthread_rwlock_unlock(&set_lock);
+  broker_set_usage(CONSUMER_RESIDENT, 0);
+}
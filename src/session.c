@@ -0,0 +1,462 @@
+/**
+ * session.c
+ *
+ * Per-open state for films in the mountpoint.
+ *
+ * OVERVIEW:
+ * Each time a program opens a film, fs_open() creates a session and stores a
+ * pointer to it in fi->fh. FUSE hands the same fi to every read() and to the
+ * final release(), so the session is where we keep everything we learn about
+ * one stream while it plays, such as how fast it is being consumed.
+ *
+ * REFERENCE COUNTING:
+ * Background threads, like the lookahead prefetcher, may still be using a
+ * session's file descriptor after the film has been closed. Each of them holds
+ * a reference, and the descriptor is only closed when the last one is dropped.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "device.h"
+#include "filmstats.h"
+#include "lookahead.h"
+#include "mapcache.h"
+#include "metrics.h"
+#include "remote.h"
+#include "resident.h"
+#include "session.h"
+#include "video.h"
+
+/* The list of open sessions, used for metrics */
+static struct session *sessions = NULL;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Session IDs only need to be unique, so we just count up */
+static atomic_ulong next_session_id = 1;
+
+/* Reads and the time spent on them, by where their data came from */
+static const char *read_source_names[READ_SOURCES] = {"resident", "mmap",
+                                                      "pread", "remote"};
+static atomic_ullong reads[READ_SOURCES];
+static atomic_ullong read_ns[READ_SOURCES];
+
+/**
+ * The upper bounds of the histogram buckets for the size of read requests in
+ * bytes, and for the time between read requests in nanoseconds. The last
+ * bucket of each histogram has no bound.
+ */
+static const unsigned long long size_bounds[READ_SIZE_BUCKETS - 1] = {
+    4096, 8192, 16384, 32768, 65536, 131072, 262144, 524288, 1048576};
+static const unsigned long long gap_bounds[READ_GAP_BUCKETS - 1] = {
+    10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+
+/* Counts of read requests in each bucket, and the totals of what they count */
+static atomic_ullong size_counts[READ_SIZE_BUCKETS];
+static atomic_ullong size_sum = 0;
+static atomic_ullong gap_counts[READ_GAP_BUCKETS];
+static atomic_ullong gap_sum_ns = 0;
+
+/* When the last read request arrived in monotonic nanoseconds, 0 for never */
+static atomic_ullong last_arrival_ns = 0;
+
+/* Reads that were interrupted, and the bytes they didn't get to read */
+static atomic_ullong interrupted_reads = 0;
+static atomic_ullong interrupted_bytes = 0;
+
+/**
+ * write_metrics - Write the read section of the metrics file
+ * @out: Stream to write to
+ *
+ * Dividing the time by the number of reads of a source gives its average
+ * latency, which lets us compare memory-mapped reads against pread(). The size
+ * of read requests shows whether the kernel is splitting reads into smaller
+ * ones than the player asked for, and the time between them how busy the FUSE
+ * threads are kept.
+ */
+static void write_metrics(FILE *out) {
+  for (unsigned int i = 0; i < READ_SOURCES; i++) {
+    fprintf(out, "filmfs_reads_total{source=\"%s\"} %llu\n",
+            read_source_names[i], atomic_load(&reads[i]));
+    fprintf(out, "filmfs_read_seconds_total{source=\"%s\"} %.6f\n",
+            read_source_names[i], atomic_load(&read_ns[i]) / 1e9);
+  }
+
+  fprintf(out, "filmfs_reads_interrupted_total %llu\n",
+          atomic_load(&interrupted_reads));
+  fprintf(out, "filmfs_read_interrupted_bytes_total %llu\n",
+          atomic_load(&interrupted_bytes));
+
+  metrics_write_histogram(out, "filmfs_read_size_bytes", NULL, size_bounds,
+                          size_counts, READ_SIZE_BUCKETS,
+                          atomic_load(&size_sum), 1);
+  metrics_write_histogram(out, "filmfs_read_interarrival_seconds", NULL,
+                          gap_bounds, gap_counts, READ_GAP_BUCKETS,
+                          atomic_load(&gap_sum_ns), 1e9);
+}
+
+/**
+ * record_arrival - Count a read request in the size and inter-arrival
+ * histograms
+ * @size: Number of bytes requested
+ * @now: When the request arrived
+ *
+ * Requests arrive on several threads at once, so a thread can swap in its
+ * arrival time just after a later one. We don't count a gap for it then.
+ */
+static void record_arrival(size_t size, const struct timespec *now) {
+  atomic_fetch_add(
+      &size_counts[metrics_bucket(size_bounds, READ_SIZE_BUCKETS, size)], 1);
+  atomic_fetch_add(&size_sum, size);
+
+  unsigned long long now_ns = now->tv_sec * 1000000000ULL + now->tv_nsec;
+  unsigned long long previous = atomic_exchange(&last_arrival_ns, now_ns);
+  if (previous != 0 && now_ns >= previous) {
+    unsigned long long gap = now_ns - previous;
+    atomic_fetch_add(
+        &gap_counts[metrics_bucket(gap_bounds, READ_GAP_BUCKETS, gap)], 1);
+    atomic_fetch_add(&gap_sum_ns, gap);
+  }
+}
+
+/**
+ * session_start - Register the read metrics
+ *
+ * Return: 0 on success, -1 on error
+ */
+int session_start(void) { return metrics_register(write_metrics); }
+
+/**
+ * open_backing_file - Open the backing file of a local film for a session
+ * @session: Session with index, content_id and policy set
+ *
+ * We open the backing file of the film's content ID, which is the same file for
+ * every identical copy in the library.
+ *
+ * Return: 0 on success, -1 with errno set on error
+ */
+static int open_backing_file(struct session *session) {
+  const struct film_policy *policy = &get_config()->policies[session->policy];
+  const char *backing_path = video_backing_path(session->index);
+  session->fd = open(backing_path, O_RDONLY);
+  if (session->fd == -1) {
+    int open_errno = errno;
+    fprintf(stderr, "Failed to open %s: %s", backing_path, strerror(errno));
+    errno = open_errno;
+    return -1;
+  }
+
+  /* The lookahead uses the size to avoid prefetching past the film's end */
+  struct stat file_stat;
+  if (fstat(session->fd, &file_stat) == -1) {
+    int stat_errno = errno;
+    fprintf(stderr, "Failed to get file status for %s: %s", backing_path,
+            strerror(errno));
+    close(session->fd);
+    errno = stat_errno;
+    return -1;
+  }
+  session->size = file_stat.st_size;
+  session->dev = file_stat.st_dev;
+
+  /* The resident parts of the film must still match the file on disk */
+  resident_check(session->content_id, &file_stat);
+
+  /* The kernel's own readahead follows the film's policy */
+  static const int advice[] = {[READAHEAD_NORMAL] = POSIX_FADV_NORMAL,
+                               [READAHEAD_SEQUENTIAL] = POSIX_FADV_SEQUENTIAL,
+                               [READAHEAD_RANDOM] = POSIX_FADV_RANDOM};
+  if (policy->readahead != READAHEAD_NORMAL) {
+    posix_fadvise(session->fd, 0, 0, advice[policy->readahead]);
+  }
+
+  /*
+   * Small films are read through a cached memory mapping instead of pread(),
+   * unless their policy keeps them out of the cache
+   */
+  if (policy->cache) {
+    session->mapping =
+        mapcache_get(session->content_id, session->fd, &file_stat);
+  }
+  return 0;
+}
+
+/**
+ * session_open - Start a session for a film
+ * @index: Index of the film in video_files
+ *
+ * Remote films have no backing file. They are read through remote.c, and the
+ * size that the remote index lists stands in for the size of the file.
+ *
+ * Return: Pointer to the session on success, NULL with errno set on error
+ */
+struct session *session_open(unsigned int index) {
+  struct session *session = calloc(1, sizeof(struct session));
+  if (!session) {
+    fprintf(stderr, "Memory allocation failed for session: %s",
+            strerror(errno));
+    return NULL;
+  }
+
+  session->index = index;
+  session->content_id = video_content_id(index);
+  session->policy = video_policy(index);
+
+  int result;
+  if (video_remote(index)) {
+    session->fd = -1;
+    session->size = video_remote_size(index);
+    session->remote = remote_open(index);
+    result = session->remote ? 0 : -1;
+  } else {
+    result = open_backing_file(session);
+  }
+  if (result == -1) {
+    int open_errno = errno;
+    free(session);
+    errno = open_errno;
+    return NULL;
+  }
+
+  filmstats_open(index);
+
+  session->id = atomic_fetch_add(&next_session_id, 1);
+  atomic_init(&session->refs, 1);
+  atomic_init(&session->closed, false);
+  atomic_init(&session->first_read, false);
+  pthread_mutex_init(&session->lock, NULL);
+
+  /* We add the session to the front of the list of open sessions */
+  pthread_mutex_lock(&sessions_lock);
+  session->next = sessions;
+  if (sessions) {
+    sessions->prev = session;
+  }
+  sessions = session;
+  pthread_mutex_unlock(&sessions_lock);
+
+  return session;
+}
+
+/**
+ * session_get - Take a reference to a session
+ * @session: Session to reference
+ */
+void session_get(struct session *session) {
+  atomic_fetch_add(&session->refs, 1);
+}
+
+/**
+ * session_put - Drop a reference to a session
+ * @session: Session to release
+ *
+ * When the last reference is dropped we close the backing file, or end reading
+ * the remote film, and free the session.
+ */
+void session_put(struct session *session) {
+  if (atomic_fetch_sub(&session->refs, 1) != 1) {
+    return;
+  }
+
+  if (session->mapping) {
+    mapcache_put(session->mapping);
+  }
+  if (session->remote) {
+    remote_close(session->remote);
+  } else if (close(session->fd) == -1) {
+    fprintf(stderr, "Failed to close %s: %s",
+            video_backing_path(session->index), strerror(errno));
+  }
+  pthread_mutex_destroy(&session->lock);
+  free(session);
+}
+
+/**
+ * session_close - End a session when its film is closed
+ * @session: Session to close
+ *
+ * We remove the session from the list of open sessions and drop the reference
+ * that session_open() returned.
+ */
+void session_close(struct session *session) {
+  atomic_store(&session->closed, true);
+  lookahead_forget(session);
+
+  pthread_mutex_lock(&sessions_lock);
+  if (session->prev) {
+    session->prev->next = session->next;
+  } else {
+    sessions = session->next;
+  }
+  if (session->next) {
+    session->next->prev = session->prev;
+  }
+  pthread_mutex_unlock(&sessions_lock);
+
+  session_put(session);
+}
+
+/**
+ * session_read - Read film data for a session
+ * @session: Session of the film being read
+ * @buffer: Buffer to fill with film data
+ * @size: Number of bytes requested
+ * @offset: Position in the film to read from
+ * @interrupted: Returns nonzero once the caller has given up on the read, may
+ *               be NULL
+ *
+ * We use pread() which reads from a specific offset without changing the file
+ * position. This is important because multiple threads might read from the same
+ * file simultaneously.
+ *
+ * pread() on a regular file isn't cut short by signals, so the only way to
+ * give up a read early is to stop between chunks.
+ *
+ * Return: Number of bytes read on success, -EINTR if the read was given up,
+ * -ERRNO on failure
+ */
+ssize_t session_read(struct session *session, char *buffer, size_t size,
+                     off_t offset, int (*interrupted)(void)) {
+  ssize_t result = 0;
+  enum read_source source = READ_RESIDENT;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  record_arrival(size, &start);
+
+  /**
+   * The openings of the most watched films are kept in memory, so we copy as
+   * much of the read as we can from there before going to the disk.
+   */
+  size_t bytes_read =
+      resident_read(session->content_id, buffer, size, offset);
+
+  /**
+   * Small films are copied straight out of their memory mapping. If the file
+   * was truncated underneath the mapping, we fall back to pread() below.
+   */
+  bool served = bytes_read == size;
+  if (!served && session->mapping) {
+    ssize_t copied = mapcache_read(session->mapping, buffer + bytes_read,
+                                   size - bytes_read, offset + bytes_read);
+    if (copied != -1) {
+      bytes_read += copied;
+      source = READ_MMAP;
+      served = true;
+    }
+  }
+  size_t memory_bytes = bytes_read;
+
+  /* Remote films are read from their cached chunks, fetching them if needed */
+  if (!served && session->remote) {
+    source = READ_REMOTE;
+    result = remote_read(session->remote, buffer + bytes_read,
+                         size - bytes_read, offset + bytes_read);
+    if (result < 0) {
+      errno = -result;
+      result = -1;
+    } else {
+      bytes_read += result;
+    }
+  } else if (!served) {
+    /**
+     * We use a loop for reading the data because pread() can return fewer
+     * bytes than requested. We keep reading until we get everything or hit an
+     * error/EOF, at most SESSION_READ_CHUNK bytes at a time, and stop early if
+     * the caller gives up on the read.
+     */
+    source = READ_PREAD;
+    while (bytes_read < size) {
+      if (interrupted && interrupted()) {
+        result = -1;
+        errno = EINTR;
+        break;
+      }
+
+      size_t len = size - bytes_read;
+      if (len > SESSION_READ_CHUNK) {
+        len = SESSION_READ_CHUNK;
+      }
+      result = pread(session->fd, buffer + bytes_read, len,
+                     offset + bytes_read);
+      if (result <= 0) {
+        break;
+      }
+      bytes_read += result;
+    }
+
+    /*
+     * Films that aren't cached, like a cold archive, shouldn't push the films
+     * that are out of the page cache, so we drop what we just read
+     */
+    if (!get_config()->policies[session->policy].cache && bytes_read > 0) {
+      posix_fadvise(session->fd, offset, bytes_read, POSIX_FADV_DONTNEED);
+    }
+  }
+
+  /* A read that was given up between chunks counts the bytes it didn't read */
+  if (result == -1 && errno == EINTR) {
+    session_interrupted(session, size - bytes_read);
+    return -EINTR;
+  }
+  if (result == -1) {
+    int read_errno = errno;
+    fprintf(stderr, "Failed to read from file for %s: %s",
+            video_backing_path(session->index), strerror(errno));
+    return -read_errno;
+  }
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  uint64_t elapsed = (end.tv_sec - start.tv_sec) * 1000000000ULL +
+                     end.tv_nsec - start.tv_nsec;
+  atomic_fetch_add(&reads[source], 1);
+  atomic_fetch_add(&read_ns[source], elapsed);
+
+  filmstats_read(session->index, memory_bytes, bytes_read - memory_bytes);
+
+  /* Only reads that went through pread() could have touched the device */
+  if (source == READ_PREAD) {
+    device_account(session->dev, bytes_read, elapsed);
+  }
+
+  /* Now that we know how much was consumed, we top up the lookahead buffer */
+  lookahead_on_read(session, offset, bytes_read);
+
+  return bytes_read;
+}
+
+/**
+ * session_interrupted - Give up a read that the kernel interrupted
+ * @session: Session of the film being read
+ * @bytes: Bytes of the read that weren't read
+ *
+ * The kernel interrupts outstanding reads when a player seeks, so the data
+ * prefetched ahead of them is probably not wanted anymore either.
+ */
+void session_interrupted(struct session *session, size_t bytes) {
+  atomic_fetch_add(&interrupted_reads, 1);
+  atomic_fetch_add(&interrupted_bytes, bytes);
+  lookahead_cancel(session);
+}
+
+/**
+ * session_foreach - Call a function for every open session
+ * @fn: Function to call
+ * @arg: Argument passed through to fn
+ */
+void session_foreach(void (*fn)(struct session *session, void *arg),
+                     void *arg) {
+  pthread_mutex_lock(&sessions_lock);
+  for (struct session *session = sessions; session; session = session->next) {
+    fn(session, arg);
+  }
+  pthread_mutex_unlock(&sessions_lock);
+}
@@ -5,52 +5,593 @@
  *
  *
  * OVERVIEW:
- * Handles scanning the LIBRARY_PATH directory to find all video files and
- * storing them in our video_files struct for quick access.
+ * Handles scanning the LIBRARY_PATH directory and its subdirectories to find
+ * all video files and storing them in our video_files struct for quick access.
+ *
+ * The mountpoint shows every film in one flat directory, so each basename may
+ * only appear once. If two subdirectories contain films with the same name, we
+ * keep the first one we find.
+ *
+ * CHANGES:
+ * When change tracking is enabled, watch.c tells us about files that appear,
+ * change or disappear while we are mounted. An index is handed out to sessions
+ * and background tasks, so we never remove or reorder entries: a file that
+ * disappears is only marked as removed, and a file that comes back at the same
+ * path gets its old entry back.
+ *
+ * RESCANS:
+ * Network filesystems like NFS and CIFS don't deliver change events, so the
+ * only way to notice changes there is to look. Adding or removing an entry
+ * changes the modification time of its directory, so we remember the mtime of
+ * every directory when we read it. A rescan then costs one stat() per
+ * directory, and only the directories whose mtime changed are read again.
+ *
+ * We save the directories and files to ~/.filmfs/index, so that startup can
+ * begin from the index and rescan it instead of reading the whole library.
+ *
+ * KEYS:
+ * Every file also gets the normalized key of its name, see normalize.c, and a
+ * second hash table from keys to files. Several files may share a key, like
+ * two releases of the same film, so the files with a key are chained together
+ * through next_with_key. This lets a title from the FILMS table be joined to
+ * the files it was watched as with one lookup.
+ *
+ * REMOTE FILMS:
+ * Films listed by the remote index, see remote.c, get entries like any other,
+ * with their URL as their path and the URL's directory as their directory.
+ * Rescans and the saved index leave them out, since remote.c lists them again
+ * from the index whenever it refreshes it.
+ *
+ * CONCURRENCY:
+ * Adding files may move the arrays, so everything that reads them takes a read
+ * lock, and changes take the write lock. The strings themselves are never
+ * freed until unmount, so the pointers that video_name() and video_path()
+ * return stay valid after the lock is released.
  */
-#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/limits.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "config.h"
+#include "executor.h"
+#include "normalize.h"
 #include "video.h"
 
+/* Where the index is saved, relative to the home directory */
+#define INDEX_FILE "/.filmfs/index"
+
+/* The first line of the index, which changes if its format does */
+#define INDEX_HEADER "filmfs-index 1\n"
+
 /*
  * This is our cache of video files found in LIBRARY_PATH, we populate it once
  * at startup and then read it many times in our FUSE operations.
  */
 static struct video_files files;
 
-/*
- * get_files - Get pointer to video_files structure
- *
- * Used by our FUSE operations in operations.c to look up files.
- *
- * Return: Pointer to video_files structure
+/* The number of entries that the arrays in files have room for */
+static unsigned int capacity = 0;
+
+/* The directories that the files are in */
+static struct library_dirs dirs;
+
+/* The number of directories that the arrays in dirs have room for */
+static unsigned int dir_capacity = 0;
+
+/* Whether the index has changed since it was last saved or loaded */
+static atomic_bool index_dirty = false;
+
+/* The number of times that a file has appeared, for counting rescan changes */
+static unsigned int files_added = 0;
+
+/* The number of directory reads so far, see video_files.last_read */
+static unsigned int reads = 0;
+
+/* The number of files whose content ID is another file's */
+static unsigned int shared = 0;
+
+/**
+ * Increases every time a file's contents are detached from its copies, so that
+ * a deduplication pass that started before can tell that its results are stale.
  */
-struct video_files *get_files(void) { return &files; }
+static unsigned int generation = 0;
+
+/**
+ * Increases every time a file appears in or disappears from the library, so
+ * that views of the listing, like the virtual layout, know to rebuild.
+ */
+static atomic_uint listing = 0;
+
+static pthread_rwlock_t files_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 /**
  * files_cleanup - free all dynamically allocated memory for file lists.
  *
  * We run this on program exit. We free in the reverse of our allocation order,
- * which is good practice.
+ * which is good practice. The names point into the paths, so we only free the
+ * paths.
  */
 void files_cleanup(void) {
   for (unsigned int i = 0; i < files.count; i++) {
-    if (files.names[i]) {
-      free(files.names[i]);
-    }
-    if (files.paths[i]) {
-      free(files.paths[i]);
-    }
+    free(files.paths[i]);
   }
+  free(files.slots);
+  free(files.key_slots);
   free(files.names);
   free(files.paths);
+  free(files.content_ids);
+  free(files.byte_rates);
+  free(files.removed);
+  free(files.next_in_dir);
+  free(files.last_read);
+  free(files.policies);
+  free(files.devs);
+  free(files.sizes);
+  free(files.keys);
+  free(files.next_with_key);
+
+  for (unsigned int i = 0; i < dirs.count; i++) {
+    free(dirs.paths[i]);
+  }
+  free(dirs.slots);
+  free(dirs.paths);
+  free(dirs.mtimes);
+  free(dirs.first_files);
+  free(dirs.removed);
+  free(dirs.devs);
+
+  /* We reset the pointers so that library_init() can safely run again */
+  files.names = NULL;
+  files.paths = NULL;
+  files.content_ids = NULL;
+  files.byte_rates = NULL;
+  files.removed = NULL;
+  files.next_in_dir = NULL;
+  files.last_read = NULL;
+  files.policies = NULL;
+  files.devs = NULL;
+  files.sizes = NULL;
+  files.keys = NULL;
+  files.next_with_key = NULL;
+  files.slots = NULL;
+  files.slot_count = 0;
+  files.key_slots = NULL;
+  files.key_slot_count = 0;
+  files.count = 0;
+  capacity = 0;
+  shared = 0;
+
+  dirs.paths = NULL;
+  dirs.mtimes = NULL;
+  dirs.first_files = NULL;
+  dirs.removed = NULL;
+  dirs.devs = NULL;
+  dirs.slots = NULL;
+  dirs.slot_count = 0;
+  dirs.count = 0;
+  dir_capacity = 0;
+}
+
+/**
+ * hash_name - Hash a basename or path for a lookup table
+ * @name: Basename or path to hash
+ *
+ * This is the 64-bit FNV-1a hash, which is simple and spreads similar names
+ * like "Film 1.mkv" and "Film 2.mkv" well.
+ *
+ * Return: Hash value
+ */
+static uint64_t hash_name(const char *name) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (const unsigned char *c = (const unsigned char *)name; *c; c++) {
+    hash ^= *c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/**
+ * find_slot_in - Find the slot of a key in a lookup table
+ * @slots: The table
+ * @slot_count: Number of slots in the table, a power of two
+ * @keys: The keys of the entries that the slots refer to
+ * @key: Key to look up
+ *
+ * We use open addressing: if a key's slot is taken by another key, we try the
+ * next slot, until we find the key or an empty slot.
+ *
+ * Return: Pointer to the slot holding the key, or to the empty slot where it
+ * belongs
+ */
+static unsigned int *find_slot_in(unsigned int *slots, unsigned int slot_count,
+                                  char **keys, const char *key) {
+  unsigned int mask = slot_count - 1;
+  for (unsigned int i = hash_name(key) & mask;; i = (i + 1) & mask) {
+    unsigned int slot = slots[i];
+    if (slot == 0 || strcmp(keys[slot - 1], key) == 0) {
+      return &slots[i];
+    }
+  }
+}
+
+/**
+ * find_slot - Find the slot of a basename in the lookup table of files
+ * @name: Basename to look up
+ *
+ * Return: Pointer to the slot holding the name, or to the empty slot where it
+ * belongs
+ */
+static unsigned int *find_slot(const char *name) {
+  return find_slot_in(files.slots, files.slot_count, files.names, name);
+}
+
+/**
+ * grow_table - Double the size of a lookup table and refill it
+ * @slots: The table, which is replaced
+ * @slot_count: Number of slots in the table, which is updated
+ * @keys: The keys of the entries
+ * @count: Number of entries
+ *
+ * We keep the tables at most half full so that lookups stay short. Entries are
+ * inserted in index order, so when two entries share a key, the slot ends up
+ * with the newer one.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int grow_table(unsigned int **slots, unsigned int *slot_count,
+                      char **keys, unsigned int count) {
+  unsigned int new_count = *slot_count ? *slot_count * 2 : FILES_MAX * 2;
+  unsigned int *new_slots = calloc(new_count, sizeof(unsigned int));
+  if (!new_slots) {
+    fprintf(stderr, "Memory allocation failed for lookup table: %s",
+            strerror(errno));
+    return -1;
+  }
+
+  free(*slots);
+  *slots = new_slots;
+  *slot_count = new_count;
+  for (unsigned int i = 0; i < count; i++) {
+    *find_slot_in(new_slots, new_count, keys, keys[i]) = i + 1;
+  }
+  return 0;
+}
+
+/**
+ * is_remote - Check whether a path is the URL of a remote film or directory
+ * @path: Path to check
+ *
+ * Return: true if the path is a URL
+ */
+static bool is_remote(const char *path) {
+  return strncmp(path, REMOTE_SCHEME, strlen(REMOTE_SCHEME)) == 0;
+}
+
+/**
+ * find_dir - Find the index of a directory without taking the lock
+ * @path: Path of the directory, ending in '/'
+ *
+ * Return: Index of the directory on success, -1 if we have never read it
+ */
+static int find_dir(const char *path) {
+  if (dirs.slot_count == 0) {
+    return -1;
+  }
+
+  unsigned int slot =
+      *find_slot_in(dirs.slots, dirs.slot_count, dirs.paths, path);
+  return (int)slot - 1;
+}
+
+/**
+ * find_index - Find the index of a basename without taking the lock
+ * @name: Basename to look up
+ *
+ * Return: Index of the file on success, -1 if not found or removed
+ */
+static int find_index(const char *name) {
+  if (files.slot_count == 0) {
+    return -1;
+  }
+
+  unsigned int slot = *find_slot(name);
+  if (slot == 0 || files.removed[slot - 1]) {
+    return -1;
+  }
+  return slot - 1;
+}
+
+/**
+ * video_find - Find the index of a file in our list of video files
+ * @path: FUSE path to the file ("/file.mp4")
+ *
+ * We look the name up in a hash table, since a linear search through a large
+ * library would happen on every getattr().
+ *
+ * Return: Index of the file on success, -1 if not found
+ */
+int video_find(const char *path) {
+  pthread_rwlock_rdlock(&files_lock);
+  /* Skip the leading slash in path */
+  int index = find_index(path + 1);
+  pthread_rwlock_unlock(&files_lock);
+  return index;
+}
+
+/**
+ * first_present - Skip the removed files at the start of a chain of keys
+ * @next: index + 1 of the first file in the chain, or 0 for none
+ *
+ * The caller holds the read lock.
+ *
+ * Return: Index of the first file that isn't removed, -1 if there is none
+ */
+static int first_present(unsigned int next) {
+  while (next != 0 && files.removed[next - 1]) {
+    next = files.next_with_key[next - 1];
+  }
+  return (int)next - 1;
+}
+
+/**
+ * video_find_key - Find the films whose names normalize to a key
+ * @key: Key to look up, see normalize_title()
+ *
+ * Return: Index of the last film added with the key, -1 if there is none
+ */
+int video_find_key(const char *key) {
+  pthread_rwlock_rdlock(&files_lock);
+  int index = -1;
+  if (files.key_slot_count != 0) {
+    index = first_present(*find_slot_in(files.key_slots, files.key_slot_count,
+                                        files.keys, key));
+  }
+  pthread_rwlock_unlock(&files_lock);
+  return index;
+}
+
+/**
+ * video_next_with_key - Find the next film with the same key as a film
+ * @index: Index of the film, from video_find_key() or an earlier call
+ *
+ * Return: Index of the next film, -1 after the last one
+ */
+int video_next_with_key(unsigned int index) {
+  pthread_rwlock_rdlock(&files_lock);
+  int next = first_present(files.next_with_key[index]);
+  pthread_rwlock_unlock(&files_lock);
+  return next;
+}
+
+/**
+ * video_count - Get the number of entries in the library
+ *
+ * Return: Number of entries, including removed ones
+ */
+unsigned int video_count(void) {
+  pthread_rwlock_rdlock(&files_lock);
+  unsigned int count = files.count;
+  pthread_rwlock_unlock(&files_lock);
+  return count;
+}
+
+/**
+ * video_removed - Check whether a file has been removed from the library
+ * @index: Index of the file in video_files
+ *
+ * Return: true if the file has been removed
+ */
+bool video_removed(unsigned int index) {
+  pthread_rwlock_rdlock(&files_lock);
+  bool removed = files.removed[index];
+  pthread_rwlock_unlock(&files_lock);
+  return removed;
+}
+
+/**
+ * video_name - Get the basename of a file
+ * @index: Index of the file in video_files
+ *
+ * Return: Basename of the file
+ */
+const char *video_name(unsigned int index) {
+  pthread_rwlock_rdlock(&files_lock);
+  const char *name = files.names[index];
+  pthread_rwlock_unlock(&files_lock);
+  return name;
+}
+
+/**
+ * video_path - Get the full path of a file
+ * @index: Index of the file in video_files
+ *
+ * Return: Path of the file
+ */
+const char *video_path(unsigned int index) {
+  pthread_rwlock_rdlock(&files_lock);
+  const char *path = files.paths[index];
+  pthread_rwlock_unlock(&files_lock);
+  return path;
+}
+
+/**
+ * video_content_id - Get the content ID of a file
+ * @index: Index of the file in video_files
+ *
+ * The deduplication task may update content IDs while FUSE threads are reading
+ * them, so we load the value atomically. Relaxed ordering is enough because
+ * either the old or the new ID refers to a file with the same contents.
+ *
+ * Return: Index of the file whose contents are read in place of this one
+ */
+unsigned int video_content_id(unsigned int index) {
+  pthread_rwlock_rdlock(&files_lock);
+  unsigned int content_id =
+      atomic_load_explicit(&files.content_ids[index], memory_order_relaxed);
+  pthread_rwlock_unlock(&files_lock);
+  return content_id;
+}
+
+/**
+ * video_generation - Get the current content generation
+ *
+ * Return: Generation number, see video_merge_content()
+ */
+unsigned int video_generation(void) {
+  pthread_rwlock_rdlock(&files_lock);
+  unsigned int current = generation;
+  pthread_rwlock_unlock(&files_lock);
+  return current;
+}
+
+/**
+ * video_listing - Get the current listing version
+ *
+ * Return: A number that changes whenever a file appears or disappears
+ */
+unsigned int video_listing(void) { return atomic_load(&listing); }
+
+/**
+ * video_merge_content - Point a file at the content ID of an identical file
+ * @index: Index of the file in video_files
+ * @content_id: Content ID of the identical file
+ * @since: Generation when the files were compared
+ *
+ * If either file may have changed since they were compared, we leave them
+ * alone, since they may not be identical anymore.
+ *
+ * Return: 0 on success, -1 if the comparison is stale
+ */
+int video_merge_content(unsigned int index, unsigned int content_id,
+                        unsigned int since) {
+  pthread_rwlock_wrlock(&files_lock);
+  if (since != generation || files.removed[index] ||
+      files.removed[content_id]) {
+    pthread_rwlock_unlock(&files_lock);
+    return -1;
+  }
+
+  unsigned int old = atomic_load_explicit(&files.content_ids[index],
+                                          memory_order_relaxed);
+  if (old == index && content_id != index) {
+    shared++;
+  }
+  atomic_store_explicit(&files.content_ids[index], content_id,
+                        memory_order_relaxed);
+  pthread_rwlock_unlock(&files_lock);
+  return 0;
+}
+
+/**
+ * video_policy - Get the policy of a file
+ * @index: Index of the file in video_files
+ *
+ * Return: ID of the policy in the configuration's policies
+ */
+uint8_t video_policy(unsigned int index) {
+  pthread_rwlock_rdlock(&files_lock);
+  uint8_t policy = files.policies[index];
+  pthread_rwlock_unlock(&files_lock);
+  return policy;
+}
+
+/**
+ * video_dev - Get the device that a file is on
+ * @index: Index of the file in video_files
+ *
+ * Return: Device number, or 0 if we don't know it yet
+ */
+dev_t video_dev(unsigned int index) {
+  pthread_rwlock_rdlock(&files_lock);
+  dev_t dev = files.devs[index];
+  pthread_rwlock_unlock(&files_lock);
+  return dev;
+}
+
+/**
+ * video_backing_path - Get the path that reads for a file should go to
+ * @index: Index of the file in video_files
+ *
+ * When several names in the library have identical contents, we always read
+ * from the same one of them. The kernel page cache is per-inode, so this means
+ * that playing any of the copies warms the cache for all of them instead of
+ * caching the same film several times over.
+ *
+ * Return: Path of the backing file
+ */
+const char *video_backing_path(unsigned int index) {
+  pthread_rwlock_rdlock(&files_lock);
+  unsigned int content_id =
+      atomic_load_explicit(&files.content_ids[index], memory_order_relaxed);
+  const char *path = files.paths[content_id];
+  pthread_rwlock_unlock(&files_lock);
+  return path;
+}
+
+/**
+ * video_remote - Check whether a file is a remote film
+ * @index: Index of the file in video_files
+ *
+ * The paths are never freed, so we don't need the lock to look at one.
+ *
+ * Return: true if the file's path is a URL
+ */
+bool video_remote(unsigned int index) { return is_remote(video_path(index)); }
+
+/**
+ * video_remote_size - Get the size of a remote film
+ * @index: Index of the file in video_files
+ *
+ * Return: Size in bytes as listed by the remote index, 0 for local files
+ */
+off_t video_remote_size(unsigned int index) {
+  pthread_rwlock_rdlock(&files_lock);
+  off_t size = files.sizes[index];
+  pthread_rwlock_unlock(&files_lock);
+  return size;
+}
+
+/**
+ * video_byte_rate - Get the last measured playback rate of a film
+ * @index: Index of the file in video_files
+ *
+ * Return: Playback rate in bytes per second, 0 if it hasn't been measured
+ */
+uint64_t video_byte_rate(unsigned int index) {
+  pthread_rwlock_rdlock(&files_lock);
+  unsigned int content_id =
+      atomic_load_explicit(&files.content_ids[index], memory_order_relaxed);
+  uint64_t rate = atomic_load_explicit(&files.byte_rates[content_id],
+                                       memory_order_relaxed);
+  pthread_rwlock_unlock(&files_lock);
+  return rate;
+}
+
+/**
+ * video_set_byte_rate - Remember the measured playback rate of a film
+ * @index: Index of the file in video_files
+ * @rate: Playback rate in bytes per second
+ *
+ * We store the rate under the content ID, so it applies to every copy.
+ */
+void video_set_byte_rate(unsigned int index, uint64_t rate) {
+  pthread_rwlock_rdlock(&files_lock);
+  unsigned int content_id =
+      atomic_load_explicit(&files.content_ids[index], memory_order_relaxed);
+  atomic_store_explicit(&files.byte_rates[content_id], rate,
+                        memory_order_relaxed);
+  pthread_rwlock_unlock(&files_lock);
 }
 
 /**
@@ -60,12 +601,12 @@ void files_cleanup(void) {
  * Determines if a file is a video by checking its extension against a list of
  * known video formats.
  *
- * We normalize the provided extension by using tolower on each character during
- * comparison.
+ * We compare with strcasecmp() so that "FILM.MKV" counts as well, without
+ * changing the name that we later build the path from.
  *
  * Return: true if file has video extension, false otherwise
  */
-static bool has_video_extension(const char *filename) {
+bool has_video_extension(const char *filename) {
   /**
    * We use static so that we allocate the array once rather than on every call,
    * and use const because the array does not need to be modified once defined.
@@ -75,7 +616,7 @@ static bool has_video_extension(const char *filename) {
       "mkv", "mp4", "mpg", "mpeg", "webm"};
 
   /* We get the position of the last '.' in the filename. */
-  char *file_extension = strrchr(filename, '.');
+  const char *file_extension = strrchr(filename, '.');
   if (!file_extension) {
     return false;
   }
@@ -83,17 +624,12 @@ static bool has_video_extension(const char *filename) {
   /* We skip past the dot */
   file_extension++;
 
-  /* We convert each character in file_extension to lowercase */
-  for (int i = 0; file_extension[i]; i++) {
-    file_extension[i] = tolower(file_extension[i]);
-  }
-
   /**
    * Then we try to find a match in the array. This is a small array so linear
    * search is fine.
    */
   for (unsigned int i = 0; i < NUM_OF_VIDEO_EXTENSIONS; i++) {
-    if (strcmp(file_extension, video_extensions[i]) == 0) {
+    if (strcasecmp(file_extension, video_extensions[i]) == 0) {
       return true;
     }
   }
@@ -101,136 +637,1248 @@ static bool has_video_extension(const char *filename) {
 }
 
 /**
- * library_init - Scan LIBRARY_PATH and build list of video files
+ * resize_files - Resize the arrays in video_files to hold a number of entries
+ * @size: Number of entries that the arrays should hold
  *
- * This function opens the library directory, reads all the entries, filters for
- * video files, stores filenames and full paths in video_files struct, and
- * dynamically grows the arrays in the struct if there are more than 64 files.
+ * realloc() with a NULL pointer behaves like malloc(), so we use this for the
+ * initial allocation as well as for growing the arrays.
+ *
+ * We use a temporary variable for each array so that we don't lose the original
+ * pointer if realloc fails.
  *
  * Return: 0 on success, -1 on error
  */
-int library_init(void) {
-  const char *library_path = get_config()->library_path;
+static int resize_files(unsigned int size) {
+  char **names_tmp = realloc(files.names, size * sizeof(char *));
+  if (names_tmp == NULL) {
+    fprintf(stderr, "Memory reallocation failed for files.names: %s",
+            strerror(errno));
+    return -1;
+  }
+  files.names = names_tmp;
 
-  /* Initial size for the arrays in video_files, but we realloc if needed */
-  unsigned int buffer_size = FILES_MAX;
+  char **paths_tmp = realloc(files.paths, size * sizeof(char *));
+  if (paths_tmp == NULL) {
+    fprintf(stderr, "Memory reallocation failed for files.paths: %s",
+            strerror(errno));
+    return -1;
+  }
+  files.paths = paths_tmp;
 
-  files.names = malloc(buffer_size * sizeof(char *));
-  if (!files.names) {
-    fprintf(stderr, "Memory allocation failed for files.names: %s",
+  _Atomic unsigned int *content_ids_tmp =
+      realloc(files.content_ids, size * sizeof(*files.content_ids));
+  if (content_ids_tmp == NULL) {
+    fprintf(stderr, "Memory reallocation failed for files.content_ids: %s",
             strerror(errno));
     return -1;
   }
+  files.content_ids = content_ids_tmp;
 
-  files.paths = malloc(buffer_size * sizeof(char *));
-  if (!files.paths) {
-    fprintf(stderr, "Memory allocation failed for files.paths: %s",
+  _Atomic uint64_t *byte_rates_tmp =
+      realloc(files.byte_rates, size * sizeof(*files.byte_rates));
+  if (byte_rates_tmp == NULL) {
+    fprintf(stderr, "Memory reallocation failed for files.byte_rates: %s",
             strerror(errno));
     return -1;
   }
+  files.byte_rates = byte_rates_tmp;
 
-  files.count = 0;
+  bool *removed_tmp = realloc(files.removed, size * sizeof(bool));
+  if (removed_tmp == NULL) {
+    fprintf(stderr, "Memory reallocation failed for files.removed: %s",
+            strerror(errno));
+    return -1;
+  }
+  files.removed = removed_tmp;
 
-  /*
-   * Open the library directory for reading. This gives us a DIR* that we use
-   * with readdir to iterate through entries. DIR* must be closed with
-   * closedir() when we are done with them.
-   */
-  struct dirent *dp;
-  DIR *dir = opendir(library_path);
-  if (!dir) {
-    fprintf(stderr, "Failed to open directory %s: %s", library_path,
+  unsigned int *next_in_dir_tmp =
+      realloc(files.next_in_dir, size * sizeof(unsigned int));
+  if (next_in_dir_tmp == NULL) {
+    fprintf(stderr, "Memory reallocation failed for files.next_in_dir: %s",
             strerror(errno));
-    free(files.names);
-    free(files.paths);
     return -1;
   }
+  files.next_in_dir = next_in_dir_tmp;
 
-  /* We iterate through all of the directory entries. readdir() returns a
-   * pointer to the next entry, or NULL when done. */
-  while ((dp = readdir(dir))) {
-    /* We only care about regular files, not directories or special files */
-    if (dp->d_type == DT_REG) {
-      if (!has_video_extension(dp->d_name)) {
-        continue;
-      }
+  unsigned int *last_read_tmp =
+      realloc(files.last_read, size * sizeof(unsigned int));
+  if (last_read_tmp == NULL) {
+    fprintf(stderr, "Memory reallocation failed for files.last_read: %s",
+            strerror(errno));
+    return -1;
+  }
+  files.last_read = last_read_tmp;
 
-      /*
-       * We duplicate the filename into our names array because dp->d_name
-       * points to readdir() state that will be overwritten on the next call.
-       */
-      files.names[files.count] = strdup(dp->d_name);
-      if (files.names[files.count] == NULL) {
-        fprintf(stderr, "Failed to duplicate d_name to files.names[%d]: %s",
-                files.count, strerror(errno));
-        return -1;
-      }
-
-      /* We allocate space for the full file path */
-      files.paths[files.count] = malloc(PATH_MAX);
-      if (!files.paths[files.count]) {
-        fprintf(stderr, "Memory allocation failed for files.names[%d]: %s",
-                files.count, strerror(errno));
-        free(files.names[files.count]);
-        for (int i = (files.count - 1); i >= 0; i--) {
-          free(files.names[i]);
-          free(files.paths[i]);
-        }
-        free(files.names);
-        free(files.paths);
-        return -1;
-      }
-
-      /* Build the full path */
-      snprintf(files.paths[files.count], PATH_MAX, "%s%s", library_path,
-               dp->d_name);
-
-      files.count++;
-
-      /*
-       * We check if we have filled the arrays and expand them by FILES_MAX (64)
-       * if so.
-       */
-      if (files.count == (unsigned int)buffer_size) {
-        buffer_size += FILES_MAX;
-
-        /*
-         * We use a temporary variable here so that we don't lose the original
-         * pointer if realloc fails.
-         */
-        char **names_tmp = realloc(files.names, buffer_size * sizeof(char *));
-        if (names_tmp == NULL) {
-          fprintf(stderr, "Memory reallocation failed for files.names: %s",
-                  strerror(errno));
-          files_cleanup();
-          return -1;
-        } else {
-          files.names = names_tmp;
-        }
+  uint8_t *policies_tmp = realloc(files.policies, size * sizeof(uint8_t));
+  if (policies_tmp == NULL) {
+    fprintf(stderr, "Memory reallocation failed for files.policies: %s",
+            strerror(errno));
+    return -1;
+  }
+  files.policies = policies_tmp;
 
-        char **paths_tmp = realloc(files.paths, buffer_size * sizeof(char *));
-        if (paths_tmp == NULL) {
-          fprintf(stderr, "Memory reallocation failed for files.names: %s",
-                  strerror(errno));
-          files_cleanup();
-          return -1;
-        } else {
-          files.paths = paths_tmp;
-        }
-      }
-    }
+  dev_t *devs_tmp = realloc(files.devs, size * sizeof(dev_t));
+  if (devs_tmp == NULL) {
+    fprintf(stderr, "Memory reallocation failed for files.devs: %s",
+            strerror(errno));
+    return -1;
   }
+  files.devs = devs_tmp;
 
-  /* 
-   * Directory streams are like file descriptors in that they are a finite
-   * resource, so it is important to close them when we are finished using them.
-   */
-  if (closedir(dir) == -1) {
-    fprintf(stderr, "Failed to close directory %s: %s", library_path,
+  off_t *sizes_tmp = realloc(files.sizes, size * sizeof(off_t));
+  if (sizes_tmp == NULL) {
+    fprintf(stderr, "Memory reallocation failed for files.sizes: %s",
+            strerror(errno));
+    return -1;
+  }
+  files.sizes = sizes_tmp;
+
+  char **keys_tmp = realloc(files.keys, size * sizeof(char *));
+  if (keys_tmp == NULL) {
+    fprintf(stderr, "Memory reallocation failed for files.keys: %s",
+            strerror(errno));
+    return -1;
+  }
+  files.keys = keys_tmp;
+
+  unsigned int *next_with_key_tmp =
+      realloc(files.next_with_key, size * sizeof(unsigned int));
+  if (next_with_key_tmp == NULL) {
+    fprintf(stderr, "Memory reallocation failed for files.next_with_key: %s",
             strerror(errno));
+    return -1;
+  }
+  files.next_with_key = next_with_key_tmp;
+
+  capacity = size;
+  return 0;
+}
+
+/**
+ * resize_dirs - Resize the arrays in library_dirs to hold a number of entries
+ * @size: Number of directories that the arrays should hold
+ *
+ * This works the same way as resize_files().
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int resize_dirs(unsigned int size) {
+  char **paths_tmp = realloc(dirs.paths, size * sizeof(char *));
+  if (paths_tmp == NULL) {
+    fprintf(stderr, "Memory reallocation failed for dirs.paths: %s",
+            strerror(errno));
+    return -1;
+  }
+  dirs.paths = paths_tmp;
+
+  struct timespec *mtimes_tmp =
+      realloc(dirs.mtimes, size * sizeof(struct timespec));
+  if (mtimes_tmp == NULL) {
+    fprintf(stderr, "Memory reallocation failed for dirs.mtimes: %s",
+            strerror(errno));
+    return -1;
+  }
+  dirs.mtimes = mtimes_tmp;
+
+  unsigned int *first_files_tmp =
+      realloc(dirs.first_files, size * sizeof(unsigned int));
+  if (first_files_tmp == NULL) {
+    fprintf(stderr, "Memory reallocation failed for dirs.first_files: %s",
+            strerror(errno));
+    return -1;
+  }
+  dirs.first_files = first_files_tmp;
+
+  bool *removed_tmp = realloc(dirs.removed, size * sizeof(bool));
+  if (removed_tmp == NULL) {
+    fprintf(stderr, "Memory reallocation failed for dirs.removed: %s",
+            strerror(errno));
+    return -1;
+  }
+  dirs.removed = removed_tmp;
+
+  dev_t *devs_tmp = realloc(dirs.devs, size * sizeof(dev_t));
+  if (devs_tmp == NULL) {
+    fprintf(stderr, "Memory reallocation failed for dirs.devs: %s",
+            strerror(errno));
+    return -1;
+  }
+  dirs.devs = devs_tmp;
+
+  dir_capacity = size;
+  return 0;
+}
+
+/**
+ * init_tables - Allocate the arrays and lookup tables for an empty library
+ *
+ * The caller holds the write lock.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int init_tables(void) {
+  /* Initial size for the arrays, but we realloc if needed */
+  files.count = 0;
+  dirs.count = 0;
+  if (resize_files(FILES_MAX) == -1 || resize_dirs(FILES_MAX) == -1 ||
+      grow_table(&files.slots, &files.slot_count, files.names, 0) == -1 ||
+      grow_table(&files.key_slots, &files.key_slot_count, files.keys, 0) ==
+          -1 ||
+      grow_table(&dirs.slots, &dirs.slot_count, dirs.paths, 0) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * add_dir - Add a directory to library_dirs
+ * @path: Full path of the directory, ending in '/'
+ *
+ * A directory that already has an entry gets it back, like files do. The
+ * caller holds the write lock.
+ *
+ * Return: Index of the directory on success, -1 on error
+ */
+static int add_dir(const char *path) {
+  unsigned int *slot =
+      find_slot_in(dirs.slots, dirs.slot_count, dirs.paths, path);
+  if (*slot != 0) {
+    dirs.removed[*slot - 1] = false;
+    return *slot - 1;
+  }
+
+  if (dirs.count == dir_capacity &&
+      resize_dirs(dir_capacity + FILES_MAX) == -1) {
+    return -1;
+  }
+
+  char *path_copy = strdup(path);
+  if (!path_copy) {
+    fprintf(stderr, "Failed to duplicate path to dirs.paths[%d]: %s",
+            dirs.count, strerror(errno));
+    return -1;
+  }
+
+  unsigned int index = dirs.count;
+  dirs.paths[index] = path_copy;
+
+  /* We haven't read the directory yet */
+  dirs.mtimes[index].tv_sec = 0;
+  dirs.mtimes[index].tv_nsec = 0;
+  dirs.first_files[index] = 0;
+  dirs.removed[index] = false;
+  dirs.devs[index] = 0;
+  *slot = index + 1;
+  dirs.count++;
+  atomic_store(&index_dirty, true);
+
+  if (dirs.count * 2 > dirs.slot_count &&
+      grow_table(&dirs.slots, &dirs.slot_count, dirs.paths, dirs.count) ==
+          -1) {
+    return -1;
+  }
+  return index;
+}
+
+/**
+ * same_time - Compare two timestamps
+ *
+ * Return: true if they are equal
+ */
+static bool same_time(const struct timespec *a, const struct timespec *b) {
+  return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/**
+ * record_mtime - Remember the modification time of a directory we are reading
+ * @dir: Index of the directory in library_dirs
+ * @dir_stat: Status of the directory from before we read it
+ *
+ * If the directory changed just before we read it, it may change again within
+ * the same second without its mtime changing, so we store zero instead and
+ * read it again on the next rescan. The caller holds the write lock.
+ */
+static void record_mtime(unsigned int dir, const struct stat *dir_stat) {
+  struct timespec mtime = dir_stat->st_mtim;
+  if (mtime.tv_sec + RESCAN_RACY_SECONDS >= time(NULL)) {
+    mtime.tv_sec = 0;
+    mtime.tv_nsec = 0;
+  }
+
+  if (!same_time(&dirs.mtimes[dir], &mtime)) {
+    dirs.mtimes[dir] = mtime;
+    atomic_store(&index_dirty, true);
+  }
+}
+
+/**
+ * record_dev - Remember the device that a directory is on
+ * @dir: Index of the directory in library_dirs
+ * @dir_stat: Status of the directory
+ *
+ * The files in a directory are on the same device as the directory, unless
+ * something is mounted over one of them, so they take its device too. The
+ * caller holds the write lock.
+ */
+static void record_dev(unsigned int dir, const struct stat *dir_stat) {
+  if (dirs.devs[dir] == dir_stat->st_dev) {
+    return;
+  }
+
+  dirs.devs[dir] = dir_stat->st_dev;
+  for (unsigned int i = dirs.first_files[dir]; i;
+       i = files.next_in_dir[i - 1]) {
+    files.devs[i - 1] = dir_stat->st_dev;
+  }
+}
+
+/**
+ * add_file - Add a video file to video_files
+ * @path: Full path of the file
+ * @dir: Index of the directory that the file is in
+ *
+ * If the file already has an entry, even a removed one, we reuse it so that its
+ * index stays the same. The caller holds the write lock.
+ *
+ * Return: Index of the file on success, -1 on error, -2 if another file with
+ * the same name is already in the library
+ */
+static int add_file(const char *path, unsigned int dir) {
+  const char *name = strrchr(path, '/') + 1;
+
+  unsigned int *slot = find_slot(name);
+  if (*slot != 0) {
+    unsigned int index = *slot - 1;
+    if (strcmp(files.paths[index], path) == 0) {
+      files.last_read[index] = reads;
+      files.devs[index] = dirs.devs[dir];
+      if (files.removed[index]) {
+        files.removed[index] = false;
+        files_added++;
+        atomic_store(&index_dirty, true);
+        atomic_fetch_add(&listing, 1);
+      }
+      return index;
+    }
+    if (!files.removed[index]) {
+      if (get_config()->debug) {
+        printf("Skipping %s, %s is already in the library.\n", path,
+               files.paths[index]);
+      }
+      return -2;
+    }
+  }
+
+  /*
+   * We check if we have filled the arrays and expand them by FILES_MAX (64)
+   * if so.
+   */
+  if (files.count == capacity && resize_files(capacity + FILES_MAX) == -1) {
+    return -1;
+  }
+
+  /*
+   * We only allocate as much as the path and the key need rather than
+   * PATH_MAX, which adds up in a library of hundreds of thousands of files.
+   * The key goes right after the path, and is never longer than the name.
+   */
+  size_t path_len = strlen(path);
+  char *path_copy = malloc(path_len + 1 + strlen(name) + 1);
+  if (!path_copy) {
+    fprintf(stderr, "Failed to duplicate path to files.paths[%d]: %s",
+            files.count, strerror(errno));
+    return -1;
+  }
+  memcpy(path_copy, path, path_len + 1);
+
+  unsigned int index = files.count;
+  files.paths[index] = path_copy;
+  files.names[index] = path_copy + (name - path);
+  files.keys[index] = path_copy + path_len + 1;
+  normalize_title(name, files.keys[index]);
+
+  unsigned int *key_slot = find_slot_in(files.key_slots, files.key_slot_count,
+                                        files.keys, files.keys[index]);
+  files.next_with_key[index] = *key_slot;
+  *key_slot = index + 1;
+
+  /* Every file is its own content ID until proven to be a duplicate */
+  atomic_init(&files.content_ids[index], index);
+
+  /* We don't know how fast the film plays until it has been watched */
+  atomic_init(&files.byte_rates[index], 0);
+
+  /* The rules were compiled at startup, so matching the path is all we do */
+  files.policies[index] = match_policy(path);
+
+  files.removed[index] = false;
+  files.last_read[index] = reads;
+  files.devs[index] = dirs.devs[dir];
+  files.sizes[index] = 0;
+  files.next_in_dir[index] = dirs.first_files[dir];
+  dirs.first_files[dir] = index + 1;
+  *slot = index + 1;
+  files.count++;
+  files_added++;
+  atomic_store(&index_dirty, true);
+  atomic_fetch_add(&listing, 1);
+
+  if (files.count * 2 > files.slot_count &&
+      (grow_table(&files.slots, &files.slot_count, files.names, files.count) ==
+           -1 ||
+       grow_table(&files.key_slots, &files.key_slot_count, files.keys,
+                  files.count) == -1)) {
+    return -1;
+  }
+  return index;
+}
+
+/**
+ * detach_contents - Give files whose contents changed or went away their own
+ * content IDs again
+ * @indices: Indices of the files
+ * @count: Number of indices
+ *
+ * Identical copies that read through one of these files are moved to the
+ * first of them instead, along with the playback rate. The caller holds the
+ * write lock.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int detach_contents(const unsigned int *indices, unsigned int count) {
+  if (count == 0) {
+    return 0;
+  }
+  generation++;
+
+  bool *detached = calloc(files.count, sizeof(bool));
+  if (!detached) {
+    fprintf(stderr, "Memory allocation failed for detached files: %s",
+            strerror(errno));
+    return -1;
+  }
+  for (unsigned int i = 0; i < count; i++) {
+    detached[indices[i]] = true;
+  }
+
+  /* Without any copies, there is nothing to move */
+  if (shared > 0) {
+    unsigned int *replacement = malloc(files.count * sizeof(unsigned int));
+    if (!replacement) {
+      fprintf(stderr, "Memory allocation failed for replacements: %s",
+              strerror(errno));
+      free(detached);
+      return -1;
+    }
+    for (unsigned int i = 0; i < files.count; i++) {
+      replacement[i] = UINT_MAX;
+    }
+
+    for (unsigned int i = 0; i < files.count; i++) {
+      unsigned int content_id =
+          atomic_load_explicit(&files.content_ids[i], memory_order_relaxed);
+      if (content_id == i) {
+        continue;
+      }
+
+      if (detached[i]) {
+        atomic_store_explicit(&files.content_ids[i], i, memory_order_relaxed);
+        shared--;
+      } else if (detached[content_id]) {
+        /* The first remaining copy takes over as the content ID */
+        if (replacement[content_id] == UINT_MAX) {
+          replacement[content_id] = i;
+          atomic_store_explicit(&files.byte_rates[i],
+                                atomic_load(&files.byte_rates[content_id]),
+                                memory_order_relaxed);
+          atomic_store_explicit(&files.content_ids[i], i, memory_order_relaxed);
+          shared--;
+        } else {
+          atomic_store_explicit(&files.content_ids[i], replacement[content_id],
+                                memory_order_relaxed);
+        }
+      }
+    }
+    free(replacement);
+  }
+
+  for (unsigned int i = 0; i < count; i++) {
+    atomic_store_explicit(&files.byte_rates[indices[i]], 0,
+                          memory_order_relaxed);
+  }
+
+  free(detached);
+  return 0;
+}
+
+static int scan_directory(const char *dir_path, bool required);
+
+/**
+ * read_directory - Add the video files in an open directory
+ * @dir: The open directory
+ * @dir_path: Path of the directory, ending in '/'
+ * @dir_index: Index of the directory in library_dirs
+ * @full: Whether to scan subdirectories that we have read before as well
+ *
+ * Subdirectories that we have never read, or that were removed, are always
+ * scanned. A rescan leaves the others to be checked on their own. The caller
+ * holds the write lock.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int read_directory(DIR *dir, const char *dir_path,
+                          unsigned int dir_index, bool full) {
+  /* We allocate this rather than using the stack, since we recurse */
+  char *path = malloc(PATH_MAX);
+  if (!path) {
+    fprintf(stderr, "Memory allocation failed for path: %s", strerror(errno));
+    return -1;
+  }
+
+  /* We iterate through all of the directory entries. readdir() returns a
+   * pointer to the next entry, or NULL when done. */
+  int result = 0;
+  struct dirent *dp;
+  while ((dp = readdir(dir))) {
+    if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0) {
+      continue;
+    }
+
+    int path_len = snprintf(path, PATH_MAX, "%s%s", dir_path, dp->d_name);
+    if (path_len >= PATH_MAX - 1) {
+      continue;
+    }
+
+    /* Some filesystems don't fill in d_type, so we have to ask lstat() */
+    unsigned char type = dp->d_type;
+    if (type == DT_UNKNOWN) {
+      struct stat file_stat;
+      if (lstat(path, &file_stat) == 0) {
+        type = S_ISDIR(file_stat.st_mode)   ? DT_DIR
+               : S_ISREG(file_stat.st_mode) ? DT_REG
+                                            : DT_UNKNOWN;
+      }
+    }
+
+    if (type == DT_DIR) {
+      path[path_len] = '/';
+      path[path_len + 1] = '\0';
+      if (!full) {
+        int known = find_dir(path);
+        if (known >= 0 && !dirs.removed[known]) {
+          continue;
+        }
+      }
+      if (scan_directory(path, false) == -1) {
+        result = -1;
+        break;
+      }
+    } else if (type == DT_REG && has_video_extension(dp->d_name)) {
+      if (add_file(path, dir_index) == -1) {
+        result = -1;
+        break;
+      }
+    }
+  }
+
+  free(path);
+  return result;
+}
+
+/**
+ * scan_directory - Add the video files in a directory and its subdirectories
+ * @dir_path: Path of the directory, ending in '/'
+ * @required: Whether failing to open the directory is an error
+ *
+ * A subdirectory that we can't read shouldn't stop us from serving the rest of
+ * the library, so only LIBRARY_PATH itself is required. We don't follow
+ * symbolic links, so a link to a parent directory can't loop forever.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int scan_directory(const char *dir_path, bool required) {
+  /*
+   * Open the directory for reading. This gives us a DIR* that we use with
+   * readdir to iterate through entries. DIR* must be closed with closedir()
+   * when we are done with them.
+   */
+  DIR *dir = opendir(dir_path);
+  if (!dir) {
+    fprintf(stderr, "Failed to open directory %s: %s", dir_path,
+            strerror(errno));
+    return required ? -1 : 0;
+  }
+
+  int result = add_dir(dir_path);
+  if (result >= 0) {
+    unsigned int dir_index = result;
+
+    /* We take the mtime before reading, so changes while we read show up */
+    struct stat dir_stat;
+    if (fstat(dirfd(dir), &dir_stat) == 0) {
+      record_mtime(dir_index, &dir_stat);
+      record_dev(dir_index, &dir_stat);
+    }
+    result = read_directory(dir, dir_path, dir_index, true);
+  }
+
+  /*
+   * Directory streams are like file descriptors in that they are a finite
+   * resource, so it is important to close them when we are finished using them.
+   */
+  if (closedir(dir) == -1) {
+    fprintf(stderr, "Failed to close directory %s: %s", dir_path,
+            strerror(errno));
+    return -1;
+  }
+
+  return result == -1 ? -1 : 0;
+}
+
+/**
+ * snapshot_removed - Copy the removed flags of every entry
+ *
+ * Return: Malloc'd copy on success, NULL on error
+ */
+static bool *snapshot_removed(void) {
+  /* We add one so that an empty library doesn't call malloc(0) */
+  bool *was_removed = malloc(files.count * sizeof(bool) + 1);
+  if (!was_removed) {
+    fprintf(stderr, "Memory allocation failed for removed flags: %s",
+            strerror(errno));
+    return NULL;
+  }
+  memcpy(was_removed, files.removed, files.count * sizeof(bool));
+  return was_removed;
+}
+
+/**
+ * detach_flipped - Detach the files that were removed or came back
+ * @was_removed: Removed flags from before, see snapshot_removed()
+ * @old_count: Number of entries when the snapshot was taken
+ *
+ * A file that comes back after being removed may have different contents, so
+ * it is treated like a changed file.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int detach_flipped(const bool *was_removed, unsigned int old_count) {
+  unsigned int *detached = malloc(old_count * sizeof(unsigned int) + 1);
+  if (!detached) {
+    fprintf(stderr, "Memory allocation failed for detached files: %s",
+            strerror(errno));
+    return -1;
+  }
+
+  unsigned int detached_count = 0;
+  for (unsigned int i = 0; i < old_count; i++) {
+    if (was_removed[i] != files.removed[i]) {
+      detached[detached_count++] = i;
+    }
+  }
+
+  int result = detach_contents(detached, detached_count);
+  free(detached);
+  return result;
+}
+
+/**
+ * rescan_directory - Read a directory whose mtime changed again
+ * @dir_index: Index of the directory in library_dirs
+ *
+ * Every file that the read finds is stamped with the number of the read, so
+ * the files of the directory without the stamp are gone. Files that came back
+ * after being removed may have new contents, so we detach them, along with the
+ * ones that are now gone. The caller holds the write lock.
+ *
+ * Return: Number of files that appeared or disappeared, -1 on error
+ */
+static int rescan_directory(unsigned int dir_index) {
+  const char *dir_path = dirs.paths[dir_index];
+  DIR *dir = opendir(dir_path);
+  if (!dir) {
+    fprintf(stderr, "Failed to open directory %s: %s", dir_path,
+            strerror(errno));
+    return 0;
+  }
+
+  struct stat dir_stat;
+  if (fstat(dirfd(dir), &dir_stat) == 0) {
+    record_mtime(dir_index, &dir_stat);
+    record_dev(dir_index, &dir_stat);
+  }
+
+  bool *was_removed = snapshot_removed();
+  if (!was_removed) {
+    closedir(dir);
+    return -1;
+  }
+
+  unsigned int old_count = files.count;
+  unsigned int added_before = files_added;
+  unsigned int this_read = ++reads;
+  int result = read_directory(dir, dir_path, dir_index, false);
+  closedir(dir);
+
+  /*
+   * On error we keep the files we didn't get to, rather than lose half of the
+   * directory
+   */
+  unsigned int gone = 0;
+  if (result != -1) {
+    for (unsigned int i = dirs.first_files[dir_index]; i;
+         i = files.next_in_dir[i - 1]) {
+      if (!files.removed[i - 1] && files.last_read[i - 1] != this_read) {
+        files.removed[i - 1] = true;
+        gone++;
+      }
+    }
+  }
+
+  if (gone > 0) {
+    atomic_store(&index_dirty, true);
+    atomic_fetch_add(&listing, 1);
+  }
+  if (detach_flipped(was_removed, old_count) == -1) {
+    result = -1;
+  }
+  free(was_removed);
+  return result == -1 ? -1 : (int)(gone + files_added - added_before);
+}
+
+/**
+ * video_path_added - Add a file or directory that appeared in the library
+ * @path: Full path of the file or directory
+ *
+ * A file that already had an entry may have new contents, so it no longer
+ * shares a content ID with its old copies.
+ */
+void video_path_added(const char *path) {
+  struct stat file_stat;
+  if (lstat(path, &file_stat) == -1) {
+    return;
+  }
+
+  pthread_rwlock_wrlock(&files_lock);
+
+  char dir_path[PATH_MAX];
+  if (S_ISDIR(file_stat.st_mode)) {
+    bool *was_removed = snapshot_removed();
+    if (was_removed && snprintf(dir_path, PATH_MAX, "%s/", path) < PATH_MAX) {
+      unsigned int old_count = files.count;
+      scan_directory(dir_path, false);
+      detach_flipped(was_removed, old_count);
+    }
+    free(was_removed);
+  } else if (S_ISREG(file_stat.st_mode) && has_video_extension(path)) {
+    /* The directory's path is everything up to the file's name */
+    size_t dir_len = strrchr(path, '/') + 1 - path;
+    memcpy(dir_path, path, dir_len);
+    dir_path[dir_len] = '\0';
+
+    int dir_index = find_dir(dir_path);
+    if (dir_index < 0 || dirs.removed[dir_index]) {
+      /* We missed the directory itself, so we read all of it */
+      scan_directory(dir_path, false);
+    } else {
+      unsigned int old_count = files.count;
+      int index = add_file(path, dir_index);
+      if (index >= 0 && (unsigned int)index < old_count) {
+        unsigned int changed = index;
+        detach_contents(&changed, 1);
+      }
+    }
+  }
+
+  pthread_rwlock_unlock(&files_lock);
+}
+
+/**
+ * remove_path - Mark a file, or the files and directories under a directory, as
+ * removed without taking the lock
+ * @path: Full path of the file or directory, without a trailing '/'
+ * @path_len: Length of the path
+ *
+ * Return: Number of files removed, -1 on error
+ */
+static int remove_path(const char *path, size_t path_len) {
+  unsigned int *removed = malloc(files.count * sizeof(unsigned int) + 1);
+  if (!removed) {
+    fprintf(stderr, "Memory allocation failed for removed files: %s",
+            strerror(errno));
+    return -1;
+  }
+
+  /*
+   * We don't know whether the path was a file or a directory anymore, so we
+   * check for both.
+   */
+  unsigned int removed_count = 0;
+  for (unsigned int i = 0; i < files.count; i++) {
+    if (files.removed[i] || strncmp(files.paths[i], path, path_len) != 0) {
+      continue;
+    }
+    char next = files.paths[i][path_len];
+    if (next == '\0' || next == '/') {
+      files.removed[i] = true;
+      removed[removed_count++] = i;
+    }
+  }
+
+  for (unsigned int i = 0; i < dirs.count; i++) {
+    if (!dirs.removed[i] && strncmp(dirs.paths[i], path, path_len) == 0 &&
+        dirs.paths[i][path_len] == '/') {
+      dirs.removed[i] = true;
+      atomic_store(&index_dirty, true);
+    }
+  }
+
+  if (removed_count > 0) {
+    atomic_store(&index_dirty, true);
+    atomic_fetch_add(&listing, 1);
+  }
+  int result = detach_contents(removed, removed_count);
+  free(removed);
+  return result == -1 ? -1 : (int)removed_count;
+}
+
+/**
+ * video_path_removed - Mark a file, or the files under a directory, as removed
+ * @path: Full path of the file or directory
+ */
+void video_path_removed(const char *path) {
+  pthread_rwlock_wrlock(&files_lock);
+  remove_path(path, strlen(path));
+  pthread_rwlock_unlock(&files_lock);
+}
+
+/**
+ * video_rescan - Check every directory in the library for changes
+ *
+ * On a network filesystem, each stat() is a round trip to the server, which is
+ * why we only read directories whose mtime changed. We don't hold the lock
+ * while we wait for stat(), only while we apply the changes to one directory,
+ * so FUSE requests aren't held up for the length of the rescan.
+ *
+ * A directory that can't be reached for another reason than being gone, like
+ * a server that is down, is left as it is until a later rescan.
+ *
+ * Return: Number of files that appeared or disappeared, -1 on error
+ */
+int video_rescan(void) {
+  pthread_rwlock_rdlock(&files_lock);
+  unsigned int dir_count = dirs.count;
+  pthread_rwlock_unlock(&files_lock);
+
+  const char *library_path = get_config()->library_path;
+  int changes = 0;
+  for (unsigned int i = 0; i < dir_count && !executor_stopping(); i++) {
+    /* The paths are never freed, so we can use them without the lock */
+    pthread_rwlock_rdlock(&files_lock);
+    const char *path = dirs.paths[i];
+    bool removed = dirs.removed[i];
+    struct timespec mtime = dirs.mtimes[i];
+    dev_t dev = dirs.devs[i];
+    pthread_rwlock_unlock(&files_lock);
+    /* Remote films are listed again when remote.c refreshes the index */
+    if (removed || is_remote(path)) {
+      continue;
+    }
+
+    struct stat dir_stat;
+    int stat_result = lstat(path, &dir_stat);
+    if (stat_result == 0 && S_ISDIR(dir_stat.st_mode) &&
+        same_time(&dir_stat.st_mtim, &mtime)) {
+      /* The saved index has no devices, so the first rescan fills them in */
+      if (dir_stat.st_dev != dev) {
+        pthread_rwlock_wrlock(&files_lock);
+        record_dev(i, &dir_stat);
+        pthread_rwlock_unlock(&files_lock);
+      }
+      continue;
+    }
+
+    bool gone = stat_result == 0 ? !S_ISDIR(dir_stat.st_mode)
+                                 : errno == ENOENT || errno == ENOTDIR;
+    if (strcmp(path, library_path) == 0 && stat_result == -1) {
+      /* We keep the index as it was rather than lose all of it */
+      fprintf(stderr, "Failed to check %s: %s", path, strerror(errno));
+      return -1;
+    }
+    if (stat_result == -1 && !gone) {
+      continue;
+    }
+
+    /* The directory may have been removed while we weren't holding the lock */
+    pthread_rwlock_wrlock(&files_lock);
+    int result = dirs.removed[i] ? 0
+                 : gone          ? remove_path(path, strlen(path) - 1)
+                                 : rescan_directory(i);
+    pthread_rwlock_unlock(&files_lock);
+    if (result == -1) {
+      return -1;
+    }
+    changes += result;
+  }
+
+  return changes;
+}
+
+/**
+ * video_set_remote - Replace the remote films with those of the remote index
+ * @films: The films listed by the index
+ * @count: Number of films
+ *
+ * This works like rescanning a directory: every film listed is added, or gets
+ * its old entry back, and remote films that weren't listed this time are
+ * marked as removed. A listed film whose name is already taken by a local one
+ * is skipped.
+ *
+ * Return: Number of films that appeared or disappeared, -1 on error
+ */
+int video_set_remote(const struct remote_film *films, unsigned int count) {
+  pthread_rwlock_wrlock(&files_lock);
+  bool *was_removed = snapshot_removed();
+  if (!was_removed) {
+    pthread_rwlock_unlock(&files_lock);
+    return -1;
+  }
+
+  unsigned int old_count = files.count;
+  unsigned int added_before = files_added;
+  unsigned int this_read = ++reads;
+  int result = 0;
+  char dir_path[PATH_MAX];
+  for (unsigned int i = 0; i < count; i++) {
+    /* The directory's URL is everything up to the film's name */
+    const char *url = films[i].url;
+    size_t dir_len = strrchr(url, '/') + 1 - url;
+    if (dir_len >= PATH_MAX) {
+      continue;
+    }
+    memcpy(dir_path, url, dir_len);
+    dir_path[dir_len] = '\0';
+
+    int dir_index = add_dir(dir_path);
+    int index = dir_index == -1 ? -1 : add_file(url, dir_index);
+    if (index == -1) {
+      result = -1;
+      break;
+    }
+    if (index >= 0) {
+      files.sizes[index] = films[i].size;
+    }
+  }
+
+  /* On error we keep the films we didn't get to, like a rescan does */
+  unsigned int gone = 0;
+  for (unsigned int i = 0; i < files.count && result != -1; i++) {
+    if (!files.removed[i] && is_remote(files.paths[i]) &&
+        files.last_read[i] != this_read) {
+      files.removed[i] = true;
+      gone++;
+    }
+  }
+
+  if (gone > 0) {
+    atomic_fetch_add(&listing, 1);
+  }
+  if (detach_flipped(was_removed, old_count) == -1) {
+    result = -1;
+  }
+  free(was_removed);
+  int changes = gone + files_added - added_before;
+  pthread_rwlock_unlock(&files_lock);
+  return result == -1 ? -1 : changes;
+}
+
+/**
+ * index_file_path - Build the path of the saved index
+ * @suffix: Appended to the path, for the temporary file that we write first
+ * @path: Buffer of PATH_MAX bytes for the path
+ *
+ * Return: 0 on success, -1 if the path is too long
+ */
+static int index_file_path(const char *suffix, char *path) {
+  if (snprintf(path, PATH_MAX, "%s%s%s", get_config()->home, INDEX_FILE,
+               suffix) >= PATH_MAX) {
+    fprintf(stderr, "Index file path exceeds PATH_MAX.\n");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * write_index - Write the index to a stream without taking the lock
+ * @out: Stream to write to
+ *
+ * The index starts with INDEX_HEADER and LIBRARY_PATH, followed by one record
+ * per directory and then one per file. Records end in '\0' rather than a
+ * newline, since names may contain newlines but not NUL bytes:
+ *
+ *   D<mtime seconds>.<mtime nanoseconds> <directory path>
+ *   F<number of the directory record> <file name>
+ *
+ * Removed entries and remote films are left out, so the directories are
+ * renumbered.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int write_index(FILE *out) {
+  unsigned int *numbers = malloc(dirs.count * sizeof(unsigned int) + 1);
+  if (!numbers) {
+    fprintf(stderr, "Memory allocation failed for directory numbers: %s",
+            strerror(errno));
+    return -1;
+  }
+
+  fprintf(out, "%s%s%c", INDEX_HEADER, get_config()->library_path, '\0');
+
+  unsigned int written = 0;
+  for (unsigned int i = 0; i < dirs.count; i++) {
+    if (dirs.removed[i] || is_remote(dirs.paths[i])) {
+      continue;
+    }
+    numbers[i] = written++;
+    fprintf(out, "D%lld.%09ld %s%c", (long long)dirs.mtimes[i].tv_sec,
+            dirs.mtimes[i].tv_nsec, dirs.paths[i], '\0');
+  }
+
+  char dir_path[PATH_MAX];
+  for (unsigned int i = 0; i < files.count; i++) {
+    if (files.removed[i]) {
+      continue;
+    }
+
+    size_t dir_len = files.names[i] - files.paths[i];
+    memcpy(dir_path, files.paths[i], dir_len);
+    dir_path[dir_len] = '\0';
+    int dir_index = find_dir(dir_path);
+    if (dir_index < 0 || dirs.removed[dir_index] ||
+        is_remote(dirs.paths[dir_index])) {
+      continue;
+    }
+    fprintf(out, "F%u %s%c", numbers[dir_index], files.names[i], '\0');
+  }
+
+  free(numbers);
+  return ferror(out) ? -1 : 0;
+}
+
+/**
+ * video_save_index - Save the index of files and directories
+ *
+ * We write to a temporary file and rename it over the index, so a crash while
+ * saving leaves the old index in place rather than half of a new one.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int video_save_index(void) {
+  if (!atomic_exchange(&index_dirty, false)) {
+    return 0;
+  }
+
+  char path[PATH_MAX];
+  char tmp_path[PATH_MAX];
+  if (index_file_path("", path) == -1 ||
+      index_file_path(".tmp", tmp_path) == -1) {
+    return -1;
+  }
+
+  /* The database may not have made the configuration directory yet */
+  char *last_slash = strrchr(tmp_path, '/');
+  *last_slash = '\0';
+  if (mkdir(tmp_path, 0700) == -1 && errno != EEXIST) {
+    fprintf(stderr, "Failed to make config directory: %s", strerror(errno));
+    atomic_store(&index_dirty, true);
+    return -1;
+  }
+  *last_slash = '/';
+
+  FILE *out = fopen(tmp_path, "w");
+  if (!out) {
+    fprintf(stderr, "Failed to open %s: %s", tmp_path, strerror(errno));
+    atomic_store(&index_dirty, true);
+    return -1;
+  }
+
+  pthread_rwlock_rdlock(&files_lock);
+  int result = write_index(out);
+  pthread_rwlock_unlock(&files_lock);
+
+  if (fclose(out) == -1 || result == -1 || rename(tmp_path, path) == -1) {
+    fprintf(stderr, "Failed to save the index to %s: %s", path,
+            strerror(errno));
+    unlink(tmp_path);
+    atomic_store(&index_dirty, true);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * read_index_file - Read the saved index into memory
+ * @size: Set to the size of the index in bytes
+ *
+ * Return: Malloc'd contents followed by a '\0', NULL on error or if there is
+ * no index
+ */
+static char *read_index_file(size_t *size) {
+  char path[PATH_MAX];
+  if (index_file_path("", path) == -1) {
+    return NULL;
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    if (errno != ENOENT) {
+      fprintf(stderr, "Failed to open %s: %s", path, strerror(errno));
+    }
+    return NULL;
+  }
+
+  struct stat index_stat;
+  char *contents = NULL;
+  if (fstat(fd, &index_stat) == 0) {
+    contents = malloc(index_stat.st_size + 1);
+  }
+  if (!contents) {
+    fprintf(stderr, "Failed to read %s: %s", path, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  size_t done = 0;
+  while (done < (size_t)index_stat.st_size) {
+    ssize_t len = read(fd, contents + done, index_stat.st_size - done);
+    if (len <= 0) {
+      fprintf(stderr, "Failed to read %s: %s", path,
+              len == 0 ? "unexpected end of file" : strerror(errno));
+      free(contents);
+      close(fd);
+      return NULL;
+    }
+    done += len;
+  }
+  close(fd);
+
+  contents[done] = '\0';
+  *size = done;
+  return contents;
+}
+
+/**
+ * load_index - Fill the empty tables from the saved index
+ *
+ * An index that is for another LIBRARY_PATH, or that we can't make sense of,
+ * is ignored. The caller holds the write lock, and clears the tables if we
+ * fail partway.
+ *
+ * Return: 0 on success, -1 if there is no usable index
+ */
+static int load_index(void) {
+  size_t size;
+  char *contents = read_index_file(&size);
+  if (!contents) {
+    return -1;
+  }
+
+  const char *library_path = get_config()->library_path;
+  size_t header_len = strlen(INDEX_HEADER);
+  char *end = contents + size;
+  char *record = contents + header_len;
+  if (size < header_len || strncmp(contents, INDEX_HEADER, header_len) != 0 ||
+      strcmp(record, library_path) != 0) {
+    if (get_config()->debug) {
+      printf("Ignoring the index, it is for another library or version.\n");
+    }
+    free(contents);
+    return -1;
+  }
+
+  char path[PATH_MAX];
+  int result = 0;
+  for (record += strlen(record) + 1; record < end && result == 0;
+       record += strlen(record) + 1) {
+    char *field;
+    if (record[0] == 'D') {
+      struct timespec mtime;
+      mtime.tv_sec = strtoll(record + 1, &field, 10);
+      if (*field != '.') {
+        result = -1;
+        break;
+      }
+      mtime.tv_nsec = strtol(field + 1, &field, 10);
+      if (*field != ' ' ||
+          strncmp(field + 1, library_path, strlen(library_path)) != 0) {
+        result = -1;
+        break;
+      }
+      int dir_index = add_dir(field + 1);
+      if (dir_index == -1) {
+        result = -1;
+        break;
+      }
+      dirs.mtimes[dir_index] = mtime;
+    } else if (record[0] == 'F') {
+      unsigned long dir_index = strtoul(record + 1, &field, 10);
+      if (*field != ' ' || dir_index >= dirs.count ||
+          snprintf(path, PATH_MAX, "%s%s", dirs.paths[dir_index], field + 1) >=
+              PATH_MAX ||
+          add_file(path, dir_index) == -1) {
+        result = -1;
+      }
+    } else {
+      result = -1;
+    }
+  }
+
+  if (result == -1) {
+    fprintf(stderr, "The index is damaged, scanning the whole library.\n");
+  }
+  free(contents);
+  return result;
+}
+
+/**
+ * library_init - Scan LIBRARY_PATH and build list of video files
+ *
+ * If the last run saved an index for this library, we start from it and only
+ * read the directories that changed since, which is a lot faster on a network
+ * filesystem. Otherwise, this function walks the library directory and its
+ * subdirectories, filters for video files, stores filenames and full paths in
+ * video_files struct, and dynamically grows the arrays in the struct if there
+ * are more than 64 files.
+ *
+ * Return: 0 on success, -1 on error
+ */
+int library_init(void) {
+  pthread_rwlock_wrlock(&files_lock);
+
+  if (init_tables() == 0 && load_index() == 0) {
+    atomic_store(&index_dirty, false);
+    pthread_rwlock_unlock(&files_lock);
+
+    /* The library may have changed since the index was saved */
+    int changes = video_rescan();
+    if (changes != -1) {
+      if (get_config()->debug) {
+        printf("Loaded the index of %u films, %d changed since.\n",
+               files.count, changes);
+      }
+      return 0;
+    }
+    pthread_rwlock_wrlock(&files_lock);
+  }
+
+  files_cleanup();
+  if (init_tables() == -1 ||
+      scan_directory(get_config()->library_path, true) == -1) {
     files_cleanup();
+    pthread_rwlock_unlock(&files_lock);
     return -1;
   }
 
+  pthread_rwlock_unlock(&files_lock);
   return 0;
 }
@@ -0,0 +1,398 @@
+/**
+ * watch.c
+ *
+ * Change tracking for the video library with fanotify and periodic rescans.
+ *
+ * OVERVIEW:
+ * inotify needs a watch on every directory, and each watch costs kernel memory
+ * and counts against fs.inotify.max_user_watches, so it can't cover a library
+ * of hundreds of thousands of directories. fanotify can instead mark the whole
+ * filesystem that LIBRARY_PATH lives on with a single mark.
+ *
+ * With FAN_REPORT_DFID_NAME, each event carries a file handle of the directory
+ * that changed and the name of the entry in it. We turn the handle back into a
+ * path with open_by_handle_at(), ignore anything outside LIBRARY_PATH, and
+ * update the index in video.c.
+ *
+ * Filesystem-wide marks need CAP_SYS_ADMIN, and open_by_handle_at() needs
+ * CAP_DAC_READ_SEARCH, so this only works when filmFS runs with those
+ * privileges. Without them we print a warning and the library is only scanned
+ * at startup, like before.
+ *
+ * MISSED EVENTS:
+ * If we fall behind, the kernel drops events and sends FAN_Q_OVERFLOW instead.
+ * We can't tell what we missed, so we rescan the library.
+ *
+ * RESCANS:
+ * Changes made on another machine to a network filesystem never reach
+ * fanotify. For those, RESCAN_SECONDS runs a rescan on the executor every so
+ * often, which only reads the directories whose mtime changed, see video.c.
+ * After each rescan, and at unmount, the index is saved so that the next
+ * startup can skip the directories that haven't changed.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fanotify.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dedup.h"
+#include "executor.h"
+#include "metrics.h"
+#include "resident.h"
+#include "video.h"
+#include "watch.h"
+
+/* The events we ask for. FAN_ONDIR adds directories being created or removed */
+#define WATCH_EVENTS                                                           \
+  (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_CLOSE_WRITE | \
+   FAN_ONDIR)
+
+static int fanotify_fd = -1;
+
+/* A descriptor on the watched filesystem, which open_by_handle_at() needs */
+static int mount_fd = -1;
+
+/**
+ * LIBRARY_PATH with symbolic links resolved and a trailing '/', since that is
+ * how the kernel reports the paths of directories
+ */
+static char library_root[PATH_MAX];
+
+/* Writing to this pipe wakes the watch thread up to stop it */
+static int stop_pipe[2] = {-1, -1};
+
+static pthread_t watch_thread;
+static bool watch_running = false;
+
+/* Counters for the metrics file */
+static atomic_ullong events_read = 0;
+static atomic_ullong events_applied = 0;
+static atomic_ullong overflows = 0;
+static atomic_ullong rescans = 0;
+static atomic_ullong rescan_changes = 0;
+static atomic_ullong last_rescan_ns = 0;
+
+/**
+ * directory_path - Get the path of a directory from its file handle
+ * @handle: File handle from an event
+ * @path: Buffer of PATH_MAX bytes for the path
+ *
+ * We open the directory by its handle and read back the path that the kernel
+ * has for the descriptor. O_PATH means we don't need permission to read it.
+ *
+ * Return: 0 on success, -1 if the directory is gone or can't be opened
+ */
+static int directory_path(struct file_handle *handle, char *path) {
+  int dir_fd = open_by_handle_at(mount_fd, handle, O_PATH);
+  if (dir_fd == -1) {
+    return -1;
+  }
+
+  char link[64];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", dir_fd);
+  ssize_t len = readlink(link, path, PATH_MAX - 1);
+  close(dir_fd);
+  if (len == -1) {
+    return -1;
+  }
+  path[len] = '\0';
+  return 0;
+}
+
+/**
+ * handle_event - Apply one fanotify event to the index
+ * @event: The event
+ * @content_changed: Set to true if a file may have new contents
+ */
+static void handle_event(const struct fanotify_event_metadata *event,
+                         bool *content_changed) {
+  struct fanotify_event_info_fid *fid =
+      (struct fanotify_event_info_fid *)(event + 1);
+  if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+    return;
+  }
+
+  /* The name of the entry comes right after the directory's handle */
+  struct file_handle *handle = (struct file_handle *)fid->handle;
+  const char *name = (const char *)handle->f_handle + handle->handle_bytes;
+
+  /*
+   * The mark covers the whole filesystem, so most events are for files that
+   * we don't serve. We drop them before doing any system calls.
+   */
+  if (!(event->mask & FAN_ONDIR) && !has_video_extension(name)) {
+    return;
+  }
+
+  char dir[PATH_MAX];
+  if (directory_path(handle, dir) == -1) {
+    return;
+  }
+
+  char resolved[PATH_MAX];
+  if (snprintf(resolved, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX) {
+    return;
+  }
+
+  size_t root_len = strlen(library_root);
+  if (strncmp(resolved, library_root, root_len) != 0) {
+    return;
+  }
+
+  /* The index stores paths under LIBRARY_PATH as it was configured */
+  char path[PATH_MAX];
+  if (snprintf(path, PATH_MAX, "%s%s", get_config()->library_path,
+               resolved + root_len) >= PATH_MAX) {
+    return;
+  }
+
+  if (event->mask & (FAN_DELETE | FAN_MOVED_FROM)) {
+    video_path_removed(path);
+  } else {
+    video_path_added(path);
+    *content_changed = true;
+  }
+  atomic_fetch_add(&events_applied, 1);
+}
+
+/**
+ * watch_run - Body of the watch thread
+ * @arg: Unused
+ *
+ * Return: NULL
+ */
+static void *watch_run(void *arg) {
+  (void)arg;
+
+  /* fanotify events must be read into a buffer aligned for their metadata */
+  static _Alignas(struct fanotify_event_metadata) char
+      buffer[WATCH_BUFFER_SIZE];
+
+  struct pollfd fds[2] = {{.fd = fanotify_fd, .events = POLLIN},
+                          {.fd = stop_pipe[0], .events = POLLIN}};
+
+  while (1) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Failed to wait for fanotify events: %s\n",
+              strerror(errno));
+      break;
+    }
+    if (fds[1].revents) {
+      break;
+    }
+
+    ssize_t len = read(fanotify_fd, buffer, sizeof(buffer));
+    if (len <= 0) {
+      continue;
+    }
+
+    bool overflow = false;
+    bool content_changed = false;
+    for (struct fanotify_event_metadata *event =
+             (struct fanotify_event_metadata *)buffer;
+         FAN_EVENT_OK(event, len); event = FAN_EVENT_NEXT(event, len)) {
+      atomic_fetch_add(&events_read, 1);
+      if (event->mask & FAN_Q_OVERFLOW) {
+        overflow = true;
+        continue;
+      }
+      handle_event(event, &content_changed);
+    }
+
+    if (overflow) {
+      atomic_fetch_add(&overflows, 1);
+      if (get_config()->debug) {
+        printf("Missed fanotify events, scanning the library again.\n");
+      }
+      video_rescan();
+      content_changed = true;
+    }
+
+    /*
+     * New or changed files may be copies of films we already have, or replace
+     * a resident film
+     */
+    if (content_changed) {
+      dedup_start();
+      resident_refresh();
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * rescan_run - Body of the periodic rescan task
+ * @arg: Unused
+ *
+ * The task schedules the next rescan itself when it finishes, so a rescan that
+ * takes longer than RESCAN_SECONDS doesn't pile up behind itself.
+ */
+static void rescan_run(void *arg) {
+  (void)arg;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int changes = video_rescan();
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  atomic_fetch_add(&rescans, 1);
+  atomic_store(&last_rescan_ns, (end.tv_sec - start.tv_sec) * 1000000000ULL +
+                                    end.tv_nsec - start.tv_nsec);
+
+  if (changes > 0) {
+    atomic_fetch_add(&rescan_changes, changes);
+    if (get_config()->debug) {
+      printf("Rescan found %d changed files.\n", changes);
+    }
+    /* New files may be copies of films we already have */
+    dedup_start();
+    /* Changed files may be resident films that have to be read again */
+    resident_refresh();
+  }
+  video_save_index();
+
+  executor_schedule(TASK_RESCAN, rescan_run, NULL, NULL,
+                    get_config()->rescan_seconds);
+}
+
+/**
+ * save_run - Body of the task that saves the index after startup
+ * @arg: Unused
+ */
+static void save_run(void *arg) {
+  (void)arg;
+  video_save_index();
+}
+
+/**
+ * write_metrics - Write the change tracking section of the metrics file
+ * @out: Stream to write to
+ */
+static void write_metrics(FILE *out) {
+  fprintf(out, "filmfs_watch_marks %d\n", watch_running ? 1 : 0);
+  fprintf(out, "filmfs_watch_events_total %llu\n", atomic_load(&events_read));
+  fprintf(out, "filmfs_watch_events_applied_total %llu\n",
+          atomic_load(&events_applied));
+  fprintf(out, "filmfs_watch_overflows_total %llu\n", atomic_load(&overflows));
+  fprintf(out, "filmfs_rescans_total %llu\n", atomic_load(&rescans));
+  fprintf(out, "filmfs_rescan_changes_total %llu\n",
+          atomic_load(&rescan_changes));
+  fprintf(out, "filmfs_rescan_last_seconds %.6f\n",
+          atomic_load(&last_rescan_ns) / 1e9);
+}
+
+/**
+ * close_fds - Close the descriptors that watch_start() opened
+ */
+static void close_fds(void) {
+  int *fds[] = {&fanotify_fd, &mount_fd, &stop_pipe[0], &stop_pipe[1]};
+  for (unsigned int i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+    if (*fds[i] != -1) {
+      close(*fds[i]);
+      *fds[i] = -1;
+    }
+  }
+}
+
+/**
+ * watch_start - Start watching the library for changes
+ *
+ * Return: 0 on success or if change tracking is off, -1 on error
+ */
+int watch_start(void) {
+  if (metrics_register(write_metrics) == -1) {
+    return -1;
+  }
+
+  /* Startup may have read directories that the saved index didn't have */
+  executor_submit(TASK_RESCAN, save_run, NULL, NULL);
+
+  unsigned int rescan_seconds = get_config()->rescan_seconds;
+  if (rescan_seconds > 0 &&
+      executor_schedule(TASK_RESCAN, rescan_run, NULL, NULL, rescan_seconds) ==
+          -1) {
+    return -1;
+  }
+
+  if (get_config()->change_tracking != CHANGE_TRACKING_FANOTIFY) {
+    return 0;
+  }
+
+  const char *library_path = get_config()->library_path;
+  char real_path[PATH_MAX];
+  if (!realpath(library_path, real_path) ||
+      snprintf(library_root, PATH_MAX, "%s/", real_path) >= PATH_MAX) {
+    fprintf(stderr, "Failed to resolve %s: %s\n", library_path,
+            strerror(errno));
+    return -1;
+  }
+
+  fanotify_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME,
+                              O_RDONLY | O_LARGEFILE);
+  if (fanotify_fd == -1) {
+    fprintf(stderr, "Failed to start fanotify, library changes won't be "
+                    "noticed: %s\n",
+            strerror(errno));
+    return -1;
+  }
+
+  /* One mark covers every directory on the filesystem */
+  if (fanotify_mark(fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                    WATCH_EVENTS, AT_FDCWD, library_path) == -1) {
+    fprintf(stderr, "Failed to mark %s for fanotify: %s\n", library_path,
+            strerror(errno));
+    close_fds();
+    return -1;
+  }
+
+  mount_fd = open(library_path, O_RDONLY | O_DIRECTORY);
+  if (mount_fd == -1 || pipe(stop_pipe) == -1) {
+    fprintf(stderr, "Failed to set up change tracking: %s\n", strerror(errno));
+    close_fds();
+    return -1;
+  }
+
+  int result = pthread_create(&watch_thread, NULL, watch_run, NULL);
+  if (result != 0) {
+    fprintf(stderr, "Failed to create watch thread: %s", strerror(result));
+    close_fds();
+    return -1;
+  }
+
+  watch_running = true;
+  return 0;
+}
+
+/**
+ * watch_stop - Stop watching the library
+ */
+void watch_stop(void) {
+  if (!watch_running) {
+    return;
+  }
+
+  char stop = 1;
+  if (write(stop_pipe[1], &stop, 1) == -1) {
+    fprintf(stderr, "Failed to stop watch thread: %s\n", strerror(errno));
+  }
+  pthread_join(watch_thread, NULL);
+  watch_running = false;
+  close_fds();
+}
@@ -0,0 +1,603 @@
+/**
+ * workers.c
+ *
+ * The adaptive pool of threads that answer FUSE requests.
+ *
+ * OVERVIEW:
+ * fuse_loop_mt() starts a thread whenever a request arrives while every thread
+ * is busy, and never stops one, so a burst of scanning leaves behind threads
+ * that sit idle for the rest of the mount. We run the event loop ourselves
+ * instead, on a pool of between WORKERS_MIN and WORKERS_MAX threads that each
+ * take one request at a time from the FUSE channel and answer it.
+ *
+ * MEASUREMENTS:
+ * The kernel doesn't tell us when a request was queued, so we estimate how
+ * long requests wait from two things we can measure:
+ * - the service time of each request, from taking it off the channel to having
+ *   answered it
+ * - how long every thread was busy at once. A request that arrives then has to
+ *   queue until one of them is done.
+ * Taking the share of the interval that the pool was saturated as the chance
+ * that a request has to queue, the Erlang C model of a queue served by n
+ * threads gives its mean queueing delay as that chance times the mean service
+ * time, divided by the number of threads that were idle on average. The delay
+ * grows without bound as the threads approach being busy all the time.
+ *
+ * CONTROLLER:
+ * Every WORKERS_INTERVAL seconds a task on the executor compares the two and
+ * sets the number of threads the pool should have:
+ * - if requests waited more than WORKERS_GROW_RATIO of their service time for
+ *   WORKERS_GROW_INTERVALS intervals in a row, it grows by half, since a burst
+ *   needs threads quickly
+ * - if the threads were busy less than WORKERS_SHRINK_UTILIZATION of the time
+ *   and nothing waited for WORKERS_SHRINK_INTERVALS intervals in a row, it
+ *   shrinks by one thread
+ * Between the two, and for a while after every change, it keeps its size, so
+ * that it doesn't flap on a workload near either threshold.
+ *
+ * The controller only sets the target. The threads themselves start a new one
+ * when they take a request and the pool is below it, and leave once they have
+ * answered a request and the pool is above it. That way the threads of the
+ * pool are always started by other threads of the pool, with their priority
+ * rather than that of the low-priority executor.
+ *
+ * A pool with WORKERS_MIN equal to WORKERS_MAX has a fixed size, which makes
+ * it easy to compare the two under the same workload with the metrics.
+ *
+ * MOUNTPOINTS:
+ * With MOUNT settings one daemon serves several mountpoints, each with a
+ * session and channel of its own, see main.c. They share the pool rather than
+ * each having one, so that the threads go wherever the requests are. The
+ * channels are then made non-blocking, and each thread waits for a request on
+ * all of them with poll() and takes it from the one that is ready. Several
+ * threads may wake up for the same request, and all but one find the channel
+ * empty and go back to waiting. With one mountpoint, threads block on its
+ * channel as they always have.
+ *
+ * SHUTDOWN:
+ * Like fuse_loop_mt(), the thread that called workers_loop() waits until the
+ * session is exited, then cancels the threads still blocked waiting for a
+ * request. Threads can only be cancelled while they wait, never while they
+ * answer one. Only the session of the first mountpoint has signal handlers,
+ * so the loop ends with it. The others just stop being polled when they are
+ * unmounted.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "database.h"
+#include "executor.h"
+#include "fuse.h"
+#include "fuse_lowlevel.h"
+#include "metrics.h"
+#include "workers.h"
+
+/**
+ * A thread of the pool:
+ * thread - the thread
+ * buf - its buffer for requests, of the size the largest channel asks for
+ * turn - the session it looks at first when several are ready
+ * next - the next thread in the pool
+ */
+struct worker {
+  pthread_t thread;
+  char *buf;
+  unsigned int turn;
+  struct worker *next;
+};
+
+/**
+ * The sessions and channels that the pool answers requests from, one for each
+ * mountpoint. The first is the one on the command line.
+ */
+static struct fuse_session *sessions[MOUNTS_MAX + 1];
+static struct fuse_chan *channels[MOUNTS_MAX + 1];
+static unsigned int session_count = 0;
+static size_t bufsize;
+
+/* Whether workers_loop() is running the event loop */
+static atomic_bool running = false;
+
+/* -1 if a thread failed to receive a request, returned by workers_loop() */
+static atomic_int loop_error = 0;
+
+/* Posted by each thread that leaves the loop because the session ended */
+static sem_t finished;
+
+/**
+ * The state of the pool, protected by pool_lock:
+ * workers - the threads of the pool
+ * threads - the number of threads
+ * busy - the number of threads answering a request
+ * target - the number of threads the controller wants
+ * stopping - whether the pool is being shut down, when threads stay put
+ * saturated_since - when every thread became busy, if they all are
+ * saturated_ns - the total time that every thread was busy
+ */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct worker *workers = NULL;
+static unsigned int threads = 0;
+static unsigned int busy = 0;
+static unsigned int target = 0;
+static bool stopping = false;
+static unsigned long long saturated_since = 0;
+static unsigned long long saturated_ns = 0;
+
+/**
+ * What the controller saw in the last interval, protected by pool_lock:
+ * queue_ns - the estimated queueing delay of a request
+ * service_ns - the mean service time of a request
+ * utilization - the share of the time that the threads were busy
+ */
+static double last_queue_ns = 0;
+static double last_service_ns = 0;
+static double last_utilization = 0;
+
+/* How the pool was resized, and how many threads it started */
+static atomic_ullong grown_total = 0;
+static atomic_ullong shrunk_total = 0;
+static atomic_ullong started_total = 0;
+static atomic_ullong retired_total = 0;
+
+/* Requests answered, with a histogram of their service times */
+static const unsigned long long service_bounds[WORKERS_SERVICE_BUCKETS - 1] = {
+    50000, 250000, 1000000, 5000000, 25000000, 100000000, 500000000};
+static atomic_ullong service_counts[WORKERS_SERVICE_BUCKETS];
+static atomic_ullong service_sum_ns = 0;
+static atomic_ullong requests_total = 0;
+
+/**
+ * now_ns - Read the monotonic clock
+ *
+ * Return: The time in nanoseconds
+ */
+static unsigned long long now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * update_saturation - Track whether every thread is busy
+ * @now: The current time in nanoseconds
+ *
+ * Must be called with pool_lock held after every change to busy or threads.
+ */
+static void update_saturation(unsigned long long now) {
+  bool saturated = threads > 0 && busy >= threads;
+  if (saturated && saturated_since == 0) {
+    saturated_since = now;
+  } else if (!saturated && saturated_since != 0) {
+    saturated_ns += now - saturated_since;
+    saturated_since = 0;
+  }
+}
+
+static void *worker_run(void *arg);
+
+/**
+ * wait_for_request - Wait until one of the channels has a request
+ * @worker: The calling thread
+ *
+ * The thread can be cancelled while it waits.
+ *
+ * Return: The session with a request, -1 if we should look again
+ */
+static int wait_for_request(struct worker *worker) {
+  struct pollfd fds[MOUNTS_MAX + 1];
+  unsigned int which[MOUNTS_MAX + 1];
+  nfds_t count = 0;
+  for (unsigned int i = 0; i < session_count; i++) {
+    if (!fuse_session_exited(sessions[i])) {
+      fds[count] = (struct pollfd){.fd = fuse_chan_fd(channels[i]),
+                                   .events = POLLIN};
+      which[count++] = i;
+    }
+  }
+
+  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+  int ready = poll(fds, count, -1);
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  if (ready <= 0) {
+    return -1;
+  }
+
+  /* We take turns, so that a busy mountpoint doesn't starve the others */
+  for (nfds_t i = 0; i < count; i++) {
+    nfds_t slot = (worker->turn + i) % count;
+    if (fds[slot].revents) {
+      worker->turn = slot + 1;
+      return which[slot];
+    }
+  }
+  return -1;
+}
+
+/**
+ * start_worker - Add a thread to the pool
+ *
+ * The new thread blocks the signals that end the session, as fuse_loop_mt does,
+ * so that they go to the thread in workers_loop(). Every other signal stays
+ * unblocked: SIGBUS has to reach the handler in mapcache.c, and FUSE interrupts
+ * requests with SIGUSR1 when mounted with -o intr.
+ * Must be called with pool_lock held.
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int start_worker(void) {
+  struct worker *worker = calloc(1, sizeof(struct worker));
+  if (!worker) {
+    fprintf(stderr, "Memory allocation failed for worker thread: %s\n",
+            strerror(errno));
+    return -1;
+  }
+  worker->buf = malloc(bufsize);
+  if (!worker->buf) {
+    fprintf(stderr, "Memory allocation failed for worker buffer: %s\n",
+            strerror(errno));
+    free(worker);
+    return -1;
+  }
+
+  sigset_t blocked, old;
+  sigemptyset(&blocked);
+  sigaddset(&blocked, SIGHUP);
+  sigaddset(&blocked, SIGINT);
+  sigaddset(&blocked, SIGQUIT);
+  sigaddset(&blocked, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &blocked, &old);
+  int result = pthread_create(&worker->thread, NULL, worker_run, worker);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (result != 0) {
+    fprintf(stderr, "Failed to create worker thread: %s\n", strerror(result));
+    free(worker->buf);
+    free(worker);
+    return -1;
+  }
+
+  worker->next = workers;
+  workers = worker;
+  threads++;
+  update_saturation(now_ns());
+  atomic_fetch_add(&started_total, 1);
+  return 0;
+}
+
+/**
+ * retire_worker - Take a thread out of the pool
+ * @worker: The calling thread
+ *
+ * Must be called with pool_lock held. The thread detaches itself, so nothing
+ * joins it once it returns.
+ */
+static void retire_worker(struct worker *worker) {
+  for (struct worker **link = &workers; *link; link = &(*link)->next) {
+    if (*link == worker) {
+      *link = worker->next;
+      break;
+    }
+  }
+  threads--;
+  atomic_fetch_add(&retired_total, 1);
+  pthread_detach(worker->thread);
+}
+
+/**
+ * worker_run - Body of a thread of the pool
+ * @arg: The thread's struct worker
+ *
+ * Return: NULL
+ */
+static void *worker_run(void *arg) {
+  struct worker *worker = arg;
+
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  while (!fuse_session_exited(sessions[0])) {
+    int index = session_count > 1 ? wait_for_request(worker) : 0;
+    if (index == -1) {
+      continue;
+    }
+    struct fuse_session *session = sessions[index];
+    struct fuse_chan *ch = channels[index];
+    struct fuse_buf buf = {.mem = worker->buf, .size = bufsize};
+
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    int result = fuse_session_receive_buf(session, &buf, &ch);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    /* Another thread took the request we were woken up for */
+    if (result == -EINTR || result == -EAGAIN) {
+      continue;
+    }
+    if (result <= 0) {
+      /**
+       * 0 means the filesystem was unmounted, and the other mountpoints are
+       * still served unless it was the first. Anything else is an error.
+       */
+      if (result < 0) {
+        atomic_store(&loop_error, -1);
+        fuse_session_exit(sessions[0]);
+      }
+      fuse_session_exit(session);
+      if (index == 0 || result < 0) {
+        break;
+      }
+      continue;
+    }
+
+    unsigned long long start = now_ns();
+    pthread_mutex_lock(&pool_lock);
+    busy++;
+    update_saturation(start);
+    /* If we can't start a thread now, we won't be able to on the next one */
+    if (!stopping && threads < target && start_worker() == -1) {
+      target = threads;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    fuse_session_process_buf(session, &buf, ch);
+
+    unsigned long long end = now_ns();
+    unsigned long long service = end - start;
+    atomic_fetch_add(&service_counts[metrics_bucket(
+                         service_bounds, WORKERS_SERVICE_BUCKETS, service)],
+                     1);
+    atomic_fetch_add(&service_sum_ns, service);
+    atomic_fetch_add(&requests_total, 1);
+
+    pthread_mutex_lock(&pool_lock);
+    busy--;
+    bool retire = !stopping && threads > target;
+    if (retire) {
+      retire_worker(worker);
+    }
+    update_saturation(end);
+    pthread_mutex_unlock(&pool_lock);
+
+    if (retire) {
+      free(worker->buf);
+      free(worker);
+      return NULL;
+    }
+  }
+
+  sem_post(&finished);
+  return NULL;
+}
+
+/**
+ * controller_run - Body of the periodic task that sizes the pool
+ * @arg: Unused
+ *
+ * Only one controller task runs at a time, so the state of the last interval
+ * can live in static variables.
+ */
+static void controller_run(void *arg) {
+  (void)arg;
+  static unsigned long long last_run, last_requests, last_service_sum,
+      last_saturated;
+  static unsigned int grow_streak, shrink_streak;
+
+  unsigned long long now = now_ns();
+  unsigned long long requests = atomic_load(&requests_total);
+  unsigned long long service_sum = atomic_load(&service_sum_ns);
+
+  pthread_mutex_lock(&pool_lock);
+  /* We count the saturation of the interval so far, even if it goes on */
+  if (saturated_since != 0) {
+    saturated_ns += now - saturated_since;
+    saturated_since = now;
+  }
+  unsigned long long saturated = saturated_ns;
+
+  if (last_run != 0 && now > last_run && threads > 0) {
+    double elapsed = now - last_run;
+    unsigned long long count = requests - last_requests;
+    double service = count ? (double)(service_sum - last_service_sum) / count
+                           : 0;
+    double saturation = (saturated - last_saturated) / elapsed;
+
+    last_service_ns = service;
+    last_utilization = (service_sum - last_service_sum) / (elapsed * threads);
+    double spare = threads * (1 - last_utilization);
+    last_queue_ns = saturation * service / (spare > 0.01 ? spare : 0.01);
+
+    if (count > 0 && last_queue_ns > service * WORKERS_GROW_RATIO) {
+      grow_streak++;
+      shrink_streak = 0;
+    } else if (last_utilization < WORKERS_SHRINK_UTILIZATION &&
+               saturated == last_saturated) {
+      shrink_streak++;
+      grow_streak = 0;
+    } else {
+      grow_streak = 0;
+      shrink_streak = 0;
+    }
+
+    struct config_ctx *config = get_config();
+    if (grow_streak >= WORKERS_GROW_INTERVALS &&
+        target < config->workers_max) {
+      unsigned int step = target / 2 ? target / 2 : 1;
+      target = target + step < config->workers_max ? target + step
+                                                   : config->workers_max;
+      grow_streak = 0;
+      atomic_fetch_add(&grown_total, 1);
+    } else if (shrink_streak >= WORKERS_SHRINK_INTERVALS &&
+               target > config->workers_min) {
+      target--;
+      shrink_streak = 0;
+      atomic_fetch_add(&shrunk_total, 1);
+    }
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  last_run = now;
+  last_requests = requests;
+  last_service_sum = service_sum;
+  last_saturated = saturated;
+
+  executor_schedule(TASK_WORKERS, controller_run, NULL, NULL,
+                    WORKERS_INTERVAL);
+}
+
+/**
+ * write_metrics - Write the worker pool section of the metrics file
+ * @out: Stream to write to
+ */
+static void write_metrics(FILE *out) {
+  struct config_ctx *config = get_config();
+
+  pthread_mutex_lock(&pool_lock);
+  fprintf(out, "filmfs_workers{state=\"total\"} %u\n", threads);
+  fprintf(out, "filmfs_workers{state=\"busy\"} %u\n", busy);
+  fprintf(out, "filmfs_workers_target %u\n", target);
+  fprintf(out, "filmfs_workers_saturated_seconds_total %.6f\n",
+          saturated_ns / 1e9);
+  fprintf(out, "filmfs_request_queue_delay_seconds %.6f\n",
+          last_queue_ns / 1e9);
+  fprintf(out, "filmfs_request_service_mean_seconds %.6f\n",
+          last_service_ns / 1e9);
+  fprintf(out, "filmfs_workers_utilization %.3f\n", last_utilization);
+  pthread_mutex_unlock(&pool_lock);
+
+  fprintf(out, "filmfs_workers_min %u\n", config->workers_min);
+  fprintf(out, "filmfs_workers_max %u\n", config->workers_max);
+  fprintf(out, "filmfs_workers_resizes_total{direction=\"grow\"} %llu\n",
+          atomic_load(&grown_total));
+  fprintf(out, "filmfs_workers_resizes_total{direction=\"shrink\"} %llu\n",
+          atomic_load(&shrunk_total));
+  fprintf(out, "filmfs_workers_started_total %llu\n",
+          atomic_load(&started_total));
+  fprintf(out, "filmfs_workers_retired_total %llu\n",
+          atomic_load(&retired_total));
+  metrics_write_histogram(out, "filmfs_request_service_seconds", NULL,
+                          service_bounds, service_counts,
+                          WORKERS_SERVICE_BUCKETS,
+                          atomic_load(&service_sum_ns), 1e9);
+}
+
+/**
+ * workers_start - Register the pool metrics and start the controller
+ *
+ * Return: 0 on success, -1 on error
+ */
+int workers_start(void) {
+  if (!atomic_load(&running)) {
+    return 0;
+  }
+  if (metrics_register(write_metrics) == -1) {
+    return -1;
+  }
+  return executor_submit(TASK_WORKERS, controller_run, NULL, NULL);
+}
+
+/**
+ * stop_cleanup_threads - Stop the cleanup threads of the mounted filesystems
+ * @fuses: The mounted filesystems
+ * @count: Number of filesystems whose cleanup threads were started
+ */
+static void stop_cleanup_threads(struct fuse **fuses, unsigned int count) {
+  for (unsigned int i = 0; i < count; i++) {
+    fuse_stop_cleanup_thread(fuses[i]);
+  }
+}
+
+/**
+ * workers_loop - Run the event loop on the pool
+ * @fuses: The mounted filesystems, starting with the one on the command line
+ * @count: Number of filesystems
+ *
+ * Return: 0 on success, -1 on error
+ */
+int workers_loop(struct fuse **fuses, unsigned int count) {
+  if (count == 0 || count > MOUNTS_MAX + 1) {
+    fprintf(stderr, "Can't serve %u mountpoints, at most %d are supported.\n",
+            count, MOUNTS_MAX + 1);
+    return -1;
+  }
+
+  session_count = count;
+  bufsize = 0;
+  for (unsigned int i = 0; i < count; i++) {
+    sessions[i] = fuse_get_session(fuses[i]);
+    channels[i] = fuse_session_next_chan(sessions[i], NULL);
+    if (fuse_chan_bufsize(channels[i]) > bufsize) {
+      bufsize = fuse_chan_bufsize(channels[i]);
+    }
+
+    /* Threads poll the channels, and must not block on one that went empty */
+    int fd = fuse_chan_fd(channels[i]);
+    int flags = fcntl(fd, F_GETFL);
+    if (count > 1 &&
+        (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)) {
+      fprintf(stderr, "Failed to make FUSE channel non-blocking: %s\n",
+              strerror(errno));
+      return -1;
+    }
+  }
+  if (sem_init(&finished, 0, 0) == -1) {
+    fprintf(stderr, "Failed to initialize worker semaphore: %s\n",
+            strerror(errno));
+    return -1;
+  }
+
+  /* This only does anything if FUSE was asked to remember inodes */
+  for (unsigned int i = 0; i < count; i++) {
+    if (fuse_start_cleanup_thread(fuses[i]) != 0) {
+      stop_cleanup_threads(fuses, i);
+      sem_destroy(&finished);
+      return -1;
+    }
+  }
+
+  /* The first request runs fs_init(), which may already look at the pool */
+  atomic_store(&running, true);
+  pthread_mutex_lock(&pool_lock);
+  target = get_config()->workers_min;
+  while (threads < target && start_worker() == 0) {
+  }
+  bool started = threads > 0;
+  pthread_mutex_unlock(&pool_lock);
+
+  /* A signal wakes us up early, after it has exited the session */
+  while (started && !fuse_session_exited(sessions[0])) {
+    sem_wait(&finished);
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  stopping = true;
+  for (struct worker *worker = workers; worker; worker = worker->next) {
+    pthread_cancel(worker->thread);
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  /* Nothing joins the pool or leaves it once it is stopping */
+  while (workers) {
+    struct worker *worker = workers;
+    pthread_join(worker->thread, NULL);
+    workers = worker->next;
+    free(worker->buf);
+    free(worker);
+  }
+  threads = 0;
+
+  atomic_store(&running, false);
+  stop_cleanup_threads(fuses, count);
+  sem_destroy(&finished);
+  for (unsigned int i = 0; i < count; i++) {
+    fuse_session_reset(sessions[i]);
+  }
+
+  return started ? atomic_load(&loop_error) : -1;
+}
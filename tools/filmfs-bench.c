@@ -0,0 +1,242 @@
+/**
+ * filmfs-bench.c
+ *
+ * A comparison of reading a film through libfilmfs and through the mountpoint.
+ *
+ * OVERVIEW:
+ * We read the same film from start to end, in reads of the size a player
+ * would make, once through filmfs_read() and once through pread() on its path
+ * in a mounted filmFS, and repeat both a number of passes. For each pass we
+ * show the throughput and the average time of a read.
+ *
+ * The first pass of each warms the page cache of the backing file, and from
+ * then on the difference between the two is the cost of going through the
+ * kernel and FUSE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filmfs.h"
+
+/* The default size of a read in KiB, about what players ask for */
+#define BENCH_BLOCK_KIB 128
+
+/* The default number of passes over the film */
+#define BENCH_PASSES 3
+
+/**
+ * The result of reading the film once:
+ * bytes - bytes read
+ * reads - number of reads
+ * seconds - time the whole pass took
+ */
+struct pass {
+  unsigned long long bytes;
+  unsigned long long reads;
+  double seconds;
+};
+
+/**
+ * print_usage - Print how to run the program
+ * @name: Name the program was run as
+ */
+static void print_usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-b KIB] [-n PASSES] [-m PATH] TITLE\n", name);
+}
+
+/**
+ * seconds_since - Seconds since a point in time
+ * @start: The point in time
+ *
+ * Return: Elapsed time in seconds
+ */
+static double seconds_since(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * read_api - Read a film through libfilmfs
+ * @id: ID of the film
+ * @buffer: Buffer of block bytes to read into
+ * @block: Size of each read
+ * @pass: Output for the result
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int read_api(unsigned int id, char *buffer, size_t block,
+                    struct pass *pass) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  struct filmfs_session *session = filmfs_begin(id, 0);
+  if (!session) {
+    fprintf(stderr, "Failed to begin reading film: %s\n", strerror(errno));
+    return -1;
+  }
+
+  *pass = (struct pass){0};
+  ssize_t result;
+  while ((result = filmfs_read(session, buffer, block, pass->bytes)) > 0) {
+    pass->bytes += result;
+    pass->reads++;
+  }
+  filmfs_end(session);
+  if (result < 0) {
+    fprintf(stderr, "Failed to read film: %s\n", strerror(-result));
+    return -1;
+  }
+
+  pass->seconds = seconds_since(&start);
+  return 0;
+}
+
+/**
+ * read_mount - Read a film through the mountpoint
+ * @path: Path of the film in a mounted filmFS
+ * @buffer: Buffer of block bytes to read into
+ * @block: Size of each read
+ * @pass: Output for the result
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int read_mount(const char *path, char *buffer, size_t block,
+                      struct pass *pass) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  *pass = (struct pass){0};
+  ssize_t result;
+  while ((result = pread(fd, buffer, block, pass->bytes)) > 0) {
+    pass->bytes += result;
+    pass->reads++;
+  }
+  if (result == -1) {
+    fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
+  }
+  if (close(fd) == -1) {
+    fprintf(stderr, "Failed to close %s: %s\n", path, strerror(errno));
+  }
+  if (result == -1) {
+    return -1;
+  }
+
+  pass->seconds = seconds_since(&start);
+  return 0;
+}
+
+/**
+ * print_pass - Print the result of a pass
+ * @how: "api" or "mount"
+ * @number: Number of the pass, from 1
+ * @pass: The result
+ */
+static void print_pass(const char *how, int number, const struct pass *pass) {
+  double seconds = pass->seconds > 0 ? pass->seconds : 1e-9;
+  printf("%-5s %5d %10.1f %10.1f %10llu %10.1f\n", how, number,
+         pass->bytes / (1024.0 * 1024.0) / seconds,
+         pass->reads ? seconds * 1e6 / pass->reads : 0, pass->reads,
+         pass->bytes / (1024.0 * 1024.0));
+}
+
+/**
+ * main - Entry point for filmfs-bench
+ * @argc: Argument count
+ * @argv: Argument vector
+ *
+ * Return: 0 on success, 1 on failure
+ */
+int main(int argc, char *argv[]) {
+  long block_kib = BENCH_BLOCK_KIB;
+  long passes = BENCH_PASSES;
+  const char *mount_path = NULL;
+
+  int option;
+  while ((option = getopt(argc, argv, "b:n:m:")) != -1) {
+    switch (option) {
+    case 'b':
+      block_kib = strtol(optarg, NULL, 10);
+      if (block_kib <= 0 || block_kib > 1024 * 1024) {
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'n':
+      passes = strtol(optarg, NULL, 10);
+      if (passes <= 0) {
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'm':
+      mount_path = optarg;
+      break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  size_t block = block_kib * 1024;
+  char *buffer = malloc(block);
+  if (!buffer) {
+    fprintf(stderr, "Memory allocation failed for read buffer: %s\n",
+            strerror(errno));
+    return 1;
+  }
+
+  if (filmfs_init() == -1) {
+    free(buffer);
+    return 1;
+  }
+
+  int id = filmfs_find(argv[optind]);
+  if (id == -1) {
+    fprintf(stderr, "No film titled %s in the library.\n", argv[optind]);
+    filmfs_cleanup();
+    free(buffer);
+    return 1;
+  }
+
+  int status = 0;
+  printf("%-5s %5s %10s %10s %10s %10s\n", "READ", "PASS", "MB/S", "US/READ",
+         "READS", "MB");
+  for (long i = 1; i <= passes && status == 0; i++) {
+    struct pass pass;
+    if (read_api(id, buffer, block, &pass) == -1) {
+      status = 1;
+      break;
+    }
+    print_pass("api", i, &pass);
+
+    if (!mount_path) {
+      continue;
+    }
+    if (read_mount(mount_path, buffer, block, &pass) == -1) {
+      status = 1;
+      break;
+    }
+    print_pass("mount", i, &pass);
+  }
+
+  filmfs_cleanup();
+  free(buffer);
+  return status;
+}
@@ -0,0 +1,337 @@
+/**
+ * filmfs-keybench.c
+ *
+ * A measurement of how fast film names are normalized into keys.
+ *
+ * OVERVIEW:
+ * Every file in the library is normalized when it is scanned, so the speed of
+ * normalize_title() bounds how fast a huge library can be loaded. We build a
+ * list of names, a million by default, and normalize all of them a number of
+ * passes, showing the names and megabytes per second and the average time per
+ * name of each pass.
+ *
+ * The names are made up from titles, years, separators, release tags and
+ * extensions, in the forms that libraries are really named in, like
+ * "Title (1999).mkv" and "Title.1999.1080p.BluRay.x264-GROUP.mkv". Given -f,
+ * we read the names from a file instead, one per line, like the output of
+ * `ls` on a real library.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "normalize.h"
+
+/* The default number of names to make up */
+#define KEYBENCH_NAMES 1000000
+
+/* The default number of passes over the names */
+#define KEYBENCH_PASSES 3
+
+/* The longest name we make up or read */
+#define KEYBENCH_NAME_MAX 256
+
+/**
+ * The names to normalize:
+ * text - the names, one after another, each ending in '\0'
+ * offsets - where each name starts in text
+ * count - number of names
+ * bytes - total length of the names
+ */
+struct names {
+  char *text;
+  size_t *offsets;
+  size_t count;
+  size_t bytes;
+};
+
+/**
+ * print_usage - Print how to run the program
+ * @name: Name the program was run as
+ */
+static void print_usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-n NAMES] [-p PASSES] [-f FILE] [-v]\n", name);
+}
+
+/**
+ * seconds_since - Seconds since a point in time
+ * @start: The point in time
+ *
+ * Return: Elapsed time in seconds
+ */
+static double seconds_since(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * next_random - Step a xorshift generator
+ * @state: The generator's state, which must not be 0
+ *
+ * The names only need to vary, and the same seed gives the same names on
+ * every run, so that runs can be compared.
+ *
+ * Return: The next random number
+ */
+static unsigned long long next_random(unsigned long long *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+/**
+ * add_name - Append a name to the list
+ * @names: The list
+ * @name: The name
+ * @capacity: Bytes that names->text has room for, which is updated
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int add_name(struct names *names, const char *name, size_t *capacity) {
+  size_t len = strlen(name) + 1;
+  if (names->bytes + len > *capacity) {
+    size_t new_capacity = *capacity ? *capacity * 2 : 1024 * 1024;
+    char *text = realloc(names->text, new_capacity);
+    if (!text) {
+      fprintf(stderr, "Memory allocation failed for names: %s\n",
+              strerror(errno));
+      return -1;
+    }
+    names->text = text;
+    *capacity = new_capacity;
+  }
+
+  memcpy(names->text + names->bytes, name, len);
+  names->offsets[names->count++] = names->bytes;
+  names->bytes += len;
+  return 0;
+}
+
+/**
+ * make_name - Make up the name of a film
+ * @state: State of the random generator
+ * @name: Output for the name, with room for KEYBENCH_NAME_MAX bytes
+ */
+static void make_name(unsigned long long *state, char *name) {
+  static const char *words[] = {
+      "the",   "a",     "of",     "night",  "city",  "last",  "star",
+      "river", "house", "dark",   "return", "king",  "blade", "runner",
+      "man",   "woman", "spider", "empire", "ghost", "love",  "war",
+      "girl",  "time",  "dragon", "summer", "winter"};
+  static const char *tags[] = {"1080p.BluRay.x264", "720p.WEB-DL.AAC",
+                               "2160p.UHD.BluRay.HEVC.HDR", "DVDRip.XviD",
+                               "1080p.WEBRip.x265.10bit"};
+  static const char *extensions[] = {"mkv", "mp4", "avi", "m4v"};
+  const size_t word_count = sizeof(words) / sizeof(words[0]);
+  const size_t tag_count = sizeof(tags) / sizeof(tags[0]);
+  const size_t extension_count = sizeof(extensions) / sizeof(extensions[0]);
+
+  unsigned long long r = next_random(state);
+  int style = r % 3;
+  unsigned int year = 1920 + (r >> 8) % 105;
+  const char *extension = extensions[(r >> 16) % extension_count];
+
+  /* Titles are written with spaces, or with dots in release names */
+  size_t len = 0;
+  unsigned int word_total = 1 + (r >> 24) % 5;
+  for (unsigned int i = 0; i < word_total; i++) {
+    const char *word = words[next_random(state) % word_count];
+    if (i > 0) {
+      name[len++] = style == 0 ? ' ' : '.';
+    }
+    len += snprintf(name + len, KEYBENCH_NAME_MAX - len, "%c%s", word[0] - 32,
+                    word + 1);
+  }
+
+  if (style == 0) {
+    snprintf(name + len, KEYBENCH_NAME_MAX - len, " (%u).%s", year, extension);
+  } else {
+    snprintf(name + len, KEYBENCH_NAME_MAX - len, ".%u.%s-GROUP.%s", year,
+             tags[(r >> 32) % tag_count], extension);
+  }
+}
+
+/**
+ * make_names - Make up a list of film names
+ * @names: Output for the list
+ * @count: Number of names
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int make_names(struct names *names, size_t count) {
+  *names = (struct names){0};
+  names->offsets = malloc(count * sizeof(size_t));
+  if (!names->offsets) {
+    fprintf(stderr, "Memory allocation failed for names: %s\n",
+            strerror(errno));
+    return -1;
+  }
+
+  unsigned long long state = 0x9e3779b97f4a7c15ULL;
+  size_t capacity = 0;
+  char name[KEYBENCH_NAME_MAX];
+  for (size_t i = 0; i < count; i++) {
+    make_name(&state, name);
+    if (add_name(names, name, &capacity) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * read_names - Read a list of film names from a file
+ * @names: Output for the list
+ * @path: The file, with one name per line
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int read_names(struct names *names, const char *path) {
+  *names = (struct names){0};
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  size_t capacity = 0;
+  size_t offset_capacity = 0;
+  char name[KEYBENCH_NAME_MAX];
+  int result = 0;
+  while (fgets(name, sizeof(name), file)) {
+    name[strcspn(name, "\n")] = '\0';
+    if (names->count == offset_capacity) {
+      offset_capacity = offset_capacity ? offset_capacity * 2 : 1024;
+      size_t *offsets =
+          realloc(names->offsets, offset_capacity * sizeof(size_t));
+      if (!offsets) {
+        fprintf(stderr, "Memory allocation failed for names: %s\n",
+                strerror(errno));
+        result = -1;
+        break;
+      }
+      names->offsets = offsets;
+    }
+    if (add_name(names, name, &capacity) == -1) {
+      result = -1;
+      break;
+    }
+  }
+
+  fclose(file);
+  if (result == 0 && names->count == 0) {
+    fprintf(stderr, "No names in %s.\n", path);
+    result = -1;
+  }
+  return result;
+}
+
+/**
+ * run_pass - Normalize every name once
+ * @names: The names
+ * @key_bytes: Output for the total length of the keys, which also keeps the
+ *             compiler from dropping the work
+ *
+ * Return: Time the pass took in seconds
+ */
+static double run_pass(const struct names *names, size_t *key_bytes) {
+  char key[KEYBENCH_NAME_MAX];
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  *key_bytes = 0;
+  for (size_t i = 0; i < names->count; i++) {
+    *key_bytes += normalize_title(names->text + names->offsets[i], key);
+  }
+  return seconds_since(&start);
+}
+
+/**
+ * main - Entry point for filmfs-keybench
+ * @argc: Argument count
+ * @argv: Argument vector
+ *
+ * Return: 0 on success, 1 on failure
+ */
+int main(int argc, char *argv[]) {
+  long count = KEYBENCH_NAMES;
+  long passes = KEYBENCH_PASSES;
+  const char *names_path = NULL;
+  int verbose = 0;
+
+  int option;
+  while ((option = getopt(argc, argv, "n:p:f:v")) != -1) {
+    switch (option) {
+    case 'n':
+      count = strtol(optarg, NULL, 10);
+      if (count <= 0) {
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'p':
+      passes = strtol(optarg, NULL, 10);
+      if (passes <= 0) {
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'f':
+      names_path = optarg;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  struct names names;
+  int loaded = names_path ? read_names(&names, names_path)
+                          : make_names(&names, count);
+  if (loaded == -1) {
+    free(names.text);
+    free(names.offsets);
+    return 1;
+  }
+
+  /* A few keys, to check that the names normalize the way they should */
+  if (verbose) {
+    char key[KEYBENCH_NAME_MAX];
+    for (size_t i = 0; i < names.count && i < 10; i++) {
+      const char *name = names.text + names.offsets[i];
+      normalize_title(name, key);
+      printf("%s -> \"%s\"\n", name, key);
+    }
+  }
+
+  double megabytes = names.bytes / (1024.0 * 1024.0);
+  printf("%5s %12s %10s %10s %10s\n", "PASS", "NAMES/S", "MB/S", "NS/NAME",
+         "KEY MB");
+  for (long i = 1; i <= passes; i++) {
+    size_t key_bytes;
+    double seconds = run_pass(&names, &key_bytes);
+    if (seconds <= 0) {
+      seconds = 1e-9;
+    }
+    printf("%5ld %12.0f %10.1f %10.1f %10.1f\n", i, names.count / seconds,
+           megabytes / seconds, seconds * 1e9 / names.count,
+           key_bytes / (1024.0 * 1024.0));
+  }
+
+  free(names.text);
+  free(names.offsets);
+  return 0;
+}
@@ -0,0 +1,342 @@
+/**
+ * filmfs-top.c
+ *
+ * A live view of the processes reading from a filmFS mount.
+ *
+ * OVERVIEW:
+ * filmFS counts the opens, reads, bytes and read time of every process that
+ * uses the mount in a table in shared memory (see proctable.h). Every interval
+ * we copy the table, work out each process's rates from the difference to the
+ * previous copy and show the busiest processes first, like top.
+ *
+ * The table is only ever read, so this can't slow filmFS down or get stuck
+ * behind a congested mount.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "proctable.h"
+
+/* Names of the caller classes, in the order of enum caller_class */
+static const char *caller_names[] = {"player", "scanner", "other"};
+
+/* How the processes are ordered */
+enum sort_key { SORT_BYTES, SORT_OPS, SORT_LATENCY };
+
+/**
+ * One process in a copy of the table:
+ * pid, comm, caller - from its slot
+ * opens, reads, bytes, read_ns - its totals
+ * read_rate, byte_rate - reads and bytes per second over the last interval
+ * latency_ms - its average read time over the last interval
+ */
+struct row {
+  pid_t pid;
+  char comm[16];
+  uint8_t caller;
+  unsigned long long opens;
+  unsigned long long reads;
+  unsigned long long bytes;
+  unsigned long long read_ns;
+  double read_rate;
+  double byte_rate;
+  double latency_ms;
+};
+
+static enum sort_key sort_key = SORT_BYTES;
+
+/**
+ * print_usage - Print how to run the program
+ * @name: Name the program was run as
+ */
+static void print_usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-d SECONDS] [-n ITERATIONS] [-s bytes|ops|latency]\n",
+          name);
+}
+
+/**
+ * open_table - Map the process table of the current user's filesystem
+ *
+ * Return: The table, NULL on error
+ */
+static const struct proc_table *open_table(void) {
+  char name[32];
+  snprintf(name, sizeof(name), PROCTABLE_NAME, getuid());
+
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open process table %s: %s\n", name,
+            strerror(errno));
+    fprintf(stderr, "Is filmfs running?\n");
+    return NULL;
+  }
+
+  void *mapping =
+      mmap(NULL, sizeof(struct proc_table), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "Failed to map process table: %s\n", strerror(errno));
+    return NULL;
+  }
+
+  const struct proc_table *table = mapping;
+  if (table->magic != PROCTABLE_MAGIC || table->version != PROCTABLE_VERSION ||
+      table->slots != PROCTABLE_SLOTS) {
+    fprintf(stderr, "Process table %s has an unknown layout\n", name);
+    munmap(mapping, sizeof(struct proc_table));
+    return NULL;
+  }
+  return table;
+}
+
+/**
+ * snapshot - Copy the processes out of the table
+ * @table: The table
+ * @rows: Output for the processes, PROCTABLE_SLOTS long
+ *
+ * Return: The number of processes copied
+ */
+static unsigned int snapshot(const struct proc_table *table,
+                             struct row *rows) {
+  unsigned int count = 0;
+  for (unsigned int i = 0; i < PROCTABLE_SLOTS; i++) {
+    const struct proc_entry *entry = &table->entries[i];
+    pid_t pid = atomic_load(&entry->pid);
+    if (pid <= 0) {
+      continue;
+    }
+
+    struct row *row = &rows[count++];
+    memset(row, 0, sizeof(*row));
+    row->pid = pid;
+    memcpy(row->comm, entry->comm, sizeof(row->comm));
+    row->comm[sizeof(row->comm) - 1] = '\0';
+    row->caller = entry->caller;
+    row->opens = atomic_load(&entry->opens);
+    row->reads = atomic_load(&entry->reads);
+    row->bytes = atomic_load(&entry->bytes);
+    row->read_ns = atomic_load(&entry->read_ns);
+  }
+  return count;
+}
+
+/**
+ * find_row - Find a process in the previous copy of the table
+ * @rows: The previous copy
+ * @count: Number of processes in it
+ * @pid: Process ID
+ *
+ * Return: The process, NULL if it wasn't there
+ */
+static const struct row *find_row(const struct row *rows, unsigned int count,
+                                  pid_t pid) {
+  for (unsigned int i = 0; i < count; i++) {
+    if (rows[i].pid == pid) {
+      return &rows[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * compute_rates - Work out the rates of each process since the last copy
+ * @rows: The current copy
+ * @count: Number of processes in it
+ * @previous: The previous copy
+ * @previous_count: Number of processes in it
+ * @seconds: Time between the copies
+ *
+ * A process whose counters went backwards took over the slot of another one
+ * with the same PID, so its totals are all new.
+ */
+static void compute_rates(struct row *rows, unsigned int count,
+                          const struct row *previous,
+                          unsigned int previous_count, double seconds) {
+  for (unsigned int i = 0; i < count; i++) {
+    struct row *row = &rows[i];
+    const struct row *before = find_row(previous, previous_count, row->pid);
+
+    unsigned long long reads = row->reads, bytes = row->bytes,
+                       read_ns = row->read_ns;
+    if (before && before->reads <= reads && before->bytes <= bytes &&
+        before->read_ns <= read_ns) {
+      reads -= before->reads;
+      bytes -= before->bytes;
+      read_ns -= before->read_ns;
+    }
+
+    row->read_rate = reads / seconds;
+    row->byte_rate = bytes / seconds;
+    row->latency_ms = reads > 0 ? read_ns / 1e6 / reads : 0;
+  }
+}
+
+/**
+ * compare_rows - Order processes by the chosen key, busiest first
+ * @a: First process
+ * @b: Second process
+ *
+ * Processes that are equally busy now are ordered by their totals.
+ *
+ * Return: Negative if a comes first, positive if b does, 0 if equal
+ */
+static int compare_rows(const void *a, const void *b) {
+  const struct row *first = a, *second = b;
+  double x = 0, y = 0;
+
+  switch (sort_key) {
+  case SORT_BYTES:
+    x = first->byte_rate;
+    y = second->byte_rate;
+    break;
+  case SORT_OPS:
+    x = first->read_rate;
+    y = second->read_rate;
+    break;
+  case SORT_LATENCY:
+    x = first->latency_ms;
+    y = second->latency_ms;
+    break;
+  }
+  if (x != y) {
+    return x < y ? 1 : -1;
+  }
+  if (first->bytes != second->bytes) {
+    return first->bytes < second->bytes ? 1 : -1;
+  }
+  return 0;
+}
+
+/**
+ * screen_rows - Get the number of lines of the terminal
+ *
+ * Return: The number of lines, 0 if the output isn't a terminal
+ */
+static unsigned int screen_rows(void) {
+  struct winsize size;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == -1) {
+    return 0;
+  }
+  return size.ws_row;
+}
+
+/**
+ * draw - Show the processes
+ * @table: The table
+ * @rows: The processes, already sorted
+ * @count: Number of processes
+ * @clear: Whether to clear the terminal first
+ */
+static void draw(const struct proc_table *table, const struct row *rows,
+                 unsigned int count, int clear) {
+  /* Leave room for the two header lines and the prompt */
+  unsigned int lines = screen_rows();
+  unsigned int shown = lines > 3 && lines - 3 < count ? lines - 3 : count;
+
+  if (clear) {
+    printf("\033[H\033[2J");
+  }
+  printf("filmfs pid %d, %u processes\n", table->owner, count);
+  printf("%7s %-15s %-7s %9s %9s %9s %10s %7s\n", "PID", "COMM", "CLASS",
+         "READS/s", "MB/s", "LAT(ms)", "TOTAL(MB)", "OPENS");
+  for (unsigned int i = 0; i < shown; i++) {
+    const struct row *row = &rows[i];
+    const char *caller = row->caller < sizeof(caller_names) /
+                                           sizeof(caller_names[0])
+                             ? caller_names[row->caller]
+                             : "?";
+    printf("%7d %-15s %-7s %9.1f %9.2f %9.3f %10.1f %7llu\n", row->pid,
+           row->comm, caller, row->read_rate,
+           row->byte_rate / (1024.0 * 1024.0), row->latency_ms,
+           row->bytes / (1024.0 * 1024.0), row->opens);
+  }
+  fflush(stdout);
+}
+
+/**
+ * main - Entry point for filmfs-top
+ * @argc: Argument count
+ * @argv: Argument vector
+ *
+ * Return: 0 on success, 1 on failure
+ */
+int main(int argc, char *argv[]) {
+  double interval = 1;
+  long iterations = -1;
+
+  int option;
+  while ((option = getopt(argc, argv, "d:n:s:")) != -1) {
+    switch (option) {
+    case 'd':
+      interval = strtod(optarg, NULL);
+      if (interval <= 0) {
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'n':
+      iterations = strtol(optarg, NULL, 10);
+      if (iterations <= 0) {
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 's':
+      if (strcmp(optarg, "bytes") == 0) {
+        sort_key = SORT_BYTES;
+      } else if (strcmp(optarg, "ops") == 0) {
+        sort_key = SORT_OPS;
+      } else if (strcmp(optarg, "latency") == 0) {
+        sort_key = SORT_LATENCY;
+      } else {
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  const struct proc_table *table = open_table();
+  if (!table) {
+    return 1;
+  }
+
+  /* Only redraw in place on a terminal, so the output can be piped */
+  int clear = isatty(STDOUT_FILENO);
+
+  static struct row previous[PROCTABLE_SLOTS], current[PROCTABLE_SLOTS];
+  unsigned int previous_count = snapshot(table, previous);
+
+  struct timespec delay = {.tv_sec = (time_t)interval,
+                           .tv_nsec = (interval - (time_t)interval) * 1e9};
+  while (iterations != 0) {
+    nanosleep(&delay, NULL);
+
+    unsigned int count = snapshot(table, current);
+    compute_rates(current, count, previous, previous_count, interval);
+    memcpy(previous, current, sizeof(current));
+    previous_count = count;
+
+    qsort(current, count, sizeof(current[0]), compare_rows);
+    draw(table, current, count, clear);
+
+    if (iterations > 0) {
+      iterations--;
+    }
+  }
+
+  munmap((void *)table, sizeof(struct proc_table));
+  return 0;
+}